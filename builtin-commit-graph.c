@@ -0,0 +1,26 @@
+/*
+ * Builtin "git commit-graph".
+ */
+
+#include "builtin.h"
+#include "cache.h"
+#include "commit.h"
+#include "commit-graph.h"
+
+static const char commit_graph_usage[] = "git commit-graph (write | verify)";
+
+int cmd_commit_graph(int argc, const char **argv, const char *prefix)
+{
+	git_config(git_default_config, NULL);
+	if (argc != 2)
+		usage(commit_graph_usage);
+
+	/* We only need the parents and dates, not the messages */
+	save_commit_buffer = 0;
+
+	if (!strcmp(argv[1], "write"))
+		return !!write_commit_graph();
+	if (!strcmp(argv[1], "verify"))
+		return !!verify_commit_graph();
+	usage(commit_graph_usage);
+}
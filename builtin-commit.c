@@ -757,6 +757,9 @@ static int parse_and_validate_options(int argc, const char *argv[],
 		commit = lookup_commit_reference(sha1);
 		if (!commit || parse_commit(commit))
 			die("could not parse commit %s", use_message);
+		load_commit_buffer(commit);
+		if (!commit->buffer)
+			die("could not read commit message of %s", use_message);
 
 		enc = strstr(commit->buffer, "\nencoding");
 		if (enc) {
@@ -835,11 +838,27 @@ int cmd_status(int argc, const char **argv, const char *prefix)
 		diff_use_color_default = git_use_color_default;
 
 	argc = parse_and_validate_options(argc, argv, builtin_status_usage, prefix);
+	/* paths given on the command line are looked up in the index */
+	sparse_index_ok = !argc;
 
 	index_file = prepare_index(argc, argv, prefix);
 
 	commitable = run_status(stdout, index_file, prefix, 0);
 
+	/*
+	 * Listing untracked files may have brought the untracked
+	 * cache up to date; keep it if we are looking at the real
+	 * index, which prepare_index() has already written out.
+	 */
+	if (commit_style == COMMIT_AS_IS &&
+	    the_index.untracked && the_index.untracked->changed) {
+		int fd = hold_locked_index(&index_lock, 0);
+		if (0 <= fd &&
+		    (write_cache(fd, active_cache, active_nr) ||
+		     commit_locked_index(&index_lock)))
+			rollback_lock_file(&index_lock);
+	}
+
 	rollback_index_files();
 
 	return commitable ? 0 : 1;
@@ -917,6 +936,7 @@ int cmd_commit(int argc, const char **argv, const char *prefix)
 		wt_status_use_color = git_use_color_default;
 
 	argc = parse_and_validate_options(argc, argv, builtin_commit_usage, prefix);
+	sparse_index_ok = !argc;
 
 	index_file = prepare_index(argc, argv, prefix);
 
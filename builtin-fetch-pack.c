@@ -409,9 +409,17 @@ static int everything_local(struct ref **refs, int nr_match, char **match)
 
 	save_commit_buffer = 0;
 
+	/*
+	 * Most of what the other side advertises is usually missing
+	 * here; find that out without a failed lookup in every object
+	 * directory, and rescan of the packs, for each ref.
+	 */
+	enable_loose_object_cache();
 	for (ref = *refs; ref; ref = ref->next) {
 		struct object *o;
 
+		if (!has_sha1_file(ref->old_sha1))
+			continue;
 		o = parse_object(ref->old_sha1);
 		if (!o)
 			continue;
@@ -426,6 +434,7 @@ static int everything_local(struct ref **refs, int nr_match, char **match)
 				cutoff = commit->date;
 		}
 	}
+	disable_loose_object_cache();
 
 	if (!args.depth) {
 		for_each_ref(mark_complete, NULL);
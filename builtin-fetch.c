@@ -166,22 +166,23 @@ static struct ref *get_ref_map(struct transport *transport,
 	return ref_map;
 }
 
+/* The refs are written together once they have all been looked at */
+static struct ref_transaction *transaction;
+
 static int s_update_ref(const char *action,
 			struct ref *ref,
-			int check_old)
+			int check_old,
+			const char **err)
 {
 	char msg[1024];
 	char *rla = getenv("GIT_REFLOG_ACTION");
-	static struct ref_lock *lock;
 
 	if (!rla)
 		rla = default_rla.buf;
 	snprintf(msg, sizeof(msg), "%s: %s", rla, action);
-	lock = lock_any_ref_for_update(ref->name,
-				       check_old ? ref->old_sha1 : NULL, 0);
-	if (!lock)
-		return 2;
-	if (write_ref_sha1(lock, ref->new_sha1, msg) < 0)
+	if (ref_transaction_update(transaction, ref->name, ref->new_sha1,
+				   check_old ? ref->old_sha1 : NULL,
+				   0, msg, err))
 		return 2;
 	return 0;
 }
@@ -189,9 +190,48 @@ static int s_update_ref(const char *action,
 #define SUMMARY_WIDTH (2 * DEFAULT_ABBREV + 3)
 #define REFCOL_WIDTH  10
 
+/*
+ * The line shown for a ref.  It is only formatted once the transaction
+ * has been committed, when we know whether the ref could be updated.
+ */
+struct ref_display {
+	char code;		/* 0 if there is nothing to show */
+	char summary[84];
+	const char *remote;
+	const char *local;
+	const char *note;	/* shown in parentheses, if not NULL */
+	const char *err;	/* set when the ref could not be updated */
+};
+
+static void set_display(struct ref_display *display, char code,
+			const char *summary, const char *remote,
+			const char *local, const char *note)
+{
+	display->code = code;
+	strlcpy(display->summary, summary, sizeof(display->summary));
+	display->remote = remote;
+	display->local = local;
+	display->note = note;
+}
+
+static void format_display(char *buf, const struct ref_display *display)
+{
+	char code = display->code;
+	const char *note = display->note;
+
+	if (display->err) {
+		code = '!';
+		note = "unable to update local ref";
+	}
+	sprintf(buf, "%c %-*s %-*s -> %s%s%s%s", code,
+		SUMMARY_WIDTH, display->summary, REFCOL_WIDTH, display->remote,
+		display->local, note ? "  (" : "", note ? note : "",
+		note ? ")" : "");
+}
+
 static int update_local_ref(struct ref *ref,
 			    const char *remote,
-			    char *display)
+			    struct ref_display *display)
 {
 	struct commit *current = NULL, *updated;
 	enum object_type type;
@@ -202,16 +242,14 @@ static int update_local_ref(struct ref *ref,
 		!prefixcmp(ref->name, "refs/remotes/") ? 13 :
 		0);
 
-	*display = 0;
 	type = sha1_object_info(ref->new_sha1, NULL);
 	if (type < 0)
 		die("object %s not found", sha1_to_hex(ref->new_sha1));
 
 	if (!hashcmp(ref->old_sha1, ref->new_sha1)) {
 		if (verbosity > 0)
-			sprintf(display, "= %-*s %-*s -> %s", SUMMARY_WIDTH,
-				"[up to date]", REFCOL_WIDTH, remote,
-				pretty_ref);
+			set_display(display, '=', "[up to date]", remote,
+				    pretty_ref, NULL);
 		return 0;
 	}
 
@@ -223,20 +261,16 @@ static int update_local_ref(struct ref *ref,
 		 * If this is the head, and it's not okay to update
 		 * the head, and the old value of the head isn't empty...
 		 */
-		sprintf(display, "! %-*s %-*s -> %s  (can't fetch in current branch)",
-			SUMMARY_WIDTH, "[rejected]", REFCOL_WIDTH, remote,
-			pretty_ref);
+		set_display(display, '!', "[rejected]", remote, pretty_ref,
+			    "can't fetch in current branch");
 		return 1;
 	}
 
 	if (!is_null_sha1(ref->old_sha1) &&
 	    !prefixcmp(ref->name, "refs/tags/")) {
-		int r;
-		r = s_update_ref("updating tag", ref, 0);
-		sprintf(display, "%c %-*s %-*s -> %s%s", r ? '!' : '-',
-			SUMMARY_WIDTH, "[tag update]", REFCOL_WIDTH, remote,
-			pretty_ref, r ? "  (unable to update local ref)" : "");
-		return r;
+		set_display(display, '-', "[tag update]", remote, pretty_ref,
+			    NULL);
+		return s_update_ref("updating tag", ref, 0, &display->err);
 	}
 
 	current = lookup_commit_reference_gently(ref->old_sha1, 1);
@@ -244,7 +278,6 @@ static int update_local_ref(struct ref *ref,
 	if (!current || !updated) {
 		const char *msg;
 		const char *what;
-		int r;
 		if (!strncmp(ref->name, "refs/tags/", 10)) {
 			msg = "storing tag";
 			what = "[new tag]";
@@ -254,40 +287,28 @@ static int update_local_ref(struct ref *ref,
 			what = "[new branch]";
 		}
 
-		r = s_update_ref(msg, ref, 0);
-		sprintf(display, "%c %-*s %-*s -> %s%s", r ? '!' : '*',
-			SUMMARY_WIDTH, what, REFCOL_WIDTH, remote, pretty_ref,
-			r ? "  (unable to update local ref)" : "");
-		return r;
+		set_display(display, '*', what, remote, pretty_ref, NULL);
+		return s_update_ref(msg, ref, 0, &display->err);
 	}
 
 	if (in_merge_bases(current, &updated, 1)) {
 		char quickref[83];
-		int r;
 		strcpy(quickref, find_unique_abbrev(current->object.sha1, DEFAULT_ABBREV));
 		strcat(quickref, "..");
 		strcat(quickref, find_unique_abbrev(ref->new_sha1, DEFAULT_ABBREV));
-		r = s_update_ref("fast forward", ref, 1);
-		sprintf(display, "%c %-*s %-*s -> %s%s", r ? '!' : ' ',
-			SUMMARY_WIDTH, quickref, REFCOL_WIDTH, remote,
-			pretty_ref, r ? "  (unable to update local ref)" : "");
-		return r;
+		set_display(display, ' ', quickref, remote, pretty_ref, NULL);
+		return s_update_ref("fast forward", ref, 1, &display->err);
 	} else if (force || ref->force) {
 		char quickref[84];
-		int r;
 		strcpy(quickref, find_unique_abbrev(current->object.sha1, DEFAULT_ABBREV));
 		strcat(quickref, "...");
 		strcat(quickref, find_unique_abbrev(ref->new_sha1, DEFAULT_ABBREV));
-		r = s_update_ref("forced-update", ref, 1);
-		sprintf(display, "%c %-*s %-*s -> %s  (%s)", r ? '!' : '+',
-			SUMMARY_WIDTH, quickref, REFCOL_WIDTH, remote,
-			pretty_ref,
-			r ? "unable to update local ref" : "forced update");
-		return r;
+		set_display(display, '+', quickref, remote, pretty_ref,
+			    "forced update");
+		return s_update_ref("forced-update", ref, 1, &display->err);
 	} else {
-		sprintf(display, "! %-*s %-*s -> %s  (non fast forward)",
-			SUMMARY_WIDTH, "[rejected]", REFCOL_WIDTH, remote,
-			pretty_ref);
+		set_display(display, '!', "[rejected]", remote, pretty_ref,
+			    "non fast forward");
 		return 1;
 	}
 }
@@ -297,16 +318,29 @@ static int store_updated_refs(const char *url, const char *remote_name,
 {
 	FILE *fp;
 	struct commit *commit;
-	int url_len, i, note_len, shown_url = 0, rc = 0;
+	int url_len, i, note_len, shown_url = 0, rc = 0, nr = 0;
 	char note[1024];
 	const char *what, *kind;
 	struct ref *rm;
+	struct ref_display *displays;
 	char *filename = git_path("FETCH_HEAD");
 
 	fp = fopen(filename, "a");
 	if (!fp)
 		return error("cannot open %s: %s\n", filename, strerror(errno));
-	for (rm = ref_map; rm; rm = rm->next) {
+
+	url_len = strlen(url);
+	for (i = url_len - 1; url[i] == '/' && 0 <= i; i--)
+		;
+	url_len = i + 1;
+	if (4 < i && !strncmp(".git", url + i - 3, 4))
+		url_len = i - 3;
+
+	for (rm = ref_map; rm; rm = rm->next)
+		nr++;
+	displays = xcalloc(nr, sizeof(*displays));
+	transaction = ref_transaction_begin();
+	for (rm = ref_map, i = 0; rm; rm = rm->next, i++) {
 		struct ref *ref = NULL;
 
 		if (rm->peer_ref) {
@@ -342,13 +376,6 @@ static int store_updated_refs(const char *url, const char *remote_name,
 			what = rm->name;
 		}
 
-		url_len = strlen(url);
-		for (i = url_len - 1; url[i] == '/' && 0 <= i; i--)
-			;
-		url_len = i + 1;
-		if (4 < i && !strncmp(".git", url + i - 3, 4))
-			url_len = i - 3;
-
 		note_len = 0;
 		if (*what) {
 			if (*kind)
@@ -364,22 +391,31 @@ static int store_updated_refs(const char *url, const char *remote_name,
 			note);
 
 		if (ref)
-			rc |= update_local_ref(ref, what, note);
+			rc |= update_local_ref(ref, what, &displays[i]);
 		else
-			sprintf(note, "* %-*s %-*s -> FETCH_HEAD",
-				SUMMARY_WIDTH, *kind ? kind : "branch",
-				 REFCOL_WIDTH, *what ? what : "HEAD");
-		if (*note) {
-			if (verbosity >= 0 && !shown_url) {
-				fprintf(stderr, "From %.*s\n",
-						url_len, url);
-				shown_url = 1;
-			}
-			if (verbosity >= 0)
-				fprintf(stderr, " %s\n", note);
-		}
+			set_display(&displays[i], '*',
+				    *kind ? kind : "branch",
+				    *what ? what : "HEAD",
+				    "FETCH_HEAD", NULL);
 	}
 	fclose(fp);
+	if (ref_transaction_commit(transaction))
+		rc |= 2;
+	transaction = NULL;
+
+	for (i = 0; i < nr; i++) {
+		if (!displays[i].code)
+			continue;
+		format_display(note, &displays[i]);
+		if (verbosity >= 0 && !shown_url) {
+			fprintf(stderr, "From %.*s\n",
+					url_len, url);
+			shown_url = 1;
+		}
+		if (verbosity >= 0)
+			fprintf(stderr, " %s\n", note);
+	}
+	free(displays);
 	if (rc & 2)
 		error("some local refs could not be updated; try running\n"
 		      " 'git remote prune %s' to remove any old, conflicting "
@@ -208,6 +208,7 @@ static void shortlog(const char *name, unsigned char *sha1,
 		if (subjects.nr > limit)
 			continue;
 
+		load_commit_buffer(commit);
 		bol = strstr(commit->buffer, "\n\n");
 		if (bol) {
 			unsigned char c;
@@ -11,6 +11,8 @@
 #include "fsck.h"
 #include "parse-options.h"
 #include "dir.h"
+#include "progress.h"
+#include "thread-utils.h"
 
 #define REACHABLE 0x0001
 #define SEEN      0x0002
@@ -26,6 +28,8 @@ static unsigned char head_sha1[20];
 static int errors_found;
 static int write_lost_and_found;
 static int verbose;
+static int nr_threads;
+static int show_progress = -1;
 #define ERROR_OBJECT 01
 #define ERROR_REACHABLE 02
 
@@ -578,6 +582,9 @@ static struct option fsck_opts[] = {
 	OPT_BOOLEAN(0, "strict", &check_strict, "enable more strict checking"),
 	OPT_BOOLEAN(0, "lost-found", &write_lost_and_found,
 				"write dangling objects in .git/lost-found"),
+	OPT_INTEGER(0, "threads", &nr_threads,
+				"verify packs using <n> threads"),
+	OPT_SET_INT(0, "progress", &show_progress, "show progress", 1),
 	OPT_END(),
 };
 
@@ -586,18 +593,28 @@ int cmd_fsck(int argc, const char **argv, const char *prefix)
 	int i, heads;
 
 	errors_found = 0;
+	/* Check the commit objects themselves, not their cached copy */
+	core_commit_graph = 0;
 
 	argc = parse_options(argc, argv, fsck_opts, fsck_usage, 0);
 	if (write_lost_and_found) {
 		check_full = 1;
 		include_reflogs = 0;
 	}
+	if (show_progress == -1)
+		show_progress = isatty(2) && !verbose;
+	if (!nr_threads)
+		nr_threads = online_cpus();
 
 	fsck_head_link();
 	fsck_object_dir(get_object_directory());
 	if (check_full) {
 		struct alternate_object_database *alt;
 		struct packed_git *p;
+		struct progress *progress = NULL;
+		uint32_t total = 0, count = 0;
+		off_t bytes = 0;
+
 		prepare_alt_odb();
 		for (alt = alt_odb_list; alt; alt = alt->next) {
 			char namebuf[PATH_MAX];
@@ -607,9 +624,22 @@ int cmd_fsck(int argc, const char **argv, const char *prefix)
 			fsck_object_dir(namebuf);
 		}
 		prepare_packed_git();
-		for (p = packed_git; p; p = p->next)
+		if (show_progress) {
+			for (p = packed_git; p; p = p->next) {
+				if (open_pack_index(p))
+					continue;
+				total += p->num_objects;
+			}
+			progress = start_progress("Checking objects", total);
+		}
+		for (p = packed_git; p; p = p->next) {
 			/* verify gives error messages itself */
-			verify_pack(p);
+			verify_pack_threaded(p, nr_threads, progress,
+					     count, bytes);
+			count += p->num_objects;
+			bytes += p->pack_size;
+		}
+		stop_progress(&progress);
 
 		for (p = packed_git; p; p = p->next) {
 			uint32_t j, num;
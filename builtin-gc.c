@@ -23,6 +23,7 @@ static const char * const builtin_gc_usage[] = {
 };
 
 static int pack_refs = 1;
+static int write_commit_graph;
 static int aggressive_window = -1;
 static int gc_auto_threshold = 6700;
 static int gc_auto_pack_limit = 50;
@@ -34,6 +35,7 @@ static const char *argv_reflog[] = {"reflog", "expire", "--all", NULL};
 static const char *argv_repack[MAX_ADD] = {"repack", "-d", "-l", NULL};
 static const char *argv_prune[] = {"prune", "--expire", NULL, NULL};
 static const char *argv_rerere[] = {"rerere", "gc", NULL};
+static const char *argv_commit_graph[] = {"commit-graph", "write", NULL};
 
 static int gc_config(const char *var, const char *value, void *cb)
 {
@@ -44,6 +46,10 @@ static int gc_config(const char *var, const char *value, void *cb)
 			pack_refs = git_config_bool(var, value);
 		return 0;
 	}
+	if (!strcmp(var, "gc.writecommitgraph")) {
+		write_commit_graph = git_config_bool(var, value);
+		return 0;
+	}
 	if (!strcmp(var, "gc.aggressivewindow")) {
 		aggressive_window = git_config_int(var, value);
 		return 0;
@@ -237,6 +243,10 @@ int cmd_gc(int argc, const char **argv, const char *prefix)
 	if (run_command_v_opt(argv_rerere, RUN_GIT_CMD))
 		return error(FAILED_RUN, argv_rerere[0]);
 
+	if (write_commit_graph &&
+	    run_command_v_opt(argv_commit_graph, RUN_GIT_CMD))
+		return error(FAILED_RUN, argv_commit_graph[0]);
+
 	if (auto_gc && too_many_loose_objects())
 		warning("There are too many unreachable loose objects; "
 			"run 'git prune' to remove them.");
@@ -501,6 +501,7 @@ static const char *get_oneline_for_filename(struct commit *commit,
 	int len = 0;
 	int suffix_len = strlen(fmt_patch_suffix) + 1;
 
+	load_commit_buffer(commit);
 	sol = strstr(commit->buffer, "\n\n");
 	if (!sol)
 		filename[0] = '\0';
@@ -9,6 +9,7 @@
 #include "delta.h"
 #include "pack.h"
 #include "pack-revindex.h"
+#include "pack-bitmap.h"
 #include "csum-file.h"
 #include "tree-walk.h"
 #include "diff.h"
@@ -28,7 +29,7 @@ git pack-objects [{ -q | --progress | --all-progress }] \n\
 	[--window=N] [--window-memory=N] [--depth=N] \n\
 	[--no-reuse-delta] [--no-reuse-object] [--delta-base-offset] \n\
 	[--threads=N] [--non-empty] [--revs [--unpacked | --all]*] [--reflog] \n\
-	[--stdout | base-name] [--include-tag] \n\
+	[--stdout | base-name] [--include-tag] [--write-bitmap-index] \n\
 	[--keep-unreachable | --unpack-unreachable] \n\
 	[<ref-list | <object-list]";
 
@@ -73,6 +74,8 @@ static int local;
 static int incremental;
 static int ignore_packed_keep;
 static int allow_ofs_delta;
+static int use_bitmap_index = 1;
+static int write_bitmap_index;
 static const char *base_name;
 static int progress = 1;
 static int window = 10;
@@ -104,6 +107,7 @@ static int object_ix_hashsz;
  */
 static uint32_t written, written_delta;
 static uint32_t reused, reused_delta;
+static uint32_t copied_verbatim, verbatim_runs;
 
 
 static void *get_delta(struct object_entry *entry)
@@ -365,7 +369,7 @@ static unsigned long write_object(struct sha1file *f,
 	else {
 		struct packed_git *p = entry->in_pack;
 		struct pack_window *w_curs = NULL;
-		struct revindex_entry *revidx;
+		int pos;
 		off_t offset;
 
 		if (entry->delta)
@@ -374,10 +378,11 @@ static unsigned long write_object(struct sha1file *f,
 		hdrlen = encode_header(type, entry->size, header);
 
 		offset = entry->in_pack_offset;
-		revidx = find_pack_revindex(p, offset);
-		datalen = revidx[1].offset - offset;
+		pos = find_pack_revindex(p, offset);
+		datalen = pack_pos_to_offset(p, pos + 1) - offset;
 		if (!pack_to_stdout && p->index_version > 1 &&
-		    check_pack_crc(p, &w_curs, offset, datalen, revidx->nr)) {
+		    check_pack_crc(p, &w_curs, offset, datalen,
+				   pack_pos_to_index(p, pos))) {
 			error("bad packed object CRC for %s", sha1_to_hex(entry->idx.sha1));
 			unuse_pack(&w_curs);
 			goto no_reuse;
@@ -463,8 +468,125 @@ static int write_one(struct sha1file *f,
 	return 1;
 }
 
-/* forward declaration for write_pack_file */
+/*
+ * Can e be copied byte for byte from pack p, where it has to start
+ * at in_offset, to out_offset in the pack we are writing?
+ */
+static int can_copy_verbatim(struct object_entry *e, struct packed_git *p,
+			     off_t in_offset, off_t out_offset)
+{
+	if (e->idx.offset || e->preferred_base)
+		return 0;	/* written already, or not to be written */
+	if (e->in_pack != p || e->in_pack_offset != in_offset)
+		return 0;
+	if (e->type != e->in_pack_type)
+		return 0;	/* pack has delta which is unusable */
+	if (!e->delta)
+		return 1;
+	if (e->type == OBJ_REF_DELTA)
+		/* write_object() would turn it into an OFS_DELTA */
+		return !allow_ofs_delta && e->delta->idx.offset;
+	if (e->type != OBJ_OFS_DELTA)
+		return 0;	/* we want to pack afresh */
+
+	/*
+	 * The encoded base offset is relative, so it stays valid if the
+	 * base is as far behind us here as it is in the pack.
+	 */
+	return allow_ofs_delta && e->delta->idx.offset &&
+		e->delta->in_pack == p &&
+		out_offset - e->delta->idx.offset ==
+		in_offset - e->delta->in_pack_offset;
+}
+
+/*
+ * When objects we reuse follow each other in the same order in their
+ * pack as in our list, there is nothing to re-encode between them:
+ * find the longest such run starting at objects[i] and copy it with
+ * one copy_pack_data().  Returns the number of objects written.
+ */
+static uint32_t write_reused_run(struct sha1file *f, uint32_t i, off_t *offset)
+{
+	struct packed_git *p = objects[i].in_pack;
+	struct pack_window *w_curs = NULL;
+	off_t start, end;
+	uint32_t n, j;
+
+	if (!reuse_object || pack_size_limit || !p)
+		return 0;
+	if (!pack_to_stdout && p->index_version == 1)
+		return 0;	/* no CRC to check the data against */
+
+	start = end = objects[i].in_pack_offset;
+	for (n = 0; i + n < nr_objects; n++) {
+		struct object_entry *e = objects + i + n;
+		off_t len;
+		uint32_t nr;
+		int pos;
+
+		if (!can_copy_verbatim(e, p, end, *offset + (end - start)))
+			break;
+		pos = find_pack_revindex(p, end);
+		len = pack_pos_to_offset(p, pos + 1) - end;
+		nr = pack_pos_to_index(p, pos);
+		if (!pack_to_stdout) {
+			/* write_one() will complain and inflate it afresh */
+			if (check_pack_crc(p, &w_curs, end, len, nr))
+				break;
+			e->idx.crc32 = packed_object_crc(p, nr);
+		}
+		e->idx.offset = *offset + (end - start);
+		end += len;
+	}
+	if (!n) {
+		unuse_pack(&w_curs);
+		return 0;
+	}
+
+	copy_pack_data(f, p, &w_curs, start, end - start);
+	unuse_pack(&w_curs);
+
+	copied_verbatim += n;
+	verbatim_runs++;
+	for (j = i; j < i + n; j++) {
+		written_list[nr_written++] = &objects[j].idx;
+		if (objects[j].delta) {
+			reused_delta++;
+			written_delta++;
+		}
+		reused++;
+		written++;
+	}
+
+	/* make sure off_t is sufficiently large not to wrap */
+	if (*offset > *offset + (end - start))
+		die("pack too large for current definition of off_t");
+	*offset += end - start;
+	return n;
+}
+
+/* forward declarations for write_pack_file */
 static int adjust_perm(const char *path, mode_t mode);
+static uint32_t object_name_hash(const unsigned char *sha1);
+
+static void write_bitmap_file(const char *idx_name, unsigned char *sha1,
+			      mode_t mode)
+{
+	char *bitmap_tmp_name, tmpname[PATH_MAX];
+
+	bitmap_tmp_name = write_pack_bitmap(idx_name, object_name_hash);
+	if (!bitmap_tmp_name)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s-%s.bitmap",
+		 base_name, sha1_to_hex(sha1));
+	if (adjust_perm(bitmap_tmp_name, mode))
+		die("unable to make temporary bitmap file readable: %s",
+		    strerror(errno));
+	if (rename(bitmap_tmp_name, tmpname))
+		die("unable to rename temporary bitmap file: %s",
+		    strerror(errno));
+	free(bitmap_tmp_name);
+}
 
 static void write_pack_file(void)
 {
@@ -501,9 +623,14 @@ static void write_pack_file(void)
 		sha1write(f, &hdr, sizeof(hdr));
 		offset = sizeof(hdr);
 		nr_written = 0;
-		for (; i < nr_objects; i++) {
-			if (!write_one(f, objects + i, &offset))
-				break;
+		while (i < nr_objects) {
+			uint32_t n = write_reused_run(f, i, &offset);
+			if (!n) {
+				if (!write_one(f, objects + i, &offset))
+					break;
+				n = 1;
+			}
+			i += n;
 			display_progress(progress_state, written);
 		}
 
@@ -525,13 +652,19 @@ static void write_pack_file(void)
 		if (!pack_to_stdout) {
 			mode_t mode = umask(0);
 			struct stat st;
-			char *idx_tmp_name, tmpname[PATH_MAX];
+			char *idx_tmp_name, *rev_tmp_name = NULL;
+			char tmpname[PATH_MAX], rev_name[PATH_MAX];
+			unsigned char pack_sha1[20];
 
 			umask(mode);
 			mode = 0444 & ~mode;
 
+			hashcpy(pack_sha1, sha1);
 			idx_tmp_name = write_idx_file(NULL, written_list,
 						      nr_written, sha1);
+			if (pack_write_rev_index)
+				rev_tmp_name = write_rev_file(NULL, written_list,
+							      nr_written, pack_sha1);
 
 			snprintf(tmpname, sizeof(tmpname), "%s-%s.pack",
 				 base_name, sha1_to_hex(sha1));
@@ -564,6 +697,18 @@ static void write_pack_file(void)
 						tmpname, strerror(errno));
 			}
 
+			if (rev_tmp_name) {
+				snprintf(rev_name, sizeof(rev_name), "%s-%s.rev",
+					 base_name, sha1_to_hex(sha1));
+				if (adjust_perm(rev_tmp_name, mode))
+					die("unable to make temporary reverse index file readable: %s",
+					    strerror(errno));
+				if (rename(rev_tmp_name, rev_name))
+					die("unable to rename temporary reverse index file: %s",
+					    strerror(errno));
+				free(rev_tmp_name);
+			}
+
 			snprintf(tmpname, sizeof(tmpname), "%s-%s.idx",
 				 base_name, sha1_to_hex(sha1));
 			if (adjust_perm(idx_tmp_name, mode))
@@ -574,6 +719,17 @@ static void write_pack_file(void)
 				    strerror(errno));
 
 			free(idx_tmp_name);
+
+			/*
+			 * The bitmap has to cover everything reachable
+			 * from the refs, which a split pack cannot do.
+			 */
+			if (write_bitmap_index && nr_written != nr_result)
+				warning("not writing bitmap index: "
+					"pack was split");
+			else if (write_bitmap_index)
+				write_bitmap_file(tmpname, sha1, mode);
+
 			free(pack_tmp_name);
 			puts(sha1_to_hex(sha1));
 		}
@@ -633,6 +789,13 @@ static struct object_entry *locate_object_entry(const unsigned char *sha1)
 	return NULL;
 }
 
+/* The name hash of an object in the pack, for its bitmap index */
+static uint32_t object_name_hash(const unsigned char *sha1)
+{
+	struct object_entry *entry = locate_object_entry(sha1);
+	return entry ? entry->hash : 0;
+}
+
 static void rehash_objects(void)
 {
 	uint32_t i;
@@ -695,6 +858,44 @@ static int no_try_delta(const char *path)
 	return 0;
 }
 
+static struct object_entry *create_object_entry(const unsigned char *sha1,
+						enum object_type type,
+						unsigned hash, int exclude,
+						struct packed_git *found_pack,
+						off_t found_offset, int ix)
+{
+	struct object_entry *entry;
+
+	if (nr_objects >= nr_alloc) {
+		nr_alloc = (nr_alloc  + 1024) * 3 / 2;
+		objects = xrealloc(objects, nr_alloc * sizeof(*entry));
+	}
+
+	entry = objects + nr_objects++;
+	memset(entry, 0, sizeof(*entry));
+	hashcpy(entry->idx.sha1, sha1);
+	entry->hash = hash;
+	if (type)
+		entry->type = type;
+	if (exclude)
+		entry->preferred_base = 1;
+	else
+		nr_result++;
+	if (found_pack) {
+		entry->in_pack = found_pack;
+		entry->in_pack_offset = found_offset;
+	}
+
+	if (object_ix_hashsz * 3 <= nr_objects * 4)
+		rehash_objects();
+	else
+		object_ix[-1 - ix] = nr_objects;
+
+	display_progress(progress_state, nr_objects);
+
+	return entry;
+}
+
 static int add_object_entry(const unsigned char *sha1, enum object_type type,
 			    const char *name, int exclude)
 {
@@ -736,39 +937,28 @@ static int add_object_entry(const unsigned char *sha1, enum object_type type,
 		}
 	}
 
-	if (nr_objects >= nr_alloc) {
-		nr_alloc = (nr_alloc  + 1024) * 3 / 2;
-		objects = xrealloc(objects, nr_alloc * sizeof(*entry));
-	}
-
-	entry = objects + nr_objects++;
-	memset(entry, 0, sizeof(*entry));
-	hashcpy(entry->idx.sha1, sha1);
-	entry->hash = hash;
-	if (type)
-		entry->type = type;
-	if (exclude)
-		entry->preferred_base = 1;
-	else
-		nr_result++;
-	if (found_pack) {
-		entry->in_pack = found_pack;
-		entry->in_pack_offset = found_offset;
-	}
-
-	if (object_ix_hashsz * 3 <= nr_objects * 4)
-		rehash_objects();
-	else
-		object_ix[-1 - ix] = nr_objects;
-
-	display_progress(progress_state, nr_objects);
-
+	entry = create_object_entry(sha1, type, hash, exclude,
+				    found_pack, found_offset, ix);
 	if (name && no_try_delta(name))
 		entry->no_try_delta = 1;
 
 	return 1;
 }
 
+static void add_object_entry_from_bitmap(const unsigned char *sha1,
+					 enum object_type type,
+					 uint32_t name_hash,
+					 struct packed_git *found_pack,
+					 off_t found_offset)
+{
+	int ix = nr_objects ? locate_object_entry_hash(sha1) : -1;
+
+	if (ix >= 0)
+		return;
+	create_object_entry(sha1, type, name_hash, 0,
+			    found_pack, found_offset, ix);
+}
+
 struct pbase_tree_cache {
 	unsigned char sha1[20];
 	int ref;
@@ -1081,11 +1271,11 @@ static void check_object(struct object_entry *entry)
 				goto give_up;
 			}
 			if (reuse_delta && !entry->preferred_base) {
-				struct revindex_entry *revidx;
-				revidx = find_pack_revindex(p, ofs);
-				if (!revidx)
+				int pos = find_pack_revindex(p, ofs);
+				if (pos < 0)
 					goto give_up;
-				base_ref = nth_packed_object_sha1(p, revidx->nr);
+				base_ref = nth_packed_object_sha1(p,
+						pack_pos_to_index(p, pos));
 			}
 			entry->in_pack_header_size = used + used_0;
 			break;
@@ -1234,10 +1424,6 @@ static int delta_cacheable(unsigned long src_size, unsigned long trg_size,
 
 #ifdef THREADED_DELTA_SEARCH
 
-static pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define read_lock()		pthread_mutex_lock(&read_mutex)
-#define read_unlock()		pthread_mutex_unlock(&read_mutex)
-
 static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define cache_lock()		pthread_mutex_lock(&cache_mutex)
 #define cache_unlock()		pthread_mutex_unlock(&cache_mutex)
@@ -1248,8 +1434,6 @@ static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #else
 
-#define read_lock()		(void)0
-#define read_unlock()		(void)0
 #define cache_lock()		(void)0
 #define cache_unlock()		(void)0
 #define progress_lock()		(void)0
@@ -1307,9 +1491,7 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 
 	/* Load data if not already done */
 	if (!trg->data) {
-		read_lock();
 		trg->data = read_sha1_file(trg_entry->idx.sha1, &type, &sz);
-		read_unlock();
 		if (!trg->data)
 			die("object %s cannot be read",
 			    sha1_to_hex(trg_entry->idx.sha1));
@@ -1319,9 +1501,7 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 		*mem_usage += sz;
 	}
 	if (!src->data) {
-		read_lock();
 		src->data = read_sha1_file(src_entry->idx.sha1, &type, &sz);
-		read_unlock();
 		if (!src->data)
 			die("object %s cannot be read",
 			    sha1_to_hex(src_entry->idx.sha1));
@@ -1645,6 +1825,7 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 	}
 
 	/* Start work threads. */
+	enable_threaded_object_reads();
 	for (i = 0; i < delta_search_threads; i++) {
 		if (!p[i].list_size)
 			continue;
@@ -1723,6 +1904,7 @@ static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 			active_threads--;
 		}
 	}
+	disable_threaded_object_reads();
 }
 
 #else
@@ -1862,10 +2044,18 @@ static int git_pack_config(const char *k, const char *v, void *cb)
 				pack_idx_default_version);
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		pack_write_rev_index = git_config_bool(k, v);
+		return 0;
+	}
 	if (!strcmp(k, "pack.packsizelimit")) {
 		pack_size_limit_cfg = git_config_ulong(k, v);
 		return 0;
 	}
+	if (!strcmp(k, "pack.usebitmaps")) {
+		use_bitmap_index = git_config_bool(k, v);
+		return 0;
+	}
 	return git_default_config(k, v, cb);
 }
 
@@ -2053,6 +2243,11 @@ static void get_object_list(int ac, const char **av)
 			die("bad revision '%s'", line);
 	}
 
+	if (use_bitmap_index && !prepare_bitmap_walk(&revs)) {
+		traverse_bitmap_commit_list(add_object_entry_from_bitmap);
+		return;
+	}
+
 	if (prepare_revision_walk(&revs))
 		die("revision walk setup failed");
 	mark_edges_uninteresting(revs.commits, &revs, show_edge);
@@ -2208,6 +2403,10 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 			include_tag = 1;
 			continue;
 		}
+		if (!strcmp("--write-bitmap-index", arg)) {
+			write_bitmap_index = 1;
+			continue;
+		}
 		if (!strcmp("--unpacked", arg) ||
 		    !prefixcmp(arg, "--unpacked=") ||
 		    !strcmp("--reflog", arg) ||
@@ -2272,6 +2471,18 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	if (keep_unreachable && unpack_unreachable)
 		die("--keep-unreachable and --unpack-unreachable are incompatible.");
 
+	if (pack_to_stdout)
+		write_bitmap_index = 0;
+
+	/*
+	 * The bitmaps can only tell what is reachable; they know nothing
+	 * about which pack each object is in, or about unreachable ones.
+	 * Nor do they know the paths that pick the bases of a thin pack.
+	 */
+	if (incremental || ignore_packed_keep ||
+	    keep_unreachable || unpack_unreachable || thin)
+		use_bitmap_index = 0;
+
 #ifdef THREADED_DELTA_SEARCH
 	if (!delta_search_threads)	/* --threads=0 means autodetect */
 		delta_search_threads = online_cpus();
@@ -2296,6 +2507,8 @@ int cmd_pack_objects(int argc, const char **argv, const char *prefix)
 	if (nr_result)
 		prepare_pack(window, depth);
 	write_pack_file();
+	trace_printf("trace: pack-objects: %"PRIu32" objects copied verbatim"
+		     " in %"PRIu32" runs\n", copied_verbatim, verbatim_runs);
 	if (progress)
 		fprintf(stderr, "Total %"PRIu32" (delta %"PRIu32"),"
 			" reused %"PRIu32" (delta %"PRIu32")\n",
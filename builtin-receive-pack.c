@@ -219,7 +219,6 @@ static const char *update(struct command *cmd)
 	const char *name = cmd->ref_name;
 	unsigned char *old_sha1 = cmd->old_sha1;
 	unsigned char *new_sha1 = cmd->new_sha1;
-	struct ref_lock *lock;
 
 	/* only refs/... are allowed */
 	if (prefixcmp(name, "refs/") || check_ref_format(name + 5)) {
@@ -289,29 +288,25 @@ static const char *update(struct command *cmd)
 		error("hook declined to update %s", name);
 		return "hook declined";
 	}
+	return NULL; /* good */
+}
 
-	if (is_null_sha1(new_sha1)) {
-		if (!parse_object(old_sha1)) {
-			warning ("Allowing deletion of corrupt ref.");
-			old_sha1 = NULL;
-		}
-		if (delete_ref(name, old_sha1, 0)) {
-			error("failed to delete %s", name);
-			return "failed to delete";
-		}
-		return NULL; /* good */
-	}
-	else {
-		lock = lock_any_ref_for_update(name, old_sha1, 0);
-		if (!lock) {
-			error("failed to lock %s", name);
-			return "failed to lock";
-		}
-		if (write_ref_sha1(lock, new_sha1, "push")) {
-			return "failed to write"; /* error() already called */
-		}
-		return NULL; /* good */
+/* Lock a ref that update() let through; the commit writes it */
+static void queue_update(struct command *cmd,
+			 struct ref_transaction *transaction)
+{
+	const char *name = cmd->ref_name;
+	unsigned char *old_sha1 = cmd->old_sha1;
+	unsigned char *new_sha1 = cmd->new_sha1;
+
+	if (is_null_sha1(new_sha1) && !parse_object(old_sha1)) {
+		warning ("Allowing deletion of corrupt ref.");
+		old_sha1 = NULL;
 	}
+	if (ref_transaction_update(transaction, name, new_sha1, old_sha1,
+				   0, "push", &cmd->error_string))
+		error("failed to %s %s",
+		      is_null_sha1(new_sha1) ? "delete" : "lock", name);
 }
 
 static char update_post_hook[] = "hooks/post-update";
@@ -349,6 +344,7 @@ static void run_update_post_hook(struct command *cmd)
 static void execute_commands(const char *unpacker_error)
 {
 	struct command *cmd = commands;
+	struct ref_transaction *transaction;
 
 	if (unpacker_error) {
 		while (cmd) {
@@ -366,10 +362,15 @@ static void execute_commands(const char *unpacker_error)
 		return;
 	}
 
-	while (cmd) {
+	/* no ref is locked while the update hooks run */
+	for (cmd = commands; cmd; cmd = cmd->next)
 		cmd->error_string = update(cmd);
-		cmd = cmd->next;
-	}
+
+	transaction = ref_transaction_begin();
+	for (cmd = commands; cmd; cmd = cmd->next)
+		if (!cmd->error_string)
+			queue_update(cmd, transaction);
+	ref_transaction_commit(transaction);
 }
 
 static void read_head_info(void)
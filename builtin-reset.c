@@ -83,7 +83,8 @@ static void print_new_head_line(struct commit *commit)
 
 	hex = find_unique_abbrev(commit->object.sha1, DEFAULT_ABBREV);
 	printf("HEAD is now at %s", hex);
-	body = strstr(commit->buffer, "\n\n");
+	load_commit_buffer(commit);
+	body = commit->buffer ? strstr(commit->buffer, "\n\n") : NULL;
 	if (body) {
 		const char *eol;
 		size_t len;
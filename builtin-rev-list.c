@@ -106,6 +106,8 @@ static void show_commit(struct commit *commit)
 	else
 		putchar('\n');
 
+	if (revs.verbose_header)
+		load_commit_buffer(commit);
 	if (revs.verbose_header && commit->buffer) {
 		struct strbuf buf = STRBUF_INIT;
 		pretty_print_commit(revs.commit_format, commit,
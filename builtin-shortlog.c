@@ -128,6 +128,7 @@ void shortlog_add_commit(struct shortlog *log, struct commit *commit)
 {
 	const char *author = NULL, *buffer;
 
+	load_commit_buffer(commit);
 	buffer = commit->buffer;
 	while (*buffer && *buffer != '\n') {
 		const char *eol = strchr(buffer, '\n');
@@ -33,6 +33,7 @@ int cmd_write_tree(int argc, const char **argv, const char *unused_prefix)
 	if (argc > 2)
 		die("too many options");
 
+	sparse_index_ok = 1;
 	ret = write_cache_as_tree(sha1, missing_ok, prefix);
 	switch (ret) {
 	case 0:
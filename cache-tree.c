@@ -99,6 +99,12 @@ struct cache_tree_sub *cache_tree_sub(struct cache_tree *it, const char *path)
 	return find_subtree(it, path, pathlen, 1);
 }
 
+struct cache_tree_sub *cache_tree_find_sub(struct cache_tree *it,
+					   const char *path, int pathlen)
+{
+	return find_subtree(it, path, pathlen, 0);
+}
+
 void cache_tree_invalidate_path(struct cache_tree *it, const char *path)
 {
 	/* a/b/c
@@ -245,6 +251,14 @@ static int update_one(struct cache_tree *it,
 	if (0 <= it->entry_count && has_sha1_file(it->sha1))
 		return it->entry_count;
 
+	/* A sparse directory entry already names the tree */
+	if (entries && ce_namelen(cache[0]) == baselen &&
+	    S_ISSPARSEDIR(cache[0]->ce_mode)) {
+		hashcpy(it->sha1, cache[0]->sha1);
+		it->entry_count = 1;
+		return 1;
+	}
+
 	/*
 	 * We first scan for subtrees and update them; we start by
 	 * marking existing subtrees -- the ones that are unmarked
@@ -376,6 +390,51 @@ int cache_tree_update(struct cache_tree *it,
 	return 0;
 }
 
+static int fix_counts(struct cache_tree *it,
+		      struct cache_entry **cache,
+		      int entries,
+		      const char *base,
+		      int baselen)
+{
+	int i = 0;
+
+	while (i < entries) {
+		struct cache_entry *ce = cache[i];
+		struct cache_tree_sub *sub = NULL;
+		const char *slash;
+		int pathlen = ce_namelen(ce);
+
+		/* a sparse directory entry is "base" itself */
+		if (pathlen < baselen || memcmp(base, ce->name, baselen))
+			break;
+		slash = memchr(ce->name + baselen, '/', pathlen - baselen);
+		if (!slash) {
+			i++;
+			continue;
+		}
+		if (it)
+			sub = find_subtree(it, ce->name + baselen,
+					   slash - ce->name - baselen, 0);
+		i += fix_counts(sub ? sub->cache_tree : NULL,
+				cache + i, entries - i,
+				ce->name, slash - ce->name + 1);
+	}
+	if (it && 0 <= it->entry_count)
+		it->entry_count = i;
+	return i;
+}
+
+/*
+ * Recompute the number of entries each valid subtree covers, after
+ * the entries have changed without changing the trees they make up.
+ */
+void cache_tree_fix_counts(struct cache_tree *it,
+			   struct cache_entry **cache,
+			   int entries)
+{
+	fix_counts(it, cache, entries, "", 0);
+}
+
 static void write_one(struct strbuf *buffer, struct cache_tree *it,
                       const char *path, int pathlen)
 {
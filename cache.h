@@ -55,6 +55,13 @@ int git_inflate(z_streamp strm, int flush);
 #define S_IFGITLINK	0160000
 #define S_ISGITLINK(m)	(((m) & S_IFMT) == S_IFGITLINK)
 
+/*
+ * A sparse index stands for a whole directory with a single entry,
+ * named after the directory with a trailing slash, that records the
+ * tree object of the directory (see sparse-index.h).
+ */
+#define S_ISSPARSEDIR(m)	((m) == S_IFDIR)
+
 /*
  * Intensive research over the course of many years has shown that
  * port 9418 is totally unused by anything else. Or
@@ -150,7 +157,6 @@ struct cache_entry {
 	unsigned int ce_size;
 	unsigned int ce_flags;
 	unsigned char sha1[20];
-	struct cache_entry *next;
 	char name[FLEX_ARRAY]; /* more */
 };
 
@@ -177,6 +183,8 @@ struct cache_entry {
 #define CE_HASHED    (0x100000)
 #define CE_UNHASHED  (0x200000)
 
+#define CE_FSMONITOR_VALID (0x400000)
+
 /*
  * Extended on-disk flags
  */
@@ -190,9 +198,9 @@ struct cache_entry {
  * Safeguard to avoid saving wrong flags:
  *  - CE_EXTENDED2 won't get saved until its semantic is known
  *  - Bits in 0x0000FFFF have been saved in ce_flags already
- *  - Bits in 0x003F0000 are currently in-memory flags
+ *  - Bits in 0x007F0000 are currently in-memory flags
  */
-#if CE_EXTENDED_FLAGS & 0x803FFFFF
+#if CE_EXTENDED_FLAGS & 0x807FFFFF
 #error "CE_EXTENDED_FLAGS out of range"
 #endif
 
@@ -205,8 +213,8 @@ static inline void copy_cache_entry(struct cache_entry *dst, struct cache_entry
 {
 	unsigned int state = dst->ce_flags & CE_STATE_MASK;
 
-	/* Don't copy hash chain and name */
-	memcpy(dst, src, offsetof(struct cache_entry, next));
+	/* Don't copy the name */
+	memcpy(dst, src, offsetof(struct cache_entry, name));
 
 	/* Restore the hash state */
 	dst->ce_flags = (dst->ce_flags & ~CE_STATE_MASK) | state;
@@ -278,21 +286,34 @@ static inline int ce_to_dtype(const struct cache_entry *ce)
 #define ondisk_cache_entry_size(len) flexible_size(ondisk_cache_entry,len)
 #define ondisk_cache_entry_extended_size(len) flexible_size(ondisk_cache_entry_extended,len)
 
+/* Index entries by name, for case-insensitive lookups; see name-hash.c */
+struct name_hash {
+	unsigned int size, nr;
+	struct name_hash_slot *slot;
+};
+
 struct index_state {
 	struct cache_entry **cache;
 	unsigned int cache_nr, cache_alloc, cache_changed;
 	struct cache_tree *cache_tree;
+	struct untracked_cache *untracked;
+	struct split_index *split_index;
+	uint64_t fsmonitor_last_update;
+	unsigned int version; /* of the index file read */
 	time_t timestamp;
 	void *alloc;
 	unsigned name_hash_initialized : 1,
-		 initialized : 1;
-	struct hash_table name_hash;
+		 initialized : 1,
+		 fsmonitor_has_run : 1,
+		 sparse_index : 1;
+	struct name_hash name_hash;
 };
 
 extern struct index_state the_index;
 
 /* Name hashing */
 extern void add_name_hash(struct index_state *istate, struct cache_entry *ce);
+extern void free_name_hash(struct index_state *istate);
 /*
  * We don't actually *remove* it, we can just mark it invalid so that
  * we won't find it in lookups.
@@ -425,10 +446,12 @@ extern int init_db(const char *template_dir, unsigned int flags);
 /* Initialize and use the cache information */
 extern int read_index(struct index_state *);
 extern int read_index_preload(struct index_state *, const char **pathspec);
+/* Threads to stat nr things with when each should do at least cost */
+extern int preload_threads(int nr, int cost);
 extern int read_index_from(struct index_state *, const char *path);
 extern int is_index_unborn(struct index_state *);
 extern int read_index_unmerged(struct index_state *);
-extern int write_index(const struct index_state *, int newfd);
+extern int write_index(struct index_state *, int newfd);
 extern int discard_index(struct index_state *);
 extern int unmerged_index(const struct index_state *);
 extern int verify_path(const char *path);
@@ -492,6 +515,7 @@ extern int hold_locked_index(struct lock_file *, int);
 extern int commit_locked_index(struct lock_file *);
 extern void set_alternate_index_output(const char *);
 extern int close_lock_file(struct lock_file *);
+extern int reopen_lock_file(struct lock_file *);
 extern void rollback_lock_file(struct lock_file *);
 extern int delete_ref(const char *, const unsigned char *sha1, int delopt);
 
@@ -516,6 +540,17 @@ extern size_t delta_base_cache_limit;
 extern int auto_crlf;
 extern int fsync_object_files;
 extern int core_preload_index;
+extern int core_preload_index_threads;
+extern int core_commit_graph;
+extern int core_multi_pack_index;
+extern int core_untracked_cache;
+extern const char *core_fsmonitor;
+extern int core_split_index;
+extern int core_sparse_index;
+extern int sparse_index_ok;
+extern int index_threads;
+extern int index_version;
+extern int checkout_workers;
 
 enum safe_crlf {
 	SAFE_CRLF_FALSE = 0,
@@ -646,6 +681,15 @@ extern int has_sha1_pack(const unsigned char *sha1, const char **ignore);
 extern int has_sha1_file(const unsigned char *sha1);
 extern int has_loose_object_nonlocal(const unsigned char *sha1);
 
+/*
+ * While enabled, existence checks for loose objects are answered from
+ * a listing of each objects/xx/ directory, read when first needed,
+ * instead of probing the file system for every object.  Objects other
+ * processes write meanwhile may be missed until reprepare_packed_git().
+ */
+extern void enable_loose_object_cache(void);
+extern void disable_loose_object_cache(void);
+
 extern int has_pack_file(const unsigned char *sha1);
 extern int has_pack_index(const unsigned char *sha1);
 
@@ -730,6 +774,7 @@ extern void clear_lstat_cache(void);
 extern struct alternate_object_database {
 	struct alternate_object_database *next;
 	char *name;
+	struct loose_object_cache *loose_cache;
 	char base[FLEX_ARRAY]; /* more */
 } *alt_odb_list;
 extern void prepare_alt_odb(void);
@@ -759,7 +804,8 @@ extern struct packed_git {
 	time_t mtime;
 	int pack_fd;
 	unsigned pack_local:1,
-		 pack_keep:1;
+		 pack_keep:1,
+		 multi_pack_index:1;
 	unsigned char sha1[20];
 	/* something like ".git/objects/pack/xxxxx.pack" */
 	char pack_name[FLEX_ARRAY]; /* more */
@@ -827,6 +873,15 @@ extern unsigned char* use_pack(struct packed_git *, struct pack_window **, off_t
 extern void close_pack_windows(struct packed_git *);
 extern void unuse_pack(struct pack_window **);
 extern void free_pack_by_name(const char *);
+
+/*
+ * Let several threads read objects at the same time, until the
+ * matching disable_threaded_object_reads().  Neither may be called
+ * while other threads are reading objects.
+ */
+extern void enable_threaded_object_reads(void);
+extern void disable_threaded_object_reads(void);
+
 extern struct packed_git *add_packed_git(const char *, int, int);
 extern const unsigned char *nth_packed_object_sha1(struct packed_git *, uint32_t);
 extern off_t nth_packed_object_offset(const struct packed_git *, uint32_t);
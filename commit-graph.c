@@ -0,0 +1,492 @@
+#include "cache.h"
+#include "commit.h"
+#include "dir.h"
+#include "tag.h"
+#include "refs.h"
+#include "csum-file.h"
+#include "commit-graph.h"
+
+/*
+ * The commit-graph file is laid out as follows (all numbers in
+ * network byte order):
+ *
+ *  - a header: signature, version, the number of commits and the
+ *    number of entries in the extra edge list;
+ *
+ *  - a 256-entry fan-out table of the number of commits whose object
+ *    name starts with a byte less than or equal to the index;
+ *
+ *  - the sorted object names of the commits;
+ *
+ *  - one 40-byte record per commit in the same order: the object name
+ *    of its tree, the positions of its first and second parent, its
+ *    generation number and its committer date as a 64-bit number;
+ *
+ *  - the extra edge list holding the parents of octopus merges;
+ *
+ *  - the SHA-1 checksum of all of the above.
+ *
+ * A parent position of GRAPH_PARENT_NONE means there is no such
+ * parent.  When the second parent position has GRAPH_EXTRA_EDGES set,
+ * the rest of it is an index into the extra edge list, which holds the
+ * positions of the second and later parents; the last one of those has
+ * GRAPH_LAST_EDGE set.
+ */
+#define GRAPH_HEADER_SIZE 16
+#define GRAPH_FANOUT_SIZE (256 * 4)
+#define GRAPH_RECORD_SIZE 40
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_EXTRA_EDGES 0x80000000
+#define GRAPH_LAST_EDGE 0x80000000
+#define GRAPH_EDGE_MASK 0x7fffffff
+
+#define GRAPH_SEEN (1u<<20)
+
+static struct commit_graph {
+	const char *path;
+	unsigned char *map;
+	size_t map_size;
+	uint32_t nr_commits;
+	uint32_t nr_extra_edges;
+	const uint32_t *fanout;
+	const unsigned char *oids;
+	const unsigned char *records;
+	const uint32_t *extra_edges;
+} graph;
+
+static char *graph_file_name(void)
+{
+	return xstrdup(mkpath("%s/info/commit-graph", get_object_directory()));
+}
+
+static int load_commit_graph(void)
+{
+	const uint32_t *hdr;
+	struct stat st;
+	uint64_t expect;
+	int fd;
+
+	graph.path = graph_file_name();
+	fd = open(graph.path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) ||
+	    st.st_size < GRAPH_HEADER_SIZE + GRAPH_FANOUT_SIZE + 20) {
+		close(fd);
+		return error("commit-graph file %s is too small", graph.path);
+	}
+	graph.map_size = xsize_t(st.st_size);
+	graph.map = xmmap(NULL, graph.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	hdr = (const uint32_t *)graph.map;
+	if (ntohl(hdr[0]) != GRAPH_SIGNATURE ||
+	    ntohl(hdr[1]) != GRAPH_VERSION)
+		goto bad;
+	graph.nr_commits = ntohl(hdr[2]);
+	graph.nr_extra_edges = ntohl(hdr[3]);
+	expect = GRAPH_HEADER_SIZE + GRAPH_FANOUT_SIZE + 20 +
+		(uint64_t)graph.nr_commits * (20 + GRAPH_RECORD_SIZE) +
+		(uint64_t)graph.nr_extra_edges * 4;
+	if (expect != graph.map_size)
+		goto bad;
+	graph.fanout = hdr + GRAPH_HEADER_SIZE / 4;
+	if (ntohl(graph.fanout[255]) != graph.nr_commits)
+		goto bad;
+	graph.oids = graph.map + GRAPH_HEADER_SIZE + GRAPH_FANOUT_SIZE;
+	graph.records = graph.oids + graph.nr_commits * 20;
+	graph.extra_edges = (const uint32_t *)
+		(graph.records + graph.nr_commits * GRAPH_RECORD_SIZE);
+	return 0;
+
+bad:
+	error("commit-graph file %s is corrupt", graph.path);
+	munmap(graph.map, graph.map_size);
+	graph.map = NULL;
+	return -1;
+}
+
+static int open_commit_graph(void)
+{
+	static int graph_opened;
+
+	if (!graph_opened) {
+		graph_opened = 1;
+		load_commit_graph();
+	}
+	return graph.map != NULL;
+}
+
+static int prepare_commit_graph(void)
+{
+	/* Grafts change the parents, and the graph records the real ones */
+	if (!core_commit_graph || has_commit_grafts())
+		return 0;
+	return open_commit_graph();
+}
+
+static int graph_pos(const unsigned char *sha1, uint32_t *pos)
+{
+	uint32_t lo, hi;
+
+	lo = sha1[0] ? ntohl(graph.fanout[sha1[0] - 1]) : 0;
+	hi = ntohl(graph.fanout[sha1[0]]);
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(sha1, graph.oids + mi * 20);
+		if (!cmp) {
+			*pos = mi;
+			return 0;
+		}
+		if (cmp < 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -1;
+}
+
+static uint32_t record_word(uint32_t pos, int offset)
+{
+	const unsigned char *rec = graph.records + pos * GRAPH_RECORD_SIZE;
+	return ntohl(*(const uint32_t *)(rec + offset));
+}
+
+static struct commit_list **insert_graph_parent(uint32_t edge,
+						struct commit_list **pptr)
+{
+	struct commit *parent;
+
+	edge &= GRAPH_EDGE_MASK;
+	if (graph.nr_commits <= edge)
+		die("commit-graph file %s is corrupt", graph.path);
+	parent = lookup_commit(graph.oids + edge * 20);
+	if (parent)
+		pptr = &commit_list_insert(parent, pptr)->next;
+	return pptr;
+}
+
+static struct commit_list *graph_parents(uint32_t pos)
+{
+	struct commit_list *parents = NULL, **pptr = &parents;
+	uint32_t edge;
+
+	edge = record_word(pos, 20);
+	if (edge == GRAPH_PARENT_NONE)
+		return NULL;
+	pptr = insert_graph_parent(edge, pptr);
+
+	edge = record_word(pos, 24);
+	if (edge == GRAPH_PARENT_NONE)
+		return parents;
+	if (!(edge & GRAPH_EXTRA_EDGES)) {
+		insert_graph_parent(edge, pptr);
+		return parents;
+	}
+	edge &= GRAPH_EDGE_MASK;
+	do {
+		if (graph.nr_extra_edges <= edge)
+			die("commit-graph file %s is corrupt", graph.path);
+		pptr = insert_graph_parent(ntohl(graph.extra_edges[edge]), pptr);
+	} while (!(ntohl(graph.extra_edges[edge++]) & GRAPH_LAST_EDGE));
+	return parents;
+}
+
+static unsigned long graph_date(uint32_t pos)
+{
+	uint64_t date = record_word(pos, 32);
+	return (unsigned long)((date << 32) | record_word(pos, 36));
+}
+
+int parse_commit_in_graph(struct commit *item)
+{
+	uint32_t pos;
+
+	if (item->object.parsed)
+		return 0;
+	if (!prepare_commit_graph() || graph_pos(item->object.sha1, &pos))
+		return -1;
+	item->object.parsed = 1;
+	item->tree = lookup_tree(graph.records + pos * GRAPH_RECORD_SIZE);
+	item->parents = graph_parents(pos);
+	item->generation = record_word(pos, 28);
+	item->date = graph_date(pos);
+	return 0;
+}
+
+static unsigned int graph_generation(const unsigned char *sha1)
+{
+	uint32_t pos;
+
+	if (graph_pos(sha1, &pos))
+		return 0;
+	return record_word(pos, 28);
+}
+
+unsigned int commit_graph_generation(const unsigned char *sha1)
+{
+	if (!prepare_commit_graph())
+		return 0;
+	return graph_generation(sha1);
+}
+
+static struct commit **commits;
+static int commits_nr, commits_alloc;
+
+static void add_graph_commit(struct commit *commit)
+{
+	if (commit->object.flags & GRAPH_SEEN)
+		return;
+	commit->object.flags |= GRAPH_SEEN;
+	ALLOC_GROW(commits, commits_nr + 1, commits_alloc);
+	commits[commits_nr++] = commit;
+}
+
+static int add_ref_tip(const char *path, const unsigned char *sha1,
+		       int flag, void *cb_data)
+{
+	struct object *obj = deref_tag(parse_object(sha1), path, 0);
+
+	if (obj && obj->type == OBJ_COMMIT)
+		add_graph_commit((struct commit *)obj);
+	return 0;
+}
+
+static int commit_cmp(const void *a_, const void *b_)
+{
+	struct commit *a = *(struct commit **)a_;
+	struct commit *b = *(struct commit **)b_;
+	return hashcmp(a->object.sha1, b->object.sha1);
+}
+
+static uint32_t commit_pos(struct commit *commit)
+{
+	struct commit **found = bsearch(&commit, commits, commits_nr,
+					sizeof(*commits), commit_cmp);
+	if (!found)
+		die("commit %s is missing from the commit-graph",
+		    sha1_to_hex(commit->object.sha1));
+	return found - commits;
+}
+
+static void compute_generations(void)
+{
+	struct commit_list *stack = NULL;
+	int i;
+
+	for (i = 0; i < commits_nr; i++)
+		commits[i]->generation = 0;
+	for (i = 0; i < commits_nr; i++) {
+		if (commits[i]->generation)
+			continue;
+		commit_list_insert(commits[i], &stack);
+		while (stack) {
+			struct commit *commit = stack->item;
+			struct commit_list *parents;
+			unsigned int max = 0;
+			int ready = 1;
+
+			for (parents = commit->parents; parents; parents = parents->next) {
+				unsigned int gen = parents->item->generation;
+				if (!gen) {
+					commit_list_insert(parents->item, &stack);
+					ready = 0;
+				} else if (max < gen)
+					max = gen;
+			}
+			if (!ready)
+				continue;
+			commit->generation = max < GENERATION_NUMBER_MAX ?
+				max + 1 : GENERATION_NUMBER_MAX;
+			pop_commit(&stack);
+		}
+	}
+}
+
+static void write_graph_record(struct sha1file *f, struct commit *commit,
+			       uint32_t *nr_extra_edges)
+{
+	struct commit_list *parents = commit->parents;
+	uint32_t word[6];
+	uint64_t date = commit->date;
+
+	word[0] = parents ? commit_pos(parents->item) : GRAPH_PARENT_NONE;
+	if (!parents || !parents->next)
+		word[1] = GRAPH_PARENT_NONE;
+	else if (!parents->next->next)
+		word[1] = commit_pos(parents->next->item);
+	else {
+		word[1] = GRAPH_EXTRA_EDGES | *nr_extra_edges;
+		*nr_extra_edges += commit_list_count(parents->next);
+	}
+	word[2] = commit->generation;
+	word[3] = (uint32_t)(date >> 32);
+	word[4] = (uint32_t)date;
+
+	sha1write(f, commit->tree->object.sha1, 20);
+	word[0] = htonl(word[0]);
+	word[1] = htonl(word[1]);
+	word[2] = htonl(word[2]);
+	word[3] = htonl(word[3]);
+	word[4] = htonl(word[4]);
+	sha1write(f, word, 5 * 4);
+}
+
+int write_commit_graph(void)
+{
+	static struct lock_file lock;
+	struct sha1file *f;
+	uint32_t hdr[4], fanout[256], nr_extra_edges = 0;
+	char *path;
+	int i, fd, saved_core_commit_graph = core_commit_graph;
+
+	if (has_commit_grafts())
+		return error("cannot write a commit-graph in a repository "
+			     "with grafts or shallow history");
+
+	/* Read what we record from the objects, not from an old graph */
+	core_commit_graph = 0;
+	for_each_ref(add_ref_tip, NULL);
+	head_ref(add_ref_tip, NULL);
+	for (i = 0; i < commits_nr; i++) {
+		struct commit_list *parents;
+		if (parse_commit(commits[i])) {
+			core_commit_graph = saved_core_commit_graph;
+			return error("unable to parse commit %s",
+				     sha1_to_hex(commits[i]->object.sha1));
+		}
+		for (parents = commits[i]->parents; parents; parents = parents->next)
+			add_graph_commit(parents->item);
+	}
+	core_commit_graph = saved_core_commit_graph;
+
+	qsort(commits, commits_nr, sizeof(*commits), commit_cmp);
+	compute_generations();
+
+	memset(fanout, 0, sizeof(fanout));
+	for (i = 0; i < commits_nr; i++)
+		fanout[commits[i]->object.sha1[0]]++;
+	for (i = 1; i < 256; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0; i < 256; i++)
+		fanout[i] = htonl(fanout[i]);
+
+	path = graph_file_name();
+	if (safe_create_leading_directories(path))
+		return error("unable to create leading directories of %s", path);
+	fd = hold_lock_file_for_update(&lock, path, LOCK_DIE_ON_ERROR);
+	f = sha1fd(fd, lock.filename);
+
+	for (i = 0; i < commits_nr; i++) {
+		struct commit_list *parents = commits[i]->parents;
+		if (parents && parents->next && parents->next->next)
+			nr_extra_edges += commit_list_count(parents->next);
+	}
+	hdr[0] = htonl(GRAPH_SIGNATURE);
+	hdr[1] = htonl(GRAPH_VERSION);
+	hdr[2] = htonl(commits_nr);
+	hdr[3] = htonl(nr_extra_edges);
+	sha1write(f, hdr, sizeof(hdr));
+	sha1write(f, fanout, sizeof(fanout));
+	for (i = 0; i < commits_nr; i++)
+		sha1write(f, commits[i]->object.sha1, 20);
+
+	nr_extra_edges = 0;
+	for (i = 0; i < commits_nr; i++)
+		write_graph_record(f, commits[i], &nr_extra_edges);
+	for (i = 0; i < commits_nr; i++) {
+		struct commit_list *parents = commits[i]->parents;
+		if (!parents || !parents->next || !parents->next->next)
+			continue;
+		for (parents = parents->next; parents; parents = parents->next) {
+			uint32_t edge = commit_pos(parents->item);
+			if (!parents->next)
+				edge |= GRAPH_LAST_EDGE;
+			edge = htonl(edge);
+			sha1write(f, &edge, 4);
+		}
+	}
+	sha1close(f, NULL, CSUM_FSYNC);
+	lock.fd = -1;	/* closed by sha1close() */
+	if (commit_lock_file(&lock))
+		return error("unable to write %s", path);
+
+	free(commits);
+	commits = NULL;
+	commits_nr = commits_alloc = 0;
+	free(path);
+	return 0;
+}
+
+static int verify_commit(uint32_t pos)
+{
+	const unsigned char *sha1 = graph.oids + pos * 20;
+	struct commit *commit = lookup_commit(sha1);
+	struct commit_list *parents, *expect;
+	unsigned int max = 0, gen;
+	int errors = 0;
+
+	if (pos && hashcmp(sha1 - 20, sha1) >= 0)
+		errors += !!error("commit-graph is not sorted at %s",
+				  sha1_to_hex(sha1));
+	if (!commit || parse_commit(commit))
+		return errors + 1;
+	if (hashcmp(commit->tree->object.sha1,
+		    graph.records + pos * GRAPH_RECORD_SIZE))
+		errors += !!error("commit-graph has the wrong tree for %s",
+				  sha1_to_hex(sha1));
+	if (graph_date(pos) != commit->date)
+		errors += !!error("commit-graph has the wrong date for %s",
+				  sha1_to_hex(sha1));
+
+	expect = graph_parents(pos);
+	for (parents = commit->parents; parents && expect;
+	     parents = parents->next) {
+		if (parents->item != expect->item)
+			break;
+		gen = graph_generation(parents->item->object.sha1);
+		if (max < gen)
+			max = gen;
+		pop_commit(&expect);
+	}
+	if (parents || expect) {
+		errors += !!error("commit-graph has the wrong parents for %s",
+				  sha1_to_hex(sha1));
+		free_commit_list(expect);
+	} else {
+		gen = max < GENERATION_NUMBER_MAX ? max + 1 : GENERATION_NUMBER_MAX;
+		if (record_word(pos, 28) != gen)
+			errors += !!error("commit-graph has the wrong "
+					  "generation for %s",
+					  sha1_to_hex(sha1));
+	}
+	return errors;
+}
+
+int verify_commit_graph(void)
+{
+	unsigned char sha1[20];
+	git_SHA_CTX ctx;
+	uint32_t pos;
+	int errors = 0, saved_core_commit_graph;
+
+	if (has_commit_grafts())
+		return error("cannot verify the commit-graph in a repository "
+			     "with grafts or shallow history");
+	if (!open_commit_graph())
+		return file_exists(graph.path);	/* only an error if corrupt */
+	git_SHA1_Init(&ctx);
+	git_SHA1_Update(&ctx, graph.map, graph.map_size - 20);
+	git_SHA1_Final(sha1, &ctx);
+	if (hashcmp(sha1, graph.map + graph.map_size - 20))
+		return error("commit-graph file %s has a bad checksum",
+			     graph.path);
+
+	/* Compare with the objects, not with the graph itself */
+	saved_core_commit_graph = core_commit_graph;
+	core_commit_graph = 0;
+	for (pos = 0; pos < graph.nr_commits; pos++)
+		errors += verify_commit(pos);
+	core_commit_graph = saved_core_commit_graph;
+	return errors;
+}
@@ -0,0 +1,43 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+/*
+ * The commit-graph file "$GIT_OBJECT_DIRECTORY/info/commit-graph"
+ * caches the tree, parents, date and generation number of commits in
+ * fixed-width records, so that history walks need not inflate the
+ * commit objects themselves.
+ */
+#define GRAPH_SIGNATURE 0x43475048	/* "CGPH" */
+#define GRAPH_VERSION 1
+
+/*
+ * The generation number of a commit without parents is 1, that of any
+ * other commit one more than the largest of its parents.  0 means the
+ * commit is not in the graph, and numbers are capped at the maximum.
+ */
+#define GENERATION_NUMBER_MAX 0x3fffffff
+
+struct commit;
+
+/*
+ * Fill the tree, parents, date and generation of an unparsed commit
+ * from the commit-graph; returns 0 when the commit was found there.
+ */
+extern int parse_commit_in_graph(struct commit *item);
+
+/* Look up the generation number of a commit; 0 when it is unknown. */
+extern unsigned int commit_graph_generation(const unsigned char *sha1);
+
+/*
+ * Write a commit-graph covering every commit reachable from the refs;
+ * returns 0 on success.
+ */
+extern int write_commit_graph(void);
+
+/*
+ * Check the checksum of the commit-graph and compare its records with
+ * the commit objects; returns the number of problems found.
+ */
+extern int verify_commit_graph(void);
+
+#endif
@@ -5,6 +5,8 @@
 #include "utf8.h"
 #include "diff.h"
 #include "revision.h"
+#include "commit-graph.h"
+#include "prio-queue.h"
 
 int save_commit_buffer = 1;
 
@@ -203,6 +205,16 @@ struct commit_graft *lookup_commit_graft(const unsigned char *sha1)
 	return commit_graft[pos];
 }
 
+/*
+ * Grafts and shallow boundaries change the parents we see, so data
+ * precomputed from the real history cannot be used while any exist.
+ */
+int has_commit_grafts(void)
+{
+	prepare_commit_graft();
+	return commit_graft_nr;
+}
+
 int write_shallow_commits(int fd, int use_pack_protocol)
 {
 	int i, count = 0;
@@ -283,6 +295,7 @@ int parse_commit_buffer(struct commit *item, void *buffer, unsigned long size)
 		}
 	}
 	item->date = parse_commit_date(bufptr, tail);
+	item->generation = commit_graph_generation(item->object.sha1);
 
 	return 0;
 }
@@ -298,6 +311,8 @@ int parse_commit(struct commit *item)
 		return -1;
 	if (item->object.parsed)
 		return 0;
+	if (!parse_commit_in_graph(item))
+		return 0;
 	buffer = read_sha1_file(item->object.sha1, &type, &size);
 	if (!buffer)
 		return error("Could not read %s",
@@ -316,6 +331,20 @@ int parse_commit(struct commit *item)
 	return ret;
 }
 
+void load_commit_buffer(struct commit *item)
+{
+	enum object_type type;
+	unsigned long size;
+
+	if (item->buffer || !save_commit_buffer)
+		return;
+	item->buffer = read_sha1_file(item->object.sha1, &type, &size);
+	if (item->buffer && type != OBJ_COMMIT) {
+		free(item->buffer);
+		item->buffer = NULL;
+	}
+}
+
 struct commit_list *commit_list_insert(struct commit *item, struct commit_list **list_p)
 {
 	struct commit_list *new_list = xmalloc(sizeof(struct commit_list));
@@ -356,6 +385,17 @@ struct commit_list * insert_by_date(struct commit *item, struct commit_list **li
 }
 
 
+int compare_commits_by_commit_date(const void *a_, const void *b_, void *unused)
+{
+	const struct commit *a = a_, *b = b_;
+
+	if (a->date < b->date)
+		return 1;
+	if (a->date > b->date)
+		return -1;
+	return 0;
+}
+
 void sort_by_date(struct commit_list **list)
 {
 	struct commit_list *ret = NULL;
@@ -426,8 +466,9 @@ struct commit *pop_commit(struct commit_list **stack)
 void sort_in_topological_order(struct commit_list ** list, int lifo)
 {
 	struct commit_list *next, *orig = *list;
-	struct commit_list *work, **insert;
 	struct commit_list **pptr;
+	struct prio_queue queue;
+	struct commit *commit;
 
 	if (!orig)
 		return;
@@ -458,30 +499,25 @@ void sort_in_topological_order(struct commit_list ** list, int lifo)
 	 *
 	 * the tips serve as a starting set for the work queue.
 	 */
-	work = NULL;
-	insert = &work;
+	memset(&queue, 0, sizeof(queue));
+	if (!lifo)
+		queue.compare = compare_commits_by_commit_date;
 	for (next = orig; next; next = next->next) {
-		struct commit *commit = next->item;
-
+		commit = next->item;
 		if (commit->indegree == 1)
-			insert = &commit_list_insert(commit, insert)->next;
+			prio_queue_put(&queue, commit);
 	}
 
-	/* process the list in topological order */
-	if (!lifo)
-		sort_by_date(&work);
+	/* the stack gives them out last first; start with the first tip */
+	if (lifo)
+		prio_queue_reverse(&queue);
 
+	/* process the list in topological order, reusing its entries */
 	pptr = list;
-	*list = NULL;
-	while (work) {
-		struct commit *commit;
-		struct commit_list *parents, *work_item;
-
-		work_item = work;
-		work = work_item->next;
-		work_item->next = NULL;
+	next = orig;
+	while ((commit = prio_queue_get(&queue)) != NULL) {
+		struct commit_list *parents;
 
-		commit = work_item->item;
 		for (parents = commit->parents; parents ; parents = parents->next) {
 			struct commit *parent=parents->item;
 
@@ -493,21 +529,21 @@ void sort_in_topological_order(struct commit_list ** list, int lifo)
 			 * when all their children have been emitted thereby
 			 * guaranteeing topological order.
 			 */
-			if (--parent->indegree == 1) {
-				if (!lifo)
-					insert_by_date(parent, &work);
-				else
-					commit_list_insert(parent, &work);
-			}
+			if (--parent->indegree == 1)
+				prio_queue_put(&queue, parent);
 		}
 		/*
-		 * work_item is a commit all of whose children
+		 * commit is a commit all of whose children
 		 * have already been emitted. we can emit it now.
 		 */
 		commit->indegree = 0;
-		*pptr = work_item;
-		pptr = &work_item->next;
+		next->item = commit;
+		*pptr = next;
+		pptr = &next->next;
+		next = next->next;
 	}
+	*pptr = NULL;
+	clear_prio_queue(&queue);
 }
 
 /* merge-base stuff */
@@ -520,21 +556,22 @@ void sort_in_topological_order(struct commit_list ** list, int lifo)
 
 static const unsigned all_flags = (PARENT1 | PARENT2 | STALE | RESULT);
 
-static struct commit *interesting(struct commit_list *list)
+static int queue_has_nonstale(struct prio_queue *queue)
 {
-	while (list) {
-		struct commit *commit = list->item;
-		list = list->next;
-		if (commit->object.flags & STALE)
-			continue;
-		return commit;
+	int i;
+
+	for (i = 0; i < queue->nr; i++) {
+		struct commit *commit = queue->array[i].data;
+		if (!(commit->object.flags & STALE))
+			return 1;
 	}
-	return NULL;
+	return 0;
 }
 
 static struct commit_list *merge_bases_many(struct commit *one, int n, struct commit **twos)
 {
-	struct commit_list *list = NULL;
+	struct prio_queue queue = { compare_commits_by_commit_date };
+	struct commit_list *list;
 	struct commit_list *result = NULL;
 	int i;
 
@@ -555,23 +592,17 @@ static struct commit_list *merge_bases_many(struct commit *one, int n, struct co
 	}
 
 	one->object.flags |= PARENT1;
-	insert_by_date(one, &list);
+	prio_queue_put(&queue, one);
 	for (i = 0; i < n; i++) {
 		twos[i]->object.flags |= PARENT2;
-		insert_by_date(twos[i], &list);
+		prio_queue_put(&queue, twos[i]);
 	}
 
-	while (interesting(list)) {
-		struct commit *commit;
+	while (queue_has_nonstale(&queue)) {
+		struct commit *commit = prio_queue_get(&queue);
 		struct commit_list *parents;
-		struct commit_list *n;
 		int flags;
 
-		commit = list->item;
-		n = list->next;
-		free(list);
-		list = n;
-
 		flags = commit->object.flags & (PARENT1 | PARENT2 | STALE);
 		if (flags == (PARENT1 | PARENT2)) {
 			if (!(commit->object.flags & RESULT)) {
@@ -587,15 +618,17 @@ static struct commit_list *merge_bases_many(struct commit *one, int n, struct co
 			parents = parents->next;
 			if ((p->object.flags & flags) == flags)
 				continue;
-			if (parse_commit(p))
+			if (parse_commit(p)) {
+				clear_prio_queue(&queue);
 				return NULL;
+			}
 			p->object.flags |= flags;
-			insert_by_date(p, &list);
+			prio_queue_put(&queue, p);
 		}
 	}
 
 	/* Clean up the result to remove stale ones */
-	free_commit_list(list);
+	clear_prio_queue(&queue);
 	list = result; result = NULL;
 	while (list) {
 		struct commit_list *n = list->next;
@@ -705,11 +738,52 @@ struct commit_list *get_merge_bases(struct commit *one, struct commit *two,
 	return get_merge_bases_many(one, 1, &two, cleanup);
 }
 
+/*
+ * With generation numbers, finding out whether commit can be reached
+ * from reference only needs to look at the commits at least as new as
+ * commit: nothing with a smaller generation can reach it.
+ */
+static int reachable_by_generation(struct commit *commit,
+				   struct commit *reference)
+{
+	struct commit_list *stack = NULL;
+	int ret = 0;
+
+	reference->object.flags |= PARENT1;
+	commit_list_insert(reference, &stack);
+	while (stack) {
+		struct commit *c = pop_commit(&stack);
+		struct commit_list *parents;
+
+		if (c == commit) {
+			ret = 1;
+			break;
+		}
+		for (parents = c->parents; parents; parents = parents->next) {
+			struct commit *p = parents->item;
+			if (p->object.flags & PARENT1)
+				continue;
+			if (parse_commit(p))
+				continue;
+			if (p->generation && p->generation < commit->generation)
+				continue;
+			p->object.flags |= PARENT1;
+			commit_list_insert(p, &stack);
+		}
+	}
+	free_commit_list(stack);
+	clear_commit_marks(reference, PARENT1);
+	return ret;
+}
+
 int in_merge_bases(struct commit *commit, struct commit **reference, int num)
 {
 	struct commit_list *bases, *b;
 	int ret = 0;
 
+	if (num == 1 && !parse_commit(commit) && commit->generation &&
+	    !parse_commit(*reference))
+		return reachable_by_generation(commit, *reference);
 	if (num == 1)
 		bases = get_merge_bases(commit, *reference, 1);
 	else
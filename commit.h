@@ -16,6 +16,7 @@ struct commit {
 	void *util;
 	unsigned int indegree;
 	unsigned long date;
+	unsigned int generation;	/* 0 when unknown, see commit-graph.h */
 	struct commit_list *parents;
 	struct tree *tree;
 	char *buffer;
@@ -40,6 +41,13 @@ int parse_commit_buffer(struct commit *item, void *buffer, unsigned long size);
 
 int parse_commit(struct commit *item);
 
+/*
+ * parse_commit() may fill a commit from the commit-graph without
+ * reading the object; this reads the message into item->buffer when it
+ * is missing and save_commit_buffer is set.
+ */
+void load_commit_buffer(struct commit *item);
+
 struct commit_list * commit_list_insert(struct commit *item, struct commit_list **list_p);
 unsigned commit_list_count(const struct commit_list *l);
 struct commit_list * insert_by_date(struct commit *item, struct commit_list **list);
@@ -48,6 +56,9 @@ void free_commit_list(struct commit_list *list);
 
 void sort_by_date(struct commit_list **list);
 
+/* For a prio_queue of commits: the newer ones come out first */
+int compare_commits_by_commit_date(const void *a_, const void *b_, void *unused);
+
 /* Commit formats */
 enum cmit_fmt {
 	CMIT_FMT_RAW,
@@ -121,6 +132,7 @@ struct commit_graft {
 struct commit_graft *read_graft_line(char *buf, int len);
 int register_commit_graft(struct commit_graft *, int);
 struct commit_graft *lookup_commit_graft(const unsigned char *sha1);
+int has_commit_grafts(void);
 
 extern struct commit_list *get_merge_bases(struct commit *rev1, struct commit *rev2, int cleanup);
 extern struct commit_list *get_merge_bases_many(struct commit *one, int n, struct commit **twos, int cleanup);
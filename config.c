@@ -447,7 +447,7 @@ static int git_default_core_config(const char *var, const char *value)
 	}
 
 	if (!strcmp(var, "core.deltabasecachelimit")) {
-		delta_base_cache_limit = git_config_int(var, value);
+		delta_base_cache_limit = git_config_ulong(var, value);
 		return 0;
 	}
 
@@ -495,6 +495,42 @@ static int git_default_core_config(const char *var, const char *value)
 		return 0;
 	}
 
+	if (!strcmp(var, "core.preloadindexthreads")) {
+		core_preload_index_threads = git_config_int(var, value);
+		if (core_preload_index_threads < 0)
+			die("invalid number of threads specified (%d)",
+			    core_preload_index_threads);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.commitgraph")) {
+		core_commit_graph = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.multipackindex")) {
+		core_multi_pack_index = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.untrackedcache")) {
+		core_untracked_cache = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.fsmonitor"))
+		return git_config_string(&core_fsmonitor, var, value);
+
+	if (!strcmp(var, "core.splitindex")) {
+		core_split_index = git_config_bool(var, value);
+		return 0;
+	}
+
+	if (!strcmp(var, "core.sparseindex")) {
+		core_sparse_index = git_config_bool(var, value);
+		return 0;
+	}
+
 	/* Add other config variables here and to Documentation/config.txt. */
 	return 0;
 }
@@ -579,6 +615,32 @@ int git_default_config(const char *var, const char *value, void *dummy)
 	if (!prefixcmp(var, "branch."))
 		return git_default_branch_config(var, value);
 
+	if (!strcmp(var, "index.threads")) {
+		int is_bool;
+		index_threads = git_config_bool_or_int(var, value, &is_bool);
+		if (is_bool)
+			index_threads = !index_threads;
+		else if (index_threads < 0)
+			die("invalid number of threads specified (%d)",
+			    index_threads);
+		return 0;
+	}
+
+	if (!strcmp(var, "index.version")) {
+		index_version = git_config_int(var, value);
+		if (index_version < 2 || index_version > 4)
+			die("bad index.version %d", index_version);
+		return 0;
+	}
+
+	if (!strcmp(var, "checkout.workers")) {
+		checkout_workers = git_config_int(var, value);
+		if (checkout_workers < 0)
+			die("invalid number of threads specified (%d)",
+			    checkout_workers);
+		return 0;
+	}
+
 	if (!strcmp(var, "pager.color") || !strcmp(var, "color.pager")) {
 		pager_use_color = git_config_bool(var,value);
 		return 0;
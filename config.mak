@@ -0,0 +1 @@
+CFLAGS = -g -O0 -Wall
@@ -427,6 +427,223 @@ static int oneway_diff(struct cache_entry **src, struct unpack_trees_options *o)
 	return 0;
 }
 
+/*
+ * "diff-index --cached" does not need unpack_trees(): the tree and the
+ * index are walked side by side, and a directory whose cache-tree is
+ * valid and names the same tree as the one we compare with cannot have
+ * any change in it, so all of its entries are skipped at once.  The
+ * cost then depends on the size of the change, not of the index.
+ */
+struct cached_diff {
+	struct rev_info *revs;
+	struct strbuf path;
+	int pos;
+};
+
+static int cached_diff_done(struct cached_diff *d)
+{
+	struct diff_options *opt = &d->revs->diffopt;
+	return DIFF_OPT_TST(opt, QUIET) && DIFF_OPT_TST(opt, HAS_CHANGES);
+}
+
+static struct cache_entry *tree_entry_ce(struct strbuf *path, unsigned mode,
+					 const unsigned char *sha1)
+{
+	struct cache_entry *ce = xcalloc(1, cache_entry_size(path->len));
+
+	memcpy(ce->name, path->buf, path->len);
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(path->len, 0);
+	hashcpy(ce->sha1, sha1);
+	return ce;
+}
+
+/* Show everything in the tree at d->path as removed */
+static void show_removed_tree(struct cached_diff *d, struct tree_desc *desc)
+{
+	struct name_entry e;
+
+	while (!cached_diff_done(d) && tree_entry(desc, &e)) {
+		int len = d->path.len;
+
+		strbuf_add(&d->path, e.path, tree_entry_len(e.path, e.sha1));
+		if (S_ISDIR(e.mode)) {
+			struct tree_desc sub;
+			void *buf = fill_tree_descriptor(&sub, e.sha1);
+
+			strbuf_addch(&d->path, '/');
+			show_removed_tree(d, &sub);
+			free(buf);
+		} else {
+			struct cache_entry *ce = tree_entry_ce(&d->path, e.mode, e.sha1);
+			if (ce_path_match(ce, d->revs->prune_data))
+				diff_index_show_file(d->revs, "-", ce,
+						     ce->sha1, ce->ce_mode);
+			free(ce);
+		}
+		strbuf_setlen(&d->path, len);
+	}
+}
+
+/* Do the entries from "pos" on cover exactly the directory "dir"? */
+static int covers_dir(const char *dir, int len, int pos, int nr)
+{
+	int end = pos + nr;
+
+	if (end > active_nr || nr <= 0)
+		return 0;
+	if (ce_namelen(active_cache[end - 1]) <= len ||
+	    memcmp(active_cache[end - 1]->name, dir, len))
+		return 0;
+	return end == active_nr || ce_namelen(active_cache[end]) <= len ||
+		memcmp(active_cache[end]->name, dir, len);
+}
+
+/*
+ * Compare the tree in "desc" with the index entries in d->path, whose
+ * cache-tree is "it" (if known).
+ */
+static void diff_cached_dir(struct cached_diff *d, struct tree_desc *desc,
+			    struct cache_tree *it)
+{
+	int baselen = d->path.len;
+
+	while (!cached_diff_done(d)) {
+		struct cache_entry *ce = NULL;
+		const char *name = NULL, *slash = NULL;
+		int len = 0, cmp;
+		unsigned mode = 0;
+
+		if (d->pos < active_nr) {
+			ce = active_cache[d->pos];
+			if (ce_namelen(ce) <= baselen ||
+			    memcmp(ce->name, d->path.buf, baselen))
+				ce = NULL;
+		}
+		if (ce) {
+			name = ce->name + baselen;
+			slash = strchr(name, '/');
+			len = slash ? slash - name : strlen(name);
+			mode = slash ? S_IFDIR : ce->ce_mode;
+		}
+		if (!ce && !desc->size)
+			break;
+
+		if (!ce)
+			cmp = -1;
+		else if (!desc->size)
+			cmp = 1;
+		else
+			cmp = base_name_compare(desc->entry.path,
+						tree_entry_len(desc->entry.path,
+							       desc->entry.sha1),
+						desc->entry.mode, name, len, mode);
+
+		if (cmp > 0) {
+			/* only in the index */
+			if (!slash) {
+				if (ce_path_match(ce, d->revs->prune_data))
+					show_new_file(d->revs, ce, 1, 0);
+				d->pos++;
+				continue;
+			}
+			len = slash - ce->name + 1;
+			while (d->pos < active_nr &&
+			       ce_namelen(active_cache[d->pos]) > len &&
+			       !memcmp(active_cache[d->pos]->name, ce->name, len) &&
+			       !cached_diff_done(d)) {
+				ce = active_cache[d->pos++];
+				if (ce_path_match(ce, d->revs->prune_data))
+					show_new_file(d->revs, ce, 1, 0);
+			}
+			continue;
+		}
+
+		strbuf_add(&d->path, desc->entry.path,
+			   tree_entry_len(desc->entry.path, desc->entry.sha1));
+		if (cmp < 0) {
+			/* only in the tree */
+			if (S_ISDIR(desc->entry.mode)) {
+				struct tree_desc sub;
+				void *buf = fill_tree_descriptor(&sub, desc->entry.sha1);
+
+				strbuf_addch(&d->path, '/');
+				show_removed_tree(d, &sub);
+				free(buf);
+			} else {
+				struct cache_entry *old;
+
+				old = tree_entry_ce(&d->path, desc->entry.mode,
+						    desc->entry.sha1);
+				if (ce_path_match(old, d->revs->prune_data))
+					diff_index_show_file(d->revs, "-", old,
+							     old->sha1, old->ce_mode);
+				free(old);
+			}
+		} else if (slash) {
+			/* a directory on both sides */
+			struct cache_tree_sub *sub = NULL;
+			struct cache_tree *subtree = NULL;
+
+			if (it)
+				sub = cache_tree_find_sub(it, name, len);
+			if (sub && 0 <= sub->cache_tree->entry_count)
+				subtree = sub->cache_tree;
+			strbuf_addch(&d->path, '/');
+			if (subtree &&
+			    !covers_dir(d->path.buf, d->path.len, d->pos,
+					subtree->entry_count))
+				subtree = NULL;
+			if (subtree && !hashcmp(subtree->sha1, desc->entry.sha1)) {
+				d->pos += subtree->entry_count;
+			} else {
+				struct tree_desc t;
+				void *buf = fill_tree_descriptor(&t, desc->entry.sha1);
+
+				diff_cached_dir(d, &t, sub ? sub->cache_tree : NULL);
+				free(buf);
+			}
+		} else {
+			/* a file on both sides */
+			if (ce_path_match(ce, d->revs->prune_data) &&
+			    (ce->ce_mode != create_ce_mode(desc->entry.mode) ||
+			     hashcmp(ce->sha1, desc->entry.sha1))) {
+				struct cache_entry *old;
+
+				old = tree_entry_ce(&d->path, desc->entry.mode,
+						    desc->entry.sha1);
+				show_modified(d->revs, old, ce, 1, 1, 0);
+				free(old);
+			}
+			d->pos++;
+		}
+		strbuf_setlen(&d->path, baselen);
+		update_tree_entry(desc);
+	}
+}
+
+/*
+ * Unmerged entries, sparse directories and --find-copies-harder need
+ * all of the index, as unpack_trees() gives it to oneway_diff().
+ */
+static int diff_cached_fast(struct rev_info *revs, struct tree *tree)
+{
+	struct cached_diff d;
+	struct tree_desc t;
+
+	if (unmerged_cache() || the_index.sparse_index ||
+	    DIFF_OPT_TST(&revs->diffopt, FIND_COPIES_HARDER))
+		return -1;
+
+	d.revs = revs;
+	d.pos = 0;
+	strbuf_init(&d.path, PATH_MAX);
+	init_tree_desc(&t, tree->buffer, tree->size);
+	diff_cached_dir(&d, &t, active_cache_tree);
+	strbuf_release(&d.path);
+	return 0;
+}
+
 int run_diff_index(struct rev_info *revs, int cached)
 {
 	struct object *ent;
@@ -435,14 +652,18 @@ int run_diff_index(struct rev_info *revs, int cached)
 	struct unpack_trees_options opts;
 	struct tree_desc t;
 
-	mark_merge_entries();
-
 	ent = revs->pending.objects[0].item;
 	tree_name = revs->pending.objects[0].name;
 	tree = parse_tree_indirect(ent->sha1);
 	if (!tree)
 		return error("bad tree object %s", tree_name);
 
+	if (cached && !diff_cached_fast(revs, tree)) {
+		trace_printf("trace: diff-index: compared the cache-tree\n");
+		goto flush;
+	}
+	mark_merge_entries();
+
 	memset(&opts, 0, sizeof(opts));
 	opts.head_idx = 1;
 	opts.index_only = cached;
@@ -456,6 +677,7 @@ int run_diff_index(struct rev_info *revs, int cached)
 	if (unpack_trees(1, &t, &opts))
 		exit(128);
 
+flush:
 	diff_set_mnemonic_prefix(&revs->diffopt, "c/", cached ? "i/" : "w/");
 	diffcore_std(&revs->diffopt);
 	diff_flush(&revs->diffopt);
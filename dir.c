@@ -8,6 +8,10 @@
 #include "cache.h"
 #include "dir.h"
 #include "refs.h"
+#include "sparse-index.h"
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 struct path_simplify {
 	int len;
@@ -18,6 +22,7 @@ static int read_directory_recursive(struct dir_struct *dir,
 	const char *path, const char *base, int baselen,
 	int check_only, const struct path_simplify *simplify);
 static int get_dtype(struct dirent *de, const char *path);
+static void add_untracked_dep(struct untracked_cache *uc, const char *path);
 
 int common_prefix(const char **pathspec)
 {
@@ -430,8 +435,12 @@ static enum exist_status directory_exists_in_index(const char *dirname, int len)
 		endchar = ce->name[len];
 		if (endchar > '/')
 			break;
-		if (endchar == '/')
+		if (endchar == '/') {
+			/* we are going to look inside after all */
+			if (S_ISSPARSEDIR(ce->ce_mode) && ce_namelen(ce) == len + 1)
+				expand_sparse_entry(&the_index, pos - 1);
 			return index_directory;
+		}
 		if (!endchar && S_ISGITLINK(ce->ce_mode))
 			return index_gitdir;
 	}
@@ -496,6 +505,8 @@ static enum directory_treatment treat_directory(struct dir_struct *dir,
 			break;
 		if (!dir->no_gitlinks) {
 			unsigned char sha1[20];
+			if (dir->untracked)
+				add_untracked_dep(dir->untracked, dirname);
 			if (resolve_gitlink_ref(dirname, "HEAD", sha1) == 0)
 				return show_directory;
 		}
@@ -565,6 +576,603 @@ static int get_dtype(struct dirent *de, const char *path)
 	return dtype;
 }
 
+/*
+ * The untracked cache.  Each directory read_directory() went into
+ * has a node, named after its last path component, holding the
+ * untracked paths it added from that directory and the directories
+ * it recursed into.  A directory whose fate depended on what was
+ * inside it (an untracked directory that is shown only when not
+ * empty, or one that might be a nested repository) is recorded as
+ * a dependency: its stat data have to match too.
+ */
+struct untracked_stat {
+	uint32_t ctime;
+	uint32_t mtime;
+	uint32_t ino;
+	uint32_t size;
+};
+
+struct untracked_dep {
+	char *path;
+	struct untracked_stat st;
+};
+
+struct untracked_cache_dir {
+	char *name;
+	struct untracked_stat st;
+	unsigned char exclude_sha1[20];
+	unsigned valid : 1,
+		 seen : 1,
+		 stat_checked : 1,
+		 stat_ok : 1;
+	int untracked_nr, untracked_alloc;
+	char **untracked;
+	int deps_nr, deps_alloc;
+	struct untracked_dep *deps;
+	int dirs_nr, dirs_alloc;
+	struct untracked_cache_dir **dirs;
+
+	/* the exclude hash computed for this directory in this run */
+	unsigned char cur_exclude_sha1[20];
+};
+
+static void fill_untracked_stat(struct untracked_stat *us, struct stat *st)
+{
+	us->ctime = st->st_ctime;
+	us->mtime = st->st_mtime;
+	us->ino = st->st_ino;
+	us->size = st->st_size;
+}
+
+static int untracked_stat_changed(struct untracked_stat *us, const char *path)
+{
+	struct stat st;
+	struct untracked_stat now;
+
+	if (lstat(path, &st))
+		return 1;
+	fill_untracked_stat(&now, &st);
+	return memcmp(us, &now, sizeof(now));
+}
+
+static struct untracked_cache_dir *new_untracked_dir(const char *name, int len)
+{
+	struct untracked_cache_dir *ucd = xcalloc(1, sizeof(*ucd));
+	ucd->name = xmemdupz(name, len);
+	return ucd;
+}
+
+static void clear_untracked_dir(struct untracked_cache_dir *ucd)
+{
+	int i;
+
+	for (i = 0; i < ucd->untracked_nr; i++)
+		free(ucd->untracked[i]);
+	ucd->untracked_nr = 0;
+	for (i = 0; i < ucd->deps_nr; i++)
+		free(ucd->deps[i].path);
+	ucd->deps_nr = 0;
+}
+
+static void free_untracked_dir(struct untracked_cache_dir *ucd)
+{
+	int i;
+
+	if (!ucd)
+		return;
+	clear_untracked_dir(ucd);
+	for (i = 0; i < ucd->dirs_nr; i++)
+		free_untracked_dir(ucd->dirs[i]);
+	free(ucd->untracked);
+	free(ucd->deps);
+	free(ucd->dirs);
+	free(ucd->name);
+	free(ucd);
+}
+
+void free_untracked_cache(struct untracked_cache *uc)
+{
+	if (!uc)
+		return;
+	free_untracked_dir(uc->root);
+	free(uc);
+}
+
+/*
+ * Find the subdirectory "name" of ucd, which are kept sorted;
+ * returns its position, or -1 - where it would go.
+ */
+static int untracked_dir_pos(struct untracked_cache_dir *ucd,
+			     const char *name, int len)
+{
+	int lo = 0, hi = ucd->dirs_nr;
+
+	while (lo < hi) {
+		int mi = (lo + hi) / 2;
+		const char *mi_name = ucd->dirs[mi]->name;
+		int cmp = strncmp(mi_name, name, len);
+		if (!cmp)
+			cmp = (unsigned char)mi_name[len];
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return -1 - lo;
+}
+
+static struct untracked_cache_dir *lookup_untracked_dir(struct untracked_cache_dir *ucd,
+							const char *name, int len,
+							int create)
+{
+	int pos = untracked_dir_pos(ucd, name, len);
+
+	if (0 <= pos)
+		return ucd->dirs[pos];
+	if (!create)
+		return NULL;
+	pos = -1 - pos;
+	ALLOC_GROW(ucd->dirs, ucd->dirs_nr + 1, ucd->dirs_alloc);
+	memmove(ucd->dirs + pos + 1, ucd->dirs + pos,
+		(ucd->dirs_nr - pos) * sizeof(*ucd->dirs));
+	ucd->dirs_nr++;
+	return ucd->dirs[pos] = new_untracked_dir(name, len);
+}
+
+void untracked_cache_invalidate_path(struct untracked_cache *uc,
+				     const char *path)
+{
+	struct untracked_cache_dir *ucd;
+	const char *slash;
+
+	if (!uc || !uc->root)
+		return;
+	ucd = uc->root;
+	ucd->valid = 0;
+	while ((slash = strchr(path, '/')) != NULL) {
+		ucd = lookup_untracked_dir(ucd, path, slash - path, 0);
+		if (!ucd)
+			return;
+		ucd->valid = 0;
+		path = slash + 1;
+	}
+}
+
+/* Record a directory whose contents decided what we showed */
+static void add_untracked_dep(struct untracked_cache *uc, const char *path)
+{
+	struct untracked_cache_dir *ucd = uc->cur;
+	struct untracked_dep *dep;
+	struct stat st;
+
+	if (!ucd)
+		return;
+	ALLOC_GROW(ucd->deps, ucd->deps_nr + 1, ucd->deps_alloc);
+	dep = &ucd->deps[ucd->deps_nr++];
+	dep->path = xstrdup(path);
+	if (lstat(path, &st))
+		memset(&dep->st, 0, sizeof(dep->st));
+	else
+		fill_untracked_stat(&dep->st, &st);
+}
+
+/*
+ * The exclude hash of a directory covers the global patterns and the
+ * per-directory exclude files of the directory and all its parents.
+ */
+static void hash_dir_excludes(struct dir_struct *dir, const char *base,
+			      int baselen, const unsigned char *parent_sha1,
+			      unsigned char *sha1)
+{
+	git_SHA_CTX c;
+	struct strbuf fname = STRBUF_INIT, buf = STRBUF_INIT;
+
+	git_SHA1_Init(&c);
+	git_SHA1_Update(&c, parent_sha1, 20);
+	if (dir->exclude_per_dir) {
+		strbuf_add(&fname, base, baselen);
+		strbuf_addstr(&fname, dir->exclude_per_dir);
+		if (strbuf_read_file(&buf, fname.buf, 0) >= 0) {
+			git_SHA1_Update(&c, fname.buf, fname.len + 1);
+			git_SHA1_Update(&c, buf.buf, buf.len);
+		}
+		strbuf_release(&fname);
+		strbuf_release(&buf);
+	}
+	git_SHA1_Final(sha1, &c);
+}
+
+static void hash_global_excludes(struct dir_struct *dir, unsigned char *sha1)
+{
+	git_SHA_CTX c;
+	struct strbuf sb = STRBUF_INIT;
+	int st, i;
+
+	strbuf_addf(&sb, "%d %d %d %s\n",
+		    dir->show_other_directories, dir->hide_empty_directories,
+		    dir->no_gitlinks,
+		    dir->exclude_per_dir ? dir->exclude_per_dir : "");
+	for (st = EXC_CMDL; st <= EXC_FILE; st++) {
+		struct exclude_list *el = &dir->exclude_list[st];
+		if (st == EXC_DIRS)
+			continue;
+		for (i = 0; i < el->nr; i++) {
+			struct exclude *x = el->excludes[i];
+			strbuf_addf(&sb, "%d %d %d %.*s %s\n", st,
+				    x->to_exclude, x->flags,
+				    x->baselen, x->base, x->pattern);
+		}
+	}
+	git_SHA1_Init(&c);
+	git_SHA1_Update(&c, sb.buf, sb.len);
+	git_SHA1_Final(sha1, &c);
+	strbuf_release(&sb);
+}
+
+/*
+ * Find (or make) the node for the directory at base; its parent is
+ * the node we are in.
+ */
+static struct untracked_cache_dir *enter_untracked_dir(struct untracked_cache *uc,
+						       const char *base,
+						       int baselen)
+{
+	const char *name;
+	int len;
+
+	if (!uc->cur) {
+		if (!uc->root)
+			uc->root = new_untracked_dir("", 0);
+		return uc->root;
+	}
+	/* base ends with a slash; find the one before it */
+	len = baselen - 1;
+	name = base + len;
+	while (name > base && name[-1] != '/')
+		name--;
+	len = base + len - name;
+	return lookup_untracked_dir(uc->cur, name, len, 1);
+}
+
+static int untracked_stat_ok(struct untracked_cache_dir *ucd,
+			     const char *path)
+{
+	int i;
+
+	if (untracked_stat_changed(&ucd->st, path))
+		return 0;
+	for (i = 0; i < ucd->deps_nr; i++)
+		if (untracked_stat_changed(&ucd->deps[i].st, ucd->deps[i].path))
+			return 0;
+	return 1;
+}
+
+static int untracked_dir_valid(struct untracked_cache_dir *ucd,
+			       const char *path)
+{
+	int checked = ucd->stat_checked;
+
+	ucd->stat_checked = 0;
+	if (!ucd->valid ||
+	    hashcmp(ucd->exclude_sha1, ucd->cur_exclude_sha1))
+		return 0;
+	if (checked)
+		return ucd->stat_ok;
+	return untracked_stat_ok(ucd, path);
+}
+
+#ifndef NO_PTHREADS
+/*
+ * With core.preloadIndex, the stat data of the directories the cache
+ * would reuse are checked by several threads before it is walked,
+ * taking a few directories at a time like preload_index() does.
+ */
+#define UNTRACKED_THREAD_COST 50
+#define UNTRACKED_CHUNK 8
+
+struct untracked_check {
+	struct untracked_check_item {
+		struct untracked_cache_dir *ucd;
+		char *path;
+	} *items;
+	int nr, alloc, next;
+	pthread_mutex_t mutex;
+};
+
+static void collect_untracked_dirs(struct untracked_check *check,
+				   struct untracked_cache_dir *ucd,
+				   struct strbuf *path)
+{
+	int i, len = path->len;
+
+	if (!ucd->valid)
+		return;
+	ALLOC_GROW(check->items, check->nr + 1, check->alloc);
+	check->items[check->nr].ucd = ucd;
+	check->items[check->nr++].path = xstrdup(len ? path->buf : ".");
+	for (i = 0; i < ucd->dirs_nr; i++) {
+		strbuf_addstr(path, ucd->dirs[i]->name);
+		strbuf_addch(path, '/');
+		collect_untracked_dirs(check, ucd->dirs[i], path);
+		strbuf_setlen(path, len);
+	}
+}
+
+static void *check_untracked_thread(void *_data)
+{
+	struct untracked_check *check = _data;
+
+	for (;;) {
+		int i, end;
+
+		pthread_mutex_lock(&check->mutex);
+		i = check->next;
+		check->next += UNTRACKED_CHUNK;
+		pthread_mutex_unlock(&check->mutex);
+		if (i >= check->nr)
+			break;
+		end = i + UNTRACKED_CHUNK < check->nr ? i + UNTRACKED_CHUNK
+						      : check->nr;
+		for (; i < end; i++) {
+			struct untracked_cache_dir *ucd = check->items[i].ucd;
+			ucd->stat_ok = untracked_stat_ok(ucd, check->items[i].path);
+			ucd->stat_checked = 1;
+		}
+	}
+	return NULL;
+}
+
+static void preload_untracked_cache(struct untracked_cache *uc)
+{
+	struct untracked_check check;
+	struct strbuf path = STRBUF_INIT;
+	pthread_t *threads;
+	int i, nr_threads;
+
+	if (!core_preload_index || !uc->root)
+		return;
+	memset(&check, 0, sizeof(check));
+	collect_untracked_dirs(&check, uc->root, &path);
+	strbuf_release(&path);
+
+	nr_threads = preload_threads(check.nr, UNTRACKED_THREAD_COST);
+	if (nr_threads >= 2) {
+		threads = xmalloc(nr_threads * sizeof(*threads));
+		pthread_mutex_init(&check.mutex, NULL);
+		for (i = 0; i < nr_threads; i++)
+			if (pthread_create(threads + i, NULL,
+					   check_untracked_thread, &check))
+				die("unable to create threaded lstat");
+		for (i = 0; i < nr_threads; i++)
+			if (pthread_join(threads[i], NULL))
+				die("unable to join threaded lstat");
+		pthread_mutex_destroy(&check.mutex);
+		free(threads);
+		trace_printf("trace: untracked cache: %d directories checked"
+			     " with %d threads\n", check.nr, nr_threads);
+	}
+
+	for (i = 0; i < check.nr; i++)
+		free(check.items[i].path);
+	free(check.items);
+}
+#else
+static void preload_untracked_cache(struct untracked_cache *uc)
+{
+	; /* nothing */
+}
+#endif
+
+/*
+ * Add what we remembered of a directory we do not have to read
+ * again, and go on with the directories we recursed into.
+ */
+static int replay_untracked_dir(struct dir_struct *dir,
+				struct untracked_cache_dir *ucd,
+				const char *base, int baselen)
+{
+	char fullname[PATH_MAX + 1];
+	int i, contents = 0;
+
+	memcpy(fullname, base, baselen);
+	for (i = 0; i < ucd->untracked_nr; i++) {
+		int len = strlen(ucd->untracked[i]);
+		if (baselen + len + 1 > sizeof(fullname))
+			continue;
+		memcpy(fullname + baselen, ucd->untracked[i], len + 1);
+		dir_add_name(dir, fullname, baselen + len);
+		contents++;
+	}
+	for (i = 0; i < ucd->dirs_nr; i++) {
+		int len = strlen(ucd->dirs[i]->name);
+		if (baselen + len + 2 > sizeof(fullname))
+			continue;
+		memcpy(fullname + baselen, ucd->dirs[i]->name, len);
+		memcpy(fullname + baselen + len, "/", 2);
+		contents += read_directory_recursive(dir, fullname, fullname,
+						     baselen + len + 1, 0, NULL);
+	}
+	return contents;
+}
+
+/*
+ * After a directory was read afresh: forget the subdirectories we
+ * did not go into this time, and trust the result next time only if
+ * nothing changed in the second we read it in (see racy-git.txt).
+ */
+static void finish_untracked_dir(struct untracked_cache *uc,
+				 struct untracked_cache_dir *ucd)
+{
+	int i, j;
+
+	for (i = j = 0; i < ucd->dirs_nr; i++) {
+		if (ucd->dirs[i]->seen)
+			ucd->dirs[j++] = ucd->dirs[i];
+		else
+			free_untracked_dir(ucd->dirs[i]);
+	}
+	ucd->dirs_nr = j;
+
+	ucd->valid = ucd->st.mtime < uc->scan_time;
+	for (i = 0; i < ucd->deps_nr; i++)
+		if (ucd->deps[i].st.mtime >= uc->scan_time)
+			ucd->valid = 0;
+	uc->changed = 1;
+}
+
+/*
+ * The index extension: the hash of the global excludes, then the
+ * directories, depth first, each with its name, stat data, flags and
+ * counts, exclude hash, untracked names and dependencies.  Integers
+ * are in network byte order, strings are NUL terminated.
+ */
+static void write_untracked_stat(struct strbuf *out, struct untracked_stat *us)
+{
+	uint32_t data[4];
+
+	data[0] = htonl(us->ctime);
+	data[1] = htonl(us->mtime);
+	data[2] = htonl(us->ino);
+	data[3] = htonl(us->size);
+	strbuf_add(out, data, sizeof(data));
+}
+
+static void write_untracked_dir(struct strbuf *out, struct untracked_cache_dir *ucd)
+{
+	uint32_t data[4];
+	int i;
+
+	strbuf_add(out, ucd->name, strlen(ucd->name) + 1);
+	write_untracked_stat(out, &ucd->st);
+	data[0] = htonl(ucd->valid);
+	data[1] = htonl(ucd->untracked_nr);
+	data[2] = htonl(ucd->deps_nr);
+	data[3] = htonl(ucd->dirs_nr);
+	strbuf_add(out, data, sizeof(data));
+	strbuf_add(out, ucd->exclude_sha1, 20);
+	for (i = 0; i < ucd->untracked_nr; i++)
+		strbuf_add(out, ucd->untracked[i], strlen(ucd->untracked[i]) + 1);
+	for (i = 0; i < ucd->deps_nr; i++) {
+		strbuf_add(out, ucd->deps[i].path, strlen(ucd->deps[i].path) + 1);
+		write_untracked_stat(out, &ucd->deps[i].st);
+	}
+	for (i = 0; i < ucd->dirs_nr; i++)
+		write_untracked_dir(out, ucd->dirs[i]);
+}
+
+void write_untracked_extension(struct strbuf *out, struct untracked_cache *uc)
+{
+	strbuf_add(out, uc->exclude_sha1, 20);
+	if (uc->root)
+		write_untracked_dir(out, uc->root);
+}
+
+static const char *read_untracked_string(const char **data, const char *end)
+{
+	const char *str = *data;
+	const char *nul = memchr(str, '\0', end - str);
+
+	if (!nul)
+		return NULL;
+	*data = nul + 1;
+	return str;
+}
+
+static int read_untracked_stat(struct untracked_stat *us,
+			       const char **data, const char *end)
+{
+	uint32_t raw[4];
+
+	if (end - *data < sizeof(raw))
+		return -1;
+	memcpy(raw, *data, sizeof(raw));
+	us->ctime = ntohl(raw[0]);
+	us->mtime = ntohl(raw[1]);
+	us->ino = ntohl(raw[2]);
+	us->size = ntohl(raw[3]);
+	*data += sizeof(raw);
+	return 0;
+}
+
+static struct untracked_cache_dir *read_untracked_dir(const char **data,
+						      const char *end)
+{
+	struct untracked_cache_dir *ucd;
+	const char *name = read_untracked_string(data, end);
+	uint32_t raw[4];
+	int i, nr;
+
+	if (!name)
+		return NULL;
+	ucd = new_untracked_dir(name, strlen(name));
+	if (read_untracked_stat(&ucd->st, data, end) ||
+	    end - *data < sizeof(raw) + 20)
+		goto bad;
+	memcpy(raw, *data, sizeof(raw));
+	*data += sizeof(raw);
+	ucd->valid = !!ntohl(raw[0]);
+	hashcpy(ucd->exclude_sha1, (const unsigned char *)*data);
+	*data += 20;
+
+	nr = ntohl(raw[1]);
+	for (i = 0; i < nr; i++) {
+		const char *path = read_untracked_string(data, end);
+		if (!path)
+			goto bad;
+		ALLOC_GROW(ucd->untracked, ucd->untracked_nr + 1,
+			   ucd->untracked_alloc);
+		ucd->untracked[ucd->untracked_nr++] = xstrdup(path);
+	}
+	nr = ntohl(raw[2]);
+	for (i = 0; i < nr; i++) {
+		const char *path = read_untracked_string(data, end);
+		struct untracked_dep *dep;
+		if (!path)
+			goto bad;
+		ALLOC_GROW(ucd->deps, ucd->deps_nr + 1, ucd->deps_alloc);
+		dep = &ucd->deps[ucd->deps_nr++];
+		dep->path = xstrdup(path);
+		if (read_untracked_stat(&dep->st, data, end))
+			goto bad;
+	}
+	nr = ntohl(raw[3]);
+	for (i = 0; i < nr; i++) {
+		struct untracked_cache_dir *sub = read_untracked_dir(data, end);
+		if (!sub)
+			goto bad;
+		ALLOC_GROW(ucd->dirs, ucd->dirs_nr + 1, ucd->dirs_alloc);
+		ucd->dirs[ucd->dirs_nr++] = sub;
+	}
+	return ucd;
+
+bad:
+	free_untracked_dir(ucd);
+	return NULL;
+}
+
+struct untracked_cache *read_untracked_extension(const char *data,
+						 unsigned long sz)
+{
+	struct untracked_cache *uc;
+	const char *end = data + sz;
+
+	if (sz < 20)
+		return NULL;
+	uc = xcalloc(1, sizeof(*uc));
+	hashcpy(uc->exclude_sha1, (const unsigned char *)data);
+	data += 20;
+	if (data < end) {
+		uc->root = read_untracked_dir(&data, end);
+		if (!uc->root || data != end) {
+			free_untracked_cache(uc);
+			return NULL;
+		}
+	}
+	return uc;
+}
+
 /*
  * Read a directory tree. We currently ignore anything but
  * directories, regular files and symlinks. That's because git
@@ -576,9 +1184,45 @@ static int get_dtype(struct dirent *de, const char *path)
  */
 static int read_directory_recursive(struct dir_struct *dir, const char *path, const char *base, int baselen, int check_only, const struct path_simplify *simplify)
 {
-	DIR *fdir = opendir(path);
+	struct untracked_cache *uc = dir->untracked;
+	struct untracked_cache_dir *ucd = NULL, *parent_ucd = NULL;
+	DIR *fdir;
 	int contents = 0;
 
+	if (uc) {
+		if (check_only) {
+			add_untracked_dep(uc, path);
+		} else {
+			struct stat st;
+			int i;
+
+			parent_ucd = uc->cur;
+			ucd = enter_untracked_dir(uc, base, baselen);
+			ucd->seen = 1;
+			hash_dir_excludes(dir, base, baselen,
+					  parent_ucd ? parent_ucd->cur_exclude_sha1
+						     : uc->exclude_sha1,
+					  ucd->cur_exclude_sha1);
+			uc->cur = ucd;
+			if (untracked_dir_valid(ucd, path)) {
+				uc->dirs_reused++;
+				contents = replay_untracked_dir(dir, ucd, base, baselen);
+				uc->cur = parent_ucd;
+				return contents;
+			}
+			uc->dirs_read++;
+			clear_untracked_dir(ucd);
+			for (i = 0; i < ucd->dirs_nr; i++)
+				ucd->dirs[i]->seen = 0;
+			hashcpy(ucd->exclude_sha1, ucd->cur_exclude_sha1);
+			if (lstat(path, &st))
+				memset(&ucd->st, 0, sizeof(ucd->st));
+			else
+				fill_untracked_stat(&ucd->st, &st);
+		}
+	}
+
+	fdir = opendir(path);
 	if (fdir) {
 		struct dirent *de;
 		char fullname[PATH_MAX + 1];
@@ -652,13 +1296,21 @@ static int read_directory_recursive(struct dir_struct *dir, const char *path, co
 			contents++;
 			if (check_only)
 				goto exit_early;
-			else
-				dir_add_name(dir, fullname, baselen + len);
+			else if (dir_add_name(dir, fullname, baselen + len) && ucd) {
+				ALLOC_GROW(ucd->untracked, ucd->untracked_nr + 1,
+					   ucd->untracked_alloc);
+				ucd->untracked[ucd->untracked_nr++] =
+					xstrdup(fullname + baselen);
+			}
 		}
 exit_early:
 		closedir(fdir);
 	}
 
+	if (ucd) {
+		finish_untracked_dir(uc, ucd);
+		uc->cur = parent_ucd;
+	}
 	return contents;
 }
 
@@ -723,9 +1375,37 @@ int read_directory(struct dir_struct *dir, const char *path, const char *base, i
 	if (has_symlink_leading_path(strlen(path), path))
 		return dir->nr;
 
+	/*
+	 * The untracked cache knows about whole work trees listed with
+	 * the standard options only.
+	 */
+	if (dir->untracked &&
+	    (pathspec || baselen || strcmp(path, ".") ||
+	     dir->show_ignored || dir->collect_ignored))
+		dir->untracked = NULL;
+	if (dir->untracked) {
+		struct untracked_cache *uc = dir->untracked;
+		unsigned char sha1[20];
+
+		hash_global_excludes(dir, sha1);
+		if (hashcmp(sha1, uc->exclude_sha1)) {
+			free_untracked_dir(uc->root);
+			uc->root = NULL;
+			hashcpy(uc->exclude_sha1, sha1);
+		}
+		uc->scan_time = time(NULL);
+		uc->cur = NULL;
+		uc->dirs_read = uc->dirs_reused = 0;
+		preload_untracked_cache(uc);
+	}
+
 	simplify = create_simplify(pathspec);
 	read_directory_recursive(dir, path, base, baselen, 0, simplify);
 	free_simplify(simplify);
+	if (dir->untracked)
+		trace_printf("trace: untracked cache: %d directories read,"
+			     " %d reused\n", dir->untracked->dirs_read,
+			     dir->untracked->dirs_reused);
 	qsort(dir->entries, dir->nr, sizeof(struct dir_entry *), cmp_name);
 	qsort(dir->ignored, dir->ignored_nr, sizeof(struct dir_entry *), cmp_name);
 	return dir->nr;
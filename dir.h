@@ -57,8 +57,40 @@ struct dir_struct {
 
 	struct exclude_stack *exclude_stack;
 	char basebuf[PATH_MAX];
+
+	/* Untracked cache to use and update, see below */
+	struct untracked_cache *untracked;
+};
+
+/*
+ * The untracked cache remembers, for each directory read_directory()
+ * went through, which untracked paths it found there, together with
+ * the stat data of the directory and a hash of the exclude files that
+ * apply to it.  As long as these do not change, the directory need
+ * not be read again.  It is saved in the index as an extension; the
+ * index invalidates the directories leading to a path that is added
+ * or removed, as that changes what is untracked there.
+ */
+struct untracked_cache_dir;
+
+struct untracked_cache {
+	/* of the global exclude patterns and the traversal options */
+	unsigned char exclude_sha1[20];
+	struct untracked_cache_dir *root;
+	/* set when read_directory() updated the cache */
+	int changed;
+
+	/* only used while read_directory() runs */
+	time_t scan_time;
+	struct untracked_cache_dir *cur;
+	int dirs_read, dirs_reused;
 };
 
+extern struct untracked_cache *read_untracked_extension(const char *data, unsigned long sz);
+extern void write_untracked_extension(struct strbuf *out, struct untracked_cache *uc);
+extern void free_untracked_cache(struct untracked_cache *uc);
+extern void untracked_cache_invalidate_path(struct untracked_cache *uc, const char *path);
+
 extern int common_prefix(const char **pathspec);
 
 #define MATCHED_RECURSIVELY 1
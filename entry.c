@@ -1,8 +1,9 @@
 #include "cache.h"
 #include "blob.h"
 #include "dir.h"
+#include "parallel-checkout.h"
 
-static void create_directories(const char *path, const struct checkout *state)
+void create_directories(const char *path, const struct checkout *state)
 {
 	int len = strlen(path);
 	char *buf = xmalloc(len + 1);
@@ -87,7 +88,13 @@ static void *read_blob_entry(struct cache_entry *ce, const char *path, unsigned
 	return NULL;
 }
 
-static int write_entry(struct cache_entry *ce, char *path, const struct checkout *state, int to_tempfile)
+/*
+ * Write "ce" out to "path".  When the index is to be refreshed, the
+ * stat data of the new file goes into "st" if that is given, and
+ * straight into the entry otherwise.
+ */
+static int write_entry(struct cache_entry *ce, char *path, const struct checkout *state,
+		       int to_tempfile, struct stat *st)
 {
 	int fd;
 	long wrote;
@@ -98,10 +105,13 @@ static int write_entry(struct cache_entry *ce, char *path, const struct checkout
 		unsigned long size;
 
 	case S_IFREG:
+		checkout_read_lock();
 		new = read_blob_entry(ce, path, &size);
-		if (!new)
+		if (!new) {
+			checkout_read_unlock();
 			return error("git checkout-index: unable to read sha1 file of %s (%s)",
 				path, sha1_to_hex(ce->sha1));
+		}
 
 		/*
 		 * Convert from git internal format to working tree format
@@ -113,6 +123,7 @@ static int write_entry(struct cache_entry *ce, char *path, const struct checkout
 			new = strbuf_detach(&buf, &newsize);
 			size = newsize;
 		}
+		checkout_read_unlock();
 
 		if (to_tempfile) {
 			strcpy(path, ".merge_file_XXXXXX");
@@ -132,7 +143,9 @@ static int write_entry(struct cache_entry *ce, char *path, const struct checkout
 			return error("git checkout-index: unable to write file %s", path);
 		break;
 	case S_IFLNK:
+		checkout_read_lock();
 		new = read_blob_entry(ce, path, &size);
+		checkout_read_unlock();
 		if (!new)
 			return error("git checkout-index: unable to read sha1 file of %s (%s)",
 				path, sha1_to_hex(ce->sha1));
@@ -172,9 +185,12 @@ static int write_entry(struct cache_entry *ce, char *path, const struct checkout
 	}
 
 	if (state->refresh_cache) {
-		struct stat st;
-		lstat(ce->name, &st);
-		fill_stat_cache_info(ce, &st);
+		struct stat new_st;
+		lstat(ce->name, &new_st);
+		if (st)
+			*st = new_st;
+		else
+			fill_stat_cache_info(ce, &new_st);
 	}
 	return 0;
 }
@@ -182,19 +198,37 @@ static int write_entry(struct cache_entry *ce, char *path, const struct checkout
 int checkout_entry(struct cache_entry *ce, const struct checkout *state, char *topath)
 {
 	static char path[PATH_MAX + 1];
-	struct stat st;
 	int len = state->base_dir_len;
 
 	if (topath)
-		return write_entry(ce, topath, state, 1);
+		return write_entry(ce, topath, state, 1, NULL);
 
 	memcpy(path, state->base_dir, len);
 	strcpy(path + len, ce->name);
+	return checkout_entry_at(ce, state, path, 1, NULL);
+}
+
+int checkout_entry_at(struct cache_entry *ce, const struct checkout *state,
+		      char *path, int mkdirs, struct stat *new_st)
+{
+	int ret = prepare_checkout_entry(ce, state, path);
+
+	if (ret)
+		return ret < 0 ? -1 : 0;
+	if (mkdirs)
+		create_directories(path, state);
+	return write_entry(ce, path, state, 0, new_st);
+}
+
+int prepare_checkout_entry(struct cache_entry *ce, const struct checkout *state,
+			   const char *path)
+{
+	struct stat st;
 
 	if (!lstat(path, &st)) {
 		unsigned changed = ce_match_stat(ce, &st, CE_MATCH_IGNORE_VALID);
 		if (!changed)
-			return 0;
+			return 1;
 		if (!state->force) {
 			if (!state->quiet)
 				fprintf(stderr, "git-checkout-index: %s already exists\n", path);
@@ -210,14 +244,19 @@ int checkout_entry(struct cache_entry *ce, const struct checkout *state, char *t
 		if (S_ISDIR(st.st_mode)) {
 			/* If it is a gitlink, leave it alone! */
 			if (S_ISGITLINK(ce->ce_mode))
-				return 0;
+				return 1;
 			if (!state->force)
 				return error("%s is a directory", path);
 			remove_subtree(path);
 		} else if (unlink(path))
 			return error("unable to unlink old '%s' (%s)", path, strerror(errno));
 	} else if (state->not_new)
-		return 0;
-	create_directories(path, state);
-	return write_entry(ce, path, state, 0);
+		return 1;
+	return 0;
+}
+
+int write_checkout_entry(struct cache_entry *ce, const struct checkout *state,
+			 char *path, struct stat *new_st)
+{
+	return write_entry(ce, path, state, 0, new_st);
 }
@@ -45,6 +45,35 @@ enum rebase_setup_type autorebase = AUTOREBASE_NEVER;
 
 /* Parallel index stat data preload? */
 int core_preload_index = 0;
+int core_preload_index_threads;
+
+/* Read parents and dates from $GIT_OBJECT_DIRECTORY/info/commit-graph? */
+int core_commit_graph = 1;
+int core_multi_pack_index = 1;
+
+/* Remember untracked files in the index for "git status"? */
+int core_untracked_cache;
+
+/* Hook asked which paths changed since the index was last refreshed */
+const char *core_fsmonitor;
+
+/* Threads to read the index with; 0 means one per CPU */
+int index_threads;
+
+/* Index file format to write; 0 means 2, or 3 when needed */
+int index_version;
+
+/* Threads to check out files with; 0 means one per CPU */
+int checkout_workers = 1;
+
+/* Keep most index entries in a shared index that is rarely rewritten? */
+int core_split_index;
+
+/* Write whole directories nobody looks at as a single index entry? */
+int core_sparse_index;
+
+/* Set by the commands that can work with such entries directly */
+int sparse_index_ok;
 
 /* This is set by setup_git_dir_gently() and/or git_default_config() */
 char *git_work_tree_cfg;
@@ -0,0 +1,190 @@
+#include "cache.h"
+#include "run-command.h"
+#include "fsmonitor.h"
+
+/*
+ * The "FSMN" extension holds, in network byte order, the version, the
+ * time of the last query as two 32-bit halves, the number of entries,
+ * and a bitmap with a bit set for every entry that has to be checked
+ * with lstat() again.
+ */
+#define FSMONITOR_HEADER_SIZE 16
+
+static uint64_t getnanotime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+}
+
+void read_fsmonitor_extension(struct index_state *istate,
+			      const char *data, unsigned long sz)
+{
+	const unsigned char *bitmap;
+	uint32_t version, nr, i;
+
+	if (sz < FSMONITOR_HEADER_SIZE) {
+		warning("ignoring truncated fsmonitor extension");
+		return;
+	}
+	version = ntohl(*(uint32_t *)data);
+	nr = ntohl(*(uint32_t *)(data + 12));
+	if (version != FSMONITOR_VERSION || nr != istate->cache_nr ||
+	    sz != FSMONITOR_HEADER_SIZE + (nr + 7) / 8) {
+		warning("ignoring unusable fsmonitor extension");
+		return;
+	}
+
+	istate->fsmonitor_last_update =
+		((uint64_t)ntohl(*(uint32_t *)(data + 4)) << 32) |
+		ntohl(*(uint32_t *)(data + 8));
+	bitmap = (const unsigned char *)data + FSMONITOR_HEADER_SIZE;
+	for (i = 0; i < nr; i++)
+		if (!(bitmap[i / 8] & (1 << (i % 8))))
+			istate->cache[i]->ce_flags |= CE_FSMONITOR_VALID;
+}
+
+void write_fsmonitor_extension(struct strbuf *sb,
+			       const struct index_state *istate)
+{
+	uint32_t hdr[4];
+	unsigned char *bitmap;
+	int i, nr, size;
+
+	for (i = nr = 0; i < istate->cache_nr; i++)
+		if (!(istate->cache[i]->ce_flags & CE_REMOVE))
+			nr++;
+	size = (nr + 7) / 8;
+	bitmap = xcalloc(1, size + 1);
+	for (i = nr = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		if (!(ce->ce_flags & CE_FSMONITOR_VALID))
+			bitmap[nr / 8] |= 1 << (nr % 8);
+		nr++;
+	}
+
+	hdr[0] = htonl(FSMONITOR_VERSION);
+	hdr[1] = htonl((uint32_t)(istate->fsmonitor_last_update >> 32));
+	hdr[2] = htonl((uint32_t)istate->fsmonitor_last_update);
+	hdr[3] = htonl(nr);
+	strbuf_add(sb, hdr, sizeof(hdr));
+	strbuf_add(sb, bitmap, size);
+	free(bitmap);
+}
+
+static int query_fsmonitor(uint64_t since, struct strbuf *out)
+{
+	struct child_process cp;
+	const char *argv[4];
+	char version[20], timestamp[40];
+	int ret;
+
+	sprintf(version, "%d", FSMONITOR_VERSION);
+	sprintf(timestamp, "%"PRIuMAX, (uintmax_t)since);
+	argv[0] = core_fsmonitor;
+	argv[1] = version;
+	argv[2] = timestamp;
+	argv[3] = NULL;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.argv = argv;
+	cp.no_stdin = 1;
+	cp.out = -1;
+	if (start_command(&cp))
+		return error("cannot run fsmonitor hook '%s'", core_fsmonitor);
+	ret = strbuf_read(out, cp.out, 1024) < 0;
+	close(cp.out);
+	if (finish_command(&cp) || ret)
+		return error("fsmonitor hook '%s' failed", core_fsmonitor);
+	return 0;
+}
+
+static void invalidate_prefix(struct index_state *istate,
+			     const char *name, int len, int exact)
+{
+	int pos = index_name_pos(istate, name, len);
+
+	if (pos < 0)
+		pos = -pos - 1;
+	for (; pos < istate->cache_nr; pos++) {
+		struct cache_entry *ce = istate->cache[pos];
+		if (strncmp(ce->name, name, len) ||
+		    (exact && ce_namelen(ce) != len))
+			break;
+		ce->ce_flags &= ~CE_FSMONITOR_VALID;
+	}
+}
+
+/* Forget that the entries at or below path are up to date */
+static void invalidate_path(struct index_state *istate, const char *path)
+{
+	struct strbuf dir = STRBUF_INIT;
+	int len = strlen(path);
+
+	if (len && path[len - 1] == '/')
+		len--;
+	invalidate_prefix(istate, path, len, 1);
+	strbuf_add(&dir, path, len);
+	strbuf_addch(&dir, '/');
+	invalidate_prefix(istate, dir.buf, dir.len, 0);
+	strbuf_release(&dir);
+}
+
+void refresh_fsmonitor(struct index_state *istate)
+{
+	struct strbuf changed = STRBUF_INIT;
+	uint64_t now;
+	int i, paths = 0, valid = 0, query_ok = 0;
+
+	if (!core_fsmonitor || istate->fsmonitor_has_run)
+		return;
+	istate->fsmonitor_has_run = 1;
+
+	/*
+	 * Take the time before asking, so that a change racing with
+	 * the hook is reported again next time.
+	 */
+	now = getnanotime();
+	if (istate->fsmonitor_last_update)
+		query_ok = !query_fsmonitor(istate->fsmonitor_last_update,
+					    &changed);
+
+	if (query_ok) {
+		const char *p = changed.buf, *end = changed.buf + changed.len;
+
+		while (p < end) {
+			const char *eol = memchr(p, '\0', end - p);
+			if (!eol)
+				eol = end;
+			if (eol == p + 1 && *p == '/') {
+				query_ok = 0;
+				break;
+			}
+			if (eol > p) {
+				char *path = xstrndup(p, eol - p);
+				invalidate_path(istate, path);
+				free(path);
+				paths++;
+			}
+			p = eol + 1;
+		}
+	}
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		if (!query_ok)
+			ce->ce_flags &= ~CE_FSMONITOR_VALID;
+		else if (ce->ce_flags & CE_FSMONITOR_VALID) {
+			ce_mark_uptodate(ce);
+			valid++;
+		}
+	}
+	istate->fsmonitor_last_update = now;
+	strbuf_release(&changed);
+
+	trace_printf("trace: fsmonitor: %d paths changed, %d of %d entries"
+		     " up to date\n", paths, valid, istate->cache_nr);
+}
@@ -0,0 +1,41 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+/*
+ * The hook named by core.fsmonitor is run as
+ *
+ *	<hook> <version> <time>
+ *
+ * and prints the NUL-terminated names of the paths that may have
+ * changed since <time>, in nanoseconds since the epoch.  A lone "/"
+ * means everything may have changed.  The time of the last query and
+ * the entries found unchanged since are kept in the index, so that
+ * refreshing it only needs to lstat() the paths the hook reports.
+ */
+#define FSMONITOR_VERSION 1
+
+/* Parse the "FSMN" index extension; entries must already be read */
+extern void read_fsmonitor_extension(struct index_state *istate,
+				     const char *data, unsigned long sz);
+
+/* Serialize the state of the entries written by write_index() */
+extern void write_fsmonitor_extension(struct strbuf *sb,
+				      const struct index_state *istate);
+
+/*
+ * Ask the hook what changed, once per process, and mark the entries
+ * it does not report up to date.
+ */
+extern void refresh_fsmonitor(struct index_state *istate);
+
+/*
+ * Called once the work tree file of ce was found to match it; entries
+ * the user told us not to check are never trusted.
+ */
+static inline void mark_fsmonitor_valid(struct cache_entry *ce)
+{
+	if (core_fsmonitor && !(ce->ce_flags & CE_VALID))
+		ce->ce_flags |= CE_FSMONITOR_VALID;
+}
+
+#endif
@@ -9,6 +9,7 @@ git repack [options]
 --
 a               pack everything in a single pack
 A               same as -a, and turn unreachable objects loose
+b               write a bitmap index together with the pack (with -a)
 d               remove redundant packs, and run git-prune-packed
 f               pass --no-reuse-object to git-pack-objects
 n               do not run git-update-server-info
@@ -24,7 +25,7 @@ SUBDIRECTORY_OK='Yes'
 . git-sh-setup
 
 no_update_info= all_into_one= remove_redundant= unpack_unreachable=
-local= quiet= no_reuse= extra=
+local= quiet= no_reuse= extra= write_bitmaps=
 while test $# != 0
 do
 	case "$1" in
@@ -32,6 +33,7 @@ do
 	-a)	all_into_one=t ;;
 	-A)	all_into_one=t
 		unpack_unreachable=--unpack-unreachable ;;
+	-b)	write_bitmaps=t ;;
 	-d)	remove_redundant=t ;;
 	-q)	quiet=-q ;;
 	-f)	no_reuse=--no-reuse-object ;;
@@ -49,6 +51,13 @@ true)
 	extra="$extra --delta-base-offset" ;;
 esac
 
+case "$write_bitmaps,`git config --bool repack.writebitmaps`" in
+t,*|,true)
+	# a bitmap only makes sense for a pack with everything in it
+	test -n "$all_into_one" &&
+	extra="$extra --write-bitmap-index" ;;
+esac
+
 PACKDIR="$GIT_OBJECT_DIRECTORY/pack"
 PACKTMP="$GIT_OBJECT_DIRECTORY/.tmp-$$-pack"
 rm -f "$PACKTMP"-*
@@ -94,7 +103,7 @@ for name in $names ; do
 	chmod a-w "$PACKTMP-$name.idx"
 	mkdir -p "$PACKDIR" || exit
 
-	for sfx in pack idx
+	for sfx in pack idx bitmap rev
 	do
 		if test -f "$PACKDIR/pack-$name.$sfx"
 		then
@@ -104,6 +113,16 @@ for name in $names ; do
 	done &&
 	mv -f "$PACKTMP-$name.pack" "$PACKDIR/pack-$name.pack" &&
 	mv -f "$PACKTMP-$name.idx"  "$PACKDIR/pack-$name.idx" &&
+	if test -f "$PACKTMP-$name.bitmap"
+	then
+		chmod a-w "$PACKTMP-$name.bitmap" &&
+		mv -f "$PACKTMP-$name.bitmap" "$PACKDIR/pack-$name.bitmap"
+	fi &&
+	if test -f "$PACKTMP-$name.rev"
+	then
+		chmod a-w "$PACKTMP-$name.rev" &&
+		mv -f "$PACKTMP-$name.rev" "$PACKDIR/pack-$name.rev"
+	fi &&
 	test -f "$PACKDIR/pack-$name.pack" &&
 	test -f "$PACKDIR/pack-$name.idx" || {
 		echo >&2 "Couldn't replace the existing pack with updated one."
@@ -111,7 +130,8 @@ for name in $names ; do
 		echo >&2 "old-pack-$name.{pack,idx} in $PACKDIR."
 		exit 1
 	}
-	rm -f "$PACKDIR/old-pack-$name.pack" "$PACKDIR/old-pack-$name.idx"
+	rm -f "$PACKDIR/old-pack-$name.pack" "$PACKDIR/old-pack-$name.idx" \
+		"$PACKDIR/old-pack-$name.bitmap" "$PACKDIR/old-pack-$name.rev"
 done
 
 if test "$remove_redundant" = t
@@ -124,7 +144,7 @@ then
 		  do
 			case " $fullbases " in
 			*" $e "*) ;;
-			*)	rm -f "$e.pack" "$e.idx" "$e.keep" ;;
+			*)	rm -f "$e.pack" "$e.idx" "$e.keep" "$e.bitmap" "$e.rev" ;;
 			esac
 		  done
 		)
@@ -132,6 +152,13 @@ then
 	git prune-packed $quiet
 fi
 
+# Keep the multi-pack index in step with the packs it covers
+if test -f "$PACKDIR/multi-pack-index" ||
+   test "`git config --bool repack.writemultipackindex`" = true
+then
+	git multi-pack-index write
+fi
+
 case "$no_update_info" in
 t) : ;;
 *) git-update-server-info ;;
@@ -8,9 +8,14 @@
 #include "tree.h"
 #include "progress.h"
 #include "fsck.h"
+#include "thread-utils.h"
+
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 static const char index_pack_usage[] =
-"git index-pack [-v] [-o <index-file>] [{ ---keep | --keep=<msg> }] [--strict] { <pack-file> | --stdin [--fix-thin] [<pack-file>] }";
+"git index-pack [-v] [-o <index-file>] [{ ---keep | --keep=<msg> }] [--strict] [--threads=<n>] [--[no-]rev-index] { <pack-file> | --stdin [--fix-thin] [<pack-file>] }";
 
 struct object_entry
 {
@@ -34,6 +39,18 @@ struct base_data {
 	unsigned long size;
 };
 
+/*
+ * Each thread resolving deltas keeps its own chain of base objects,
+ * and its own budget of delta_base_cache_limit bytes for them.
+ */
+struct thread_local {
+#ifndef NO_PTHREADS
+	pthread_t thread;
+#endif
+	struct base_data *base_cache;
+	size_t base_cache_used;
+};
+
 /*
  * Even if sizeof(union delta_base) == 24 on 64-bit archs, we really want
  * to memcmp() only the first 20 bytes.
@@ -51,16 +68,59 @@ struct delta_entry
 
 static struct object_entry *objects;
 static struct delta_entry *deltas;
-static struct base_data *base_cache;
-static size_t base_cache_used;
+static struct thread_local nothread_data;
 static int nr_objects;
 static int nr_deltas;
 static int nr_resolved_deltas;
+static int nr_threads;
 
 static int from_stdin;
 static int strict;
 static int verbose;
 
+#ifndef NO_PTHREADS
+
+static struct thread_local *thread_data;
+static int nr_dispatched;
+static int threads_active;
+
+static pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define read_lock()		pthread_mutex_lock(&read_mutex)
+#define read_unlock()		pthread_mutex_unlock(&read_mutex)
+
+static pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define counter_lock()		pthread_mutex_lock(&counter_mutex)
+#define counter_unlock()	pthread_mutex_unlock(&counter_mutex)
+
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define work_lock()		pthread_mutex_lock(&work_mutex)
+#define work_unlock()		pthread_mutex_unlock(&work_mutex)
+
+static pthread_key_t key;
+
+static struct thread_local *get_thread_data(void)
+{
+	if (threads_active)
+		return pthread_getspecific(key);
+	return &nothread_data;
+}
+
+#else
+
+#define read_lock()
+#define read_unlock()
+#define counter_lock()
+#define counter_unlock()
+#define work_lock()
+#define work_unlock()
+
+static struct thread_local *get_thread_data(void)
+{
+	return &nothread_data;
+}
+
+#endif
+
 static struct progress *progress;
 
 /* We always read in 4kB chunks. */
@@ -221,20 +281,27 @@ static void bad_object(unsigned long offset, const char *format, ...)
 	die("pack has bad object at offset %lu: %s", offset, buf);
 }
 
+static int is_delta_type(enum object_type type)
+{
+	return (type == OBJ_REF_DELTA || type == OBJ_OFS_DELTA);
+}
+
 static void free_base_data(struct base_data *c)
 {
 	if (c->data) {
 		free(c->data);
 		c->data = NULL;
-		base_cache_used -= c->size;
+		get_thread_data()->base_cache_used -= c->size;
 	}
 }
 
 static void prune_base_data(struct base_data *retain)
 {
-	struct base_data *b = base_cache;
-	for (b = base_cache;
-	     base_cache_used > delta_base_cache_limit && b;
+	struct thread_local *data = get_thread_data();
+	struct base_data *b;
+
+	for (b = data->base_cache;
+	     data->base_cache_used > delta_base_cache_limit && b;
 	     b = b->child) {
 		if (b->data && b != retain)
 			free_base_data(b);
@@ -246,12 +313,12 @@ static void link_base_data(struct base_data *base, struct base_data *c)
 	if (base)
 		base->child = c;
 	else
-		base_cache = c;
+		get_thread_data()->base_cache = c;
 
 	c->base = base;
 	c->child = NULL;
 	if (c->data)
-		base_cache_used += c->size;
+		get_thread_data()->base_cache_used += c->size;
 	prune_base_data(c);
 }
 
@@ -261,7 +328,7 @@ static void unlink_base_data(struct base_data *c)
 	if (base)
 		base->child = NULL;
 	else
-		base_cache = NULL;
+		get_thread_data()->base_cache = NULL;
 	free_base_data(c);
 }
 
@@ -436,19 +503,23 @@ static void sha1_object(const void *data, unsigned long size,
 			enum object_type type, unsigned char *sha1)
 {
 	hash_sha1_file(data, size, typename(type), sha1);
+	read_lock();
 	if (has_sha1_file(sha1)) {
 		void *has_data;
 		enum object_type has_type;
 		unsigned long has_size;
 		has_data = read_sha1_file(sha1, &has_type, &has_size);
+		read_unlock();
 		if (!has_data)
 			die("cannot read existing object %s", sha1_to_hex(sha1));
 		if (size != has_size || type != has_type ||
 		    memcmp(data, has_data, size) != 0)
 			die("SHA1 COLLISION FOUND WITH %s !", sha1_to_hex(sha1));
 		free(has_data);
-	}
+	} else
+		read_unlock();
 	if (strict) {
+		read_lock();
 		if (type == OBJ_BLOB) {
 			struct blob *blob = lookup_blob(sha1);
 			if (blob)
@@ -482,6 +553,7 @@ static void sha1_object(const void *data, unsigned long size,
 			}
 			obj->flags |= FLAG_CHECKED;
 		}
+		read_unlock();
 	}
 }
 
@@ -490,7 +562,7 @@ static void *get_base_data(struct base_data *c)
 	if (!c->data) {
 		struct object_entry *obj = c->obj;
 
-		if (obj->type == OBJ_REF_DELTA || obj->type == OBJ_OFS_DELTA) {
+		if (is_delta_type(obj->type)) {
 			void *base = get_base_data(c->base);
 			void *raw = get_data_from_pack(obj);
 			c->data = patch_delta(
@@ -505,7 +577,7 @@ static void *get_base_data(struct base_data *c)
 			c->size = obj->size;
 		}
 
-		base_cache_used += c->size;
+		get_thread_data()->base_cache_used += c->size;
 		prune_base_data(c);
 	}
 	return c->data;
@@ -527,7 +599,9 @@ static void resolve_delta(struct object_entry *delta_obj,
 		bad_object(delta_obj->idx.offset, "failed to apply delta");
 	sha1_object(result->data, result->size, delta_obj->real_type,
 		    delta_obj->idx.sha1);
+	counter_lock();
 	nr_resolved_deltas++;
+	counter_unlock();
 }
 
 static void find_unresolved_deltas(struct base_data *base,
@@ -582,6 +656,69 @@ static void find_unresolved_deltas(struct base_data *base,
 	unlink_base_data(base);
 }
 
+static void resolve_base(struct object_entry *obj)
+{
+	struct base_data base_obj;
+
+	base_obj.obj = obj;
+	base_obj.data = NULL;
+	find_unresolved_deltas(&base_obj, NULL);
+}
+
+#ifndef NO_PTHREADS
+/*
+ * Each base object and the deltas resting on it, directly or not,
+ * form a tree of their own; hand out whole trees to the threads.
+ */
+static void *threaded_second_pass(void *data)
+{
+	pthread_setspecific(key, data);
+	for (;;) {
+		int i;
+
+		counter_lock();
+		display_progress(progress, nr_resolved_deltas);
+		counter_unlock();
+
+		work_lock();
+		while (nr_dispatched < nr_objects &&
+		       is_delta_type(objects[nr_dispatched].type))
+			nr_dispatched++;
+		if (nr_dispatched >= nr_objects) {
+			work_unlock();
+			break;
+		}
+		i = nr_dispatched++;
+		work_unlock();
+
+		resolve_base(&objects[i]);
+	}
+	return NULL;
+}
+
+static void resolve_deltas_threaded(void)
+{
+	int i;
+
+	thread_data = xcalloc(nr_threads, sizeof(*thread_data));
+	pthread_key_create(&key, NULL);
+	nr_dispatched = 0;
+	threads_active = 1;
+	for (i = 0; i < nr_threads; i++) {
+		int ret = pthread_create(&thread_data[i].thread, NULL,
+					 threaded_second_pass, thread_data + i);
+		if (ret)
+			die("unable to create thread: %s", strerror(ret));
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(thread_data[i].thread, NULL);
+	threads_active = 0;
+	pthread_key_delete(key);
+	free(thread_data);
+	thread_data = NULL;
+}
+#endif
+
 static int compare_delta_entry(const void *a, const void *b)
 {
 	const struct delta_entry *delta_a = a;
@@ -610,7 +747,7 @@ static void parse_pack_objects(unsigned char *sha1)
 		struct object_entry *obj = &objects[i];
 		void *data = unpack_raw_entry(obj, &delta->base);
 		obj->real_type = obj->type;
-		if (obj->type == OBJ_REF_DELTA || obj->type == OBJ_OFS_DELTA) {
+		if (is_delta_type(obj->type)) {
 			nr_deltas++;
 			delta->obj_no = i;
 			delta++;
@@ -653,15 +790,18 @@ static void parse_pack_objects(unsigned char *sha1)
 	 */
 	if (verbose)
 		progress = start_progress("Resolving deltas", nr_deltas);
+#ifndef NO_PTHREADS
+	if (nr_threads > 1) {
+		resolve_deltas_threaded();
+		return;
+	}
+#endif
 	for (i = 0; i < nr_objects; i++) {
 		struct object_entry *obj = &objects[i];
-		struct base_data base_obj;
 
-		if (obj->type == OBJ_REF_DELTA || obj->type == OBJ_OFS_DELTA)
+		if (is_delta_type(obj->type))
 			continue;
-		base_obj.obj = obj;
-		base_obj.data = NULL;
-		find_unresolved_deltas(&base_obj, NULL);
+		resolve_base(obj);
 		display_progress(progress, nr_resolved_deltas);
 	}
 }
@@ -775,6 +915,7 @@ static void fix_unresolved_deltas(struct sha1file *f, int nr_unresolved)
 
 static void final(const char *final_pack_name, const char *curr_pack_name,
 		  const char *final_index_name, const char *curr_index_name,
+		  const char *final_rev_name, const char *curr_rev_name,
 		  const char *keep_name, const char *keep_msg,
 		  unsigned char *sha1)
 {
@@ -825,6 +966,19 @@ static void final(const char *final_pack_name, const char *curr_pack_name,
 	if (from_stdin)
 		chmod(final_pack_name, 0444);
 
+	if (curr_rev_name) {
+		if (final_rev_name != curr_rev_name) {
+			if (!final_rev_name) {
+				snprintf(name, sizeof(name), "%s/pack/pack-%s.rev",
+					 get_object_directory(), sha1_to_hex(sha1));
+				final_rev_name = name;
+			}
+			if (move_temp_to_file(curr_rev_name, final_rev_name))
+				die("cannot store reverse index file");
+		}
+		chmod(final_rev_name, 0444);
+	}
+
 	if (final_index_name != curr_index_name) {
 		if (!final_index_name) {
 			snprintf(name, sizeof(name), "%s/pack/pack-%s.idx",
@@ -867,6 +1021,22 @@ static int git_index_pack_config(const char *k, const char *v, void *cb)
 				pack_idx_default_version);
 		return 0;
 	}
+	if (!strcmp(k, "pack.writereverseindex")) {
+		pack_write_rev_index = git_config_bool(k, v);
+		return 0;
+	}
+	if (!strcmp(k, "pack.threads")) {
+		nr_threads = git_config_int(k, v);
+		if (nr_threads < 0)
+			die("invalid number of threads specified (%d)",
+			    nr_threads);
+#ifdef NO_PTHREADS
+		if (nr_threads != 1)
+			warning("no threads support, ignoring %s", k);
+		nr_threads = 1;
+#endif
+		return 0;
+	}
 	return git_default_config(k, v, cb);
 }
 
@@ -875,10 +1045,11 @@ int main(int argc, char **argv)
 	int i, fix_thin_pack = 0;
 	char *curr_pack, *pack_name = NULL;
 	char *curr_index, *index_name = NULL;
+	char *curr_rev = NULL, *rev_name = NULL;
 	const char *keep_name = NULL, *keep_msg = NULL;
 	char *index_name_buf = NULL, *keep_name_buf = NULL;
 	struct pack_idx_entry **idx_objects;
-	unsigned char pack_sha1[20];
+	unsigned char pack_sha1[20], pack_trailer[20];
 
 	/*
 	 * We wish to read the repository's config file if any, and
@@ -910,6 +1081,10 @@ int main(int argc, char **argv)
 				fix_thin_pack = 1;
 			} else if (!strcmp(arg, "--strict")) {
 				strict = 1;
+			} else if (!strcmp(arg, "--rev-index")) {
+				pack_write_rev_index = 1;
+			} else if (!strcmp(arg, "--no-rev-index")) {
+				pack_write_rev_index = 0;
 			} else if (!strcmp(arg, "--keep")) {
 				keep_msg = "";
 			} else if (!prefixcmp(arg, "--keep=")) {
@@ -929,6 +1104,17 @@ int main(int argc, char **argv)
 				input_len = sizeof(*hdr);
 			} else if (!strcmp(arg, "-v")) {
 				verbose = 1;
+			} else if (!prefixcmp(arg, "--threads=")) {
+				char *end;
+				nr_threads = strtoul(arg+10, &end, 0);
+				if (!arg[10] || *end || nr_threads < 0)
+					usage(index_pack_usage);
+#ifdef NO_PTHREADS
+				if (nr_threads != 1)
+					warning("no threads support, "
+						"ignoring %s", arg);
+				nr_threads = 1;
+#endif
 			} else if (!strcmp(arg, "-o")) {
 				if (index_name || (i+1) >= argc)
 					usage(index_pack_usage);
@@ -976,6 +1162,20 @@ int main(int argc, char **argv)
 		strcpy(keep_name_buf + len - 5, ".keep");
 		keep_name = keep_name_buf;
 	}
+	if (pack_write_rev_index && pack_name) {
+		int len = strlen(pack_name);
+		if (!has_extension(pack_name, ".pack"))
+			die("packfile name '%s' does not end with '.pack'",
+			    pack_name);
+		rev_name = xmalloc(len);
+		memcpy(rev_name, pack_name, len - 5);
+		strcpy(rev_name + len - 5, ".rev");
+	}
+
+#ifndef NO_PTHREADS
+	if (!nr_threads)	/* --threads=0 means autodetect */
+		nr_threads = online_cpus();
+#endif
 
 	curr_pack = open_pack_file(pack_name);
 	parse_pack_header();
@@ -1023,11 +1223,16 @@ int main(int argc, char **argv)
 	idx_objects = xmalloc((nr_objects) * sizeof(struct pack_idx_entry *));
 	for (i = 0; i < nr_objects; i++)
 		idx_objects[i] = &objects[i].idx;
+	hashcpy(pack_trailer, pack_sha1);
 	curr_index = write_idx_file(index_name, idx_objects, nr_objects, pack_sha1);
+	if (pack_write_rev_index)
+		curr_rev = write_rev_file(rev_name, idx_objects, nr_objects,
+					  pack_trailer);
 	free(idx_objects);
 
 	final(pack_name, curr_pack,
 		index_name, curr_index,
+		rev_name, curr_rev,
 		keep_name, keep_msg,
 		pack_sha1);
 	free(objects);
@@ -1037,6 +1242,9 @@ int main(int argc, char **argv)
 		free(curr_pack);
 	if (index_name == NULL)
 		free(curr_index);
+	if (rev_name == NULL)
+		free(curr_rev);
+	free(rev_name);
 
 	return 0;
 }
@@ -201,6 +201,15 @@ int close_lock_file(struct lock_file *lk)
 	return close(fd);
 }
 
+/* Open a lock file that was closed with close_lock_file() again */
+int reopen_lock_file(struct lock_file *lk)
+{
+	if (lk->fd >= 0 || !lk->filename[0])
+		die("BUG: reopening a lock file that is not held closed");
+	lk->fd = open(lk->filename, O_WRONLY);
+	return lk->fd;
+}
+
 int commit_lock_file(struct lock_file *lk)
 {
 	char result_file[PATH_MAX];
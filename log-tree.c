@@ -379,6 +379,7 @@ void show_log(struct rev_info *opt)
 		}
 	}
 
+	load_commit_buffer(commit);
 	if (!commit->buffer)
 		return;
 
@@ -134,6 +134,11 @@ static void output_commit_title(struct merge_options *o, struct commit *commit)
 		else {
 			const char *s;
 			int len;
+			load_commit_buffer(commit);
+			if (!commit->buffer) {
+				printf("(bad commit)\n");
+				return;
+			}
 			for (s = commit->buffer; *s; s++)
 				if (*s == '\n' && s[1] == '\n') {
 					s += 2;
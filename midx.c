@@ -0,0 +1,414 @@
+#include "cache.h"
+#include "dir.h"
+#include "csum-file.h"
+#include "sha1-lookup.h"
+#include "midx.h"
+
+/*
+ * The multi-pack index is laid out as follows (all numbers in network
+ * byte order):
+ *
+ *  - a header: signature, version, the number of packs, the number of
+ *    objects and the size of the pack name list;
+ *
+ *  - the sorted names of the packs, e.g. "pack-<sha1>.pack", each one
+ *    terminated by a NUL, and padded with NULs to a multiple of four
+ *    bytes;
+ *
+ *  - a 256-entry fan-out table of the number of objects whose name
+ *    starts with a byte less than or equal to the index;
+ *
+ *  - the sorted object names;
+ *
+ *  - one 12-byte record per object in the same order: the position of
+ *    its pack in the name list, and its offset there as a 64-bit
+ *    number;
+ *
+ *  - the SHA-1 checksum of all of the above.
+ *
+ * An object found in several packs is recorded once, for the pack
+ * find_pack_entry() would have looked at first.
+ */
+#define MIDX_HEADER_SIZE 20
+#define MIDX_FANOUT_SIZE (256 * 4)
+#define MIDX_RECORD_SIZE 12
+
+static struct multi_pack_index {
+	char *path;
+	unsigned char *map;
+	size_t map_size;
+	uint32_t nr_packs;
+	uint32_t nr_objects;
+	const char **pack_names;
+	struct packed_git **packs;
+	const uint32_t *fanout;
+	const unsigned char *oids;
+	const unsigned char *records;
+} midx;
+
+static char *midx_file_name(void)
+{
+	return xstrdup(mkpath("%s/pack/multi-pack-index",
+			      get_object_directory()));
+}
+
+static int load_multi_pack_index(void)
+{
+	const uint32_t *hdr;
+	const char *name, *end;
+	struct stat st;
+	uint64_t expect;
+	uint32_t names_size, i;
+	int fd;
+
+	if (!midx.path)
+		midx.path = midx_file_name();
+	fd = open(midx.path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) ||
+	    st.st_size < MIDX_HEADER_SIZE + MIDX_FANOUT_SIZE + 20) {
+		close(fd);
+		return error("multi-pack-index file %s is too small",
+			     midx.path);
+	}
+	midx.map_size = xsize_t(st.st_size);
+	midx.map = xmmap(NULL, midx.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	hdr = (const uint32_t *)midx.map;
+	if (ntohl(hdr[0]) != MIDX_SIGNATURE ||
+	    ntohl(hdr[1]) != MIDX_VERSION)
+		goto bad;
+	midx.nr_packs = ntohl(hdr[2]);
+	midx.nr_objects = ntohl(hdr[3]);
+	names_size = ntohl(hdr[4]);
+	expect = MIDX_HEADER_SIZE + (uint64_t)names_size +
+		MIDX_FANOUT_SIZE + 20 +
+		(uint64_t)midx.nr_objects * (20 + MIDX_RECORD_SIZE);
+	if (names_size % 4 || expect != midx.map_size)
+		goto bad;
+
+	name = (const char *)midx.map + MIDX_HEADER_SIZE;
+	end = name + names_size;
+	midx.pack_names = xcalloc(midx.nr_packs, sizeof(*midx.pack_names));
+	for (i = 0; i < midx.nr_packs; i++) {
+		const char *nul = memchr(name, 0, end - name);
+		if (!nul || nul == name)
+			goto bad;
+		midx.pack_names[i] = name;
+		name = nul + 1;
+	}
+
+	midx.fanout = (const uint32_t *)end;
+	if (ntohl(midx.fanout[255]) != midx.nr_objects)
+		goto bad;
+	midx.oids = (const unsigned char *)end + MIDX_FANOUT_SIZE;
+	midx.records = midx.oids + midx.nr_objects * 20;
+	midx.packs = xcalloc(midx.nr_packs, sizeof(*midx.packs));
+	return 0;
+
+bad:
+	error("multi-pack-index file %s is corrupt", midx.path);
+	free(midx.pack_names);
+	midx.pack_names = NULL;
+	munmap(midx.map, midx.map_size);
+	midx.map = NULL;
+	return -1;
+}
+
+static void close_multi_pack_index(void)
+{
+	uint32_t i;
+
+	if (!midx.map)
+		return;
+	for (i = 0; i < midx.nr_packs; i++)
+		if (midx.packs[i])
+			midx.packs[i]->multi_pack_index = 0;
+	free(midx.packs);
+	midx.packs = NULL;
+	free(midx.pack_names);
+	midx.pack_names = NULL;
+	munmap(midx.map, midx.map_size);
+	midx.map = NULL;
+}
+
+static const char *pack_basename(struct packed_git *p)
+{
+	const char *slash = strrchr(p->pack_name, '/');
+	return slash ? slash + 1 : p->pack_name;
+}
+
+static int midx_pack_pos(const char *name)
+{
+	uint32_t lo = 0, hi = midx.nr_packs;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, midx.pack_names[mi]);
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -1;
+}
+
+void prepare_multi_pack_index(void)
+{
+	struct packed_git *p;
+
+	close_multi_pack_index();
+	if (!core_multi_pack_index || load_multi_pack_index())
+		return;
+	for (p = packed_git; p; p = p->next) {
+		int pos;
+		if (!p->pack_local)
+			continue;
+		pos = midx_pack_pos(pack_basename(p));
+		if (pos < 0)
+			continue;
+		midx.packs[pos] = p;
+		p->multi_pack_index = 1;
+	}
+	trace_printf("trace: multi-pack-index: %"PRIu32" packs, "
+		     "%"PRIu32" objects\n", midx.nr_packs, midx.nr_objects);
+}
+
+void close_multi_pack_index_pack(struct packed_git *p)
+{
+	uint32_t i;
+
+	if (!p->multi_pack_index)
+		return;
+	for (i = 0; i < midx.nr_packs; i++)
+		if (midx.packs[i] == p)
+			midx.packs[i] = NULL;
+	p->multi_pack_index = 0;
+}
+
+static uint32_t record_word(uint32_t pos, int offset)
+{
+	const unsigned char *rec = midx.records + pos * MIDX_RECORD_SIZE;
+	return ntohl(*(const uint32_t *)(rec + offset));
+}
+
+static uint32_t record_pack(uint32_t pos)
+{
+	uint32_t pack = record_word(pos, 0);
+	if (midx.nr_packs <= pack)
+		die("multi-pack-index file %s is corrupt", midx.path);
+	return pack;
+}
+
+static off_t record_offset(uint32_t pos)
+{
+	uint64_t offset = record_word(pos, 4);
+	return (off_t)((offset << 32) | record_word(pos, 8));
+}
+
+int find_multi_pack_index_entry(const unsigned char *sha1,
+				struct pack_entry *e)
+{
+	uint32_t lo, hi;
+	int pos;
+
+	if (!midx.map)
+		return 0;
+	lo = sha1[0] ? ntohl(midx.fanout[sha1[0] - 1]) : 0;
+	hi = ntohl(midx.fanout[sha1[0]]);
+	pos = sha1_entry_pos(midx.oids, 20, 0, lo, hi, midx.nr_objects, sha1);
+	if (pos < 0)
+		return 0;
+	e->p = midx.packs[record_pack(pos)];
+	e->offset = record_offset(pos);
+	hashcpy(e->sha1, sha1);
+	return 1;
+}
+
+struct midx_entry {
+	const unsigned char *sha1;
+	uint32_t pack;
+	off_t offset;
+};
+
+struct midx_pack {
+	struct packed_git *p;
+	uint32_t order;
+};
+
+static struct midx_pack *packs;
+static int packs_nr, packs_alloc;
+
+static int midx_entry_cmp(const void *a_, const void *b_)
+{
+	const struct midx_entry *a = a_, *b = b_;
+	int cmp = hashcmp(a->sha1, b->sha1);
+
+	if (cmp)
+		return cmp;
+	/* prefer the pack that comes first in the list of packs */
+	return a->pack < b->pack ? -1 : a->pack > b->pack;
+}
+
+static int pack_name_cmp(const void *a_, const void *b_)
+{
+	const struct midx_pack *a = a_, *b = b_;
+	return strcmp(pack_basename(a->p), pack_basename(b->p));
+}
+
+int write_multi_pack_index(void)
+{
+	static struct lock_file lock;
+	struct sha1file *f;
+	struct midx_entry *entries;
+	struct packed_git *p;
+	uint32_t hdr[5], fanout[256], *pack_id, nr = 0, names_size = 0;
+	char *path;
+	int i, j, fd;
+
+	reprepare_packed_git();
+	for (p = packed_git; p; p = p->next) {
+		if (!p->pack_local)
+			continue;
+		if (open_pack_index(p))
+			return error("packfile %s index unavailable",
+				     p->pack_name);
+		ALLOC_GROW(packs, packs_nr + 1, packs_alloc);
+		packs[packs_nr].p = p;
+		packs[packs_nr].order = packs_nr;
+		packs_nr++;
+		nr += p->num_objects;
+	}
+
+	path = midx_file_name();
+	if (!packs_nr) {
+		if (unlink(path) && errno != ENOENT)
+			return error("unable to remove %s: %s", path,
+				     strerror(errno));
+		free(path);
+		return 0;
+	}
+
+	entries = xmalloc(nr * sizeof(*entries));
+	nr = 0;
+	for (i = 0; i < packs_nr; i++) {
+		uint32_t n;
+		p = packs[i].p;
+		for (n = 0; n < p->num_objects; n++) {
+			entries[nr].sha1 = nth_packed_object_sha1(p, n);
+			entries[nr].pack = i;
+			entries[nr].offset = nth_packed_object_offset(p, n);
+			nr++;
+		}
+	}
+	qsort(entries, nr, sizeof(*entries), midx_entry_cmp);
+	for (i = j = 0; i < nr; i++) {
+		if (j && !hashcmp(entries[j - 1].sha1, entries[i].sha1))
+			continue;
+		entries[j++] = entries[i];
+	}
+	nr = j;
+
+	/* the records name the packs by their position in sorted order */
+	qsort(packs, packs_nr, sizeof(*packs), pack_name_cmp);
+	pack_id = xmalloc(packs_nr * sizeof(*pack_id));
+	for (i = 0; i < packs_nr; i++) {
+		pack_id[packs[i].order] = i;
+		names_size += strlen(pack_basename(packs[i].p)) + 1;
+	}
+	names_size = (names_size + 3) & ~3;
+
+	memset(fanout, 0, sizeof(fanout));
+	for (i = 0; i < nr; i++)
+		fanout[entries[i].sha1[0]]++;
+	for (i = 1; i < 256; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0; i < 256; i++)
+		fanout[i] = htonl(fanout[i]);
+
+	fd = hold_lock_file_for_update(&lock, path, LOCK_DIE_ON_ERROR);
+	f = sha1fd(fd, lock.filename);
+
+	hdr[0] = htonl(MIDX_SIGNATURE);
+	hdr[1] = htonl(MIDX_VERSION);
+	hdr[2] = htonl(packs_nr);
+	hdr[3] = htonl(nr);
+	hdr[4] = htonl(names_size);
+	sha1write(f, hdr, sizeof(hdr));
+	for (i = 0; i < packs_nr; i++) {
+		const char *name = pack_basename(packs[i].p);
+		sha1write(f, (char *)name, strlen(name) + 1);
+		names_size -= strlen(name) + 1;
+	}
+	sha1write(f, "\0\0\0", names_size);
+	sha1write(f, fanout, sizeof(fanout));
+	for (i = 0; i < nr; i++)
+		sha1write(f, (unsigned char *)entries[i].sha1, 20);
+	for (i = 0; i < nr; i++) {
+		uint64_t offset = entries[i].offset;
+		uint32_t word[3];
+		word[0] = htonl(pack_id[entries[i].pack]);
+		word[1] = htonl((uint32_t)(offset >> 32));
+		word[2] = htonl((uint32_t)offset);
+		sha1write(f, word, sizeof(word));
+	}
+	sha1close(f, NULL, CSUM_FSYNC);
+	lock.fd = -1;	/* closed by sha1close() */
+	if (commit_lock_file(&lock))
+		return error("unable to write %s", path);
+
+	free(pack_id);
+	free(entries);
+	free(packs);
+	packs = NULL;
+	packs_nr = packs_alloc = 0;
+	free(path);
+	return 0;
+}
+
+int verify_multi_pack_index(void)
+{
+	unsigned char sha1[20];
+	git_SHA_CTX ctx;
+	uint32_t pos;
+	int errors = 0;
+
+	prepare_packed_git();
+	if (!midx.map) {
+		/* only an error if corrupt */
+		return core_multi_pack_index && file_exists(midx.path);
+	}
+	git_SHA1_Init(&ctx);
+	git_SHA1_Update(&ctx, midx.map, midx.map_size - 20);
+	git_SHA1_Final(sha1, &ctx);
+	if (hashcmp(sha1, midx.map + midx.map_size - 20))
+		return error("multi-pack-index file %s has a bad checksum",
+			     midx.path);
+
+	for (pos = 0; pos < midx.nr_packs; pos++) {
+		if (pos && strcmp(midx.pack_names[pos - 1],
+				  midx.pack_names[pos]) >= 0)
+			errors += !!error("multi-pack-index pack names are "
+					  "not sorted at %s",
+					  midx.pack_names[pos]);
+		if (!midx.packs[pos])
+			errors += !!error("multi-pack-index names a missing "
+					  "pack %s", midx.pack_names[pos]);
+	}
+	for (pos = 0; pos < midx.nr_objects; pos++) {
+		const unsigned char *oid = midx.oids + pos * 20;
+		struct packed_git *p = midx.packs[record_pack(pos)];
+
+		if (pos && hashcmp(oid - 20, oid) >= 0)
+			errors += !!error("multi-pack-index is not sorted at %s",
+					  sha1_to_hex(oid));
+		if (p && find_pack_entry_one(oid, p) != record_offset(pos))
+			errors += !!error("multi-pack-index has the wrong "
+					  "offset for %s", sha1_to_hex(oid));
+	}
+	return errors;
+}
@@ -0,0 +1,41 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+/*
+ * The multi-pack index "$GIT_OBJECT_DIRECTORY/pack/multi-pack-index"
+ * maps the name of every object in the local packs to the pack that
+ * holds it and its offset there, so that finding an object takes one
+ * binary search however many packs there are.
+ */
+#define MIDX_SIGNATURE 0x4d494458	/* "MIDX" */
+#define MIDX_VERSION 1
+
+/*
+ * (Re)read the multi-pack index and mark the packs it covers; called
+ * by prepare_packed_git() once the list of packs is known.
+ */
+extern void prepare_multi_pack_index(void);
+
+/* Forget about a pack that is being removed from the list of packs */
+extern void close_multi_pack_index_pack(struct packed_git *p);
+
+/*
+ * Look up an object in the multi-pack index.  Returns 1 when it is
+ * there, and fills e; e->p is NULL when its pack has gone away.
+ */
+extern int find_multi_pack_index_entry(const unsigned char *sha1,
+				       struct pack_entry *e);
+
+/*
+ * Write a multi-pack index covering all local packs; returns 0 on
+ * success.
+ */
+extern int write_multi_pack_index(void);
+
+/*
+ * Check the checksum of the multi-pack index and compare its entries
+ * with the pack indexes; returns the number of problems found.
+ */
+extern int verify_multi_pack_index(void);
+
+#endif
@@ -32,21 +32,65 @@ static unsigned int hash_name(const char *name, int namelen)
 	return hash;
 }
 
+/*
+ * The table is open-addressed: every hashed entry has a slot of its
+ * own, which keeps the full hash of its name, so that a probe only
+ * has to look at the entry itself when the hashes match.  The size is
+ * a power of two, and the table is kept at most half full.
+ */
+struct name_hash_slot {
+	unsigned int hash;
+	struct cache_entry *ce;
+};
+
+static void insert_slot(struct name_hash *table, unsigned int hash,
+			struct cache_entry *ce)
+{
+	unsigned int mask = table->size - 1, nr = hash & mask;
+
+	while (table->slot[nr].ce)
+		nr = (nr + 1) & mask;
+	table->slot[nr].hash = hash;
+	table->slot[nr].ce = ce;
+	table->nr++;
+}
+
+/*
+ * Make room for "nr" entries.  Entries removed from the index are
+ * dropped on the way, and get added again if they come back.
+ */
+static void grow_name_hash(struct name_hash *table, unsigned int nr)
+{
+	struct name_hash_slot *old = table->slot;
+	unsigned int i, old_size = table->size, size = 64;
+
+	while (size < 2 * nr)
+		size <<= 1;
+	table->slot = xcalloc(size, sizeof(*table->slot));
+	table->size = size;
+	table->nr = 0;
+	for (i = 0; i < old_size; i++) {
+		struct cache_entry *ce = old[i].ce;
+		if (!ce)
+			continue;
+		if (ce->ce_flags & CE_UNHASHED)
+			ce->ce_flags &= ~CE_HASHED;
+		else
+			insert_slot(table, old[i].hash, ce);
+	}
+	free(old);
+}
+
 static void hash_index_entry(struct index_state *istate, struct cache_entry *ce)
 {
-	void **pos;
-	unsigned int hash;
+	struct name_hash *table = &istate->name_hash;
 
 	if (ce->ce_flags & CE_HASHED)
 		return;
+	if (2 * (table->nr + 1) > table->size)
+		grow_name_hash(table, table->nr + 1);
 	ce->ce_flags |= CE_HASHED;
-	ce->next = NULL;
-	hash = hash_name(ce->name, ce_namelen(ce));
-	pos = insert_hash(hash, ce, &istate->name_hash);
-	if (pos) {
-		ce->next = *pos;
-		*pos = ce;
-	}
+	insert_slot(table, hash_name(ce->name, ce_namelen(ce)), ce);
 }
 
 static void lazy_init_name_hash(struct index_state *istate)
@@ -55,11 +99,19 @@ static void lazy_init_name_hash(struct index_state *istate)
 
 	if (istate->name_hash_initialized)
 		return;
+	grow_name_hash(&istate->name_hash, istate->cache_nr);
 	for (nr = 0; nr < istate->cache_nr; nr++)
 		hash_index_entry(istate, istate->cache[nr]);
 	istate->name_hash_initialized = 1;
 }
 
+void free_name_hash(struct index_state *istate)
+{
+	free(istate->name_hash.slot);
+	memset(&istate->name_hash, 0, sizeof(istate->name_hash));
+	istate->name_hash_initialized = 0;
+}
+
 void add_name_hash(struct index_state *istate, struct cache_entry *ce)
 {
 	ce->ce_flags &= ~CE_UNHASHED;
@@ -103,17 +155,19 @@ static int same_name(const struct cache_entry *ce, const char *name, int namelen
 struct cache_entry *index_name_exists(struct index_state *istate, const char *name, int namelen, int icase)
 {
 	unsigned int hash = hash_name(name, namelen);
-	struct cache_entry *ce;
+	const struct name_hash *table = &istate->name_hash;
+	unsigned int mask, nr;
 
 	lazy_init_name_hash(istate);
-	ce = lookup_hash(hash, &istate->name_hash);
-
-	while (ce) {
-		if (!(ce->ce_flags & CE_UNHASHED)) {
-			if (same_name(ce, name, namelen, icase))
-				return ce;
-		}
-		ce = ce->next;
+	mask = table->size - 1;
+	for (nr = hash & mask; table->slot[nr].ce; nr = (nr + 1) & mask) {
+		struct cache_entry *ce = table->slot[nr].ce;
+
+		if (table->slot[nr].hash != hash ||
+		    (ce->ce_flags & CE_UNHASHED))
+			continue;
+		if (same_name(ce, name, namelen, icase))
+			return ce;
 	}
 	return NULL;
 }
@@ -0,0 +1,682 @@
+#include "cache.h"
+#include "commit.h"
+#include "tag.h"
+#include "tree.h"
+#include "tree-walk.h"
+#include "diff.h"
+#include "revision.h"
+#include "refs.h"
+#include "decorate.h"
+#include "csum-file.h"
+#include "pack-revindex.h"
+#include "pack-bitmap.h"
+
+/*
+ * The bitmap file is laid out as follows (all numbers in network
+ * byte order):
+ *
+ *  - a header: signature, version, the number of objects in the
+ *    pack, the number of commit bitmaps and the SHA-1 of the pack;
+ *
+ *  - four bitmaps telling which objects are commits, trees, blobs
+ *    and tags;
+ *
+ *  - the commit bitmaps, each one the 20-byte object name of the
+ *    commit followed by the bitmap itself;
+ *
+ *  - the name hash of every object of the pack, in pack order, as
+ *    pack-objects would compute it from the path of the object when
+ *    walking; they let a pack made from the bitmaps still sort its
+ *    delta candidates by path;
+ *
+ *  - the SHA-1 checksum of all of the above.
+ *
+ * Every bitmap is stored as a 32-bit word count followed by that
+ * many words of run-length compressed data.  Each run starts with a
+ * marker word whose top bit is the fill value, whose next 15 bits
+ * count the words filled with it, and whose low 16 bits count the
+ * literal words that follow the marker verbatim.
+ */
+#define BITMAP_MAX_FILL 0x7fff
+#define BITMAP_MAX_LITERAL 0xffff
+
+/*
+ * Besides every ref tip, store a bitmap for one commit out of this
+ * many, so that a walk from any commit soon reaches a stored one.
+ */
+#define BITMAP_COMMIT_INTERVAL 100
+
+#define bitmap_test(bits, pos) ((bits)[(pos) / 32] & (1u << ((pos) % 32)))
+#define bitmap_set(bits, pos) ((bits)[(pos) / 32] |= (1u << ((pos) % 32)))
+
+struct stored_bitmap {
+	const uint32_t *data;	/* compressed, network byte order */
+	uint32_t nr;
+};
+
+/*
+ * State shared by the reader and the writer while filling a bitmap
+ * with everything reachable from some objects.
+ */
+struct bitmap_fill {
+	struct packed_git *pack;
+	uint32_t *bits;
+	const uint32_t *seen;	/* everything set here is excluded */
+	uint32_t *types[4];	/* commits, trees, blobs, tags */
+	struct decoration *stored;
+};
+
+static uint32_t bitmap_words(struct packed_git *p)
+{
+	return (p->num_objects + 31) / 32;
+}
+
+static uint32_t *compress_bitmap(const uint32_t *raw, uint32_t nr_words,
+				 uint32_t *nr_out)
+{
+	uint32_t *out = xmalloc(sizeof(*out) *
+				(nr_words + nr_words / BITMAP_MAX_LITERAL + 2));
+	uint32_t i = 0, nr = 0;
+
+	while (i < nr_words) {
+		uint32_t fill = 0, run = 0, literal = 0, marker;
+
+		if (!raw[i] || !~raw[i]) {
+			uint32_t word = raw[i];
+			fill = !!word;
+			while (i < nr_words && raw[i] == word &&
+			       run < BITMAP_MAX_FILL) {
+				run++;
+				i++;
+			}
+		}
+		marker = nr++;
+		while (i < nr_words && raw[i] && ~raw[i] &&
+		       literal < BITMAP_MAX_LITERAL) {
+			out[nr++] = htonl(raw[i++]);
+			literal++;
+		}
+		out[marker] = htonl((fill << 31) | (run << 16) | literal);
+	}
+	*nr_out = nr;
+	return out;
+}
+
+static int or_compressed_bitmap(uint32_t *raw, uint32_t nr_words,
+				const uint32_t *data, uint32_t nr)
+{
+	uint32_t i = 0, pos = 0;
+
+	while (i < nr) {
+		uint32_t marker = ntohl(data[i++]);
+		uint32_t run = (marker >> 16) & BITMAP_MAX_FILL;
+		uint32_t literal = marker & BITMAP_MAX_LITERAL;
+
+		if (nr_words - pos < run || nr - i < literal ||
+		    nr_words - pos - run < literal)
+			return error("corrupt bitmap data");
+		if (marker >> 31)
+			memset(raw + pos, 0xff, run * sizeof(*raw));
+		pos += run;
+		while (literal--)
+			raw[pos++] |= ntohl(data[i++]);
+	}
+	return 0;
+}
+
+static int object_pos(struct packed_git *p, const unsigned char *sha1)
+{
+	off_t offset = find_pack_entry_one(sha1, p);
+
+	if (!offset)
+		return -1;
+	return find_revindex_position(p, offset);
+}
+
+static int mark_object(struct bitmap_fill *f, const unsigned char *sha1,
+		       enum object_type type)
+{
+	int pos = object_pos(f->pack, sha1);
+
+	if (pos < 0)
+		return -1;
+	if (bitmap_test(f->bits, pos) || (f->seen && bitmap_test(f->seen, pos)))
+		return 1;
+	bitmap_set(f->bits, pos);
+	if (OBJ_COMMIT <= type && type <= OBJ_TAG)
+		bitmap_set(f->types[type - OBJ_COMMIT], pos);
+	return 0;
+}
+
+static int fill_tree(struct bitmap_fill *f, const unsigned char *sha1)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	enum object_type type;
+	unsigned long size;
+	void *buf;
+	int ret = mark_object(f, sha1, OBJ_TREE);
+
+	if (ret)
+		return ret < 0 ? -1 : 0;
+	buf = read_sha1_file(sha1, &type, &size);
+	if (!buf || type != OBJ_TREE) {
+		free(buf);
+		return error("unable to read tree %s", sha1_to_hex(sha1));
+	}
+	init_tree_desc(&desc, buf, size);
+	while (tree_entry(&desc, &entry)) {
+		if (S_ISGITLINK(entry.mode))
+			continue;
+		if (S_ISDIR(entry.mode))
+			ret = fill_tree(f, entry.sha1);
+		else
+			ret = mark_object(f, entry.sha1, OBJ_BLOB);
+		if (ret < 0)
+			break;
+	}
+	free(buf);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Commits are walked first, taking in the stored bitmaps we come
+ * across, so that the trees they already cover are not opened again
+ * when the trees of the remaining commits are walked afterwards.
+ */
+static int fill_commit(struct bitmap_fill *f, struct commit *tip)
+{
+	struct commit_list *stack = NULL, *found = NULL;
+	struct commit *commit;
+	int ret = 0;
+
+	commit_list_insert(tip, &stack);
+	while (stack) {
+		struct stored_bitmap *stored;
+		struct commit_list *parents;
+
+		commit = pop_commit(&stack);
+		ret = mark_object(f, commit->object.sha1, OBJ_COMMIT);
+		if (ret < 0)
+			break;
+		if (ret) {
+			ret = 0;
+			continue;
+		}
+		stored = lookup_decoration(f->stored, &commit->object);
+		if (stored) {
+			ret = or_compressed_bitmap(f->bits, bitmap_words(f->pack),
+						   stored->data, stored->nr);
+			if (ret < 0)
+				break;
+			continue;
+		}
+		if (parse_commit(commit)) {
+			ret = -1;
+			break;
+		}
+		commit_list_insert(commit, &found);
+		for (parents = commit->parents; parents; parents = parents->next)
+			commit_list_insert(parents->item, &stack);
+	}
+	free_commit_list(stack);
+
+	while (found) {
+		commit = pop_commit(&found);
+		if (!ret && fill_tree(f, commit->tree->object.sha1) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+static int fill_object(struct bitmap_fill *f, struct object *obj)
+{
+	while (obj->type == OBJ_TAG) {
+		struct tag *tag = (struct tag *)obj;
+		if (mark_object(f, obj->sha1, OBJ_TAG) < 0)
+			return -1;
+		if (parse_tag(tag) || !tag->tagged)
+			return -1;
+		obj = tag->tagged;
+		if (!obj->parsed && !parse_object(obj->sha1))
+			return -1;
+	}
+	switch (obj->type) {
+	case OBJ_COMMIT:
+		return fill_commit(f, (struct commit *)obj);
+	case OBJ_TREE:
+		return fill_tree(f, obj->sha1);
+	case OBJ_BLOB:
+		return mark_object(f, obj->sha1, OBJ_BLOB) < 0 ? -1 : 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Reading side.
+ */
+static struct bitmap_index {
+	struct packed_git *pack;
+	void *map;
+	size_t map_size;
+	uint32_t *types[4];
+	struct decoration stored;
+	const uint32_t *name_hashes;	/* network byte order */
+	uint32_t *result;
+} bitmap_git;
+
+static int load_bitmap_stream(const unsigned char **ptr,
+			      const unsigned char *end,
+			      struct stored_bitmap *bitmap)
+{
+	if (end - *ptr < 4)
+		return -1;
+	bitmap->nr = ntohl(*(uint32_t *)*ptr);
+	*ptr += 4;
+	if ((end - *ptr) / 4 < bitmap->nr)
+		return -1;
+	bitmap->data = (const uint32_t *)*ptr;
+	*ptr += 4 * bitmap->nr;
+	return 0;
+}
+
+static int open_pack_bitmap_1(struct packed_git *p)
+{
+	const unsigned char *ptr, *end;
+	char *bitmap_name;
+	struct stat st;
+	uint32_t nr_entries, nr_words, i;
+	int fd;
+
+	if (open_pack_index(p))
+		return -1;
+	bitmap_name = xstrdup(p->pack_name);
+	strcpy(bitmap_name + strlen(bitmap_name) - strlen(".pack"), ".bitmap");
+	fd = open(bitmap_name, O_RDONLY);
+	free(bitmap_name);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < 36 + 20) {
+		close(fd);
+		return -1;
+	}
+	bitmap_git.map_size = xsize_t(st.st_size);
+	bitmap_git.map = xmmap(NULL, bitmap_git.map_size, PROT_READ,
+			       MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	ptr = bitmap_git.map;
+	end = ptr + bitmap_git.map_size - 20;
+	if (ntohl(((uint32_t *)ptr)[0]) == BITMAP_SIGNATURE &&
+	    ntohl(((uint32_t *)ptr)[1]) != BITMAP_VERSION) {
+		/* written by another version; repacking replaces it */
+		munmap(bitmap_git.map, bitmap_git.map_size);
+		bitmap_git.map = NULL;
+		return -1;
+	}
+	if (ntohl(((uint32_t *)ptr)[0]) != BITMAP_SIGNATURE ||
+	    ntohl(((uint32_t *)ptr)[2]) != p->num_objects ||
+	    hashcmp(ptr + 16, p->sha1))
+		goto bad;
+	nr_entries = ntohl(((uint32_t *)ptr)[3]);
+	ptr += 36;
+
+	bitmap_git.pack = p;
+	nr_words = bitmap_words(p);
+	for (i = 0; i < 4; i++) {
+		struct stored_bitmap type_bitmap;
+		bitmap_git.types[i] = xcalloc(nr_words, sizeof(uint32_t));
+		if (load_bitmap_stream(&ptr, end, &type_bitmap) ||
+		    or_compressed_bitmap(bitmap_git.types[i], nr_words,
+					 type_bitmap.data, type_bitmap.nr))
+			goto bad;
+	}
+	for (i = 0; i < nr_entries; i++) {
+		struct stored_bitmap *stored = xmalloc(sizeof(*stored));
+		struct commit *commit;
+
+		if (end - ptr < 20 ||
+		    !(commit = lookup_commit(ptr)) ||
+		    (ptr += 20, load_bitmap_stream(&ptr, end, stored))) {
+			free(stored);
+			goto bad;
+		}
+		add_decoration(&bitmap_git.stored, &commit->object, stored);
+	}
+	if (end - ptr != 4 * (off_t)p->num_objects)
+		goto bad;
+	bitmap_git.name_hashes = (const uint32_t *)ptr;
+	return 0;
+
+bad:
+	error("bitmap index for %s is corrupt", p->pack_name);
+	munmap(bitmap_git.map, bitmap_git.map_size);
+	for (i = 0; i < 4; i++) {
+		free(bitmap_git.types[i]);
+		bitmap_git.types[i] = NULL;
+	}
+	bitmap_git.map = NULL;
+	bitmap_git.pack = NULL;
+	return -1;
+}
+
+static int open_pack_bitmap(void)
+{
+	struct packed_git *p;
+
+	if (bitmap_git.pack)
+		return 0;
+	prepare_packed_git();
+	for (p = packed_git; p; p = p->next) {
+		if (!p->pack_local)
+			continue;
+		if (!open_pack_bitmap_1(p))
+			return 0;
+	}
+	return -1;
+}
+
+static int can_use_bitmap(struct rev_info *revs)
+{
+	return (revs->tree_objects && revs->blob_objects && revs->tag_objects &&
+		!revs->prune_data && !revs->unpacked &&
+		!revs->num_ignore_packed && !revs->reflog_info &&
+		revs->max_count < 0 && revs->skip_count <= 0 &&
+		revs->max_age == -1 && revs->min_age == -1 &&
+		!revs->no_merges && !revs->first_parent_only);
+}
+
+int prepare_bitmap_walk(struct rev_info *revs)
+{
+	struct bitmap_fill f;
+	uint32_t *haves, nr_words, i;
+	int ret = 0;
+
+	if (!revs->pending.nr || !can_use_bitmap(revs))
+		return -1;
+	/* grafts and shallow boundaries change what is reachable */
+	if (has_commit_grafts())
+		return -1;
+	if (open_pack_bitmap())
+		return -1;
+
+	nr_words = bitmap_words(bitmap_git.pack);
+	haves = xcalloc(nr_words, sizeof(uint32_t));
+	memset(&f, 0, sizeof(f));
+	f.pack = bitmap_git.pack;
+	memcpy(f.types, bitmap_git.types, sizeof(f.types));
+	f.stored = &bitmap_git.stored;
+
+	f.bits = haves;
+	for (i = 0; !ret && i < revs->pending.nr; i++) {
+		struct object *obj = revs->pending.objects[i].item;
+		if (obj->flags & UNINTERESTING)
+			ret = fill_object(&f, obj);
+	}
+
+	f.bits = xcalloc(nr_words, sizeof(uint32_t));
+	f.seen = haves;
+	for (i = 0; !ret && i < revs->pending.nr; i++) {
+		struct object *obj = revs->pending.objects[i].item;
+		if (!(obj->flags & UNINTERESTING))
+			ret = fill_object(&f, obj);
+	}
+
+	if (ret) {
+		trace_printf("trace: bitmap index not usable for this walk\n");
+		free(haves);
+		free(f.bits);
+		return -1;
+	}
+	for (i = 0; i < nr_words; i++)
+		f.bits[i] &= ~haves[i];
+	free(haves);
+	bitmap_git.result = f.bits;
+	trace_printf("trace: using bitmap index of %s\n",
+		     bitmap_git.pack->pack_name);
+	return 0;
+}
+
+void traverse_bitmap_commit_list(show_reachable_fn show)
+{
+	struct packed_git *p = bitmap_git.pack;
+	uint32_t *result = bitmap_git.result;
+	uint32_t nr_words = bitmap_words(p), i, pos;
+
+	for (i = 0; i < nr_words; i++) {
+		if (!result[i])
+			continue;
+		for (pos = i * 32; pos < (i + 1) * 32; pos++) {
+			const unsigned char *sha1;
+			enum object_type type;
+			unsigned long size;
+			int t;
+
+			if (!bitmap_test(result, pos))
+				continue;
+			sha1 = nth_packed_object_sha1(p, pack_pos_to_index(p, pos));
+			for (t = 0; t < 4; t++)
+				if (bitmap_test(bitmap_git.types[t], pos))
+					break;
+			if (t < 4)
+				type = OBJ_COMMIT + t;
+			else
+				type = sha1_object_info(sha1, &size);
+			show(sha1, type, ntohl(bitmap_git.name_hashes[pos]),
+			     p, pack_pos_to_offset(p, pos));
+		}
+	}
+	free(result);
+	bitmap_git.result = NULL;
+}
+
+/*
+ * Writing side.
+ */
+struct bitmap_commit {
+	struct commit *commit;
+	int pos;
+	struct stored_bitmap bitmap;
+};
+
+static struct bitmap_commit *all_commits;
+static int all_commits_nr, all_commits_alloc;
+static struct packed_git *writer_pack;
+static uint32_t *writer_types[4];
+static uint32_t *writer_commits_seen;
+static int writer_failed;
+
+static void record_bitmap_commit(struct commit *commit, int pos)
+{
+	ALLOC_GROW(all_commits, all_commits_nr + 1, all_commits_alloc);
+	memset(all_commits + all_commits_nr, 0, sizeof(*all_commits));
+	all_commits[all_commits_nr].commit = commit;
+	all_commits[all_commits_nr].pos = pos;
+	all_commits_nr++;
+}
+
+static void collect_commits(struct commit *tip)
+{
+	struct commit_list *stack = NULL;
+
+	commit_list_insert(tip, &stack);
+	while (stack && !writer_failed) {
+		struct commit *commit = pop_commit(&stack);
+		struct commit_list *parents;
+		int pos = object_pos(writer_pack, commit->object.sha1);
+
+		if (pos < 0) {
+			warning("not writing bitmap index: commit %s is not "
+				"in the pack", sha1_to_hex(commit->object.sha1));
+			writer_failed = 1;
+			break;
+		}
+		if (bitmap_test(writer_commits_seen, pos))
+			continue;
+		bitmap_set(writer_commits_seen, pos);
+		if (parse_commit(commit)) {
+			writer_failed = 1;
+			break;
+		}
+		record_bitmap_commit(commit, pos);
+		for (parents = commit->parents; parents; parents = parents->next)
+			commit_list_insert(parents->item, &stack);
+	}
+	free_commit_list(stack);
+}
+
+static struct decoration writer_tips = { "bitmap tip" };
+
+static int collect_ref_tip(const char *path, const unsigned char *sha1,
+			   int flag, void *cb_data)
+{
+	struct object *obj = parse_object(sha1);
+
+	while (obj && obj->type == OBJ_TAG) {
+		int pos = object_pos(writer_pack, obj->sha1);
+		if (0 <= pos)
+			bitmap_set(writer_types[OBJ_TAG - OBJ_COMMIT], pos);
+		obj = ((struct tag *)obj)->tagged;
+		if (obj)
+			obj = parse_object(obj->sha1);
+	}
+	if (!obj || obj->type != OBJ_COMMIT)
+		return 0;
+	add_decoration(&writer_tips, obj, obj);
+	collect_commits((struct commit *)obj);
+	return 0;
+}
+
+static int pos_cmp(const void *a_, const void *b_)
+{
+	const struct bitmap_commit *a = a_;
+	const struct bitmap_commit *b = b_;
+	return a->pos - b->pos;
+}
+
+static void write_stream(struct sha1file *f, const uint32_t *data, uint32_t nr)
+{
+	uint32_t nr_be = htonl(nr);
+	sha1write(f, &nr_be, 4);
+	sha1write(f, (void *)data, nr * 4);
+}
+
+static void free_writer_state(void)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		free(writer_types[i]);
+		writer_types[i] = NULL;
+	}
+	for (i = 0; i < all_commits_nr; i++)
+		free((void *)all_commits[i].bitmap.data);
+	free(all_commits);
+	all_commits = NULL;
+	all_commits_nr = all_commits_alloc = 0;
+}
+
+char *write_pack_bitmap(const char *idx_name, bitmap_name_hash_fn name_hash)
+{
+	struct packed_git *p;
+	struct bitmap_fill fill;
+	struct decoration stored = { "stored bitmap" };
+	struct sha1file *f;
+	uint32_t nr_words, hdr[4], nr_selected = 0, pos;
+	char tmpname[PATH_MAX];
+	int i, fd;
+
+	p = add_packed_git(idx_name, strlen(idx_name), 1);
+	if (!p || open_pack_index(p)) {
+		error("unable to open pack index %s", idx_name);
+		return NULL;
+	}
+	if (has_commit_grafts()) {
+		warning("not writing bitmap index: repository has grafts");
+		return NULL;
+	}
+
+	writer_pack = p;
+	writer_failed = 0;
+	nr_words = bitmap_words(p);
+	for (i = 0; i < 4; i++)
+		writer_types[i] = xcalloc(nr_words, sizeof(uint32_t));
+	writer_commits_seen = xcalloc(nr_words, sizeof(uint32_t));
+	for_each_ref(collect_ref_tip, NULL);
+	free(writer_commits_seen);
+	if (writer_failed) {
+		free_writer_state();
+		return NULL;
+	}
+
+	/*
+	 * Pick the commits to store, and compute their bitmaps oldest
+	 * first so that the bitmaps of their descendants can reuse them.
+	 */
+	qsort(all_commits, all_commits_nr, sizeof(*all_commits), pos_cmp);
+	memset(&fill, 0, sizeof(fill));
+	fill.pack = p;
+	memcpy(fill.types, writer_types, sizeof(fill.types));
+	fill.stored = &stored;
+	fill.bits = xmalloc(nr_words * sizeof(uint32_t));
+	for (i = all_commits_nr - 1; i >= 0; i--) {
+		struct bitmap_commit *bc = all_commits + i;
+		uint32_t *data;
+
+		if (i % BITMAP_COMMIT_INTERVAL &&
+		    !lookup_decoration(&writer_tips, &bc->commit->object))
+			continue;
+		memset(fill.bits, 0, nr_words * sizeof(uint32_t));
+		if (fill_commit(&fill, bc->commit) < 0) {
+			warning("not writing bitmap index: objects reachable "
+				"from %s are not in the pack",
+				sha1_to_hex(bc->commit->object.sha1));
+			free(fill.bits);
+			free_writer_state();
+			return NULL;
+		}
+		data = compress_bitmap(fill.bits, nr_words, &bc->bitmap.nr);
+		bc->bitmap.data = data;
+		add_decoration(&stored, &bc->commit->object, &bc->bitmap);
+		nr_selected++;
+	}
+	free(fill.bits);
+
+	snprintf(tmpname, sizeof(tmpname),
+		 "%s/pack/tmp_bitmap_XXXXXX", get_object_directory());
+	fd = xmkstemp(tmpname);
+	f = sha1fd(fd, tmpname);
+
+	hdr[0] = htonl(BITMAP_SIGNATURE);
+	hdr[1] = htonl(BITMAP_VERSION);
+	hdr[2] = htonl(p->num_objects);
+	hdr[3] = htonl(nr_selected);
+	sha1write(f, hdr, sizeof(hdr));
+	sha1write(f, p->sha1, 20);
+	for (i = 0; i < 4; i++) {
+		uint32_t nr, *data;
+		data = compress_bitmap(writer_types[i], nr_words, &nr);
+		write_stream(f, data, nr);
+		free(data);
+	}
+	for (i = all_commits_nr - 1; i >= 0; i--) {
+		struct bitmap_commit *bc = all_commits + i;
+		if (!bc->bitmap.data)
+			continue;
+		sha1write(f, bc->commit->object.sha1, 20);
+		write_stream(f, bc->bitmap.data, bc->bitmap.nr);
+	}
+	for (pos = 0; pos < p->num_objects; pos++) {
+		const unsigned char *sha1;
+		uint32_t hash;
+
+		sha1 = nth_packed_object_sha1(p, pack_pos_to_index(p, pos));
+		hash = htonl(name_hash(sha1));
+		sha1write(f, &hash, 4);
+	}
+	sha1close(f, NULL, CSUM_FSYNC);
+
+	free_writer_state();
+	return xstrdup(tmpname);
+}
@@ -0,0 +1,43 @@
+#ifndef PACK_BITMAP_H
+#define PACK_BITMAP_H
+
+/*
+ * Reachability bitmaps stored next to a pack as "pack-<sha1>.bitmap".
+ * For a selection of commits they record which objects of the pack
+ * are reachable from that commit, one bit per object in the pack
+ * order of pack-revindex.c.
+ */
+#define BITMAP_SIGNATURE 0x4249544d	/* "BITM" */
+#define BITMAP_VERSION 2
+
+struct rev_info;
+
+/*
+ * name_hash is the hash pack-objects groups delta candidates by,
+ * of the path the object was first found at.
+ */
+typedef void (*show_reachable_fn)(const unsigned char *sha1,
+				  enum object_type type,
+				  uint32_t name_hash,
+				  struct packed_git *found_pack,
+				  off_t found_offset);
+typedef uint32_t (*bitmap_name_hash_fn)(const unsigned char *sha1);
+
+/*
+ * Compute the objects to show for the pending objects of revs from
+ * the bitmap index; returns -1 (and leaves revs untouched) when no
+ * usable bitmap exists or the request cannot be answered from it.
+ */
+extern int prepare_bitmap_walk(struct rev_info *revs);
+extern void traverse_bitmap_commit_list(show_reachable_fn show);
+
+/*
+ * Write a bitmap index for the pack whose index is idx_name into a
+ * temporary file, and return its name; NULL when the pack does not
+ * hold everything reachable from the refs.  The name hash of each
+ * object in the pack is taken from name_hash and stored with it.
+ */
+extern char *write_pack_bitmap(const char *idx_name,
+			       bitmap_name_hash_fn name_hash);
+
+#endif
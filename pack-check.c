@@ -1,6 +1,11 @@
 #include "cache.h"
 #include "pack.h"
 #include "pack-revindex.h"
+#include "progress.h"
+
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 struct idx_entry
 {
@@ -20,10 +25,16 @@ static int compare_entries(const void *e1, const void *e2)
 	return 0;
 }
 
+uint32_t packed_object_crc(struct packed_git *p, unsigned int nr)
+{
+	const uint32_t *index_crc = p->index_data;
+	index_crc += 2 + 256 + p->num_objects * (20/4) + nr;
+	return ntohl(*index_crc);
+}
+
 int check_pack_crc(struct packed_git *p, struct pack_window **w_curs,
 		   off_t offset, off_t len, unsigned int nr)
 {
-	const uint32_t *index_crc;
 	uint32_t data_crc = crc32(0, Z_NULL, 0);
 
 	do {
@@ -36,14 +47,162 @@ int check_pack_crc(struct packed_git *p, struct pack_window **w_curs,
 		len -= avail;
 	} while (len);
 
-	index_crc = p->index_data;
-	index_crc += 2 + 256 + p->num_objects * (20/4) + nr;
+	return data_crc != packed_object_crc(p, nr);
+}
+
+/*
+ * The objects of a pack are checked in pack order, which is the order
+ * deltas usually follow their bases.  When several threads share the
+ * work, each one takes the next VERIFY_CHUNK objects at a time, so
+ * that most bases are still found in the delta base cache.
+ */
+#define VERIFY_CHUNK 64
+
+struct verify_state {
+	struct packed_git *p;
+	struct idx_entry *entries;
+	uint32_t nr_objects;
+	uint32_t next;
+	int err;
+	int stop;
+	struct progress *progress;
+	uint32_t done;
+	off_t bytes;
+};
+
+#ifndef NO_PTHREADS
+static int threads_active;
+
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define work_lock()		do { if (threads_active) pthread_mutex_lock(&work_mutex); } while (0)
+#define work_unlock()		do { if (threads_active) pthread_mutex_unlock(&work_mutex); } while (0)
+#else
+#define work_lock()
+#define work_unlock()
+#endif
+
+/* Another thread may set "stop" at any time; look at it under the lock */
+static int verify_stopped(struct verify_state *vs)
+{
+	int stop;
+
+	work_lock();
+	stop = vs->stop;
+	work_unlock();
+	return stop;
+}
+
+static void stop_verify(struct verify_state *vs)
+{
+	work_lock();
+	vs->stop = 1;
+	work_unlock();
+}
+
+static int verify_entries(struct verify_state *vs,
+			  struct pack_window **w_curs,
+			  uint32_t i, uint32_t end)
+{
+	struct packed_git *p = vs->p;
+	struct idx_entry *entries = vs->entries;
+	int err = 0;
+
+	for (; i < end && !verify_stopped(vs); i++) {
+		void *data;
+		enum object_type type;
+		unsigned long size;
 
-	return data_crc != ntohl(*index_crc);
+		if (p->index_version > 1) {
+			off_t offset = entries[i].offset;
+			off_t len = entries[i+1].offset - offset;
+			unsigned int nr = entries[i].nr;
+			if (check_pack_crc(p, w_curs, offset, len, nr))
+				err = error("index CRC mismatch for object %s "
+					    "from %s at offset %"PRIuMAX"",
+					    sha1_to_hex(entries[i].sha1),
+					    p->pack_name, (uintmax_t)offset);
+		}
+		data = unpack_entry(p, entries[i].offset, &type, &size);
+		if (!data) {
+			err = error("cannot unpack %s from %s at offset %"PRIuMAX"",
+				    sha1_to_hex(entries[i].sha1), p->pack_name,
+				    (uintmax_t)entries[i].offset);
+			stop_verify(vs);
+			break;
+		}
+		if (check_sha1_signature(entries[i].sha1, data, size, typename(type))) {
+			err = error("packed %s from %s is corrupt",
+				    sha1_to_hex(entries[i].sha1), p->pack_name);
+			free(data);
+			stop_verify(vs);
+			break;
+		}
+		free(data);
+	}
+	return err;
 }
 
+static void *verify_objects(void *data)
+{
+	struct verify_state *vs = data;
+	struct pack_window *w_curs = NULL;
+
+	for (;;) {
+		uint32_t i, end;
+		int err, stop;
+
+		work_lock();
+		i = vs->next;
+		end = vs->nr_objects - i < VERIFY_CHUNK ?
+			vs->nr_objects : i + VERIFY_CHUNK;
+		vs->next = end;
+		stop = vs->stop;
+		work_unlock();
+		if (i >= end || stop)
+			break;
+
+		err = verify_entries(vs, &w_curs, i, end);
+
+		work_lock();
+		vs->err |= err;
+		vs->done += end - i;
+		vs->bytes += vs->entries[end].offset - vs->entries[i].offset;
+		display_progress(vs->progress, vs->done);
+		display_throughput(vs->progress, vs->bytes);
+		work_unlock();
+	}
+	unuse_pack(&w_curs);
+	return NULL;
+}
+
+#ifndef NO_PTHREADS
+static void verify_objects_threaded(struct verify_state *vs, int nr_threads)
+{
+	pthread_t *threads = xcalloc(nr_threads, sizeof(*threads));
+	int i;
+
+	enable_threaded_object_reads();
+	threads_active = 1;
+	for (i = 0; i < nr_threads; i++) {
+		int ret = pthread_create(&threads[i], NULL,
+					 verify_objects, vs);
+		if (ret)
+			die("unable to create thread: %s", strerror(ret));
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	threads_active = 0;
+	disable_threaded_object_reads();
+	free(threads);
+}
+#endif
+
 static int verify_packfile(struct packed_git *p,
-		struct pack_window **w_curs)
+		struct pack_window **w_curs,
+		int nr_threads,
+		struct progress *progress,
+		uint32_t base_count,
+		off_t base_bytes)
 {
 	off_t index_size = p->index_size;
 	const unsigned char *index_base = p->index_data;
@@ -53,6 +212,7 @@ static int verify_packfile(struct packed_git *p,
 	uint32_t nr_objects, i;
 	int err = 0;
 	struct idx_entry *entries;
+	struct verify_state vs;
 
 	/* Note that the pack header checks are actually performed by
 	 * use_pack when it first opens the pack file.  If anything
@@ -96,42 +256,27 @@ static int verify_packfile(struct packed_git *p,
 	}
 	qsort(entries, nr_objects, sizeof(*entries), compare_entries);
 
-	for (i = 0; i < nr_objects; i++) {
-		void *data;
-		enum object_type type;
-		unsigned long size;
-
-		if (p->index_version > 1) {
-			off_t offset = entries[i].offset;
-			off_t len = entries[i+1].offset - offset;
-			unsigned int nr = entries[i].nr;
-			if (check_pack_crc(p, w_curs, offset, len, nr))
-				err = error("index CRC mismatch for object %s "
-					    "from %s at offset %"PRIuMAX"",
-					    sha1_to_hex(entries[i].sha1),
-					    p->pack_name, (uintmax_t)offset);
-		}
-		data = unpack_entry(p, entries[i].offset, &type, &size);
-		if (!data) {
-			err = error("cannot unpack %s from %s at offset %"PRIuMAX"",
-				    sha1_to_hex(entries[i].sha1), p->pack_name,
-				    (uintmax_t)entries[i].offset);
-			break;
-		}
-		if (check_sha1_signature(entries[i].sha1, data, size, typename(type))) {
-			err = error("packed %s from %s is corrupt",
-				    sha1_to_hex(entries[i].sha1), p->pack_name);
-			free(data);
-			break;
-		}
-		free(data);
-	}
+	memset(&vs, 0, sizeof(vs));
+	vs.p = p;
+	vs.entries = entries;
+	vs.nr_objects = nr_objects;
+	vs.progress = progress;
+	vs.done = base_count;
+	vs.bytes = base_bytes;
+#ifndef NO_PTHREADS
+	if (nr_threads > 1 && nr_objects > VERIFY_CHUNK)
+		verify_objects_threaded(&vs, nr_threads);
+	else
+#endif
+		verify_objects(&vs);
 	free(entries);
 
-	return err;
+	return err | vs.err;
 }
 
-int verify_pack(struct packed_git *p)
+int verify_pack_threaded(struct packed_git *p, int nr_threads,
+			 struct progress *progress, uint32_t base_count,
+			 off_t base_bytes)
 {
 	off_t index_size;
 	const unsigned char *index_base;
@@ -154,8 +299,14 @@ int verify_pack(struct packed_git *p)
 			    p->pack_name);
 
 	/* Verify pack file */
-	err |= verify_packfile(p, &w_curs);
+	err |= verify_packfile(p, &w_curs, nr_threads, progress,
+			       base_count, base_bytes);
 	unuse_pack(&w_curs);
 
 	return err;
 }
+
+int verify_pack(struct packed_git *p)
+{
+	return verify_pack_threaded(p, 1, NULL, 0, 0);
+}
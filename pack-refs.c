@@ -96,8 +96,12 @@ int pack_refs(unsigned int flags)
 		die("unable to create ref-pack file structure (%s)",
 		    strerror(errno));
 
-	/* perhaps other traits later as well */
-	fprintf(cbdata.refs_file, "# pack-refs with: peeled \n");
+	/*
+	 * for_each_ref() gives the refs in order, which lets readers
+	 * look a single one up with a binary search; perhaps other
+	 * traits later as well.
+	 */
+	fprintf(cbdata.refs_file, "# pack-refs with: peeled sorted \n");
 
 	for_each_ref(handle_one_ref, &cbdata);
 	if (ferror(cbdata.refs_file))
@@ -1,4 +1,5 @@
 #include "cache.h"
+#include "pack.h"
 #include "pack-revindex.h"
 
 /*
@@ -14,11 +15,17 @@
  * ordered by offset, so if you know the offset of an object, next offset
  * is where its packed representation ends and the index_nr can be used to
  * get the object sha1 from the main index.
+ *
+ * When the pack comes with a ".rev" file, which lists the index_nr of
+ * every object in offset order, that file is mapped instead and the
+ * offsets are read from the pack index; nothing needs to be sorted.
  */
-
 struct pack_revindex {
 	struct packed_git *p;
 	struct revindex_entry *revindex;
+	const uint32_t *rev_data;	/* from the .rev file, if any */
+	void *rev_map;
+	size_t rev_map_size;
 };
 
 static struct pack_revindex *pack_revindex;
@@ -59,6 +66,39 @@ static void init_pack_revindex(void)
 	/* revindex elements are lazily initialized */
 }
 
+/*
+ * A pack that was not yet known when the table was built (e.g. one
+ * that was just written by pack-objects) gets a slot of its own; the
+ * table is grown, keeping the revindex already computed, when it
+ * becomes too full.
+ */
+static int add_pack_revindex(struct packed_git *p)
+{
+	int i, num, used = 0;
+
+	for (i = 0; i < pack_revindex_hashsz; i++)
+		if (pack_revindex[i].p)
+			used++;
+	if (pack_revindex_hashsz <= (used + 1) * 2) {
+		struct pack_revindex *old = pack_revindex;
+		int old_hashsz = pack_revindex_hashsz;
+
+		pack_revindex_hashsz = (used + 1) * 11;
+		pack_revindex = xcalloc(sizeof(*pack_revindex),
+					pack_revindex_hashsz);
+		for (i = 0; i < old_hashsz; i++) {
+			if (!old[i].p)
+				continue;
+			num = -1 - pack_revindex_ix(old[i].p);
+			pack_revindex[num] = old[i];
+		}
+		free(old);
+	}
+	num = -1 - pack_revindex_ix(p);
+	pack_revindex[num].p = p;
+	return num;
+}
+
 static int cmp_offset(const void *a_, const void *b_)
 {
 	const struct revindex_entry *a = a_;
@@ -66,6 +106,82 @@ static int cmp_offset(const void *a_, const void *b_)
 	return (a->offset < b->offset) ? -1 : (a->offset > b->offset) ? 1 : 0;
 }
 
+/*
+ * Map the ".rev" file that index-pack or pack-objects may have left
+ * next to the pack.  It must have been written for this very pack:
+ * the same name can be given to a pack holding the same objects in
+ * a different order, so its copy of the pack checksum has to match
+ * the one in the pack index.
+ */
+static int load_pack_revindex_file(struct pack_revindex *rix)
+{
+	struct packed_git *p = rix->p;
+	const struct pack_rev_header *hdr;
+	char *rev_name;
+	const uint32_t *data;
+	struct stat st;
+	size_t len, size;
+	uint32_t i;
+	void *map;
+	int fd;
+
+	if (!has_extension(p->pack_name, ".pack"))
+		return -1;
+	len = strlen(p->pack_name);
+	rev_name = xmalloc(len);
+	memcpy(rev_name, p->pack_name, len - 5);
+	strcpy(rev_name + len - 5, ".rev");
+	fd = open(rev_name, O_RDONLY);
+	if (fd < 0) {
+		free(rev_name);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		free(rev_name);
+		return -1;
+	}
+	size = xsize_t(st.st_size);
+	if (size != sizeof(*hdr) + 4 * p->num_objects + 40) {
+		close(fd);
+		error("reverse index file %s has wrong size", rev_name);
+		free(rev_name);
+		return -1;
+	}
+	map = xmmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	hdr = map;
+	if (hdr->rev_signature != htonl(PACK_REV_SIGNATURE) ||
+	    hdr->rev_version != htonl(PACK_REV_VERSION) ||
+	    hashcmp((unsigned char *)map + size - 40,
+		    (unsigned char *)p->index_data + p->index_size - 40)) {
+		munmap(map, size);
+		error("reverse index file %s does not match its pack",
+		      rev_name);
+		free(rev_name);
+		return -1;
+	}
+
+	/* The entries are used as index positions without more checks */
+	data = (const uint32_t *)(hdr + 1);
+	for (i = 0; i < p->num_objects; i++)
+		if (ntohl(data[i]) >= p->num_objects)
+			break;
+	if (i < p->num_objects) {
+		munmap(map, size);
+		error("reverse index file %s is corrupt", rev_name);
+		free(rev_name);
+		return -1;
+	}
+	free(rev_name);
+
+	rix->rev_map = map;
+	rix->rev_map_size = size;
+	rix->rev_data = data;
+	return 0;
+}
+
 /*
  * Ordered list of offsets of objects in the pack.
  */
@@ -74,8 +190,14 @@ static void create_pack_revindex(struct pack_revindex *rix)
 	struct packed_git *p = rix->p;
 	int num_ent = p->num_objects;
 	int i;
-	const char *index = p->index_data;
+	const char *index;
 
+	if (!p->index_data && open_pack_index(p))
+		die("cannot open index for %s", p->pack_name);
+	if (!load_pack_revindex_file(rix))
+		return;
+
+	index = p->index_data;
 	rix->revindex = xmalloc(sizeof(*rix->revindex) * (num_ent + 1));
 	index += 4 * 256;
 
@@ -111,46 +233,92 @@ static void create_pack_revindex(struct pack_revindex *rix)
 	qsort(rix->revindex, num_ent, sizeof(*rix->revindex), cmp_offset);
 }
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs)
+static struct pack_revindex *get_pack_revindex(struct packed_git *p)
 {
 	int num;
-	int lo, hi;
 	struct pack_revindex *rix;
-	struct revindex_entry *revindex;
 
 	if (!pack_revindex_hashsz)
 		init_pack_revindex();
+	if (!pack_revindex_hashsz) {
+		pack_revindex_hashsz = 11;
+		pack_revindex = xcalloc(sizeof(*pack_revindex),
+					pack_revindex_hashsz);
+	}
 	num = pack_revindex_ix(p);
 	if (num < 0)
-		die("internal error: pack revindex fubar");
+		num = add_pack_revindex(p);
 
 	rix = &pack_revindex[num];
-	if (!rix->revindex)
+	if (!rix->revindex && !rix->rev_data)
 		create_pack_revindex(rix);
-	revindex = rix->revindex;
+	return rix;
+}
+
+static off_t rix_pos_to_offset(struct pack_revindex *rix, uint32_t pos)
+{
+	struct packed_git *p = rix->p;
+
+	if (!rix->rev_data)
+		return rix->revindex[pos].offset;
+	if (pos == p->num_objects)
+		return p->pack_size - 20;
+	return nth_packed_object_offset(p, ntohl(rix->rev_data[pos]));
+}
+
+int find_revindex_position(struct packed_git *p, off_t ofs)
+{
+	int lo, hi;
+	struct pack_revindex *rix = get_pack_revindex(p);
 
 	lo = 0;
 	hi = p->num_objects + 1;
 	do {
 		int mi = (lo + hi) / 2;
-		if (revindex[mi].offset == ofs) {
-			return revindex + mi;
-		} else if (ofs < revindex[mi].offset)
+		off_t mi_ofs = rix_pos_to_offset(rix, mi);
+		if (mi_ofs == ofs) {
+			return mi;
+		} else if (ofs < mi_ofs)
 			hi = mi;
 		else
 			lo = mi + 1;
 	} while (lo < hi);
-	error("bad offset for revindex");
-	return NULL;
+	return -1;
+}
+
+int find_pack_revindex(struct packed_git *p, off_t ofs)
+{
+	int pos = find_revindex_position(p, ofs);
+
+	if (pos < 0)
+		error("bad offset for revindex");
+	return pos;
+}
+
+uint32_t pack_pos_to_index(struct packed_git *p, uint32_t pos)
+{
+	struct pack_revindex *rix = get_pack_revindex(p);
+
+	if (rix->rev_data)
+		return ntohl(rix->rev_data[pos]);
+	return rix->revindex[pos].nr;
+}
+
+off_t pack_pos_to_offset(struct packed_git *p, uint32_t pos)
+{
+	return rix_pos_to_offset(get_pack_revindex(p), pos);
 }
 
 void discard_revindex(void)
 {
 	if (pack_revindex_hashsz) {
 		int i;
-		for (i = 0; i < pack_revindex_hashsz; i++)
-			if (pack_revindex[i].revindex)
-				free(pack_revindex[i].revindex);
+		for (i = 0; i < pack_revindex_hashsz; i++) {
+			free(pack_revindex[i].revindex);
+			if (pack_revindex[i].rev_map)
+				munmap(pack_revindex[i].rev_map,
+				       pack_revindex[i].rev_map_size);
+		}
 		free(pack_revindex);
 		pack_revindex_hashsz = 0;
 	}
@@ -6,7 +6,20 @@ struct revindex_entry {
 	unsigned int nr;
 };
 
-struct revindex_entry *find_pack_revindex(struct packed_git *p, off_t ofs);
+/*
+ * The reverse index numbers the objects of a pack in the order they
+ * are stored there.  Position p->num_objects stands for the trailer
+ * that follows the last object, so that the object at pos always
+ * ends where the one at pos + 1 starts.
+ */
+
+/* Position of the object that starts at ofs, or -1 if there is none */
+int find_revindex_position(struct packed_git *p, off_t ofs);
+/* Likewise, but complain when ofs is not where an object starts */
+int find_pack_revindex(struct packed_git *p, off_t ofs);
+/* Position of the object in the pack index (for nth_packed_object_sha1()) */
+uint32_t pack_pos_to_index(struct packed_git *p, uint32_t pos);
+off_t pack_pos_to_offset(struct packed_git *p, uint32_t pos);
 void discard_revindex(void);
 
 #endif
@@ -1,9 +1,11 @@
 #include "cache.h"
 #include "pack.h"
 #include "csum-file.h"
+#include "pack-revindex.h"
 
 uint32_t pack_idx_default_version = 2;
 uint32_t pack_idx_off32_limit = 0x7fffffff;
+int pack_write_rev_index;
 
 static int sha1_compare(const void *_a, const void *_b)
 {
@@ -144,6 +146,61 @@ char *write_idx_file(char *index_name, struct pack_idx_entry **objects,
 	return index_name;
 }
 
+static int offset_compare(const void *_a, const void *_b)
+{
+	const struct revindex_entry *a = _a;
+	const struct revindex_entry *b = _b;
+	return (a->offset < b->offset) ? -1 : (a->offset > b->offset) ? 1 : 0;
+}
+
+/*
+ * Write the reverse index for the objects just given to
+ * write_idx_file(), which left them sorted by SHA1, so that their
+ * position in the array is their position in the pack index.
+ * pack_sha1 is the checksum of the pack itself.
+ */
+char *write_rev_file(char *rev_name, struct pack_idx_entry **objects,
+		     int nr_objects, const unsigned char *pack_sha1)
+{
+	struct sha1file *f;
+	struct revindex_entry *revindex;
+	struct pack_rev_header hdr;
+	int i, fd;
+
+	revindex = xmalloc(sizeof(*revindex) * nr_objects);
+	for (i = 0; i < nr_objects; i++) {
+		revindex[i].offset = objects[i]->offset;
+		revindex[i].nr = i;
+	}
+	qsort(revindex, nr_objects, sizeof(*revindex), offset_compare);
+
+	if (!rev_name) {
+		static char tmpfile[PATH_MAX];
+		snprintf(tmpfile, sizeof(tmpfile),
+			 "%s/pack/tmp_rev_XXXXXX", get_object_directory());
+		fd = xmkstemp(tmpfile);
+		rev_name = xstrdup(tmpfile);
+	} else {
+		unlink(rev_name);
+		fd = open(rev_name, O_CREAT|O_EXCL|O_WRONLY, 0600);
+	}
+	if (fd < 0)
+		die("unable to create %s: %s", rev_name, strerror(errno));
+	f = sha1fd(fd, rev_name);
+
+	hdr.rev_signature = htonl(PACK_REV_SIGNATURE);
+	hdr.rev_version = htonl(PACK_REV_VERSION);
+	sha1write(f, &hdr, sizeof(hdr));
+	for (i = 0; i < nr_objects; i++) {
+		uint32_t nr = htonl(revindex[i].nr);
+		sha1write(f, &nr, 4);
+	}
+	sha1write(f, (unsigned char *)pack_sha1, 20);
+	sha1close(f, NULL, CSUM_FSYNC);
+	free(revindex);
+	return rev_name;
+}
+
 /*
  * Update pack header with object_count and compute new SHA1 for pack data
  * associated to pack_fd, and write that SHA1 at the end.  That new SHA1
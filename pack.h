@@ -46,6 +46,23 @@ struct pack_idx_header {
 	uint32_t idx_version;
 };
 
+/*
+ * A pack may come with a reverse index ".rev" file: after this header,
+ * the position in the pack index of each object, in the order the
+ * objects appear in the pack, as 4-byte network order integers;
+ * then the checksum of the pack and that of the file itself.
+ */
+#define PACK_REV_SIGNATURE 0x52494458	/* "RIDX" */
+#define PACK_REV_VERSION 1
+
+struct pack_rev_header {
+	uint32_t rev_signature;
+	uint32_t rev_version;
+};
+
+/* Write .rev files next to the packs we create (pack.writeReverseIndex) */
+extern int pack_write_rev_index;
+
 /*
  * Common part of object structure used for write_idx_file
  */
@@ -56,8 +73,20 @@ struct pack_idx_entry {
 };
 
 extern char *write_idx_file(char *index_name, struct pack_idx_entry **objects, int nr_objects, unsigned char *sha1);
+extern char *write_rev_file(char *rev_name, struct pack_idx_entry **objects, int nr_objects, const unsigned char *pack_sha1);
 extern int check_pack_crc(struct packed_git *p, struct pack_window **w_curs, off_t offset, off_t len, unsigned int nr);
+/* The CRC32 recorded in a version 2 index for the nr-th object in pack order */
+extern uint32_t packed_object_crc(struct packed_git *p, unsigned int nr);
 extern int verify_pack(struct packed_git *);
+/*
+ * Like verify_pack(), but inflate and check the objects with up to
+ * nr_threads threads, and count them on the progress meter starting
+ * at base_count objects and base_bytes bytes.
+ */
+struct progress;
+extern int verify_pack_threaded(struct packed_git *, int nr_threads,
+				struct progress *, uint32_t base_count,
+				off_t base_bytes);
 extern void fixup_pack_header_footer(int, unsigned char *, const char *, uint32_t, unsigned char *, off_t);
 extern char *index_pack_lockfile(int fd);
 
@@ -0,0 +1,218 @@
+#include "cache.h"
+#include "progress.h"
+#include "parallel-checkout.h"
+
+#ifdef NO_PTHREADS
+void checkout_read_lock(void)
+{
+	; /* nothing */
+}
+
+void checkout_read_unlock(void)
+{
+	; /* nothing */
+}
+
+int parallel_checkout(struct index_state *istate, const struct checkout *state,
+		      struct progress *progress, unsigned *cnt)
+{
+	return -1;
+}
+#else
+
+#include <pthread.h>
+#include "thread-utils.h"
+
+/*
+ * Starting a worker is not worth it for fewer than CHECKOUT_COST
+ * files, and the workers take CHECKOUT_CHUNK of them at a time.
+ */
+#define CHECKOUT_COST (100)
+#define CHECKOUT_CHUNK (32)
+
+static pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int workers_running;
+
+void checkout_read_lock(void)
+{
+	if (workers_running)
+		pthread_mutex_lock(&read_mutex);
+}
+
+void checkout_read_unlock(void)
+{
+	if (workers_running)
+		pthread_mutex_unlock(&read_mutex);
+}
+
+struct checkout_queue {
+	const struct checkout *state;
+	struct cache_entry **entries;
+	struct stat *st;
+	int nr, next, done, errs;
+	pthread_mutex_t mutex;
+};
+
+/*
+ * Account for the "done" entries of the last chunk, and hand out the
+ * next one; returns its start, and how many entries are done.
+ */
+static int next_chunk(struct checkout_queue *q, int done, int *end,
+		      int *total_done)
+{
+	int start;
+
+	pthread_mutex_lock(&q->mutex);
+	q->done += done;
+	*total_done = q->done;
+	start = q->next;
+	q->next += CHECKOUT_CHUNK;
+	pthread_mutex_unlock(&q->mutex);
+
+	*end = start + CHECKOUT_CHUNK;
+	if (*end > q->nr)
+		*end = q->nr;
+	return start;
+}
+
+static int checkout_chunk(struct checkout_queue *q, int start, int end,
+			  char *path)
+{
+	int i, errs = 0;
+
+	for (i = start; i < end; i++) {
+		struct cache_entry *ce = q->entries[i];
+		struct stat *st = q->st ? q->st + i : NULL;
+
+		strcpy(path + q->state->base_dir_len, ce->name);
+		if (st)
+			st->st_mode = 0;
+		errs |= write_checkout_entry(ce, q->state, path, st);
+	}
+	return errs;
+}
+
+/* Check out chunks until there are none left */
+static int run_worker(struct checkout_queue *q, struct progress *progress,
+		      unsigned cnt)
+{
+	char path[PATH_MAX + 1];
+	int start, end, done = 0, total_done, errs = 0;
+
+	memcpy(path, q->state->base_dir, q->state->base_dir_len);
+	while ((start = next_chunk(q, done, &end, &total_done)) < q->nr) {
+		display_progress(progress, cnt + total_done);
+		errs |= checkout_chunk(q, start, end, path);
+		done = end - start;
+	}
+	return errs;
+}
+
+static void *checkout_thread(void *_data)
+{
+	struct checkout_queue *q = _data;
+	int errs = run_worker(q, NULL, 0);
+
+	pthread_mutex_lock(&q->mutex);
+	q->errs |= errs;
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+/*
+ * Entries of the same directory are next to each other, so each
+ * directory is only looked at once.
+ */
+static void create_all_directories(struct checkout_queue *q)
+{
+	const struct checkout *state = q->state;
+	char path[PATH_MAX + 1];
+	const char *dir = "";
+	int i, dirlen = 0;
+
+	memcpy(path, state->base_dir, state->base_dir_len);
+	for (i = 0; i < q->nr; i++) {
+		const char *name = q->entries[i]->name;
+		const char *slash = strrchr(name, '/');
+		int len = slash ? slash - name : 0;
+
+		if (len == dirlen && !memcmp(name, dir, len))
+			continue;
+		dir = name;
+		dirlen = len;
+		if (!len)
+			continue;
+		strcpy(path + state->base_dir_len, name);
+		create_directories(path, state);
+	}
+}
+
+int parallel_checkout(struct index_state *istate, const struct checkout *state,
+		      struct progress *progress, unsigned *cnt)
+{
+	struct checkout_queue q;
+	pthread_t *threads;
+	char path[PATH_MAX + 1];
+	int i, nr, workers, errs = 0;
+
+	for (i = nr = 0; i < istate->cache_nr; i++)
+		if (istate->cache[i]->ce_flags & CE_UPDATE)
+			nr++;
+	workers = checkout_workers ? checkout_workers : online_cpus();
+	if (workers > nr / CHECKOUT_COST)
+		workers = nr / CHECKOUT_COST;
+	if (workers < 2)
+		return -1;
+
+	/* Only the entries that really need writing go to the workers */
+	memset(&q, 0, sizeof(q));
+	q.state = state;
+	q.entries = xmalloc(nr * sizeof(*q.entries));
+	memcpy(path, state->base_dir, state->base_dir_len);
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		int ret;
+
+		if (!(ce->ce_flags & CE_UPDATE))
+			continue;
+		ce->ce_flags &= ~CE_UPDATE;
+		strcpy(path + state->base_dir_len, ce->name);
+		ret = prepare_checkout_entry(ce, state, path);
+		if (ret < 0)
+			errs = 1;
+		else if (!ret)
+			q.entries[q.nr++] = ce;
+	}
+	if (workers > q.nr / CHECKOUT_COST + 1)
+		workers = q.nr / CHECKOUT_COST + 1;
+	if (state->refresh_cache)
+		q.st = xmalloc(q.nr * sizeof(*q.st));
+	pthread_mutex_init(&q.mutex, NULL);
+	create_all_directories(&q);
+
+	/* this thread is one of the workers */
+	workers_running = 1;
+	threads = xmalloc((workers - 1) * sizeof(*threads));
+	for (i = 0; i < workers - 1; i++)
+		if (pthread_create(threads + i, NULL, checkout_thread, &q))
+			die("unable to create checkout thread");
+	errs |= run_worker(&q, progress, *cnt);
+	for (i = 0; i < workers - 1; i++)
+		if (pthread_join(threads[i], NULL))
+			die("unable to join checkout thread");
+	workers_running = 0;
+	free(threads);
+	pthread_mutex_destroy(&q.mutex);
+
+	for (i = 0; q.st && i < q.nr; i++)
+		if (q.st[i].st_mode)
+			fill_stat_cache_info(q.entries[i], q.st + i);
+	trace_printf("trace: parallel checkout: %d files with %d workers\n",
+		     q.nr, workers);
+	*cnt += nr;
+	display_progress(progress, *cnt);
+	free(q.st);
+	free(q.entries);
+	return (errs | q.errs) != 0;
+}
+#endif
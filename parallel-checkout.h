@@ -0,0 +1,49 @@
+#ifndef PARALLEL_CHECKOUT_H
+#define PARALLEL_CHECKOUT_H
+
+struct progress;
+
+/*
+ * Check out the entries of "istate" that are marked CE_UPDATE with
+ * a pool of checkout.workers threads, and clear the mark.  The
+ * entries are compared with the working tree and the leading
+ * directories are all created first, so that the workers only ever
+ * write files, and the stat data of the new files is filled into
+ * the entries once the workers are done.
+ *
+ * Returns -1 without doing anything when there are too few entries
+ * for it to be worth it, and otherwise non-zero if any of them could
+ * not be checked out.  "cnt" is advanced for the progress meter.
+ */
+extern int parallel_checkout(struct index_state *istate,
+			     const struct checkout *state,
+			     struct progress *progress, unsigned *cnt);
+
+/*
+ * Reading objects and converting them for the working tree is not
+ * thread-safe; entry.c does it with this lock held.
+ */
+extern void checkout_read_lock(void);
+extern void checkout_read_unlock(void);
+
+/* From entry.c */
+extern void create_directories(const char *path, const struct checkout *state);
+extern int checkout_entry_at(struct cache_entry *ce, const struct checkout *state,
+			     char *path, int mkdirs, struct stat *st);
+
+/*
+ * Compare "ce" with what is at "path" and, when it is to be replaced,
+ * remove that; returns 0 when the entry is to be written, 1 when it
+ * is to be left alone, and -1 on error.  This reads the index and the
+ * attributes, so it is not for the workers.
+ */
+extern int prepare_checkout_entry(struct cache_entry *ce,
+				  const struct checkout *state,
+				  const char *path);
+
+/* Write out an entry that prepare_checkout_entry() made room for */
+extern int write_checkout_entry(struct cache_entry *ce,
+				const struct checkout *state,
+				char *path, struct stat *st);
+
+#endif
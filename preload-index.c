@@ -2,8 +2,14 @@
  * Copyright (C) 2008 Linus Torvalds
  */
 #include "cache.h"
+#include "fsmonitor.h"
 
 #ifdef NO_PTHREADS
+int preload_threads(int nr, int cost)
+{
+	return 1;
+}
+
 static void preload_index(struct index_state *index, const char **pathspec)
 {
 	; /* nothing */
@@ -14,80 +20,129 @@ static void preload_index(struct index_state *index, const char **pathspec)
 
 /*
  * Mostly randomly chosen maximum thread counts: we
- * cap the parallelism to 20 threads, and we want
+ * cap the parallelism to 20 threads (unless told
+ * otherwise by core.preloadIndexThreads), and we want
  * to have at least 500 lstat's per thread for it to
  * be worth starting a thread.
+ *
+ * The threads take PRELOAD_CHUNK entries at a time,
+ * so that one stuck in a slow directory does not hold
+ * up a large slice of the index while the others idle.
  */
 #define MAX_PARALLEL (20)
 #define THREAD_COST (500)
+#define PRELOAD_CHUNK (64)
 
-struct thread_data {
-	pthread_t pthread;
+int preload_threads(int nr, int cost)
+{
+	int max = core_preload_index_threads ? core_preload_index_threads
+					     : MAX_PARALLEL;
+	int threads = nr / cost;
+
+	return threads > max ? max : threads;
+}
+
+struct preload_state {
 	struct index_state *index;
 	const char **pathspec;
-	int offset, nr;
+	int next;
+	pthread_mutex_t mutex;
 };
 
+struct thread_data {
+	pthread_t pthread;
+	struct preload_state *state;
+	int lstats;
+	unsigned long usec;
+};
+
+/* Hand out the next chunk of entries; returns its start */
+static int next_chunk(struct preload_state *state, int *end)
+{
+	int start;
+
+	pthread_mutex_lock(&state->mutex);
+	start = state->next;
+	state->next += PRELOAD_CHUNK;
+	pthread_mutex_unlock(&state->mutex);
+
+	*end = start + PRELOAD_CHUNK;
+	if (*end > state->index->cache_nr)
+		*end = state->index->cache_nr;
+	return start;
+}
+
 static void *preload_thread(void *_data)
 {
-	int nr;
 	struct thread_data *p = _data;
-	struct index_state *index = p->index;
-	struct cache_entry **cep = index->cache + p->offset;
-
-	nr = p->nr;
-	if (nr + p->offset > index->cache_nr)
-		nr = index->cache_nr - p->offset;
-
-	do {
-		struct cache_entry *ce = *cep++;
-		struct stat st;
-
-		if (ce_stage(ce))
-			continue;
-		if (ce_uptodate(ce))
-			continue;
-		if (!ce_path_match(ce, p->pathspec))
-			continue;
-		if (lstat(ce->name, &st))
-			continue;
-		if (ie_match_stat(index, ce, &st, CE_MATCH_RACY_IS_DIRTY))
-			continue;
-		ce_mark_uptodate(ce);
-	} while (--nr > 0);
+	struct preload_state *state = p->state;
+	struct index_state *index = state->index;
+	struct timeval start, end;
+	int i, last;
+
+	gettimeofday(&start, NULL);
+	while ((i = next_chunk(state, &last)) < index->cache_nr) {
+		for (; i < last; i++) {
+			struct cache_entry *ce = index->cache[i];
+			struct stat st;
+
+			if (ce_stage(ce))
+				continue;
+			if (ce_uptodate(ce))
+				continue;
+			if (!ce_path_match(ce, state->pathspec))
+				continue;
+			p->lstats++;
+			if (lstat(ce->name, &st))
+				continue;
+			if (ie_match_stat(index, ce, &st, CE_MATCH_RACY_IS_DIRTY))
+				continue;
+			ce_mark_uptodate(ce);
+		}
+	}
+	gettimeofday(&end, NULL);
+	p->usec = (end.tv_sec - start.tv_sec) * 1000000 +
+		end.tv_usec - start.tv_usec;
 	return NULL;
 }
 
 static void preload_index(struct index_state *index, const char **pathspec)
 {
-	int threads, i, work, offset;
+	int threads, i;
 	struct thread_data data[MAX_PARALLEL];
+	struct thread_data *dp = data;
+	struct preload_state state;
 
 	if (!core_preload_index)
 		return;
 
-	threads = index->cache_nr / THREAD_COST;
+	threads = preload_threads(index->cache_nr, THREAD_COST);
 	if (threads < 2)
 		return;
 	if (threads > MAX_PARALLEL)
-		threads = MAX_PARALLEL;
-	offset = 0;
-	work = (index->cache_nr + threads - 1) / threads;
+		dp = xmalloc(threads * sizeof(*dp));
+	state.index = index;
+	state.pathspec = pathspec;
+	state.next = 0;
+	pthread_mutex_init(&state.mutex, NULL);
 	for (i = 0; i < threads; i++) {
-		struct thread_data *p = data+i;
-		p->index = index;
-		p->pathspec = pathspec;
-		p->offset = offset;
-		p->nr = work;
-		offset += work;
+		struct thread_data *p = dp+i;
+		p->state = &state;
+		p->lstats = 0;
+		p->usec = 0;
 		if (pthread_create(&p->pthread, NULL, preload_thread, p))
 			die("unable to create threaded lstat");
 	}
 	for (i = 0; i < threads; i++) {
-		struct thread_data *p = data+i;
+		struct thread_data *p = dp+i;
 		if (pthread_join(p->pthread, NULL))
 			die("unable to join threaded lstat");
+		trace_printf("trace: preload: thread %d: %d lstats in %lu us\n",
+			     i, p->lstats, p->usec);
 	}
+	pthread_mutex_destroy(&state.mutex);
+	if (dp != data)
+		free(dp);
 }
 #endif
 
@@ -95,6 +150,7 @@ int read_index_preload(struct index_state *index, const char **pathspec)
 {
 	int retval = read_index(index);
 
+	refresh_fsmonitor(index);
 	preload_index(index, pathspec);
 	return retval;
 }
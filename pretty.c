@@ -690,6 +690,7 @@ void format_commit_message(const struct commit *commit,
 {
 	struct format_commit_context context;
 
+	load_commit_buffer((struct commit *)commit);
 	memset(&context, 0, sizeof(context));
 	context.commit = commit;
 	context.dmode = dmode;
@@ -841,6 +842,7 @@ char *reencode_commit_message(const struct commit *commit, const char **encoding
 		encoding = "utf-8";
 	if (encoding_p)
 		*encoding_p = encoding;
+	load_commit_buffer((struct commit *)commit);
 	return logmsg_reencode(commit, encoding);
 }
 
@@ -851,10 +853,13 @@ void pretty_print_commit(enum cmit_fmt fmt, const struct commit *commit,
 {
 	unsigned long beginning_of_body;
 	int indent = 4;
-	const char *msg = commit->buffer;
+	const char *msg;
 	char *reencoded;
 	const char *encoding;
 
+	load_commit_buffer((struct commit *)commit);
+	msg = commit->buffer;
+
 	if (fmt == CMIT_FMT_USERFORMAT) {
 		format_commit_message(commit, user_format, sb, dmode);
 		return;
@@ -0,0 +1,43 @@
+#ifndef PRIO_QUEUE_H
+#define PRIO_QUEUE_H
+
+/*
+ * A priority queue of pointers, kept as a binary heap, so that
+ * adding and taking out an item cost O(log n) instead of the O(n) of
+ * inserting into a sorted list.  It is mostly used to walk commits
+ * from the newest to the oldest as they are found.
+ *
+ * "compare" returns a negative value when "one" is to come out before
+ * "two"; items that compare equal come out in the order they were
+ * put in.  Without a compare function, the queue is a LIFO stack.
+ */
+typedef int (*prio_queue_compare_fn)(const void *one, const void *two,
+				     void *cb_data);
+
+struct prio_queue_entry {
+	unsigned ctr;
+	void *data;
+};
+
+struct prio_queue {
+	prio_queue_compare_fn compare;
+	unsigned insertion_ctr;
+	void *cb_data;
+	int alloc, nr;
+	struct prio_queue_entry *array;
+};
+
+extern void prio_queue_put(struct prio_queue *queue, void *thing);
+
+/* Take out the next item; NULL when the queue is empty */
+extern void *prio_queue_get(struct prio_queue *queue);
+
+/* The next item, left in the queue */
+extern void *prio_queue_peek(struct prio_queue *queue);
+
+extern void clear_prio_queue(struct prio_queue *queue);
+
+/* Reverse the order of a LIFO stack */
+extern void prio_queue_reverse(struct prio_queue *queue);
+
+#endif
@@ -14,6 +14,13 @@
 #include "diffcore.h"
 #include "revision.h"
 #include "blob.h"
+#include "fsmonitor.h"
+#include "split-index.h"
+#include "sparse-index.h"
+#include "thread-utils.h"
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 /* Index extensions.
  *
@@ -26,6 +33,23 @@
 
 #define CACHE_EXT(s) ( (s[0]<<24)|(s[1]<<16)|(s[2]<<8)|(s[3]) )
 #define CACHE_EXT_TREE 0x54524545	/* "TREE" */
+#define CACHE_EXT_UNTRACKED 0x554e5452	/* "UNTR" */
+#define CACHE_EXT_FSMONITOR 0x46534d4e	/* "FSMN" */
+#define CACHE_EXT_LINK 0x6c696e6b	/* "link" */
+#define CACHE_EXT_ENTRY_OFFSETS 0x49454f54	/* "IEOT" */
+#define CACHE_EXT_END_OF_ENTRIES 0x454f4945	/* "EOIE" */
+#define CACHE_EXT_SPARSE_DIRECTORIES 0x73646972	/* "sdir" */
+
+/*
+ * A large index records where every IEOT_BLOCK_SIZE-th entry starts
+ * in the "IEOT" extension, so that blocks of entries can be read by
+ * several threads.  It is found through the "EOIE" extension, which
+ * comes last and gives the offset of the first extension.
+ */
+#define IEOT_VERSION 1
+#define IEOT_BLOCK_SIZE 10000
+#define EOIE_SIZE (8 + 4)
+#define MAX_INDEX_THREADS 32
 
 struct index_state the_index;
 
@@ -432,6 +456,7 @@ int remove_index_entry_at(struct index_state *istate, int pos)
 {
 	struct cache_entry *ce = istate->cache[pos];
 
+	untracked_cache_invalidate_path(istate->untracked, ce->name);
 	remove_name_hash(ce);
 	istate->cache_changed = 1;
 	istate->cache_nr--;
@@ -874,6 +899,7 @@ static int add_index_entry_with_check(struct index_state *istate, struct cache_e
 	int new_only = option & ADD_CACHE_NEW_ONLY;
 
 	cache_tree_invalidate_path(istate->cache_tree, ce->name);
+	untracked_cache_invalidate_path(istate->untracked, ce->name);
 	pos = index_name_pos(istate, ce->name, ce->ce_flags);
 
 	/* existing match? Just replace it. */
@@ -1042,6 +1068,7 @@ int refresh_index(struct index_state *istate, unsigned int flags, const char **p
 
 	needs_update_message = ((flags & REFRESH_SAY_CHANGED)
 				? "locally modified" : "needs update");
+	refresh_fsmonitor(istate);
 	for (i = 0; i < istate->cache_nr; i++) {
 		struct cache_entry *ce, *new;
 		int cache_errno = 0;
@@ -1066,8 +1093,10 @@ int refresh_index(struct index_state *istate, unsigned int flags, const char **p
 			continue;
 
 		new = refresh_cache_ent(istate, ce, options, &cache_errno);
-		if (new == ce)
+		if (new == ce) {
+			mark_fsmonitor_valid(ce);
 			continue;
+		}
 		if (!new) {
 			if (not_new && cache_errno == ENOENT)
 				continue;
@@ -1085,6 +1114,7 @@ int refresh_index(struct index_state *istate, unsigned int flags, const char **p
 			continue;
 		}
 
+		mark_fsmonitor_valid(new);
 		replace_index_entry(istate, i, new);
 	}
 	return has_errors;
@@ -1095,15 +1125,21 @@ struct cache_entry *refresh_cache_entry(struct cache_entry *ce, int really)
 	return refresh_cache_ent(&the_index, ce, really, NULL);
 }
 
-static int verify_hdr(struct cache_header *hdr, unsigned long size)
+static int verify_hdr_version(struct cache_header *hdr)
 {
-	git_SHA_CTX c;
-	unsigned char sha1[20];
-
 	if (hdr->hdr_signature != htonl(CACHE_SIGNATURE))
 		return error("bad signature");
-	if (hdr->hdr_version != htonl(2) && hdr->hdr_version != htonl(3))
+	if (hdr->hdr_version != htonl(2) && hdr->hdr_version != htonl(3) &&
+	    hdr->hdr_version != htonl(4))
 		return error("bad index version");
+	return 0;
+}
+
+static int verify_hdr_checksum(struct cache_header *hdr, unsigned long size)
+{
+	git_SHA_CTX c;
+	unsigned char sha1[20];
+
 	git_SHA1_Init(&c);
 	git_SHA1_Update(&c, hdr, size - 20);
 	git_SHA1_Final(sha1, &c);
@@ -1119,6 +1155,24 @@ static int read_index_extension(struct index_state *istate,
 	case CACHE_EXT_TREE:
 		istate->cache_tree = cache_tree_read(data, sz);
 		break;
+	case CACHE_EXT_UNTRACKED:
+		istate->untracked = read_untracked_extension(data, sz);
+		break;
+	case CACHE_EXT_FSMONITOR:
+		read_fsmonitor_extension(istate, data, sz);
+		break;
+	case CACHE_EXT_LINK:
+		if (read_link_extension(istate, data, sz) < 0)
+			return -1;
+		break;
+	case CACHE_EXT_ENTRY_OFFSETS:
+	case CACHE_EXT_END_OF_ENTRIES:
+		/* only used to find the entries */
+		break;
+	case CACHE_EXT_SPARSE_DIRECTORIES:
+		/* some entries are directories */
+		istate->sparse_index = 1;
+		break;
 	default:
 		if (*ext < 'A' || 'Z' < *ext)
 			return error("index uses %.4s extension, which we do not understand",
@@ -1129,15 +1183,96 @@ static int read_index_extension(struct index_state *istate,
 	return 0;
 }
 
+/* Extensions that refer to the entries, and have to be read after them */
+static int extension_needs_entries(const char *ext)
+{
+	switch (CACHE_EXT(ext)) {
+	case CACHE_EXT_FSMONITOR:
+	case CACHE_EXT_LINK:
+		return 1;
+	}
+	return 0;
+}
+
+static int read_index_extensions(struct index_state *istate,
+				 const char *mmap, unsigned long mmap_size,
+				 unsigned long src_offset, int need_entries)
+{
+	while (src_offset <= mmap_size - 20 - 8) {
+		/* After an array of active_nr index entries,
+		 * there can be arbitrary number of extended
+		 * sections, each of which is prefixed with
+		 * extension name (4-byte) and section length
+		 * in 4-byte network byte order.
+		 */
+		const char *ext = mmap + src_offset;
+		unsigned long extsize;
+		memcpy(&extsize, mmap + src_offset + 4, 4);
+		extsize = ntohl(extsize);
+		if (extension_needs_entries(ext) == need_entries &&
+		    read_index_extension(istate, ext,
+					 (char *) mmap + src_offset + 8,
+					 extsize) < 0)
+			return -1;
+		src_offset += 8;
+		src_offset += extsize;
+	}
+	return 0;
+}
+
 int read_index(struct index_state *istate)
 {
 	return read_index_from(istate, get_index_file());
 }
 
-static void convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_entry *ce)
+/*
+ * Index version 4 stores each path as the number of bytes to drop
+ * from the end of the previous path, followed by the NUL-terminated
+ * rest of the path, and does not pad the entries.  The number uses
+ * the same encoding as the base offset of an OFS_DELTA object.
+ */
+static size_t decode_varint(const unsigned char **bufp)
+{
+	const unsigned char *buf = *bufp;
+	unsigned char c = *buf++;
+	size_t val = c & 127;
+
+	while (c & 128) {
+		val += 1;
+		if (!val || MSB(val, 7))
+			return 0; /* overflow */
+		c = *buf++;
+		val = (val << 7) + (c & 127);
+	}
+	*bufp = buf;
+	return val;
+}
+
+static int encode_varint(size_t value, unsigned char *buf)
 {
-	size_t len;
+	unsigned char varint[16];
+	unsigned pos = sizeof(varint) - 1;
+
+	varint[pos] = value & 127;
+	while (value >>= 7)
+		varint[--pos] = 128 | (--value & 127);
+	if (buf)
+		memcpy(buf, varint + pos, sizeof(varint) - pos);
+	return sizeof(varint) - pos;
+}
+
+/*
+ * Convert the entry at "ondisk" and return its size on disk.  For
+ * index version 4, "previous" is the entry just before it, or NULL
+ * when the path has been stripped all the way.
+ */
+static unsigned long convert_from_disk(struct ondisk_cache_entry *ondisk,
+				       struct cache_entry *ce, int version,
+				       const struct cache_entry *previous)
+{
+	size_t len, keep, strip;
 	const char *name;
+	const unsigned char *suffix;
 
 	ce->ce_ctime = ntohl(ondisk->ctime.sec);
 	ce->ce_mtime = ntohl(ondisk->mtime.sec);
@@ -1168,13 +1303,68 @@ static void convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_en
 	else
 		name = ondisk->name;
 
+	if (version < 4) {
+		if (len == CE_NAMEMASK)
+			len = strlen(name);
+		/*
+		 * NEEDSWORK: If the original index is crafted, this copy
+		 * could go unchecked.
+		 */
+		memcpy(ce->name, name, len + 1);
+		return ondisk_ce_size(ce);
+	}
+
+	suffix = (const unsigned char *)name;
+	strip = decode_varint(&suffix);
+	keep = 0;
+	if (previous) {
+		keep = ce_namelen(previous);
+		if (keep < strip)
+			die("malformed name field in the index");
+		keep -= strip;
+	}
 	if (len == CE_NAMEMASK)
-		len = strlen(name);
-	/*
-	 * NEEDSWORK: If the original index is crafted, this copy could
-	 * go unchecked.
-	 */
-	memcpy(ce->name, name, len + 1);
+		len = keep + strlen((const char *)suffix);
+	else if (len < keep || suffix[len - keep])
+		die("malformed name field in the index");
+	if (keep)
+		memcpy(ce->name, previous->name, keep);
+	memcpy(ce->name + keep, suffix, len - keep + 1);
+	return (const char *)suffix - (const char *)ondisk + len - keep + 1;
+}
+
+/* The in-core size of "nr" version 4 entries from "offset" on */
+static unsigned long v4_entries_size(const char *mmap, unsigned long offset,
+				     unsigned long end, int nr)
+{
+	unsigned long size = 0;
+	size_t len = 0, strip, suffix_len;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		struct ondisk_cache_entry *ondisk;
+		const unsigned char *suffix;
+		const char *nul = NULL;
+
+		if (end < offset + offsetof(struct ondisk_cache_entry, name) + 2)
+			die("index file corrupt");
+		ondisk = (struct ondisk_cache_entry *)(mmap + offset);
+		if (ntohs(ondisk->flags) & CE_EXTENDED)
+			suffix = (const unsigned char *)
+				((struct ondisk_cache_entry_extended *)ondisk)->name;
+		else
+			suffix = (const unsigned char *)ondisk->name;
+		strip = decode_varint(&suffix);
+		if ((const char *)suffix < mmap + end)
+			nul = memchr(suffix, '\0', mmap + end - (const char *)suffix);
+		if (!nul)
+			die("index file corrupt");
+		suffix_len = nul - (const char *)suffix;
+		len = (strip < len ? len - strip : 0) + suffix_len;
+		size += cache_entry_size(len);
+		offset = (const char *)suffix + suffix_len + 1 - mmap;
+	}
+	return size;
 }
 
 static inline size_t estimate_cache_size(size_t ondisk_size, unsigned int entries)
@@ -1191,12 +1381,233 @@ static inline size_t estimate_cache_size(size_t ondisk_size, unsigned int entrie
 	return ondisk_size + entries*per_entry;
 }
 
+/* How much memory the entries between "offset" and "end" need */
+static unsigned long entries_size(const struct index_state *istate,
+				  const char *mmap, unsigned long offset,
+				  unsigned long end, int nr)
+{
+	if (istate->version >= 4)
+		return v4_entries_size(mmap, offset, end, nr);
+	return estimate_cache_size(end - offset, nr);
+}
+
+static unsigned long load_cache_entries(struct index_state *istate,
+					const char *mmap,
+					unsigned long src_offset,
+					unsigned long dst_offset,
+					int first, int nr)
+{
+	struct cache_entry *previous = NULL;
+	int i;
+
+	for (i = first; i < first + nr; i++) {
+		struct ondisk_cache_entry *disk_ce;
+		struct cache_entry *ce;
+
+		disk_ce = (struct ondisk_cache_entry *)(mmap + src_offset);
+		ce = (struct cache_entry *)((char *)istate->alloc + dst_offset);
+		src_offset += convert_from_disk(disk_ce, ce, istate->version,
+						previous);
+		set_index_entry(istate, i, ce);
+
+		dst_offset += ce_size(ce);
+		previous = ce;
+	}
+	return src_offset;
+}
+
+#ifndef NO_PTHREADS
+
+static uint32_t get_be32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+struct entry_block {
+	unsigned long offset, end, dst_offset;
+	int first, nr;
+};
+
+/*
+ * Find the blocks of entries recorded in the "IEOT" extension, and
+ * where the extensions start.  Returns the number of blocks, or 0
+ * when the index does not have (usable) offsets.
+ */
+static int read_entry_offsets(const struct index_state *istate,
+			      const char *mmap, unsigned long mmap_size,
+			      unsigned long *ext_offset,
+			      struct entry_block **blocks_p)
+{
+	unsigned long eoie, offset, extsize, ieot = 0, ieot_size = 0;
+	struct entry_block *blocks;
+	uint32_t nr_blocks;
+	int i, first;
+
+	if (mmap_size < sizeof(struct cache_header) + EOIE_SIZE + 20)
+		return 0;
+	eoie = mmap_size - 20 - EOIE_SIZE;
+	if (get_be32(mmap + eoie) != CACHE_EXT_END_OF_ENTRIES ||
+	    get_be32(mmap + eoie + 4) != EOIE_SIZE - 8)
+		return 0;
+	*ext_offset = offset = get_be32(mmap + eoie + 8);
+	if (offset < sizeof(struct cache_header) || offset > eoie)
+		return 0;
+
+	/* the extension headers have to lead exactly to the EOIE */
+	while (offset < eoie) {
+		if (eoie - offset < 8)
+			return 0;
+		extsize = get_be32(mmap + offset + 4);
+		if (get_be32(mmap + offset) == CACHE_EXT_ENTRY_OFFSETS) {
+			ieot = offset + 8;
+			ieot_size = extsize;
+		}
+		if (extsize > eoie - offset - 8)
+			return 0;
+		offset += 8 + extsize;
+	}
+	if (offset != eoie || !ieot || ieot_size < 4 || (ieot_size - 4) % 8 ||
+	    get_be32(mmap + ieot) != IEOT_VERSION)
+		return 0;
+
+	nr_blocks = (ieot_size - 4) / 8;
+	if (!nr_blocks)
+		return 0;
+	blocks = xcalloc(nr_blocks, sizeof(*blocks));
+	for (i = first = 0; i < nr_blocks; i++) {
+		const char *rec = mmap + ieot + 4 + 8 * i;
+		struct entry_block *b = blocks + i;
+
+		b->offset = get_be32(rec);
+		b->nr = get_be32(rec + 4);
+		b->first = first;
+		first += b->nr;
+		if (i)
+			b[-1].end = b->offset;
+	}
+	blocks[nr_blocks - 1].end = *ext_offset;
+
+	/* the blocks have to cover all entries, in order */
+	for (i = 0; i < nr_blocks; i++) {
+		struct entry_block *b = blocks + i;
+		if (b->offset >= b->end || b->nr <= 0 ||
+		    (!i && b->offset != sizeof(struct cache_header)))
+			break;
+		b->dst_offset = i ? b[-1].dst_offset +
+			entries_size(istate, mmap, b[-1].offset,
+				     b[-1].end, b[-1].nr) : 0;
+	}
+	if (i < nr_blocks || first != istate->cache_nr) {
+		free(blocks);
+		return 0;
+	}
+	*blocks_p = blocks;
+	return nr_blocks;
+}
+
+struct load_entries_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	const char *mmap;
+	struct entry_block *blocks;
+	int nr_blocks, corrupt;
+};
+
+static void *load_entries_thread(void *_data)
+{
+	struct load_entries_data *p = _data;
+	int i;
+
+	for (i = 0; i < p->nr_blocks; i++) {
+		struct entry_block *b = p->blocks + i;
+		if (load_cache_entries(p->istate, p->mmap, b->offset,
+				       b->dst_offset, b->first, b->nr) != b->end)
+			p->corrupt = 1;
+	}
+	return NULL;
+}
+
+/*
+ * Read the entries with several threads, if the index records where
+ * its blocks of entries start.  The checksum is verified and the
+ * extensions that do not refer to the entries are read meanwhile.
+ * Returns -1 when the index has to be read the normal way.
+ */
+static int load_entries_threaded(struct index_state *istate,
+				 const char *mmap, unsigned long mmap_size)
+{
+	struct load_entries_data data[MAX_INDEX_THREADS];
+	struct entry_block *blocks, *last;
+	unsigned long ext_offset;
+	int nr_blocks, threads, i, err = 0;
+
+	threads = index_threads ? index_threads : online_cpus();
+	if (threads < 2)
+		return -1;
+	nr_blocks = read_entry_offsets(istate, mmap, mmap_size,
+				       &ext_offset, &blocks);
+	if (nr_blocks < 2)
+		return -1;
+	if (threads > nr_blocks)
+		threads = nr_blocks;
+	if (threads > MAX_INDEX_THREADS)
+		threads = MAX_INDEX_THREADS;
+	last = blocks + nr_blocks - 1;
+	istate->alloc = xmalloc(last->dst_offset +
+				entries_size(istate, mmap, last->offset,
+					     last->end, last->nr));
+
+	for (i = 0; i < threads; i++) {
+		struct load_entries_data *p = data + i;
+		int start = i * nr_blocks / threads;
+		int end = (i + 1) * nr_blocks / threads;
+
+		p->istate = istate;
+		p->mmap = mmap;
+		p->blocks = blocks + start;
+		p->nr_blocks = end - start;
+		p->corrupt = 0;
+		if (pthread_create(&p->pthread, NULL, load_entries_thread, p))
+			die("unable to create index loading thread");
+	}
+
+	if (verify_hdr_checksum((struct cache_header *)mmap, mmap_size) < 0 ||
+	    read_index_extensions(istate, mmap, mmap_size, ext_offset, 0) < 0)
+		err = -1;
+
+	for (i = 0; i < threads; i++) {
+		struct load_entries_data *p = data + i;
+		if (pthread_join(p->pthread, NULL))
+			die("unable to join index loading thread");
+		if (p->corrupt)
+			err = -1;
+	}
+	free(blocks);
+	if (err)
+		die("index file corrupt");
+	trace_printf("trace: read index entries with %d threads\n", threads);
+
+	if (read_index_extensions(istate, mmap, mmap_size, ext_offset, 1) < 0)
+		die("index file corrupt");
+	return 0;
+}
+#else
+static int load_entries_threaded(struct index_state *istate,
+				 const char *mmap, unsigned long mmap_size)
+{
+	return -1;
+}
+#endif
+
 /* remember to discard_cache() before reading a different cache! */
 int read_index_from(struct index_state *istate, const char *path)
 {
-	int fd, i;
+	int fd;
 	struct stat st;
-	unsigned long src_offset, dst_offset;
+	unsigned long src_offset;
 	struct cache_header *hdr;
 	void *mmap;
 	size_t mmap_size;
@@ -1228,56 +1639,40 @@ int read_index_from(struct index_state *istate, const char *path)
 		die("unable to map index file");
 
 	hdr = mmap;
-	if (verify_hdr(hdr, mmap_size) < 0)
+	if (verify_hdr_version(hdr) < 0)
 		goto unmap;
 
+	istate->version = ntohl(hdr->hdr_version);
 	istate->cache_nr = ntohl(hdr->hdr_entries);
 	istate->cache_alloc = alloc_nr(istate->cache_nr);
 	istate->cache = xcalloc(istate->cache_alloc, sizeof(struct cache_entry *));
-
-	/*
-	 * The disk format is actually larger than the in-memory format,
-	 * due to space for nsec etc, so even though the in-memory one
-	 * has room for a few  more flags, we can allocate using the same
-	 * index size
-	 */
-	istate->alloc = xmalloc(estimate_cache_size(mmap_size, istate->cache_nr));
 	istate->initialized = 1;
-
-	src_offset = sizeof(*hdr);
-	dst_offset = 0;
-	for (i = 0; i < istate->cache_nr; i++) {
-		struct ondisk_cache_entry *disk_ce;
-		struct cache_entry *ce;
-
-		disk_ce = (struct ondisk_cache_entry *)((char *)mmap + src_offset);
-		ce = (struct cache_entry *)((char *)istate->alloc + dst_offset);
-		convert_from_disk(disk_ce, ce);
-		set_index_entry(istate, i, ce);
-
-		src_offset += ondisk_ce_size(ce);
-		dst_offset += ce_size(ce);
-	}
 	istate->timestamp = st.st_mtime;
-	while (src_offset <= mmap_size - 20 - 8) {
-		/* After an array of active_nr index entries,
-		 * there can be arbitrary number of extended
-		 * sections, each of which is prefixed with
-		 * extension name (4-byte) and section length
-		 * in 4-byte network byte order.
+
+	if (load_entries_threaded(istate, mmap, mmap_size) < 0) {
+		if (verify_hdr_checksum(hdr, mmap_size) < 0)
+			goto unmap;
+		/*
+		 * The disk format is actually larger than the in-memory
+		 * format, due to space for nsec etc, so even though the
+		 * in-memory one has room for a few more flags, we can
+		 * allocate using the same index size.  Version 4 names
+		 * are compressed, and have to be counted.
 		 */
-		unsigned long extsize;
-		memcpy(&extsize, (char *)mmap + src_offset + 4, 4);
-		extsize = ntohl(extsize);
-		if (read_index_extension(istate,
-					 (const char *) mmap + src_offset,
-					 (char *) mmap + src_offset + 8,
-					 extsize) < 0)
+		istate->alloc = xmalloc(entries_size(istate, mmap, sizeof(*hdr),
+						     mmap_size - 20,
+						     istate->cache_nr));
+		src_offset = load_cache_entries(istate, mmap, sizeof(*hdr),
+						0, 0, istate->cache_nr);
+		if (read_index_extensions(istate, mmap, mmap_size,
+					  src_offset, 0) < 0 ||
+		    read_index_extensions(istate, mmap, mmap_size,
+					  src_offset, 1) < 0)
 			goto unmap;
-		src_offset += 8;
-		src_offset += extsize;
 	}
 	munmap(mmap, mmap_size);
+	if (istate->sparse_index)
+		sparse_index_loaded(istate);
 	return istate->cache_nr;
 
 unmap:
@@ -1296,9 +1691,14 @@ int discard_index(struct index_state *istate)
 	istate->cache_nr = 0;
 	istate->cache_changed = 0;
 	istate->timestamp = 0;
-	istate->name_hash_initialized = 0;
-	free_hash(&istate->name_hash);
+	free_name_hash(istate);
 	cache_tree_free(&(istate->cache_tree));
+	free_untracked_cache(istate->untracked);
+	istate->untracked = NULL;
+	istate->fsmonitor_last_update = 0;
+	istate->fsmonitor_has_run = 0;
+	istate->sparse_index = 0;
+	discard_split_index(istate);
 	free(istate->alloc);
 	istate->alloc = NULL;
 	istate->initialized = 0;
@@ -1364,7 +1764,7 @@ static int write_index_ext_header(git_SHA_CTX *context, int fd,
 		(ce_write(context, fd, &sz, 4) < 0)) ? -1 : 0;
 }
 
-static int ce_flush(git_SHA_CTX *context, int fd)
+static int ce_flush(git_SHA_CTX *context, int fd, unsigned char *sha1)
 {
 	unsigned int left = write_buffer_len;
 
@@ -1382,6 +1782,8 @@ static int ce_flush(git_SHA_CTX *context, int fd)
 
 	/* Append the SHA1 signature at the end */
 	git_SHA1_Final(write_buffer + left, context);
+	if (sha1)
+		hashcpy(sha1, write_buffer + left);
 	left += 20;
 	return (write_in_full(fd, write_buffer, left) != left) ? -1 : 0;
 }
@@ -1435,12 +1837,32 @@ static void ce_smudge_racily_clean_entry(struct cache_entry *ce)
 	}
 }
 
-static int ce_write_entry(git_SHA_CTX *c, int fd, struct cache_entry *ce)
+/*
+ * Write "ce" and return the number of bytes written, or -1.  With
+ * "previous_name", the name is written the version 4 way, relative
+ * to the previous one, which is then updated.
+ */
+static int ce_write_entry(git_SHA_CTX *c, int fd, struct cache_entry *ce,
+			  struct strbuf *previous_name)
 {
-	int size = ondisk_ce_size(ce);
-	struct ondisk_cache_entry *ondisk = xcalloc(1, size);
+	int size, len = ce_namelen(ce), common = 0, strip = 0;
+	struct ondisk_cache_entry *ondisk;
 	char *name;
 
+	if (!previous_name) {
+		size = ondisk_ce_size(ce);
+	} else {
+		while (common < len && common < previous_name->len &&
+		       ce->name[common] == previous_name->buf[common])
+			common++;
+		strip = previous_name->len - common;
+		size = (ce->ce_flags & CE_EXTENDED ?
+			offsetof(struct ondisk_cache_entry_extended, name) :
+			offsetof(struct ondisk_cache_entry, name)) +
+			encode_varint(strip, NULL) + len - common + 1;
+	}
+	ondisk = xcalloc(1, size);
+
 	ondisk->ctime.sec = htonl(ce->ce_ctime);
 	ondisk->ctime.nsec = 0;
 	ondisk->mtime.sec = htonl(ce->ce_mtime);
@@ -1461,21 +1883,41 @@ static int ce_write_entry(git_SHA_CTX *c, int fd, struct cache_entry *ce)
 	}
 	else
 		name = ondisk->name;
-	memcpy(name, ce->name, ce_namelen(ce));
+	if (!previous_name) {
+		memcpy(name, ce->name, len);
+	} else {
+		name += encode_varint(strip, (unsigned char *)name);
+		memcpy(name, ce->name + common, len - common);
+		strbuf_setlen(previous_name, common);
+		strbuf_add(previous_name, ce->name + common, len - common);
+	}
 
-	return ce_write(c, fd, ondisk, size);
+	if (ce_write(c, fd, ondisk, size) < 0)
+		size = -1;
+	free(ondisk);
+	return size;
 }
 
-int write_index(const struct index_state *istate, int newfd)
+/*
+ * Write the entries that are not removed, and not marked in skip[]
+ * as being in the shared index, followed by the extensions unless we
+ * are writing a shared index.
+ */
+static int do_write_index(const struct index_state *istate, int newfd,
+			  const unsigned char *skip, int shared,
+			  unsigned char *sha1)
 {
 	git_SHA_CTX c;
 	struct cache_header hdr;
-	int i, err, removed, extended;
+	int i, err, removed, extended, written, version, size, ret = -1;
 	struct cache_entry **cache = istate->cache;
 	int entries = istate->cache_nr;
+	struct strbuf offsets = STRBUF_INIT;
+	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	unsigned long offset;
 
 	for (i = removed = extended = 0; i < entries; i++) {
-		if (cache[i]->ce_flags & CE_REMOVE)
+		if ((cache[i]->ce_flags & CE_REMOVE) || (skip && skip[i]))
 			removed++;
 
 		/* reduce extended entries if possible */
@@ -1488,24 +1930,57 @@ int write_index(const struct index_state *istate, int newfd)
 
 	hdr.hdr_signature = htonl(CACHE_SIGNATURE);
 	/* for extended format, increase version so older git won't try to read it */
-	hdr.hdr_version = htonl(extended ? 3 : 2);
+	version = extended ? 3 : 2;
+	if (version < index_version)
+		version = index_version;
+	hdr.hdr_version = htonl(version);
+	previous_name = index_version == 4 ? &previous_name_buf : NULL;
 	hdr.hdr_entries = htonl(entries - removed);
 
 	git_SHA1_Init(&c);
 	if (ce_write(&c, newfd, &hdr, sizeof(hdr)) < 0)
 		return -1;
 
-	for (i = 0; i < entries; i++) {
+	/* Record where blocks of entries start, if it is worth it */
+	if (index_threads != 1 && entries - removed >= 2 * IEOT_BLOCK_SIZE) {
+		uint32_t version = htonl(IEOT_VERSION);
+		strbuf_add(&offsets, &version, 4);
+	}
+	offset = sizeof(hdr);
+	for (i = written = 0; i < entries; i++) {
 		struct cache_entry *ce = cache[i];
-		if (ce->ce_flags & CE_REMOVE)
+		if ((ce->ce_flags & CE_REMOVE) || (skip && skip[i]))
 			continue;
-		if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce))
-			ce_smudge_racily_clean_entry(ce);
-		if (ce_write_entry(&c, newfd, ce) < 0)
-			return -1;
+		if (offsets.len && !(written % IEOT_BLOCK_SIZE)) {
+			uint32_t rec[2];
+			rec[0] = htonl(offset);
+			rec[1] = htonl(entries - removed - written < IEOT_BLOCK_SIZE ?
+				       entries - removed - written : IEOT_BLOCK_SIZE);
+			strbuf_add(&offsets, rec, sizeof(rec));
+			/* a block has to be readable on its own */
+			if (previous_name && previous_name->len)
+				previous_name->buf[0] = '\0';
+		}
+		size = ce_write_entry(&c, newfd, ce, previous_name);
+		if (size < 0)
+			goto out;
+		offset += size;
+		written++;
 	}
+	if (shared)
+		goto entry_offsets;
+
+	/* Write extension data here; "link" has to come first */
+	if (skip) {
+		struct strbuf sb = STRBUF_INIT;
 
-	/* Write extension data here */
+		write_link_extension(&sb, istate);
+		err = write_index_ext_header(&c, newfd, CACHE_EXT_LINK, sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			goto out;
+	}
 	if (istate->cache_tree) {
 		struct strbuf sb = STRBUF_INIT;
 
@@ -1514,9 +1989,162 @@ int write_index(const struct index_state *istate, int newfd)
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
+			goto out;
+	}
+	if (istate->untracked) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_untracked_extension(&sb, istate->untracked);
+		err = write_index_ext_header(&c, newfd, CACHE_EXT_UNTRACKED,
+					     sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			goto out;
+	}
+	if (istate->sparse_index) {
+		err = write_index_ext_header(&c, newfd,
+					     CACHE_EXT_SPARSE_DIRECTORIES, 0) < 0;
+		if (err)
+			goto out;
+	}
+	if (core_fsmonitor && istate->fsmonitor_last_update) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_fsmonitor_extension(&sb, istate);
+		err = write_index_ext_header(&c, newfd, CACHE_EXT_FSMONITOR,
+					     sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			goto out;
+	}
+
+entry_offsets:
+	/* "EOIE" has to come last */
+	if (offsets.len) {
+		uint32_t ext_offset = htonl(offset);
+
+		err = write_index_ext_header(&c, newfd, CACHE_EXT_ENTRY_OFFSETS,
+					     offsets.len) < 0
+			|| ce_write(&c, newfd, offsets.buf, offsets.len) < 0
+			|| write_index_ext_header(&c, newfd,
+						  CACHE_EXT_END_OF_ENTRIES, 4) < 0
+			|| ce_write(&c, newfd, &ext_offset, 4) < 0;
+		if (err)
+			goto out;
+	}
+	ret = ce_flush(&c, newfd, sha1);
+
+out:
+	strbuf_release(&offsets);
+	strbuf_release(&previous_name_buf);
+	return ret;
+}
+
+/*
+ * Shared indexes not used by any index file for two weeks go away,
+ * and so do the temporary files of writers that died before renaming
+ * them into place.
+ */
+static void clean_shared_index_files(const char *current)
+{
+	DIR *dir = opendir(get_git_dir());
+	struct dirent *de;
+	unsigned long expire = time(NULL) - 14 * 86400;
+
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		const char *path;
+		struct stat st;
+
+		if (!prefixcmp(de->d_name, "sharedindex.")) {
+			if (!strcmp(de->d_name + 12, current))
+				continue;
+		} else if (prefixcmp(de->d_name, "sharedindex_"))
+			continue;
+		path = git_path("%s", de->d_name);
+		if (!stat(path, &st) && st.st_mtime < expire)
+			unlink(path);
+	}
+	closedir(dir);
+}
+
+static int write_shared_index(struct index_state *istate)
+{
+	char tmp[PATH_MAX], *path;
+	unsigned char sha1[20];
+	int fd, err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s",
+		     git_path("sharedindex_XXXXXX")) >= sizeof(tmp))
+		return error("shared index path too long");
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return error("unable to create '%s': %s", tmp, strerror(errno));
+	fchmod(fd, 0444);
+	err = do_write_index(istate, fd, NULL, 1, sha1);
+	if (close(fd))
+		err = -1;
+	path = git_path("sharedindex.%s", sha1_to_hex(sha1));
+	if (err || adjust_shared_perm(tmp) || rename(tmp, path)) {
+		unlink(tmp);
+		return error("unable to write shared index '%s'", path);
+	}
+	replace_split_base(istate, sha1);
+	clean_shared_index_files(sha1_to_hex(sha1));
+	return 0;
+}
+
+static int write_sparse_index(struct index_state *istate, int newfd)
+{
+	struct index_state sparse;
+	int ret;
+
+	if (!convert_to_sparse(istate, &sparse))
+		return do_write_index(istate, newfd, NULL, 0, NULL);
+	ret = do_write_index(&sparse, newfd, NULL, 0, NULL);
+	discard_sparse_copy(istate, &sparse);
+	return ret;
+}
+
+int write_index(struct index_state *istate, int newfd)
+{
+	unsigned char *skip;
+	int i, ret;
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce))
+			ce_smudge_racily_clean_entry(ce);
+	}
+	/* a split index never has sparse directory entries */
+	if (istate->sparse_index && (!core_sparse_index || core_split_index))
+		ensure_full_index(istate);
+	if (!core_split_index) {
+		/* the last split index written is the one to clean up after */
+		if (istate->split_index)
+			clean_shared_index_files("");
+		return core_sparse_index ?
+			write_sparse_index(istate, newfd) :
+			do_write_index(istate, newfd, NULL, 0, NULL);
+	}
+
+	skip = prepare_split_delta(istate);
+	if (!skip) {
+		if (write_shared_index(istate) < 0)
 			return -1;
+		skip = prepare_split_delta(istate);
 	}
-	return ce_flush(&c, newfd);
+	ret = do_write_index(istate, newfd, skip, 0, NULL);
+	free(skip);
+	/* keep the shared index from expiring */
+	utime(git_path("sharedindex.%s",
+		       sha1_to_hex(istate->split_index->base_sha1)), NULL);
+	return ret;
 }
 
 /*
@@ -3,150 +3,244 @@
 #include "object.h"
 #include "tag.h"
 #include "dir.h"
+#include "string-list.h"
 
 /* ISSYMREF=01 and ISPACKED=02 are public interfaces */
 #define REF_KNOWS_PEELED 04
+#define REF_DIR 010
+#define REF_INCOMPLETE 020 /* a loose directory that has not been read yet */
 
-struct ref_list {
-	struct ref_list *next;
-	unsigned char flag; /* ISSYMREF? ISPACKED? */
-	unsigned char sha1[20];
-	unsigned char peeled[20];
+struct ref_entry;
+
+/*
+ * The refs are kept in a tree that follows their directories: the
+ * entries of a directory are sorted by their full name, and those
+ * that are directories themselves have a name that ends with a slash.
+ * Loose directories are only read when something looks into them.
+ */
+struct ref_dir {
+	int nr, alloc;
+	int sorted; /* the first "sorted" entries are in order */
+	struct ref_entry **entries;
+};
+
+struct ref_entry {
+	unsigned char flag; /* ISSYMREF? ISPACKED? DIR? */
+	union {
+		struct {
+			unsigned char sha1[20];
+			unsigned char peeled[20];
+		} value;
+		struct ref_dir subdir;
+	} u;
 	char name[FLEX_ARRAY];
 };
 
-static const char *parse_ref_line(char *line, unsigned char *sha1)
+/*
+ * Parse a "<sha1> <name>" line of packed-refs that ends with the
+ * newline at "eol"; returns the length of the name, which starts at
+ * line + 41, or -1 if it is not such a line.
+ */
+static int parse_ref_line(const char *line, const char *eol,
+			  unsigned char *sha1)
 {
 	/*
-	 * 42: the answer to everything.
+	 * 41: the answer to everything, less the newline.
 	 *
 	 * In this case, it happens to be the answer to
 	 *  40 (length of sha1 hex representation)
 	 *  +1 (space in between hex and name)
-	 *  +1 (newline at the end of the line)
 	 */
-	int len = strlen(line) - 42;
+	int len = eol - line - 41;
 
 	if (len <= 0)
-		return NULL;
+		return -1;
 	if (get_sha1_hex(line, sha1) < 0)
-		return NULL;
+		return -1;
 	if (!isspace(line[40]))
-		return NULL;
-	line += 41;
-	if (isspace(*line))
-		return NULL;
-	if (line[len] != '\n')
-		return NULL;
-	line[len] = 0;
-
-	return line;
+		return -1;
+	if (isspace(line[41]))
+		return -1;
+	return len;
 }
 
-static struct ref_list *add_ref(const char *name, const unsigned char *sha1,
-				int flag, struct ref_list *list,
-				struct ref_list **new_entry)
+static struct ref_entry *create_ref_entry(const char *name, int len, int flag)
 {
-	int len;
-	struct ref_list *entry;
+	struct ref_entry *entry = xcalloc(1, sizeof(struct ref_entry) + len + 1);
 
-	/* Allocate it and add it in.. */
-	len = strlen(name) + 1;
-	entry = xmalloc(sizeof(struct ref_list) + len);
-	hashcpy(entry->sha1, sha1);
-	hashclr(entry->peeled);
 	memcpy(entry->name, name, len);
 	entry->flag = flag;
-	entry->next = list;
-	if (new_entry)
-		*new_entry = entry;
 	return entry;
 }
 
-/* merge sort the ref list */
-static struct ref_list *sort_ref_list(struct ref_list *list)
+static void free_ref_entry(struct ref_entry *entry);
+
+static void clear_ref_dir(struct ref_dir *dir)
 {
-	int psize, qsize, last_merge_count, cmp;
-	struct ref_list *p, *q, *l, *e;
-	struct ref_list *new_list = list;
-	int k = 1;
-	int merge_count = 0;
+	int i;
 
-	if (!list)
-		return list;
+	for (i = 0; i < dir->nr; i++)
+		free_ref_entry(dir->entries[i]);
+	free(dir->entries);
+	memset(dir, 0, sizeof(*dir));
+}
 
-	do {
-		last_merge_count = merge_count;
-		merge_count = 0;
+static void free_ref_entry(struct ref_entry *entry)
+{
+	if (entry->flag & REF_DIR)
+		clear_ref_dir(&entry->u.subdir);
+	free(entry);
+}
 
-		psize = 0;
+static void add_entry_to_dir(struct ref_dir *dir, struct ref_entry *entry)
+{
+	ALLOC_GROW(dir->entries, dir->nr + 1, dir->alloc);
+	dir->entries[dir->nr++] = entry;
+	if (dir->sorted == dir->nr - 1 &&
+	    (!dir->sorted ||
+	     strcmp(dir->entries[dir->sorted - 1]->name, entry->name) < 0))
+		dir->sorted = dir->nr;
+}
 
-		p = new_list;
-		q = new_list;
-		new_list = NULL;
-		l = NULL;
+static int ref_entry_cmp(const void *a_, const void *b_)
+{
+	struct ref_entry *a = *(struct ref_entry **)a_;
+	struct ref_entry *b = *(struct ref_entry **)b_;
+	return strcmp(a->name, b->name);
+}
 
-		while (p) {
-			merge_count++;
+static void sort_ref_dir(struct ref_dir *dir)
+{
+	int i, j;
 
-			while (psize < k && q->next) {
-				q = q->next;
-				psize++;
-			}
-			qsize = k;
-
-			while ((psize > 0) || (qsize > 0 && q)) {
-				if (qsize == 0 || !q) {
-					e = p;
-					p = p->next;
-					psize--;
-				} else if (psize == 0) {
-					e = q;
-					q = q->next;
-					qsize--;
-				} else {
-					cmp = strcmp(q->name, p->name);
-					if (cmp < 0) {
-						e = q;
-						q = q->next;
-						qsize--;
-					} else if (cmp > 0) {
-						e = p;
-						p = p->next;
-						psize--;
-					} else {
-						if (hashcmp(q->sha1, p->sha1))
-							die("Duplicated ref, and SHA1s don't match: %s",
-							    q->name);
-						warning("Duplicated ref: %s", q->name);
-						e = q;
-						q = q->next;
-						qsize--;
-						free(e);
-						e = p;
-						p = p->next;
-						psize--;
-					}
-				}
+	if (dir->sorted == dir->nr)
+		return;
+	qsort(dir->entries, dir->nr, sizeof(*dir->entries), ref_entry_cmp);
 
-				e->next = NULL;
+	/* the same ref can only be there twice in a broken packed-refs */
+	for (i = j = 1; i < dir->nr; i++) {
+		struct ref_entry *prev = dir->entries[j - 1];
+		struct ref_entry *entry = dir->entries[i];
 
-				if (l)
-					l->next = e;
-				if (!new_list)
-					new_list = e;
-				l = e;
-			}
+		if (strcmp(prev->name, entry->name)) {
+			dir->entries[j++] = entry;
+			continue;
+		}
+		if ((prev->flag | entry->flag) & REF_DIR)
+			die("Duplicated ref directory: %s", entry->name);
+		if (hashcmp(prev->u.value.sha1, entry->u.value.sha1))
+			die("Duplicated ref, and SHA1s don't match: %s",
+			    entry->name);
+		warning("Duplicated ref: %s", entry->name);
+		free_ref_entry(entry);
+	}
+	dir->nr = dir->sorted = j;
+}
 
-			p = q;
-		};
+static void read_packed_dir(const char *dirname, struct ref_dir *dir);
+static void read_loose_refs(const char *dirname, struct ref_dir *dir);
 
-		k = k * 2;
-	} while ((last_merge_count != merge_count) || (last_merge_count != 1));
+static struct ref_dir *get_ref_dir(struct ref_entry *entry)
+{
+	if (entry->flag & REF_INCOMPLETE) {
+		if (entry->flag & REF_ISPACKED)
+			read_packed_dir(entry->name, &entry->u.subdir);
+		else
+			read_loose_refs(entry->name, &entry->u.subdir);
+		entry->flag &= ~REF_INCOMPLETE;
+	}
+	return &entry->u.subdir;
+}
 
-	return new_list;
+/* Find the entry named by the first "len" bytes of "name" in "dir" */
+static int search_ref_dir(struct ref_dir *dir, const char *name, int len)
+{
+	int lo = 0, hi;
+
+	sort_ref_dir(dir);
+	hi = dir->nr;
+	while (lo < hi) {
+		int mi = (lo + hi) / 2;
+		const char *mi_name = dir->entries[mi]->name;
+		int cmp = strncmp(mi_name, name, len);
+
+		if (!cmp)
+			cmp = (unsigned char)mi_name[len];
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return -1;
+}
+
+/*
+ * Find the directory that "name" is in, reading loose directories on
+ * the way.  With "mkdir", missing directories are created; otherwise
+ * NULL is returned for them.
+ */
+static struct ref_dir *find_containing_dir(struct ref_dir *dir,
+					   const char *name, int mkdir)
+{
+	const char *slash;
+
+	for (slash = strchr(name, '/'); slash; slash = strchr(slash + 1, '/')) {
+		int len = slash - name + 1, pos;
+		struct ref_entry *entry;
+
+		pos = search_ref_dir(dir, name, len);
+		if (pos >= 0) {
+			entry = dir->entries[pos];
+		} else {
+			if (!mkdir)
+				return NULL;
+			entry = create_ref_entry(name, len, REF_DIR);
+			add_entry_to_dir(dir, entry);
+		}
+		if (!(entry->flag & REF_DIR))
+			return NULL;
+		dir = get_ref_dir(entry);
+	}
+	return dir;
+}
+
+static struct ref_entry *find_ref(struct ref_dir *dir, const char *name)
+{
+	int pos;
+
+	dir = find_containing_dir(dir, name, 0);
+	if (!dir)
+		return NULL;
+	pos = search_ref_dir(dir, name, strlen(name));
+	if (pos < 0 || (dir->entries[pos]->flag & REF_DIR))
+		return NULL;
+	return dir->entries[pos];
+}
+
+static void add_ref(struct ref_dir *dir, struct ref_entry *entry)
+{
+	dir = find_containing_dir(dir, entry->name, 1);
+	if (!dir)
+		die("'%s' is both a ref and a directory of refs", entry->name);
+	add_entry_to_dir(dir, entry);
 }
 
+/*
+ * The packed-refs file, mapped into memory.  When its header says
+ * that the refs are sorted, a single ref is found with a binary
+ * search, and a directory of the cache is only filled from the part
+ * of the file it covers, when something looks into it.
+ */
+struct packed_refs_file {
+	char *buf, *eof;
+	const char *refs; /* the first line after the header */
+	size_t size;
+	int flag; /* REF_ISPACKED, and REF_KNOWS_PEELED if it says so */
+	int sorted;
+};
+
 /*
  * Future: need to be in "struct repository"
  * when doing a full libification.
@@ -154,146 +248,344 @@ static struct ref_list *sort_ref_list(struct ref_list *list)
 static struct cached_refs {
 	char did_loose;
 	char did_packed;
-	struct ref_list *loose;
-	struct ref_list *packed;
+	struct ref_dir loose;
+	struct ref_dir packed;
+	struct packed_refs_file file;
 } cached_refs;
-static struct ref_list *current_ref;
+static struct ref_entry *current_ref;
 
-static struct ref_list *extra_refs;
+static struct ref_dir extra_refs;
 
-static void free_ref_list(struct ref_list *list)
+static void map_packed_refs(const char *path, struct packed_refs_file *file)
 {
-	struct ref_list *next;
-	for ( ; list; list = next) {
-		next = list->next;
-		free(list);
+	static const char header[] = "# pack-refs with:";
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(file, 0, sizeof(*file));
+	file->flag = REF_ISPACKED;
+	if (fd < 0)
+		return;
+	if (!fstat(fd, &st) && st.st_size > 0) {
+		file->size = xsize_t(st.st_size);
+		file->buf = xmmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+				  fd, 0);
+		file->eof = file->buf + file->size;
+	}
+	close(fd);
+	file->refs = file->buf;
+
+	if (file->size >= sizeof(header) - 1 &&
+	    !memcmp(file->buf, header, sizeof(header) - 1)) {
+		const char *eol = memchr(file->buf, '\n', file->size);
+		char *traits;
+
+		if (!eol)
+			eol = file->eof;
+		traits = xmemdupz(file->buf + sizeof(header) - 1,
+				  eol - file->buf - (sizeof(header) - 1));
+		if (strstr(traits, " peeled "))
+			file->flag |= REF_KNOWS_PEELED;
+		if (strstr(traits, " sorted "))
+			file->sorted = 1;
+		/* perhaps other traits later as well */
+		free(traits);
+		file->refs = eol < file->eof ? eol + 1 : eol;
 	}
+	/* the binary search wants every line to be terminated */
+	if (file->sorted && file->eof[-1] != '\n')
+		file->sorted = 0;
+}
+
+static void unmap_packed_refs(struct packed_refs_file *file)
+{
+	if (file->buf)
+		munmap(file->buf, file->size);
+	memset(file, 0, sizeof(*file));
 }
 
 static void invalidate_cached_refs(void)
 {
 	struct cached_refs *ca = &cached_refs;
 
-	if (ca->did_loose && ca->loose)
-		free_ref_list(ca->loose);
-	if (ca->did_packed && ca->packed)
-		free_ref_list(ca->packed);
-	ca->loose = ca->packed = NULL;
+	clear_ref_dir(&ca->loose);
+	clear_ref_dir(&ca->packed);
+	unmap_packed_refs(&ca->file);
 	ca->did_loose = ca->did_packed = 0;
 }
 
-static void read_packed_refs(FILE *f, struct cached_refs *cached_refs)
+/*
+ * A record of packed-refs is a ref line, perhaps followed by a "^"
+ * line with the object the ref peels to.  Parse the one at "rec";
+ * returns the length of its name, which starts at rec + 41, or -1 if
+ * it is not a ref, and sets *next to the record after it.
+ */
+static int parse_record(const char *rec, const char *eof,
+			unsigned char *sha1, unsigned char *peeled,
+			const char **next)
 {
-	struct ref_list *list = NULL;
-	struct ref_list *last = NULL;
-	char refline[PATH_MAX];
-	int flag = REF_ISPACKED;
+	const char *eol = memchr(rec, '\n', eof - rec);
+	int len;
 
-	while (fgets(refline, sizeof(refline), f)) {
-		unsigned char sha1[20];
-		const char *name;
-		static const char header[] = "# pack-refs with:";
-
-		if (!strncmp(refline, header, sizeof(header)-1)) {
-			const char *traits = refline + sizeof(header) - 1;
-			if (strstr(traits, " peeled "))
-				flag |= REF_KNOWS_PEELED;
-			/* perhaps other traits later as well */
-			continue;
+	if (!eol) {
+		*next = eof;
+		return -1;
+	}
+	len = parse_ref_line(rec, eol, sha1);
+	rec = eol + 1;
+	hashclr(peeled);
+	if (rec < eof && *rec == '^') {
+		eol = memchr(rec, '\n', eof - rec);
+		if (!eol)
+			eol = eof;
+		if (len < 0 || eol - rec != 41 || get_sha1_hex(rec + 1, peeled))
+			hashclr(peeled);
+		rec = eol < eof ? eol + 1 : eof;
+	}
+	*next = rec;
+	return len;
+}
+
+static struct ref_entry *create_packed_entry(const struct packed_refs_file *file,
+					     const char *rec, int len,
+					     const unsigned char *sha1,
+					     const unsigned char *peeled)
+{
+	struct ref_entry *entry = create_ref_entry(rec + 41, len, file->flag);
+
+	hashcpy(entry->u.value.sha1, sha1);
+	hashcpy(entry->u.value.peeled, peeled);
+	return entry;
+}
+
+/* Read all of the packed-refs, which may not be sorted */
+static void read_packed_refs(const struct packed_refs_file *file,
+			     struct ref_dir *dir)
+{
+	const char *rec, *next;
+
+	for (rec = file->refs; rec < file->eof; rec = next) {
+		unsigned char sha1[20], peeled[20];
+		int len = parse_record(rec, file->eof, sha1, peeled, &next);
+
+		if (len >= 0)
+			add_ref(dir, create_packed_entry(file, rec, len,
+							 sha1, peeled));
+	}
+}
+
+/* Compare the name of the record at "rec" with "key" */
+static int cmp_record(const char *rec, const char *eof,
+		      const char *key, int keylen)
+{
+	const char *eol = memchr(rec, '\n', eof - rec);
+	const char *name = rec + 41;
+	int len, cmp;
+
+	if (eol - rec < 41)
+		name = eol;
+	len = eol - name;
+	cmp = memcmp(name, key, len < keylen ? len : keylen);
+	return cmp ? cmp : len - keylen;
+}
+
+/* Back up from "p" to the start of its record, but not beyond "lo" */
+static const char *record_start(const char *lo, const char *p)
+{
+	while (p > lo && p[-1] != '\n')
+		p--;
+	if (p > lo && *p == '^') {
+		p--;
+		while (p > lo && p[-1] != '\n')
+			p--;
+	}
+	return p;
+}
+
+/*
+ * Find the first record of the sorted packed-refs whose name does not
+ * sort before "key".
+ */
+static const char *find_packed_record(const struct packed_refs_file *file,
+				      const char *key, int keylen)
+{
+	const char *lo = file->refs, *hi = file->eof;
+
+	while (lo < hi) {
+		const char *mi = record_start(lo, lo + (hi - lo) / 2);
+
+		if (cmp_record(mi, file->eof, key, keylen) < 0) {
+			unsigned char sha1[20], peeled[20];
+			parse_record(mi, file->eof, sha1, peeled, &lo);
+		} else {
+			hi = mi;
 		}
+	}
+	return lo;
+}
+
+/*
+ * Look a ref up in the sorted packed-refs without reading the rest;
+ * returns 0 if it is there.
+ */
+static int find_packed_ref(const struct packed_refs_file *file,
+			   const char *name,
+			   unsigned char *sha1, unsigned char *peeled)
+{
+	int len = strlen(name);
+	const char *rec = find_packed_record(file, name, len);
+	const char *next;
 
-		name = parse_ref_line(refline, sha1);
-		if (name) {
-			list = add_ref(name, sha1, flag, list, &last);
+	if (rec == file->eof || cmp_record(rec, file->eof, name, len))
+		return -1;
+	return parse_record(rec, file->eof, sha1, peeled, &next) == len ? 0 : -1;
+}
+
+/*
+ * Fill "dir" with the refs and subdirectories of "dirname" from the
+ * sorted packed-refs; the refs in a subdirectory are skipped with
+ * another binary search, and only read when it is looked into.
+ */
+static void read_packed_dir(const char *dirname, struct ref_dir *dir)
+{
+	const struct packed_refs_file *file = &cached_refs.file;
+	int baselen = strlen(dirname);
+	struct strbuf key = STRBUF_INIT;
+	const char *rec, *next;
+
+	for (rec = find_packed_record(file, dirname, baselen);
+	     rec < file->eof;
+	     rec = next) {
+		unsigned char sha1[20], peeled[20];
+		int len = parse_record(rec, file->eof, sha1, peeled, &next);
+		const char *name = rec + 41, *slash;
+
+		if (len < 0)
+			continue;
+		if (len < baselen || memcmp(name, dirname, baselen))
+			break;
+		slash = memchr(name + baselen, '/', len - baselen);
+		if (!slash) {
+			add_entry_to_dir(dir, create_packed_entry(file, rec, len,
+								  sha1, peeled));
 			continue;
 		}
-		if (last &&
-		    refline[0] == '^' &&
-		    strlen(refline) == 42 &&
-		    refline[41] == '\n' &&
-		    !get_sha1_hex(refline + 1, sha1))
-			hashcpy(last->peeled, sha1);
+		len = slash - name + 1;
+		add_entry_to_dir(dir, create_ref_entry(name, len,
+				 REF_DIR | REF_INCOMPLETE | REF_ISPACKED));
+		/* the refs in "name/" all sort before "name0" */
+		strbuf_reset(&key);
+		strbuf_add(&key, name, len);
+		key.buf[len - 1] = '/' + 1;
+		next = find_packed_record(file, key.buf, len);
 	}
-	cached_refs->packed = sort_ref_list(list);
+	strbuf_release(&key);
 }
 
 void add_extra_ref(const char *name, const unsigned char *sha1, int flag)
 {
-	extra_refs = add_ref(name, sha1, flag, extra_refs, NULL);
+	struct ref_entry *entry = create_ref_entry(name, strlen(name), flag);
+
+	hashcpy(entry->u.value.sha1, sha1);
+	add_entry_to_dir(&extra_refs, entry);
 }
 
 void clear_extra_refs(void)
 {
-	free_ref_list(extra_refs);
-	extra_refs = NULL;
+	clear_ref_dir(&extra_refs);
 }
 
-static struct ref_list *get_packed_refs(void)
+static struct ref_dir *get_packed_refs(void)
 {
 	if (!cached_refs.did_packed) {
-		FILE *f = fopen(git_path("packed-refs"), "r");
-		cached_refs.packed = NULL;
-		if (f) {
-			read_packed_refs(f, &cached_refs);
-			fclose(f);
-		}
+		struct packed_refs_file *file = &cached_refs.file;
+
+		map_packed_refs(git_path("packed-refs"), file);
+		if (file->sorted)
+			read_packed_dir("", &cached_refs.packed);
+		else
+			read_packed_refs(file, &cached_refs.packed);
 		cached_refs.did_packed = 1;
 	}
-	return cached_refs.packed;
+	return &cached_refs.packed;
 }
 
-static struct ref_list *get_ref_dir(const char *base, struct ref_list *list)
+/*
+ * Look up a single packed ref; returns its flags, or -1 if there is
+ * no such ref.
+ */
+static int get_packed_ref(const char *name,
+			  unsigned char *sha1, unsigned char *peeled)
 {
-	DIR *dir = opendir(git_path("%s", base));
-
-	if (dir) {
-		struct dirent *de;
-		int baselen = strlen(base);
-		char *ref = xmalloc(baselen + 257);
-
-		memcpy(ref, base, baselen);
-		if (baselen && base[baselen-1] != '/')
-			ref[baselen++] = '/';
+	struct packed_refs_file *file = &cached_refs.file;
+	struct ref_entry *entry = NULL;
+
+	get_packed_refs();
+	if (file->sorted)
+		return find_packed_ref(file, name, sha1, peeled) ? -1 : file->flag;
+	entry = find_ref(&cached_refs.packed, name);
+	if (!entry)
+		return -1;
+	hashcpy(sha1, entry->u.value.sha1);
+	hashcpy(peeled, entry->u.value.peeled);
+	return entry->flag;
+}
 
-		while ((de = readdir(dir)) != NULL) {
-			unsigned char sha1[20];
-			struct stat st;
-			int flag;
-			int namelen;
+/* Read the loose refs in "dirname", which ends with a slash */
+static void read_loose_refs(const char *dirname, struct ref_dir *dir)
+{
+	DIR *d = opendir(git_path("%s", dirname));
+	struct dirent *de;
+	int baselen = strlen(dirname);
+	char *ref;
+
+	if (!d)
+		return;
+	ref = xmalloc(baselen + 257);
+	memcpy(ref, dirname, baselen);
+	while ((de = readdir(d)) != NULL) {
+		unsigned char sha1[20];
+		struct stat st;
+		int flag;
+		int namelen;
 
-			if (de->d_name[0] == '.')
-				continue;
-			namelen = strlen(de->d_name);
-			if (namelen > 255)
-				continue;
-			if (has_extension(de->d_name, ".lock"))
-				continue;
-			memcpy(ref + baselen, de->d_name, namelen+1);
-			if (stat(git_path("%s", ref), &st) < 0)
-				continue;
-			if (S_ISDIR(st.st_mode)) {
-				list = get_ref_dir(ref, list);
-				continue;
-			}
-			if (!resolve_ref(ref, sha1, 1, &flag)) {
-				error("%s points nowhere!", ref);
-				continue;
-			}
-			list = add_ref(ref, sha1, flag, list, NULL);
+		if (de->d_name[0] == '.')
+			continue;
+		namelen = strlen(de->d_name);
+		if (namelen > 255)
+			continue;
+		if (has_extension(de->d_name, ".lock"))
+			continue;
+		memcpy(ref + baselen, de->d_name, namelen+1);
+		if (stat(git_path("%s", ref), &st) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			ref[baselen + namelen] = '/';
+			add_entry_to_dir(dir, create_ref_entry(ref,
+				baselen + namelen + 1, REF_DIR | REF_INCOMPLETE));
+			continue;
 		}
-		free(ref);
-		closedir(dir);
+		if (!resolve_ref(ref, sha1, 1, &flag)) {
+			error("%s points nowhere!", ref);
+			continue;
+		}
+		add_entry_to_dir(dir, create_ref_entry(ref, baselen + namelen,
+						       flag));
+		hashcpy(dir->entries[dir->nr - 1]->u.value.sha1, sha1);
 	}
-	return sort_ref_list(list);
+	free(ref);
+	closedir(d);
 }
 
-static struct ref_list *get_loose_refs(void)
+static struct ref_dir *get_loose_refs(void)
 {
 	if (!cached_refs.did_loose) {
-		cached_refs.loose = get_ref_dir("refs", NULL);
+		add_entry_to_dir(&cached_refs.loose,
+				 create_ref_entry("refs/", 5,
+						  REF_DIR | REF_INCOMPLETE));
 		cached_refs.did_loose = 1;
 	}
-	return cached_refs.loose;
+	return &cached_refs.loose;
 }
 
 /* We allow "recursive" symbolic refs. Only within reason, though */
@@ -302,28 +594,27 @@ static struct ref_list *get_loose_refs(void)
 
 static int resolve_gitlink_packed_ref(char *name, int pathlen, const char *refname, unsigned char *result)
 {
-	FILE *f;
-	struct cached_refs refs;
-	struct ref_list *ref;
-	int retval;
+	struct packed_refs_file file;
+	struct ref_dir refs;
+	struct ref_entry *ref;
+	unsigned char peeled[20];
+	int retval = -1;
 
 	strcpy(name + pathlen, "packed-refs");
-	f = fopen(name, "r");
-	if (!f)
-		return -1;
-	read_packed_refs(f, &refs);
-	fclose(f);
-	ref = refs.packed;
-	retval = -1;
-	while (ref) {
-		if (!strcmp(ref->name, refname)) {
+	map_packed_refs(name, &file);
+	if (file.sorted) {
+		retval = find_packed_ref(&file, refname, result, peeled);
+	} else {
+		memset(&refs, 0, sizeof(refs));
+		read_packed_refs(&file, &refs);
+		ref = find_ref(&refs, refname);
+		if (ref) {
 			retval = 0;
-			memcpy(result, ref->sha1, 20);
-			break;
+			hashcpy(result, ref->u.value.sha1);
 		}
-		ref = ref->next;
+		clear_ref_dir(&refs);
 	}
-	free_ref_list(refs.packed);
+	unmap_packed_refs(&file);
 	return retval;
 }
 
@@ -424,15 +715,11 @@ const char *resolve_ref(const char *ref, unsigned char *sha1, int reading, int *
 		git_snpath(path, sizeof(path), "%s", ref);
 		/* Special case: non-existing file. */
 		if (lstat(path, &st) < 0) {
-			struct ref_list *list = get_packed_refs();
-			while (list) {
-				if (!strcmp(ref, list->name)) {
-					hashcpy(sha1, list->sha1);
-					if (flag)
-						*flag |= REF_ISPACKED;
-					return ref;
-				}
-				list = list->next;
+			unsigned char peeled[20];
+			if (get_packed_ref(ref, sha1, peeled) >= 0) {
+				if (flag)
+					*flag |= REF_ISPACKED;
+				return ref;
 			}
 			if (reading || errno != ENOENT)
 				return NULL;
@@ -499,18 +786,19 @@ int read_ref(const char *ref, unsigned char *sha1)
 }
 
 static int do_one_ref(const char *base, each_ref_fn fn, int trim,
-		      void *cb_data, struct ref_list *entry)
+		      void *cb_data, struct ref_entry *entry)
 {
 	if (strncmp(base, entry->name, trim))
 		return 0;
-	if (is_null_sha1(entry->sha1))
+	if (is_null_sha1(entry->u.value.sha1))
 		return 0;
-	if (!has_sha1_file(entry->sha1)) {
+	if (!has_sha1_file(entry->u.value.sha1)) {
 		error("%s does not point to a valid object!", entry->name);
 		return 0;
 	}
 	current_ref = entry;
-	return fn(entry->name + trim, entry->sha1, entry->flag, cb_data);
+	return fn(entry->name + trim, entry->u.value.sha1, entry->flag,
+		  cb_data);
 }
 
 int peel_ref(const char *ref, unsigned char *sha1)
@@ -522,10 +810,10 @@ int peel_ref(const char *ref, unsigned char *sha1)
 	if (current_ref && (current_ref->name == ref
 		|| !strcmp(current_ref->name, ref))) {
 		if (current_ref->flag & REF_KNOWS_PEELED) {
-			hashcpy(sha1, current_ref->peeled);
+			hashcpy(sha1, current_ref->u.value.peeled);
 			return 0;
 		}
-		hashcpy(base, current_ref->sha1);
+		hashcpy(base, current_ref->u.value.sha1);
 		goto fallback;
 	}
 
@@ -533,18 +821,13 @@ int peel_ref(const char *ref, unsigned char *sha1)
 		return -1;
 
 	if ((flag & REF_ISPACKED)) {
-		struct ref_list *list = get_packed_refs();
+		unsigned char packed[20], peeled[20];
+		int packed_flag = get_packed_ref(ref, packed, peeled);
 
-		while (list) {
-			if (!strcmp(list->name, ref)) {
-				if (list->flag & REF_KNOWS_PEELED) {
-					hashcpy(sha1, list->peeled);
-					return 0;
-				}
-				/* older pack-refs did not leave peeled ones */
-				break;
-			}
-			list = list->next;
+		/* older pack-refs did not leave peeled ones */
+		if (packed_flag >= 0 && (packed_flag & REF_KNOWS_PEELED)) {
+			hashcpy(sha1, peeled);
+			return 0;
 		}
 	}
 
@@ -560,44 +843,112 @@ fallback:
 	return -1;
 }
 
-static int do_for_each_ref(const char *base, each_ref_fn fn, int trim,
-			   void *cb_data)
-{
-	int retval = 0;
-	struct ref_list *packed = get_packed_refs();
-	struct ref_list *loose = get_loose_refs();
-
-	struct ref_list *extra;
+typedef int each_entry_fn(struct ref_entry *entry, void *cb_data);
 
-	for (extra = extra_refs; extra; extra = extra->next)
-		retval = do_one_ref(base, fn, trim, cb_data, extra);
+static int do_for_each_entry_in_dir(struct ref_dir *dir, each_entry_fn fn,
+				    void *cb_data)
+{
+	int i, retval = 0;
+
+	sort_ref_dir(dir);
+	for (i = 0; !retval && i < dir->nr; i++) {
+		struct ref_entry *entry = dir->entries[i];
+		if (entry->flag & REF_DIR)
+			retval = do_for_each_entry_in_dir(get_ref_dir(entry),
+							  fn, cb_data);
+		else
+			retval = fn(entry, cb_data);
+	}
+	return retval;
+}
 
-	while (packed && loose) {
-		struct ref_list *entry;
-		int cmp = strcmp(packed->name, loose->name);
-		if (!cmp) {
-			packed = packed->next;
+/*
+ * Walk two directories of the same name, one from the packed refs
+ * and one from the loose ones, in order; a loose ref hides the packed
+ * one of the same name.
+ */
+static int do_for_each_entry_in_dirs(struct ref_dir *packed,
+				     struct ref_dir *loose,
+				     each_entry_fn fn, void *cb_data)
+{
+	int p = 0, l = 0, retval = 0;
+
+	sort_ref_dir(packed);
+	sort_ref_dir(loose);
+	while (!retval && (p < packed->nr || l < loose->nr)) {
+		struct ref_entry *entry;
+		int cmp;
+
+		if (p == packed->nr)
+			cmp = 1;
+		else if (l == loose->nr)
+			cmp = -1;
+		else
+			cmp = strcmp(packed->entries[p]->name,
+				     loose->entries[l]->name);
+		if (!cmp && (packed->entries[p]->flag &
+			     loose->entries[l]->flag & REF_DIR)) {
+			retval = do_for_each_entry_in_dirs(
+					get_ref_dir(packed->entries[p++]),
+					get_ref_dir(loose->entries[l++]),
+					fn, cb_data);
 			continue;
 		}
-		if (cmp > 0) {
-			entry = loose;
-			loose = loose->next;
-		} else {
-			entry = packed;
-			packed = packed->next;
-		}
-		retval = do_one_ref(base, fn, trim, cb_data, entry);
-		if (retval)
-			goto end_each;
+		if (!cmp)
+			p++;
+		if (cmp < 0)
+			entry = packed->entries[p++];
+		else
+			entry = loose->entries[l++];
+		if (entry->flag & REF_DIR)
+			retval = do_for_each_entry_in_dir(get_ref_dir(entry),
+							  fn, cb_data);
+		else
+			retval = fn(entry, cb_data);
 	}
+	return retval;
+}
 
-	for (packed = packed ? packed : loose; packed; packed = packed->next) {
-		retval = do_one_ref(base, fn, trim, cb_data, packed);
-		if (retval)
-			goto end_each;
-	}
+struct each_ref_data {
+	const char *base;
+	int trim;
+	each_ref_fn *fn;
+	void *cb_data;
+};
+
+static int do_one_ref_entry(struct ref_entry *entry, void *cb_data)
+{
+	struct each_ref_data *data = cb_data;
+	return do_one_ref(data->base, data->fn, data->trim, data->cb_data,
+			  entry);
+}
+
+static int do_for_each_ref(const char *base, each_ref_fn fn, int trim,
+			   void *cb_data)
+{
+	int i, retval = 0;
+	struct ref_dir *packed, *loose;
+	struct each_ref_data data;
+
+	for (i = 0; i < extra_refs.nr; i++)
+		retval = do_one_ref(base, fn, trim, cb_data,
+				    extra_refs.entries[i]);
+
+	/* Only the directories "base" is in need to be looked at */
+	packed = find_containing_dir(get_packed_refs(), base, 0);
+	loose = find_containing_dir(get_loose_refs(), base, 0);
+
+	data.base = base;
+	data.trim = trim;
+	data.fn = fn;
+	data.cb_data = cb_data;
+	if (packed && loose)
+		retval = do_for_each_entry_in_dirs(packed, loose,
+						   do_one_ref_entry, &data);
+	else if (packed || loose)
+		retval = do_for_each_entry_in_dir(packed ? packed : loose,
+						  do_one_ref_entry, &data);
 
-end_each:
 	current_ref = NULL;
 	return retval;
 }
@@ -767,27 +1118,61 @@ static int remove_empty_directories(const char *file)
 	return result;
 }
 
+static int is_other_ref(struct ref_entry *entry, const char *oldref)
+{
+	return !oldref || strcmp(oldref, entry->name);
+}
+
+static struct ref_entry *first_other_ref(struct ref_dir *dir,
+					 const char *oldref)
+{
+	int i;
+
+	for (i = 0; i < dir->nr; i++) {
+		struct ref_entry *entry = dir->entries[i];
+		if (entry->flag & REF_DIR)
+			entry = first_other_ref(get_ref_dir(entry), oldref);
+		else if (!is_other_ref(entry, oldref))
+			entry = NULL;
+		if (entry)
+			return entry;
+	}
+	return NULL;
+}
+
 static int is_refname_available(const char *ref, const char *oldref,
-				struct ref_list *list, int quiet)
-{
-	int namlen = strlen(ref); /* e.g. 'foo/bar' */
-	while (list) {
-		/* list->name could be 'foo' or 'foo/bar/baz' */
-		if (!oldref || strcmp(oldref, list->name)) {
-			int len = strlen(list->name);
-			int cmplen = (namlen < len) ? namlen : len;
-			const char *lead = (namlen < len) ? list->name : ref;
-			if (!strncmp(ref, list->name, cmplen) &&
-			    lead[cmplen] == '/') {
-				if (!quiet)
-					error("'%s' exists; cannot create '%s'",
-					      list->name, ref);
-				return 0;
-			}
-		}
-		list = list->next;
+				struct ref_dir *dir, int quiet)
+{
+	struct ref_entry *entry = NULL;
+	struct ref_dir *subdir;
+	char *name = xstrdup(ref); /* e.g. 'foo/bar' */
+	char *slash;
+
+	/* Is any of 'foo', 'foo/bar/' ... a ref? */
+	for (slash = strchr(name, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		entry = find_ref(dir, name);
+		*slash = '/';
+		if (entry && is_other_ref(entry, oldref))
+			break;
+		entry = NULL;
 	}
-	return 1;
+
+	/* Or is there a ref in 'foo/bar/'? */
+	if (!entry) {
+		name = xrealloc(name, strlen(ref) + 2);
+		strcat(name, "/");
+		subdir = find_containing_dir(dir, name, 0);
+		if (subdir)
+			entry = first_other_ref(subdir, oldref);
+	}
+	free(name);
+
+	if (!entry)
+		return 1;
+	if (!quiet)
+		error("'%s' exists; cannot create '%s'", entry->name, ref);
+	return 0;
 }
 
 static struct ref_lock *lock_ref_sha1_basic(const char *ref, const unsigned char *old_sha1, int flags, int *type_p)
@@ -838,7 +1223,7 @@ static struct ref_lock *lock_ref_sha1_basic(const char *ref, const unsigned char
 
 	lock->lk = xcalloc(1, sizeof(struct lock_file));
 
-	lflags = LOCK_DIE_ON_ERROR;
+	lflags = 0;
 	if (flags & REF_NODEREF) {
 		ref = orig_ref;
 		lflags |= LOCK_NODEREF;
@@ -857,7 +1242,14 @@ static struct ref_lock *lock_ref_sha1_basic(const char *ref, const unsigned char
 		goto error_return;
 	}
 
+	/* A ref locked by somebody else fails only its own update */
 	lock->lock_fd = hold_lock_file_for_update(lock->lk, ref_file, lflags);
+	if (lock->lock_fd < 0) {
+		last_errno = errno;
+		error("unable to create '%s.lock': %s",
+		      ref_file, strerror(errno));
+		goto error_return;
+	}
 	return old_sha1 ? verify_lock(lock, old_sha1, mustexist) : lock;
 
  error_return:
@@ -888,84 +1280,324 @@ struct ref_lock *lock_any_ref_for_update(const char *ref, const unsigned char *o
 
 static struct lock_file packlock;
 
-static int repack_without_ref(const char *refname)
-{
-	struct ref_list *list, *packed_ref_list;
+struct repack_data {
 	int fd;
-	int found = 0;
+	struct string_list *skip;
+};
 
-	packed_ref_list = get_packed_refs();
-	for (list = packed_ref_list; list; list = list->next) {
-		if (!strcmp(refname, list->name)) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found)
+static int write_packed_entry(struct ref_entry *entry, void *cb_data)
+{
+	struct repack_data *data = cb_data;
+	char line[PATH_MAX + 100];
+	int len;
+
+	if (string_list_has_string(data->skip, entry->name))
 		return 0;
-	fd = hold_lock_file_for_update(&packlock, git_path("packed-refs"), 0);
-	if (fd < 0)
-		return error("cannot delete '%s' from packed refs", refname);
+	len = snprintf(line, sizeof(line), "%s %s\n",
+		       sha1_to_hex(entry->u.value.sha1), entry->name);
+	/* this should not happen but just being defensive */
+	if (len > sizeof(line))
+		die("too long a refname '%s'", entry->name);
+	write_or_die(data->fd, line, len);
+	if ((entry->flag & REF_KNOWS_PEELED) &&
+	    !is_null_sha1(entry->u.value.peeled)) {
+		len = sprintf(line, "^%s\n",
+			      sha1_to_hex(entry->u.value.peeled));
+		write_or_die(data->fd, line, len);
+	}
+	return 0;
+}
 
-	for (list = packed_ref_list; list; list = list->next) {
-		char line[PATH_MAX + 100];
-		int len;
+/* Rewrite packed-refs once, without any of the sorted "refnames" */
+static int repack_without_refs(struct string_list *refnames)
+{
+	struct repack_data data;
+	unsigned char sha1[20], peeled[20];
+	char header[64];
+	int i, len;
 
-		if (!strcmp(refname, list->name))
-			continue;
-		len = snprintf(line, sizeof(line), "%s %s\n",
-			       sha1_to_hex(list->sha1), list->name);
-		/* this should not happen but just being defensive */
-		if (len > sizeof(line))
-			die("too long a refname '%s'", list->name);
-		write_or_die(fd, line, len);
-	}
+	for (i = 0; i < refnames->nr; i++)
+		if (get_packed_ref(refnames->items[i].string, sha1, peeled) >= 0)
+			break;
+	if (i == refnames->nr)
+		return 0;
+	trace_printf("trace: rewriting packed-refs without %d refs\n",
+		     refnames->nr);
+	data.fd = hold_lock_file_for_update(&packlock, git_path("packed-refs"), 0);
+	if (data.fd < 0)
+		return error("cannot delete '%s' from packed refs",
+			     refnames->items[i].string);
+
+	/* what is left is written in order, whatever the old file was */
+	len = sprintf(header, "# pack-refs with:%s sorted \n",
+		      (cached_refs.file.flag & REF_KNOWS_PEELED) ?
+		      " peeled" : "");
+	write_or_die(data.fd, header, len);
+	data.skip = refnames;
+	do_for_each_entry_in_dir(get_packed_refs(), write_packed_entry, &data);
 	return commit_lock_file(&packlock);
 }
 
-int delete_ref(const char *refname, const unsigned char *sha1, int delopt)
+static int is_branch(const char *refname)
+{
+	return !strcmp(refname, "HEAD") || !prefixcmp(refname, "refs/heads/");
+}
+
+static int check_new_value(struct ref_lock *lock, const unsigned char *sha1)
 {
+	struct object *o = parse_object(sha1);
+
+	if (!o)
+		return error("Trying to write ref %s with nonexistant object %s",
+			     lock->ref_name, sha1_to_hex(sha1));
+	if (o->type != OBJ_COMMIT && is_branch(lock->ref_name))
+		return error("Trying to write non-commit object %s to branch %s",
+			     sha1_to_hex(sha1), lock->ref_name);
+	return 0;
+}
+
+struct ref_update {
 	struct ref_lock *lock;
-	int err, i = 0, ret = 0, flag = 0;
+	unsigned char new_sha1[20];
+	int flags;
+	int type; /* of the ref, when it was locked */
+	char *msg;
+	const char **err;
+	struct ref_update *same; /* the same update, asked for again */
+};
 
-	lock = lock_ref_sha1_basic(refname, sha1, 0, &flag);
-	if (!lock)
-		return 1;
-	if (!(flag & REF_ISPACKED) || flag & REF_ISSYMREF) {
-		/* loose */
-		const char *path;
-
-		if (!(delopt & REF_NODEREF)) {
-			i = strlen(lock->lk->filename) - 5; /* .lock */
-			lock->lk->filename[i] = 0;
-			path = lock->lk->filename;
-		} else {
-			path = git_path("%s", refname);
+struct ref_transaction {
+	struct string_list refs; /* sorted, the util is a ref_update */
+};
+
+struct ref_transaction *ref_transaction_begin(void)
+{
+	struct ref_transaction *transaction = xcalloc(1, sizeof(*transaction));
+
+	transaction->refs.strdup_strings = 1;
+	return transaction;
+}
+
+static int update_failed(const char **err, const char *why)
+{
+	if (err)
+		*err = why;
+	return -1;
+}
+
+static int transaction_failed(struct ref_update *update, const char *why)
+{
+	for (; update; update = update->same)
+		update_failed(update->err, why);
+	return -1;
+}
+
+int ref_transaction_update(struct ref_transaction *transaction,
+			   const char *refname,
+			   const unsigned char *new_sha1,
+			   const unsigned char *old_sha1,
+			   int flags, const char *msg, const char **err)
+{
+	int delete = is_null_sha1(new_sha1);
+	const char *why = delete ? "failed to delete" : "failed to lock";
+	const char *name = refname;
+	struct string_list_item *item;
+	struct ref_update *update;
+	struct ref_lock *lock;
+	unsigned char sha1[20];
+	int type = 0;
+
+	/*
+	 * A deletion locks the ref a symref points at even with
+	 * REF_NODEREF, and only removes the symref itself.
+	 */
+	if (delete || !(flags & REF_NODEREF)) {
+		name = resolve_ref(refname, sha1, 0, NULL);
+		if (!name)
+			name = refname;
+	}
+
+	/* As lock_any_ref_for_update(); deleting a broken ref is fine */
+	if (!delete) {
+		switch (check_ref_format(refname)) {
+		case 0:
+		case CHECK_REF_FORMAT_ONELEVEL:
+			break;
+		default:
+			return update_failed(err, why);
 		}
-		err = unlink(path);
-		if (err && errno != ENOENT) {
-			ret = 1;
-			error("unlink(%s) failed: %s",
-			      path, strerror(errno));
+	}
+
+	/*
+	 * Two names of one ref, e.g. through a symref, may ask to write
+	 * the very same value; anything else would depend on the order.
+	 */
+	item = string_list_lookup(name, &transaction->refs);
+	if (item) {
+		struct ref_update *queued = item->util;
+
+		if (delete || hashcmp(queued->new_sha1, new_sha1) ||
+		    (old_sha1 && hashcmp(queued->lock->old_sha1, old_sha1))) {
+			error("multiple updates for ref '%s' not allowed", name);
+			return update_failed(err, why);
 		}
-		if (!(delopt & REF_NODEREF))
-			lock->lk->filename[i] = '.';
+		update = xcalloc(1, sizeof(*update));
+		update->err = err;
+		update->same = queued->same;
+		queued->same = update;
+		return 0;
 	}
-	/* removing the loose one could have resurrected an earlier
-	 * packed one.  Also, if it was not loose we need to repack
-	 * without it.
+
+	lock = lock_ref_sha1_basic(refname, old_sha1,
+				   delete ? 0 : flags, &type);
+	if (!lock)
+		return update_failed(err, why);
+	if (!delete && check_new_value(lock, new_sha1)) {
+		unlock_ref(lock);
+		return update_failed(err, "failed to write");
+	}
+	/*
+	 * Keep the lock, but not its file descriptor: a transaction
+	 * may lock more refs than we can have files open.
 	 */
-	ret |= repack_without_ref(refname);
+	if (close_ref(lock)) {
+		error("unable to close '%s': %s",
+		      lock->lk->filename, strerror(errno));
+		unlock_ref(lock);
+		return update_failed(err, why);
+	}
+
+	update = xcalloc(1, sizeof(*update));
+	update->lock = lock;
+	hashcpy(update->new_sha1, new_sha1);
+	update->flags = flags;
+	update->type = type;
+	update->msg = msg ? xstrdup(msg) : NULL;
+	update->err = err;
+	string_list_insert(lock->ref_name, &transaction->refs)->util = update;
+	return 0;
+}
+
+/* Remove the loose file of a ref that is being deleted */
+static int delete_loose_ref(struct ref_update *update)
+{
+	struct ref_lock *lock = update->lock;
+	const char *path;
+	int i = 0, err;
 
-	err = unlink(git_path("logs/%s", lock->ref_name));
+	if ((update->type & REF_ISPACKED) && !(update->type & REF_ISSYMREF))
+		return 0;
+	if (!(update->flags & REF_NODEREF)) {
+		i = strlen(lock->lk->filename) - 5; /* .lock */
+		lock->lk->filename[i] = 0;
+		path = lock->lk->filename;
+	} else {
+		path = git_path("%s", lock->orig_ref_name);
+	}
+	err = unlink(path);
 	if (err && errno != ENOENT)
-		fprintf(stderr, "warning: unlink(%s) failed: %s",
-			git_path("logs/%s", lock->ref_name), strerror(errno));
+		error("unlink(%s) failed: %s", path, strerror(errno));
+	if (!(update->flags & REF_NODEREF))
+		lock->lk->filename[i] = '.';
+	return err && errno != ENOENT;
+}
+
+void ref_transaction_free(struct ref_transaction *transaction)
+{
+	int i;
+
+	for (i = 0; i < transaction->refs.nr; i++) {
+		struct ref_update *update = transaction->refs.items[i].util;
+
+		if (update->lock)
+			unlock_ref(update->lock);
+		free(update->msg);
+		while (update->same) {
+			struct ref_update *same = update->same;
+			update->same = same->same;
+			free(same);
+		}
+	}
+	string_list_clear(&transaction->refs, 1);
+	free(transaction);
+}
+
+int ref_transaction_commit(struct ref_transaction *transaction)
+{
+	struct string_list deleted;
+	int i, ret = 0;
+
+	memset(&deleted, 0, sizeof(deleted));
+	for (i = 0; i < transaction->refs.nr; i++) {
+		struct ref_update *update = transaction->refs.items[i].util;
+
+		if (!is_null_sha1(update->new_sha1)) {
+			struct ref_lock *lock = update->lock;
+
+			update->lock = NULL;
+			lock->lock_fd = reopen_lock_file(lock->lk);
+			if (lock->lock_fd < 0) {
+				error("unable to reopen '%s': %s",
+				      lock->lk->filename, strerror(errno));
+				unlock_ref(lock);
+				ret = transaction_failed(update,
+							 "failed to write");
+				continue;
+			}
+			/* this unlocks the ref, whatever happens */
+			if (write_ref_sha1(lock, update->new_sha1, update->msg))
+				ret = transaction_failed(update,
+							 "failed to write");
+			continue;
+		}
+		if (delete_loose_ref(update))
+			ret = transaction_failed(update, "failed to delete");
+		string_list_insert(update->lock->orig_ref_name, &deleted);
+	}
+
+	/*
+	 * Removing the loose ones could have resurrected earlier
+	 * packed ones, and the packed ones need to go, too: do it
+	 * with one rewrite of packed-refs for all of them.
+	 */
+	if (repack_without_refs(&deleted)) {
+		for (i = 0; i < transaction->refs.nr; i++) {
+			struct ref_update *update = transaction->refs.items[i].util;
+			if (update->lock)
+				ret = transaction_failed(update,
+							 "failed to delete");
+		}
+	}
+	string_list_clear(&deleted, 0);
+
+	for (i = 0; i < transaction->refs.nr; i++) {
+		struct ref_update *update = transaction->refs.items[i].util;
+		const char *log;
+
+		if (!update->lock)
+			continue;
+		log = git_path("logs/%s", update->lock->ref_name);
+		if (unlink(log) && errno != ENOENT)
+			fprintf(stderr, "warning: unlink(%s) failed: %s",
+				log, strerror(errno));
+	}
 	invalidate_cached_refs();
-	unlock_ref(lock);
+	ref_transaction_free(transaction);
 	return ret;
 }
 
+int delete_ref(const char *refname, const unsigned char *sha1, int delopt)
+{
+	struct ref_transaction *transaction = ref_transaction_begin();
+
+	if (ref_transaction_update(transaction, refname, null_sha1, sha1,
+				   delopt, NULL, NULL)) {
+		ref_transaction_free(transaction);
+		return 1;
+	}
+	return ref_transaction_commit(transaction) ? 1 : 0;
+}
+
 int rename_ref(const char *oldref, const char *newref, const char *logmsg)
 {
 	static const char renamed_ref[] = "RENAMED-REF";
@@ -1200,16 +1832,10 @@ static int log_ref_write(const char *ref_name, const unsigned char *old_sha1,
 	return 0;
 }
 
-static int is_branch(const char *refname)
-{
-	return !strcmp(refname, "HEAD") || !prefixcmp(refname, "refs/heads/");
-}
-
 int write_ref_sha1(struct ref_lock *lock,
 	const unsigned char *sha1, const char *logmsg)
 {
 	static char term = '\n';
-	struct object *o;
 
 	if (!lock)
 		return -1;
@@ -1217,16 +1843,7 @@ int write_ref_sha1(struct ref_lock *lock,
 		unlock_ref(lock);
 		return 0;
 	}
-	o = parse_object(sha1);
-	if (!o) {
-		error("Trying to write ref %s with nonexistant object %s",
-			lock->ref_name, sha1_to_hex(sha1));
-		unlock_ref(lock);
-		return -1;
-	}
-	if (o->type != OBJ_COMMIT && is_branch(lock->ref_name)) {
-		error("Trying to write non-commit object %s to branch %s",
-			sha1_to_hex(sha1), lock->ref_name);
+	if (check_new_value(lock, sha1)) {
 		unlock_ref(lock);
 		return -1;
 	}
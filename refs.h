@@ -54,6 +54,33 @@ extern void unlock_ref(struct ref_lock *lock);
 /** Writes sha1 into the ref specified by the lock. **/
 extern int write_ref_sha1(struct ref_lock *lock, const unsigned char *sha1, const char *msg);
 
+/*
+ * A transaction updates a set of refs together: each ref is locked and
+ * its old value checked as it is added, and the commit writes all of
+ * them, with a single rewrite of packed-refs for the deleted ones.
+ *
+ * A null new_sha1 deletes the ref; a NULL old_sha1 does not check
+ * the old value.  When a ref cannot be updated, a short reason is
+ * stored in *err, if err is not NULL, when the update is added or
+ * when the transaction is committed; the other refs are still
+ * updated.  Committing or freeing the transaction releases it.
+ *
+ * The locks are held without keeping their files open, so a
+ * transaction can hold any number of them.
+ *
+ * A ref may be added again under another name, e.g. through a symref,
+ * only to be written with the same value.
+ */
+struct ref_transaction;
+extern struct ref_transaction *ref_transaction_begin(void);
+extern int ref_transaction_update(struct ref_transaction *transaction,
+				  const char *refname,
+				  const unsigned char *new_sha1,
+				  const unsigned char *old_sha1,
+				  int flags, const char *msg, const char **err);
+extern int ref_transaction_commit(struct ref_transaction *transaction);
+extern void ref_transaction_free(struct ref_transaction *transaction);
+
 /** Reads log for the value of ref during at_time. **/
 extern int read_ref_at(const char *ref, unsigned long at_time, int cnt, unsigned char *sha1, char **msg, unsigned long *cutoff_time, int *cutoff_tz, int *cutoff_cnt);
 
@@ -12,6 +12,7 @@
 #include "patch-ids.h"
 #include "decorate.h"
 #include "log-tree.h"
+#include "commit-graph.h"
 
 volatile show_early_output_fn_t show_early_output;
 
@@ -238,12 +239,12 @@ static struct commit *handle_commit(struct rev_info *revs, struct object *object
 	die("%s is unknown object", name);
 }
 
-static int everybody_uninteresting(struct commit_list *orig)
+static int everybody_uninteresting(struct prio_queue *queue)
 {
-	struct commit_list *list = orig;
-	while (list) {
-		struct commit *commit = list->item;
-		list = list->next;
+	int i;
+
+	for (i = 0; i < queue->nr; i++) {
+		struct commit *commit = queue->array[i].data;
 		if (commit->object.flags & UNINTERESTING)
 			continue;
 		return 0;
@@ -438,26 +439,11 @@ static void try_to_simplify_commit(struct rev_info *revs, struct commit *commit)
 	commit->object.flags |= TREESAME;
 }
 
-static void insert_by_date_cached(struct commit *p, struct commit_list **head,
-		    struct commit_list *cached_base, struct commit_list **cache)
-{
-	struct commit_list *new_entry;
-
-	if (cached_base && p->date < cached_base->item->date)
-		new_entry = insert_by_date(p, &cached_base->next);
-	else
-		new_entry = insert_by_date(p, head);
-
-	if (cache && (!*cache || p->date < (*cache)->item->date))
-		*cache = new_entry;
-}
-
 static int add_parents_to_list(struct rev_info *revs, struct commit *commit,
-		    struct commit_list **list, struct commit_list **cache_ptr)
+			       struct prio_queue *queue)
 {
 	struct commit_list *parent = commit->parents;
 	unsigned left_flag;
-	struct commit_list *cached_base = cache_ptr ? *cache_ptr : NULL;
 
 	if (commit->object.flags & ADDED)
 		return 0;
@@ -487,7 +473,7 @@ static int add_parents_to_list(struct rev_info *revs, struct commit *commit,
 			if (p->object.flags & SEEN)
 				continue;
 			p->object.flags |= SEEN;
-			insert_by_date_cached(p, list, cached_base, cache_ptr);
+			prio_queue_put(queue, p);
 		}
 		return 0;
 	}
@@ -514,7 +500,8 @@ static int add_parents_to_list(struct rev_info *revs, struct commit *commit,
 		p->object.flags |= left_flag;
 		if (!(p->object.flags & SEEN)) {
 			p->object.flags |= SEEN;
-			insert_by_date_cached(p, list, cached_base, cache_ptr);
+			if (queue)
+				prio_queue_put(queue, p);
 		}
 		if (revs->first_parent_only)
 			break;
@@ -610,19 +597,21 @@ static void cherry_pick_list(struct commit_list *list, struct rev_info *revs)
 /* How many extra uninteresting commits we want to see.. */
 #define SLOP 5
 
-static int still_interesting(struct commit_list *src, unsigned long date, int slop)
+static int still_interesting(struct prio_queue *src, unsigned long date, int slop)
 {
+	struct commit *next = prio_queue_peek(src);
+
 	/*
 	 * No source list at all? We're definitely done..
 	 */
-	if (!src)
+	if (!next)
 		return 0;
 
 	/*
 	 * Does the destination list contain entries with a date
 	 * before the source list? Definitely _not_ done.
 	 */
-	if (date < src->item->date)
+	if (date < next->date)
 		return SLOP;
 
 	/*
@@ -640,33 +629,35 @@ static int limit_list(struct rev_info *revs)
 {
 	int slop = SLOP;
 	unsigned long date = ~0ul;
-	struct commit_list *list = revs->commits;
+	struct prio_queue queue = { compare_commits_by_commit_date };
 	struct commit_list *newlist = NULL;
 	struct commit_list **p = &newlist;
+	struct commit *commit;
 
-	while (list) {
-		struct commit_list *entry = list;
-		struct commit *commit = list->item;
+	while (revs->commits)
+		prio_queue_put(&queue, pop_commit(&revs->commits));
+
+	while ((commit = prio_queue_get(&queue)) != NULL) {
 		struct object *obj = &commit->object;
 		show_early_output_fn_t show;
 
-		list = list->next;
-		free(entry);
-
 		if (revs->max_age != -1 && (commit->date < revs->max_age))
 			obj->flags |= UNINTERESTING;
-		if (add_parents_to_list(revs, commit, &list, NULL) < 0)
+		if (add_parents_to_list(revs, commit, &queue) < 0) {
+			clear_prio_queue(&queue);
 			return -1;
+		}
 		if (obj->flags & UNINTERESTING) {
 			mark_parents_uninteresting(commit);
 			if (revs->show_all)
 				p = &commit_list_insert(commit, p)->next;
-			slop = still_interesting(list, date, slop);
+			slop = still_interesting(&queue, date, slop);
 			if (slop)
 				continue;
 			/* If showing all, add the whole pending list to the end */
 			if (revs->show_all)
-				*p = list;
+				while ((commit = prio_queue_get(&queue)) != NULL)
+					p = &commit_list_insert(commit, p)->next;
 			break;
 		}
 		if (revs->min_age != -1 && (commit->date > revs->min_age))
@@ -681,6 +672,7 @@ static int limit_list(struct rev_info *revs)
 		show(revs, newlist);
 		show_early_output = NULL;
 	}
+	clear_prio_queue(&queue);
 	if (revs->cherry_pick)
 		cherry_pick_list(newlist, revs);
 
@@ -801,6 +793,7 @@ void init_revisions(struct rev_info *revs, const char *prefix)
 	revs->pruning.change = file_change;
 	revs->lifo = 1;
 	revs->dense = 1;
+	revs->queue.compare = compare_commits_by_commit_date;
 	revs->prefix = prefix;
 	revs->max_age = -1;
 	revs->min_age = -1;
@@ -1349,9 +1342,6 @@ int setup_revisions(int argc, const char **argv, struct rev_info *revs, const ch
 	    DIFF_OPT_TST(&revs->diffopt, FOLLOW_RENAMES))
 		revs->diff = 1;
 
-	if (revs->topo_order)
-		revs->limited = 1;
-
 	if (revs->prune_data) {
 		diff_tree_setup_paths(revs->prune_data, &revs->pruning);
 		/* Can't prune commits with rename following: the paths change.. */
@@ -1581,6 +1571,133 @@ static void set_children(struct rev_info *revs)
 	}
 }
 
+/*
+ * Without limit_list(), --topo-order is walked incrementally.  A
+ * commit may be shown once all of its children have been, so each
+ * commit walked carries in "indegree" one more than the number of its
+ * children still to be shown.  None of the commits whose generation
+ * is below that of a commit can be its children, so we count the
+ * children in order of decreasing generation, only as deep as the
+ * commits taken out so far need it, and the first commits can be
+ * shown without reading all of history.
+ */
+static int can_walk_topo_incrementally(struct rev_info *revs)
+{
+	return !revs->limited &&
+		revs->max_age == -1 &&
+		!revs->early_output &&
+		!revs->boundary &&
+		!revs->reflog_info;
+}
+
+static unsigned int topo_generation(const struct commit *commit)
+{
+	/* A commit missing from the commit-graph may be anywhere */
+	return commit->generation ? commit->generation : GENERATION_NUMBER_MAX + 1;
+}
+
+static int compare_commits_by_generation(const void *a_, const void *b_,
+					 void *unused)
+{
+	unsigned int a = topo_generation(a_), b = topo_generation(b_);
+
+	if (a < b)
+		return 1;
+	if (a > b)
+		return -1;
+	return 0;
+}
+
+static int count_indegrees_to_depth(struct rev_info *revs,
+				    unsigned int generation)
+{
+	struct commit *commit;
+
+	while ((commit = prio_queue_peek(&revs->indegree_queue)) &&
+	       topo_generation(commit) >= generation) {
+		struct commit_list *parents;
+
+		prio_queue_get(&revs->indegree_queue);
+		/* Simplify the parents before counting them */
+		if (add_parents_to_list(revs, commit, NULL) < 0)
+			return -1;
+		for (parents = commit->parents; parents; parents = parents->next) {
+			struct commit *parent = parents->item;
+
+			if (parent->object.flags & TOPO_WALKED)
+				parent->indegree++;
+			else {
+				parent->object.flags |= TOPO_WALKED;
+				parent->indegree = 2;
+				prio_queue_put(&revs->indegree_queue, parent);
+			}
+			if (revs->first_parent_only)
+				break;
+		}
+	}
+	return 0;
+}
+
+static int init_topo_walk(struct rev_info *revs)
+{
+	struct commit_list *list;
+	struct commit *commit;
+
+	revs->indegree_queue.compare = compare_commits_by_generation;
+	revs->topo_queue.compare = revs->lifo ?
+		NULL : compare_commits_by_commit_date;
+	revs->min_generation = GENERATION_NUMBER_MAX + 1;
+
+	for (list = revs->commits; list; list = list->next) {
+		commit = list->item;
+		commit->object.flags |= TOPO_WALKED;
+		commit->indegree = 1;
+		prio_queue_put(&revs->indegree_queue, commit);
+		if (topo_generation(commit) < revs->min_generation)
+			revs->min_generation = topo_generation(commit);
+	}
+	if (count_indegrees_to_depth(revs, revs->min_generation) < 0)
+		return -1;
+
+	/* The tips are the ones none of the others can reach */
+	while ((commit = pop_commit(&revs->commits)) != NULL)
+		if (commit->indegree == 1)
+			prio_queue_put(&revs->topo_queue, commit);
+
+	/* the stack gives them out last first; start with the first tip */
+	if (revs->lifo)
+		prio_queue_reverse(&revs->topo_queue);
+	return 0;
+}
+
+static struct commit *next_topo_commit(struct rev_info *revs)
+{
+	struct commit *commit = prio_queue_get(&revs->topo_queue);
+	struct commit_list *parents;
+
+	if (!commit) {
+		clear_prio_queue(&revs->indegree_queue);
+		clear_prio_queue(&revs->topo_queue);
+		return NULL;
+	}
+	commit->indegree = 0;
+
+	for (parents = commit->parents; parents; parents = parents->next) {
+		struct commit *parent = parents->item;
+
+		if (topo_generation(parent) < revs->min_generation) {
+			revs->min_generation = topo_generation(parent);
+			if (count_indegrees_to_depth(revs, revs->min_generation) < 0)
+				return NULL;
+		}
+		if (--parent->indegree == 1)
+			prio_queue_put(&revs->topo_queue, parent);
+		if (revs->first_parent_only)
+			break;
+	}
+	return commit;
+}
+
 int prepare_revision_walk(struct rev_info *revs)
 {
 	int nr = revs->pending.nr;
@@ -1604,11 +1721,17 @@ int prepare_revision_walk(struct rev_info *revs)
 
 	if (revs->no_walk)
 		return 0;
-	if (revs->limited)
+	if (revs->topo_order && !can_walk_topo_incrementally(revs))
+		revs->limited = 1;
+	if (revs->limited) {
 		if (limit_list(revs) < 0)
 			return -1;
-	if (revs->topo_order)
-		sort_in_topological_order(&revs->commits, revs->lifo);
+		if (revs->topo_order)
+			sort_in_topological_order(&revs->commits, revs->lifo);
+	} else if (revs->topo_order) {
+		if (init_topo_walk(revs) < 0)
+			return -1;
+	}
 	if (revs->simplify_merges)
 		simplify_merges(revs);
 	if (revs->children.name)
@@ -1624,12 +1747,11 @@ enum rewrite_result {
 
 static enum rewrite_result rewrite_one(struct rev_info *revs, struct commit **pp)
 {
-	struct commit_list *cache = NULL;
-
 	for (;;) {
 		struct commit *p = *pp;
 		if (!revs->limited)
-			if (add_parents_to_list(revs, p, &revs->commits, &cache) < 0)
+			if (add_parents_to_list(revs, p, revs->topo_order ?
+						NULL : &revs->queue) < 0)
 				return rewrite_one_error;
 		if (p->parents && p->parents->next)
 			return rewrite_one_ok;
@@ -1667,6 +1789,7 @@ static int commit_match(struct commit *commit, struct rev_info *opt)
 {
 	if (!opt->grep_filter.pattern_list)
 		return 1;
+	load_commit_buffer(commit);
 	return grep_buffer(&opt->grep_filter,
 			   NULL, /* we say nothing, not even filename */
 			   commit->buffer, strlen(commit->buffer));
@@ -1709,31 +1832,39 @@ enum commit_action simplify_commit(struct rev_info *revs, struct commit *commit)
 	return commit_show;
 }
 
-static struct commit *get_revision_1(struct rev_info *revs)
+static struct commit *next_commit(struct rev_info *revs)
 {
-	if (!revs->commits)
-		return NULL;
+	if (revs->limited)
+		return pop_commit(&revs->commits);
+	if (revs->topo_order)
+		return next_topo_commit(revs);
+	return prio_queue_get(&revs->queue);
+}
 
-	do {
-		struct commit_list *entry = revs->commits;
-		struct commit *commit = entry->item;
+static struct commit *get_revision_1(struct rev_info *revs)
+{
+	struct commit *commit;
 
-		revs->commits = entry->next;
-		free(entry);
+	/* Without limit_list(), the walk starts from the queue */
+	if (!revs->limited && !revs->topo_order)
+		while (revs->commits)
+			prio_queue_put(&revs->queue, pop_commit(&revs->commits));
 
+	while ((commit = next_commit(revs)) != NULL) {
 		if (revs->reflog_info)
 			fake_reflog_parent(revs->reflog_info, commit);
 
 		/*
 		 * If we haven't done the list limiting, we need to look at
 		 * the parents here. We also need to do the date-based limiting
-		 * that we'd otherwise have done in limit_list().
+		 * that we'd otherwise have done in limit_list().  The
+		 * topo walk has looked at them already.
 		 */
-		if (!revs->limited) {
+		if (!revs->limited && !revs->topo_order) {
 			if (revs->max_age != -1 &&
 			    (commit->date < revs->max_age))
 				continue;
-			if (add_parents_to_list(revs, commit, &revs->commits, NULL) < 0)
+			if (add_parents_to_list(revs, commit, &revs->queue) < 0)
 				return NULL;
 		}
 
@@ -1745,7 +1876,7 @@ static struct commit *get_revision_1(struct rev_info *revs)
 		default:
 			return commit;
 		}
-	} while (revs->commits);
+	}
 	return NULL;
 }
 
@@ -1787,6 +1918,7 @@ static void create_boundary_commit_list(struct rev_info *revs)
 		free_commit_list(revs->commits);
 		revs->commits = NULL;
 	}
+	clear_prio_queue(&revs->queue);
 
 	/*
 	 * Put all of the actual boundary commits from revs->boundary_commits
@@ -3,6 +3,7 @@
 
 #include "parse-options.h"
 #include "grep.h"
+#include "prio-queue.h"
 
 #define SEEN		(1u<<0)
 #define UNINTERESTING   (1u<<1)
@@ -13,7 +14,8 @@
 #define CHILD_SHOWN	(1u<<6)
 #define ADDED		(1u<<7)	/* Parents already parsed and added? */
 #define SYMMETRIC_LEFT	(1u<<8)
-#define ALL_REV_FLAGS	((1u<<9)-1)
+#define TOPO_WALKED	(1u<<9)	/* Counted in the incremental topo walk? */
+#define ALL_REV_FLAGS	((1u<<10)-1)
 
 struct rev_info;
 struct log_info;
@@ -23,6 +25,14 @@ struct rev_info {
 	struct commit_list *commits;
 	struct object_array pending;
 
+	/* The commits still to be walked, when not limited */
+	struct prio_queue queue;
+
+	/* The incremental --topo-order walk, when not limited */
+	struct prio_queue indegree_queue;
+	struct prio_queue topo_queue;
+	unsigned int min_generation;
+
 	/* Parents of shown commits */
 	struct object_array boundary_commits;
 
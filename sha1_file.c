@@ -16,6 +16,11 @@
 #include "refs.h"
 #include "pack-revindex.h"
 #include "sha1-lookup.h"
+#include "midx.h"
+
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 #ifndef O_NOATIME
 #if defined(__linux__) && (defined(__i386__) || defined(__PPC__))
@@ -33,6 +38,34 @@ static unsigned long sz_fmt(size_t s) { return (unsigned long)s; }
 static size_t sz_fmt(size_t s) { return s; }
 #endif
 
+#ifndef NO_PTHREADS
+/*
+ * Between enable_threaded_object_reads() and its counterpart, several
+ * threads may read objects at once.  The list of packs, their windows
+ * and use counts, and the static buffers of sha1_file_name() are then
+ * protected by pack_mutex; a reader whose window cursor already covers
+ * the offset it asks for does not need it.  The mutex is recursive, as
+ * xmalloc() calls back into release_pack_memory() when memory is low.
+ */
+static int threaded_object_reads;
+static pthread_mutex_t pack_mutex;
+
+static void pack_lock(void)
+{
+	if (threaded_object_reads)
+		pthread_mutex_lock(&pack_mutex);
+}
+
+static void pack_unlock(void)
+{
+	if (threaded_object_reads)
+		pthread_mutex_unlock(&pack_mutex);
+}
+#else
+#define pack_lock()	(void)0
+#define pack_unlock()	(void)0
+#endif
+
 const unsigned char null_sha1[20];
 
 const signed char hexval_table[256] = {
@@ -280,6 +313,7 @@ static int link_alt_odb_entry(const char * entry, int len, const char * relative
 		memcpy(ent->base, entry, pfxlen);
 
 	ent->name = ent->base + pfxlen + 1;
+	ent->loose_cache = NULL;
 	ent->base[pfxlen + 3] = '/';
 	ent->base[pfxlen] = ent->base[entlen-1] = 0;
 
@@ -423,19 +457,179 @@ void prepare_alt_odb(void)
 	read_info_alternates(get_object_directory(), 0);
 }
 
+/*
+ * While the loose object cache is enabled, the loose objects of an
+ * object directory are listed with one readdir() of each objects/xx/
+ * subdirectory, the first time an object in it is asked about, and
+ * existence checks become binary searches in these sorted lists.
+ */
+struct loose_object_list {
+	unsigned char (*sha1)[20];
+	int nr, alloc;
+};
+
+struct loose_object_cache {
+	unsigned char loaded[256];
+	struct loose_object_list dir[256];
+};
+
+static int use_loose_object_cache;
+static struct loose_object_cache *local_loose_cache;
+
+static int loose_object_cmp(const void *a, const void *b)
+{
+	return hashcmp(a, b);
+}
+
+static void read_loose_object_dir(struct loose_object_list *list,
+				  const char *objdir, int subdir)
+{
+	char path[PATH_MAX], hex[41];
+	unsigned char sha1[20];
+	struct dirent *de;
+	DIR *dir;
+
+	if (snprintf(path, sizeof(path), "%s/%02x", objdir, subdir)
+	    >= sizeof(path))
+		return;
+	dir = opendir(path);
+	if (!dir)
+		return;
+	sprintf(hex, "%02x", subdir);
+	while ((de = readdir(dir)) != NULL) {
+		if (strlen(de->d_name) != 38)
+			continue;
+		memcpy(hex + 2, de->d_name, 39);
+		if (get_sha1_hex(hex, sha1))
+			continue;
+		ALLOC_GROW(list->sha1, list->nr + 1, list->alloc);
+		hashcpy(list->sha1[list->nr++], sha1);
+	}
+	closedir(dir);
+	qsort(list->sha1, list->nr, sizeof(*list->sha1), loose_object_cmp);
+}
+
+/* Returns the position of sha1 in list, or -1 - where it would go */
+static int loose_object_pos(struct loose_object_list *list,
+			    const unsigned char *sha1)
+{
+	int lo = 0, hi = list->nr;
+
+	while (lo < hi) {
+		int mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(sha1, list->sha1[mi]);
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -lo - 1;
+}
+
+static int has_cached_loose_object(struct loose_object_cache **cachep,
+				   const char *objdir,
+				   const unsigned char *sha1)
+{
+	struct loose_object_cache *cache = *cachep;
+
+	if (!cache)
+		cache = *cachep = xcalloc(1, sizeof(*cache));
+	if (!cache->loaded[sha1[0]]) {
+		read_loose_object_dir(&cache->dir[sha1[0]], objdir, sha1[0]);
+		cache->loaded[sha1[0]] = 1;
+	}
+	return loose_object_pos(&cache->dir[sha1[0]], sha1) >= 0;
+}
+
+static void add_loose_object_cache(const unsigned char *sha1)
+{
+	struct loose_object_list *list;
+	int pos;
+
+	if (!use_loose_object_cache || !local_loose_cache ||
+	    !local_loose_cache->loaded[sha1[0]])
+		return;
+	list = &local_loose_cache->dir[sha1[0]];
+	pos = loose_object_pos(list, sha1);
+	if (pos >= 0)
+		return;
+	pos = -pos - 1;
+	ALLOC_GROW(list->sha1, list->nr + 1, list->alloc);
+	memmove(list->sha1 + pos + 1, list->sha1 + pos,
+		(list->nr - pos) * sizeof(*list->sha1));
+	hashcpy(list->sha1[pos], sha1);
+	list->nr++;
+}
+
+static void clear_loose_object_cache(struct loose_object_cache **cachep)
+{
+	struct loose_object_cache *cache = *cachep;
+	int i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < 256; i++)
+		free(cache->dir[i].sha1);
+	free(cache);
+	*cachep = NULL;
+}
+
+static void clear_loose_object_caches(void)
+{
+	struct alternate_object_database *alt;
+
+	clear_loose_object_cache(&local_loose_cache);
+	for (alt = alt_odb_list; alt; alt = alt->next)
+		clear_loose_object_cache(&alt->loose_cache);
+}
+
+void enable_loose_object_cache(void)
+{
+	use_loose_object_cache = 1;
+}
+
+void disable_loose_object_cache(void)
+{
+	pack_lock();
+	use_loose_object_cache = 0;
+	clear_loose_object_caches();
+	pack_unlock();
+}
+
 static int has_loose_object_local(const unsigned char *sha1)
 {
-	char *name = sha1_file_name(sha1);
+	char *name;
+
+	if (use_loose_object_cache)
+		return has_cached_loose_object(&local_loose_cache,
+					       get_object_directory(), sha1);
+	name = sha1_file_name(sha1);
 	return !access(name, F_OK);
 }
 
+static int has_loose_object_alt(struct alternate_object_database *alt,
+				const unsigned char *sha1)
+{
+	int ret;
+
+	if (!use_loose_object_cache) {
+		fill_sha1_path(alt->name, sha1);
+		return !access(alt->base, F_OK);
+	}
+	alt->name[-1] = 0;
+	ret = has_cached_loose_object(&alt->loose_cache, alt->base, sha1);
+	alt->name[-1] = '/';
+	return ret;
+}
+
 int has_loose_object_nonlocal(const unsigned char *sha1)
 {
 	struct alternate_object_database *alt;
 	prepare_alt_odb();
 	for (alt = alt_odb_list; alt; alt = alt->next) {
-		fill_sha1_path(alt->name, sha1);
-		if (!access(alt->base, F_OK))
+		if (has_loose_object_alt(alt, sha1))
 			return 1;
 	}
 	return 0;
@@ -443,8 +637,13 @@ int has_loose_object_nonlocal(const unsigned char *sha1)
 
 static int has_loose_object(const unsigned char *sha1)
 {
-	return has_loose_object_local(sha1) ||
-	       has_loose_object_nonlocal(sha1);
+	int ret;
+
+	pack_lock();
+	ret = has_loose_object_local(sha1) ||
+	      has_loose_object_nonlocal(sha1);
+	pack_unlock();
+	return ret;
 }
 
 static unsigned int pack_used_ctr;
@@ -642,13 +841,18 @@ static int unuse_one_window(struct packed_git *current, int keep_fd)
 
 void release_pack_memory(size_t need, int fd)
 {
-	size_t cur = pack_mapped;
+	size_t cur;
+
+	pack_lock();
+	cur = pack_mapped;
 	while (need >= (cur - pack_mapped) && unuse_one_window(NULL, fd))
 		; /* nothing */
+	pack_unlock();
 }
 
 void close_pack_windows(struct packed_git *p)
 {
+	pack_lock();
 	while (p->windows) {
 		struct pack_window *w = p->windows;
 
@@ -661,13 +865,16 @@ void close_pack_windows(struct packed_git *p)
 		p->windows = w->next;
 		free(w);
 	}
+	pack_unlock();
 }
 
 void unuse_pack(struct pack_window **w_cursor)
 {
 	struct pack_window *w = *w_cursor;
 	if (w) {
+		pack_lock();
 		w->inuse_cnt--;
+		pack_unlock();
 		*w_cursor = NULL;
 	}
 }
@@ -686,10 +893,12 @@ void free_pack_by_name(const char *pack_name)
 {
 	struct packed_git *p, **pp = &packed_git;
 
+	pack_lock();
 	while (*pp) {
 		p = *pp;
 		if (strcmp(pack_name, p->pack_name) == 0) {
 			close_pack_windows(p);
+			close_multi_pack_index_pack(p);
 			if (p->pack_fd != -1)
 				close(p->pack_fd);
 			if (p->index_data)
@@ -697,10 +906,11 @@ void free_pack_by_name(const char *pack_name)
 			free(p->bad_object_sha1);
 			*pp = p->next;
 			free(p);
-			return;
+			break;
 		}
 		pp = &p->next;
 	}
+	pack_unlock();
 }
 
 /*
@@ -797,6 +1007,14 @@ unsigned char* use_pack(struct packed_git *p,
 {
 	struct pack_window *win = *w_cursor;
 
+	/*
+	 * A window we hold a use count on stays mapped, so reading
+	 * from it again needs no lock.
+	 */
+	if (win && in_window(win, offset))
+		goto found;
+
+	pack_lock();
 	if (p->pack_fd == -1 && open_packed_git(p))
 		die("packfile %s cannot be accessed", p->pack_name);
 
@@ -808,48 +1026,47 @@ unsigned char* use_pack(struct packed_git *p,
 	if (offset > (p->pack_size - 20))
 		die("offset beyond end of packfile (truncated pack?)");
 
-	if (!win || !in_window(win, offset)) {
-		if (win)
-			win->inuse_cnt--;
-		for (win = p->windows; win; win = win->next) {
-			if (in_window(win, offset))
-				break;
-		}
-		if (!win) {
-			size_t window_align = packed_git_window_size / 2;
-			off_t len;
-			win = xcalloc(1, sizeof(*win));
-			win->offset = (offset / window_align) * window_align;
-			len = p->pack_size - win->offset;
-			if (len > packed_git_window_size)
-				len = packed_git_window_size;
-			win->len = (size_t)len;
-			pack_mapped += win->len;
-			while (packed_git_limit < pack_mapped
-				&& unuse_one_window(p, p->pack_fd))
-				; /* nothing */
-			win->base = xmmap(NULL, win->len,
-				PROT_READ, MAP_PRIVATE,
-				p->pack_fd, win->offset);
-			if (win->base == MAP_FAILED)
-				die("packfile %s cannot be mapped: %s",
-					p->pack_name,
-					strerror(errno));
-			pack_mmap_calls++;
-			pack_open_windows++;
-			if (pack_mapped > peak_pack_mapped)
-				peak_pack_mapped = pack_mapped;
-			if (pack_open_windows > peak_pack_open_windows)
-				peak_pack_open_windows = pack_open_windows;
-			win->next = p->windows;
-			p->windows = win;
-		}
-	}
-	if (win != *w_cursor) {
-		win->last_used = pack_used_ctr++;
-		win->inuse_cnt++;
-		*w_cursor = win;
+	if (win)
+		win->inuse_cnt--;
+	for (win = p->windows; win; win = win->next) {
+		if (in_window(win, offset))
+			break;
 	}
+	if (!win) {
+		size_t window_align = packed_git_window_size / 2;
+		off_t len;
+		win = xcalloc(1, sizeof(*win));
+		win->offset = (offset / window_align) * window_align;
+		len = p->pack_size - win->offset;
+		if (len > packed_git_window_size)
+			len = packed_git_window_size;
+		win->len = (size_t)len;
+		pack_mapped += win->len;
+		while (packed_git_limit < pack_mapped
+			&& unuse_one_window(p, p->pack_fd))
+			; /* nothing */
+		win->base = xmmap(NULL, win->len,
+			PROT_READ, MAP_PRIVATE,
+			p->pack_fd, win->offset);
+		if (win->base == MAP_FAILED)
+			die("packfile %s cannot be mapped: %s",
+				p->pack_name,
+				strerror(errno));
+		pack_mmap_calls++;
+		pack_open_windows++;
+		if (pack_mapped > peak_pack_mapped)
+			peak_pack_mapped = pack_mapped;
+		if (pack_open_windows > peak_pack_open_windows)
+			peak_pack_open_windows = pack_open_windows;
+		win->next = p->windows;
+		p->windows = win;
+	}
+	win->last_used = pack_used_ctr++;
+	win->inuse_cnt++;
+	*w_cursor = win;
+	pack_unlock();
+
+ found:
 	offset -= win->offset;
 	if (left)
 		*left = win->len - xsize_t(offset);
@@ -1033,46 +1250,87 @@ void prepare_packed_git(void)
 
 	if (prepare_packed_git_run_once)
 		return;
-	prepare_packed_git_one(get_object_directory(), 1);
-	prepare_alt_odb();
-	for (alt = alt_odb_list; alt; alt = alt->next) {
-		alt->name[-1] = 0;
-		prepare_packed_git_one(alt->base, 0);
-		alt->name[-1] = '/';
+	pack_lock();
+	if (!prepare_packed_git_run_once) {
+		prepare_packed_git_one(get_object_directory(), 1);
+		prepare_alt_odb();
+		for (alt = alt_odb_list; alt; alt = alt->next) {
+			alt->name[-1] = 0;
+			prepare_packed_git_one(alt->base, 0);
+			alt->name[-1] = '/';
+		}
+		rearrange_packed_git();
+		prepare_multi_pack_index();
+		prepare_packed_git_run_once = 1;
 	}
-	rearrange_packed_git();
-	prepare_packed_git_run_once = 1;
+	pack_unlock();
 }
 
 void reprepare_packed_git(void)
 {
+	pack_lock();
 	discard_revindex();
+	clear_loose_object_caches();
 	prepare_packed_git_run_once = 0;
 	prepare_packed_git();
+	pack_unlock();
 }
 
 static void mark_bad_packed_object(struct packed_git *p,
 				   const unsigned char *sha1)
 {
 	unsigned i;
+
+	pack_lock();
 	for (i = 0; i < p->num_bad_objects; i++)
 		if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
-			return;
-	p->bad_object_sha1 = xrealloc(p->bad_object_sha1, 20 * (p->num_bad_objects + 1));
-	hashcpy(p->bad_object_sha1 + 20 * p->num_bad_objects, sha1);
-	p->num_bad_objects++;
+			break;
+	if (i == p->num_bad_objects) {
+		p->bad_object_sha1 = xrealloc(p->bad_object_sha1,
+					      20 * (p->num_bad_objects + 1));
+		hashcpy(p->bad_object_sha1 + 20 * p->num_bad_objects, sha1);
+		p->num_bad_objects++;
+	}
+	pack_unlock();
+}
+
+/*
+ * Look up the object that starts at ofs in the reverse index, which
+ * is loaded or built on first use: find its position in the pack
+ * index, and where the next object starts.
+ */
+static int pack_revindex_entry(struct packed_git *p, off_t ofs,
+			       uint32_t *nr, off_t *next)
+{
+	int pos;
+
+	pack_lock();
+	pos = find_pack_revindex(p, ofs);
+	if (pos >= 0) {
+		if (nr)
+			*nr = pack_pos_to_index(p, pos);
+		if (next)
+			*next = pack_pos_to_offset(p, pos + 1);
+	}
+	pack_unlock();
+	return pos < 0 ? -1 : 0;
 }
 
 static int has_packed_and_bad(const unsigned char *sha1)
 {
 	struct packed_git *p;
 	unsigned i;
+	int ret = 0;
 
-	for (p = packed_git; p; p = p->next)
+	pack_lock();
+	for (p = packed_git; p && !ret; p = p->next)
 		for (i = 0; i < p->num_bad_objects; i++)
-			if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
-				return 1;
-	return 0;
+			if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i)) {
+				ret = 1;
+				break;
+			}
+	pack_unlock();
+	return ret;
 }
 
 int check_sha1_signature(const unsigned char *sha1, void *map, unsigned long size, const char *type)
@@ -1096,19 +1354,28 @@ static int git_open_noatime(const char *name)
 	return fd;
 }
 
-static int open_sha1_file(const unsigned char *sha1)
+/*
+ * With quick set, only look in the object directories whose loose
+ * object cache lists the object.
+ */
+static int open_sha1_file_1(const unsigned char *sha1, int quick)
 {
 	int fd;
-	char *name = sha1_file_name(sha1);
+	char *name;
 	struct alternate_object_database *alt;
 
-	fd = git_open_noatime(name);
-	if (fd >= 0)
-		return fd;
+	if (!quick || has_loose_object_local(sha1)) {
+		name = sha1_file_name(sha1);
+		fd = git_open_noatime(name);
+		if (fd >= 0)
+			return fd;
+	}
 
 	prepare_alt_odb();
 	errno = ENOENT;
 	for (alt = alt_odb_list; alt; alt = alt->next) {
+		if (quick && !has_loose_object_alt(alt, sha1))
+			continue;
 		name = alt->name;
 		fill_sha1_path(name, sha1);
 		fd = git_open_noatime(alt->base);
@@ -1118,12 +1385,30 @@ static int open_sha1_file(const unsigned char *sha1)
 	return -1;
 }
 
+static int open_sha1_file(const unsigned char *sha1)
+{
+	int fd;
+
+	/*
+	 * The cache may have missed an object another process wrote
+	 * since; look everywhere before giving up.
+	 */
+	if (use_loose_object_cache) {
+		fd = open_sha1_file_1(sha1, 1);
+		if (fd >= 0)
+			return fd;
+	}
+	return open_sha1_file_1(sha1, 0);
+}
+
 static void *map_sha1_file(const unsigned char *sha1, unsigned long *size)
 {
 	void *map;
 	int fd;
 
+	pack_lock();
 	fd = open_sha1_file(sha1);
+	pack_unlock();
 	map = NULL;
 	if (fd >= 0) {
 		struct stat st;
@@ -1431,12 +1716,11 @@ static int packed_delta_info(struct packed_git *p,
 		return OBJ_BAD;
 	type = packed_object_info(p, base_offset, NULL);
 	if (type <= OBJ_NONE) {
-		struct revindex_entry *revidx;
+		uint32_t nr;
 		const unsigned char *base_sha1;
-		revidx = find_pack_revindex(p, base_offset);
-		if (!revidx)
+		if (pack_revindex_entry(p, base_offset, &nr, NULL))
 			return OBJ_BAD;
-		base_sha1 = nth_packed_object_sha1(p, revidx->nr);
+		base_sha1 = nth_packed_object_sha1(p, nr);
 		mark_bad_packed_object(p, base_sha1);
 		type = sha1_object_info(base_sha1, NULL);
 		if (type <= OBJ_NONE)
@@ -1495,14 +1779,17 @@ const char *packed_object_info_detail(struct packed_git *p,
 	unsigned long dummy;
 	unsigned char *next_sha1;
 	enum object_type type;
-	struct revindex_entry *revidx;
+	uint32_t nr;
+	off_t next;
 
 	*delta_chain_length = 0;
 	curpos = obj_offset;
 	type = unpack_object_header(p, &w_curs, &curpos, size);
 
-	revidx = find_pack_revindex(p, obj_offset);
-	*store_size = revidx[1].offset - obj_offset;
+	if (pack_revindex_entry(p, obj_offset, NULL, &next))
+		die("pack %s has no object at offset %"PRIuMAX,
+		    p->pack_name, (uintmax_t)obj_offset);
+	*store_size = next - obj_offset;
 
 	for (;;) {
 		switch (type) {
@@ -1521,8 +1808,10 @@ const char *packed_object_info_detail(struct packed_git *p,
 				die("pack %s contains bad delta base reference of type %s",
 				    p->pack_name, typename(type));
 			if (*delta_chain_length == 0) {
-				revidx = find_pack_revindex(p, obj_offset);
-				hashcpy(base_sha1, nth_packed_object_sha1(p, revidx->nr));
+				if (pack_revindex_entry(p, obj_offset, &nr, NULL))
+					die("pack %s contains bad delta base reference",
+					    p->pack_name);
+				hashcpy(base_sha1, nth_packed_object_sha1(p, nr));
 			}
 			break;
 		case OBJ_REF_DELTA:
@@ -1601,104 +1890,336 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	return buffer;
 }
 
-#define MAX_DELTA_CACHE (256)
-
-static size_t delta_base_cached;
+/*
+ * Base objects recently used to apply a delta, keyed by pack and
+ * offset.  The entries are chained in a hash table that grows with
+ * them, and kept on a list from least to most recently used; once
+ * they take more than delta_base_cache_limit bytes, the least
+ * recently used ones are dropped, blobs first.
+ *
+ * While object reads are threaded, the cache is split into shards
+ * with a lock each, an entry's shard being picked by its hash, and
+ * every shard gets its part of the limit.
+ */
+#define DELTA_BASE_CACHE_SHARDS 16
 
-static struct delta_base_cache_lru_list {
+struct delta_base_cache_lru_list {
 	struct delta_base_cache_lru_list *prev;
 	struct delta_base_cache_lru_list *next;
-} delta_base_cache_lru = { &delta_base_cache_lru, &delta_base_cache_lru };
+};
 
-static struct delta_base_cache_entry {
+struct delta_base_cache_entry {
 	struct delta_base_cache_lru_list lru;
+	struct delta_base_cache_entry *next;
 	void *data;
 	struct packed_git *p;
 	off_t base_offset;
 	unsigned long size;
 	enum object_type type;
-} delta_base_cache[MAX_DELTA_CACHE];
+};
+
+struct delta_base_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t peak;
+};
+
+static struct delta_base_cache {
+	struct delta_base_cache_entry **table;
+	unsigned int size, nr;
+	size_t cached;
+	struct delta_base_cache_lru_list lru;
+	struct delta_base_cache_stats stats;
+#ifndef NO_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+} delta_base_cache[DELTA_BASE_CACHE_SHARDS];
+static unsigned int delta_base_cache_shards = 1;
+
+#ifndef NO_PTHREADS
+static void delta_base_cache_lock(struct delta_base_cache *c)
+{
+	if (threaded_object_reads)
+		pthread_mutex_lock(&c->mutex);
+}
+
+static void delta_base_cache_unlock(struct delta_base_cache *c)
+{
+	if (threaded_object_reads)
+		pthread_mutex_unlock(&c->mutex);
+}
+#else
+#define delta_base_cache_lock(c)	(void)0
+#define delta_base_cache_unlock(c)	(void)0
+#endif
+
+static void trace_delta_base_cache_stats(void)
+{
+	struct delta_base_cache_stats st;
+	unsigned int i;
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < DELTA_BASE_CACHE_SHARDS; i++) {
+		struct delta_base_cache_stats *s = &delta_base_cache[i].stats;
+		st.hits += s->hits;
+		st.misses += s->misses;
+		st.evictions += s->evictions;
+		st.peak += s->peak;
+	}
+	trace_printf("trace: delta base cache: %lu hits, %lu misses, "
+		     "%lu evictions, %lu bytes at most (limit %lu)\n",
+		     st.hits, st.misses, st.evictions,
+		     (unsigned long)st.peak,
+		     (unsigned long)delta_base_cache_limit);
+}
+
+static void register_delta_base_cache_stats(void)
+{
+	static int stats_registered;
+
+	if (!stats_registered) {
+		atexit(trace_delta_base_cache_stats);
+		stats_registered = 1;
+	}
+}
 
-static unsigned long pack_entry_hash(struct packed_git *p, off_t base_offset)
+static unsigned int pack_entry_hash(struct packed_git *p, off_t base_offset)
 {
 	unsigned long hash;
 
 	hash = (unsigned long)p + (unsigned long)base_offset;
 	hash += (hash >> 8) + (hash >> 16);
-	return hash % MAX_DELTA_CACHE;
+	return hash;
+}
+
+static struct delta_base_cache *delta_base_cache_shard(struct packed_git *p,
+						       off_t base_offset)
+{
+	unsigned int hash = pack_entry_hash(p, base_offset);
+	return delta_base_cache + (hash & (delta_base_cache_shards - 1));
+}
+
+static unsigned int delta_base_cache_bucket(struct delta_base_cache *c,
+					    struct packed_git *p,
+					    off_t base_offset)
+{
+	unsigned int hash = pack_entry_hash(p, base_offset);
+	return (hash / delta_base_cache_shards) & (c->size - 1);
+}
+
+static struct delta_base_cache_entry **delta_base_cache_pos(struct delta_base_cache *c,
+							    struct packed_git *p,
+							    off_t base_offset)
+{
+	struct delta_base_cache_entry **pos;
+
+	if (!c->size) {
+		register_delta_base_cache_stats();
+		c->size = 256;
+		c->table = xcalloc(c->size, sizeof(*c->table));
+		c->lru.prev = c->lru.next = &c->lru;
+	}
+	pos = c->table + delta_base_cache_bucket(c, p, base_offset);
+	while (*pos && ((*pos)->p != p || (*pos)->base_offset != base_offset))
+		pos = &(*pos)->next;
+	return pos;
+}
+
+static void grow_delta_base_cache(struct delta_base_cache *c)
+{
+	struct delta_base_cache_entry **old = c->table;
+	unsigned int i, old_size = c->size;
+
+	c->size *= 2;
+	c->table = xcalloc(c->size, sizeof(*c->table));
+	for (i = 0; i < old_size; i++) {
+		struct delta_base_cache_entry *ent = old[i], *next;
+		for (; ent; ent = next) {
+			unsigned int hash = delta_base_cache_bucket(c, ent->p,
+							ent->base_offset);
+			next = ent->next;
+			ent->next = c->table[hash];
+			c->table[hash] = ent;
+		}
+	}
+	free(old);
+}
+
+static inline void lru_unlink(struct delta_base_cache_entry *ent)
+{
+	ent->lru.next->prev = ent->lru.prev;
+	ent->lru.prev->next = ent->lru.next;
+}
+
+static inline void lru_append(struct delta_base_cache *c,
+			      struct delta_base_cache_entry *ent)
+{
+	ent->lru.next = &c->lru;
+	ent->lru.prev = c->lru.prev;
+	c->lru.prev->next = &ent->lru;
+	c->lru.prev = &ent->lru;
+}
+
+/* Remove the entry at *pos from the cache, and return its data */
+static void *detach_delta_base_cache(struct delta_base_cache *c,
+				     struct delta_base_cache_entry **pos)
+{
+	struct delta_base_cache_entry *ent = *pos;
+	void *data = ent->data;
+
+	*pos = ent->next;
+	lru_unlink(ent);
+	c->cached -= ent->size;
+	c->nr--;
+	free(ent);
+	return data;
 }
 
 static void *cache_or_unpack_entry(struct packed_git *p, off_t base_offset,
 	unsigned long *base_size, enum object_type *type, int keep_cache)
 {
+	struct delta_base_cache *c = delta_base_cache_shard(p, base_offset);
+	struct delta_base_cache_entry **pos, *ent;
 	void *ret;
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	struct delta_base_cache_entry *ent = delta_base_cache + hash;
 
-	ret = ent->data;
-	if (!ret || ent->p != p || ent->base_offset != base_offset)
+	delta_base_cache_lock(c);
+	pos = delta_base_cache_pos(c, p, base_offset);
+	ent = *pos;
+	if (!ent) {
+		c->stats.misses++;
+		delta_base_cache_unlock(c);
 		return unpack_entry(p, base_offset, type, base_size);
+	}
 
+	c->stats.hits++;
+	*type = ent->type;
+	*base_size = ent->size;
 	if (!keep_cache) {
-		ent->data = NULL;
-		ent->lru.next->prev = ent->lru.prev;
-		ent->lru.prev->next = ent->lru.next;
-		delta_base_cached -= ent->size;
+		ret = detach_delta_base_cache(c, pos);
 	} else {
 		ret = xmemdupz(ent->data, ent->size);
+		lru_unlink(ent);
+		lru_append(c, ent);
 	}
-	*type = ent->type;
-	*base_size = ent->size;
+	delta_base_cache_unlock(c);
 	return ret;
 }
 
-static inline void release_delta_base_cache(struct delta_base_cache_entry *ent)
+static void release_delta_base_cache(struct delta_base_cache *c,
+				     struct delta_base_cache_entry *ent)
 {
-	if (ent->data) {
-		free(ent->data);
-		ent->data = NULL;
-		ent->lru.next->prev = ent->lru.prev;
-		ent->lru.prev->next = ent->lru.next;
-		delta_base_cached -= ent->size;
-	}
+	free(detach_delta_base_cache(c, delta_base_cache_pos(c, ent->p,
+							     ent->base_offset)));
+	c->stats.evictions++;
 }
 
 static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
 	void *base, unsigned long base_size, enum object_type type)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	struct delta_base_cache_entry *ent = delta_base_cache + hash;
-	struct delta_base_cache_lru_list *lru;
+	struct delta_base_cache *c = delta_base_cache_shard(p, base_offset);
+	size_t limit = delta_base_cache_limit / delta_base_cache_shards;
+	struct delta_base_cache_entry **pos, *ent;
+	struct delta_base_cache_lru_list *lru, *next;
 
-	release_delta_base_cache(ent);
-	delta_base_cached += base_size;
+	delta_base_cache_lock(c);
+	pos = delta_base_cache_pos(c, p, base_offset);
+	if (*pos)
+		free(detach_delta_base_cache(c, pos));
+	c->cached += base_size;
 
-	for (lru = delta_base_cache_lru.next;
-	     delta_base_cached > delta_base_cache_limit
-	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
+	for (lru = c->lru.next;
+	     c->cached > limit && lru != &c->lru;
+	     lru = next) {
 		struct delta_base_cache_entry *f = (void *)lru;
+		next = lru->next;
 		if (f->type == OBJ_BLOB)
-			release_delta_base_cache(f);
+			release_delta_base_cache(c, f);
 	}
-	for (lru = delta_base_cache_lru.next;
-	     delta_base_cached > delta_base_cache_limit
-	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
+	for (lru = c->lru.next;
+	     c->cached > limit && lru != &c->lru;
+	     lru = next) {
 		struct delta_base_cache_entry *f = (void *)lru;
-		release_delta_base_cache(f);
+		next = lru->next;
+		release_delta_base_cache(c, f);
 	}
 
+	ent = xmalloc(sizeof(*ent));
 	ent->p = p;
 	ent->base_offset = base_offset;
 	ent->type = type;
 	ent->data = base;
 	ent->size = base_size;
-	ent->lru.next = &delta_base_cache_lru;
-	ent->lru.prev = delta_base_cache_lru.prev;
-	delta_base_cache_lru.prev->next = &ent->lru;
-	delta_base_cache_lru.prev = &ent->lru;
+	pos = delta_base_cache_pos(c, p, base_offset);
+	ent->next = *pos;
+	*pos = ent;
+	lru_append(c, ent);
+	if (c->stats.peak < c->cached)
+		c->stats.peak = c->cached;
+	if (++c->nr > c->size)
+		grow_delta_base_cache(c);
+	delta_base_cache_unlock(c);
+}
+
+/* Drop all cached bases, e.g. before changing the number of shards */
+static void clear_delta_base_cache(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DELTA_BASE_CACHE_SHARDS; i++) {
+		struct delta_base_cache *c = &delta_base_cache[i];
+		while (c->nr) {
+			struct delta_base_cache_entry *ent = (void *)c->lru.next;
+			free(detach_delta_base_cache(c,
+				delta_base_cache_pos(c, ent->p, ent->base_offset)));
+		}
+	}
+}
+
+#ifndef NO_PTHREADS
+void enable_threaded_object_reads(void)
+{
+	pthread_mutexattr_t attr;
+	unsigned int i;
+
+	if (threaded_object_reads)
+		return;
+	register_delta_base_cache_stats();
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pack_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	for (i = 0; i < DELTA_BASE_CACHE_SHARDS; i++)
+		pthread_mutex_init(&delta_base_cache[i].mutex, NULL);
+	clear_delta_base_cache();
+	delta_base_cache_shards = DELTA_BASE_CACHE_SHARDS;
+	threaded_object_reads = 1;
+}
+
+void disable_threaded_object_reads(void)
+{
+	unsigned int i;
+
+	if (!threaded_object_reads)
+		return;
+	threaded_object_reads = 0;
+	clear_delta_base_cache();
+	delta_base_cache_shards = 1;
+	for (i = 0; i < DELTA_BASE_CACHE_SHARDS; i++)
+		pthread_mutex_destroy(&delta_base_cache[i].mutex);
+	pthread_mutex_destroy(&pack_mutex);
+}
+#else
+void enable_threaded_object_reads(void)
+{
+	; /* nothing */
+}
+
+void disable_threaded_object_reads(void)
+{
+	; /* nothing */
 }
+#endif
 
 static void *read_object(const unsigned char *sha1, enum object_type *type,
 			 unsigned long *size);
@@ -1731,12 +2252,11 @@ static void *unpack_delta_entry(struct packed_git *p,
 		 * This is costly but should happen only in the presence
 		 * of a corrupted pack, and is better than failing outright.
 		 */
-		struct revindex_entry *revidx;
+		uint32_t nr;
 		const unsigned char *base_sha1;
-		revidx = find_pack_revindex(p, base_offset);
-		if (!revidx)
+		if (pack_revindex_entry(p, base_offset, &nr, NULL))
 			return NULL;
-		base_sha1 = nth_packed_object_sha1(p, revidx->nr);
+		base_sha1 = nth_packed_object_sha1(p, nr);
 		error("failed to read delta base object %s"
 		      " at offset %"PRIuMAX" from %s",
 		      sha1_to_hex(base_sha1), (uintmax_t)base_offset,
@@ -1775,11 +2295,13 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 	void *data;
 
 	if (do_check_packed_object_crc && p->index_version > 1) {
-		struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
-		unsigned long len = revidx[1].offset - obj_offset;
-		if (check_pack_crc(p, &w_curs, obj_offset, len, revidx->nr)) {
+		uint32_t nr;
+		off_t next;
+		if (pack_revindex_entry(p, obj_offset, &nr, &next))
+			return NULL;
+		if (check_pack_crc(p, &w_curs, obj_offset, next - obj_offset, nr)) {
 			const unsigned char *sha1 =
-				nth_packed_object_sha1(p, revidx->nr);
+				nth_packed_object_sha1(p, nr);
 			error("bad packed object CRC for %s",
 			      sha1_to_hex(sha1));
 			mark_bad_packed_object(p, sha1);
@@ -1929,18 +2451,47 @@ int matches_pack_name(struct packed_git *p, const char *name)
 	return 0;
 }
 
-static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e, const char **ignore_packed)
+static int packed_object_is_bad(struct packed_git *p,
+				const unsigned char *sha1)
+{
+	unsigned i;
+
+	for (i = 0; i < p->num_bad_objects; i++)
+		if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
+			return 1;
+	return 0;
+}
+
+static int find_pack_entry_1(const unsigned char *sha1, struct pack_entry *e, const char **ignore_packed)
 {
 	static struct packed_git *last_found = (void *)1;
 	struct packed_git *p;
 	off_t offset;
+	int skip_indexed = 0;
 
 	prepare_packed_git();
 	if (!packed_git)
 		return 0;
+
+	/*
+	 * The multi-pack index answers for all the packs it covers at
+	 * once.  Only when it points at a pack we cannot use do we go
+	 * through them one by one.
+	 */
+	if (!ignore_packed) {
+		if (!find_multi_pack_index_entry(sha1, e))
+			skip_indexed = 1;
+		else if (e->p && !packed_object_is_bad(e->p, sha1) &&
+			 (e->p->pack_fd != -1 || !open_packed_git(e->p)))
+			return 1;
+	}
+
 	p = (last_found == (void *)1) ? packed_git : last_found;
 
 	do {
+		if (skip_indexed && p->multi_pack_index)
+			goto next;
+
 		if (ignore_packed) {
 			const char **ig;
 			for (ig = ignore_packed; *ig; ig++)
@@ -1950,12 +2501,8 @@ static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e, cons
 				goto next;
 		}
 
-		if (p->num_bad_objects) {
-			unsigned i;
-			for (i = 0; i < p->num_bad_objects; i++)
-				if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
-					goto next;
-		}
+		if (packed_object_is_bad(p, sha1))
+			goto next;
 
 		offset = find_pack_entry_one(sha1, p);
 		if (offset) {
@@ -1989,6 +2536,16 @@ static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e, cons
 	return 0;
 }
 
+static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e, const char **ignore_packed)
+{
+	int ret;
+
+	pack_lock();
+	ret = find_pack_entry_1(sha1, e, ignore_packed);
+	pack_unlock();
+	return ret;
+}
+
 struct packed_git *find_sha1_pack(const unsigned char *sha1,
 				  struct packed_git *packs)
 {
@@ -2399,7 +2956,12 @@ static int write_loose_object(const unsigned char *sha1, char *hdr, int hdrlen,
 				tmpfile, strerror(errno));
 	}
 
-	return move_temp_to_file(tmpfile, filename);
+	if (move_temp_to_file(tmpfile, filename))
+		return -1;
+	pack_lock();
+	add_loose_object_cache(sha1);
+	pack_unlock();
+	return 0;
 }
 
 int write_sha1_file(void *buf, unsigned long len, const char *type, unsigned char *returnsha1)
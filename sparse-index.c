@@ -0,0 +1,284 @@
+#include "cache.h"
+#include "cache-tree.h"
+#include "tree.h"
+#include "sparse-index.h"
+
+struct sparse_entries {
+	struct index_state *istate;
+	struct cache_entry **cache;
+	int nr, alloc;
+	int uptodate;
+};
+
+static void append_entry(struct sparse_entries *e, struct cache_entry *ce)
+{
+	ALLOC_GROW(e->cache, e->nr + 1, e->alloc);
+	e->cache[e->nr++] = ce;
+}
+
+static int add_tree_entry(const unsigned char *sha1, const char *base,
+			  int baselen, const char *pathname, unsigned mode,
+			  int stage, void *context)
+{
+	struct sparse_entries *e = context;
+	struct cache_entry *ce;
+	int len;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+
+	len = strlen(pathname);
+	ce = xcalloc(1, cache_entry_size(baselen + len));
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(baselen + len, 0) | CE_VALID;
+	memcpy(ce->name, base, baselen);
+	memcpy(ce->name + baselen, pathname, len);
+	hashcpy(ce->sha1, sha1);
+	if (e->uptodate)
+		ce_mark_uptodate(ce);
+	add_name_hash(e->istate, ce);
+	append_entry(e, ce);
+	return 0;
+}
+
+/*
+ * The entries of a tree come in the same order as they sort in the
+ * index, so they can go where the sparse directory entry was.
+ */
+static void expand_entry(struct sparse_entries *e, struct cache_entry *ce)
+{
+	struct tree *tree = lookup_tree(ce->sha1);
+
+	if (!tree ||
+	    read_tree_recursive(tree, ce->name, ce_namelen(ce), 0, NULL,
+				add_tree_entry, e) < 0)
+		die("unable to expand sparse directory %s", ce->name);
+	remove_name_hash(ce);
+}
+
+static void fix_counts(struct index_state *istate)
+{
+	if (istate->cache_tree)
+		cache_tree_fix_counts(istate->cache_tree,
+				      istate->cache, istate->cache_nr);
+}
+
+void ensure_full_index(struct index_state *istate)
+{
+	struct sparse_entries e;
+	int i, expanded = 0;
+
+	if (!istate->sparse_index)
+		return;
+	memset(&e, 0, sizeof(e));
+	e.istate = istate;
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+
+		if (!S_ISSPARSEDIR(ce->ce_mode)) {
+			append_entry(&e, ce);
+			continue;
+		}
+		expand_entry(&e, ce);
+		expanded++;
+	}
+	free(istate->cache);
+	istate->cache = e.cache;
+	istate->cache_nr = e.nr;
+	istate->cache_alloc = e.alloc;
+	istate->sparse_index = 0;
+	fix_counts(istate);
+	trace_printf("trace: sparse index: expanded %d directories\n",
+		     expanded);
+}
+
+void expand_sparse_entry(struct index_state *istate, int pos)
+{
+	struct cache_entry *ce = istate->cache[pos];
+	struct sparse_entries e;
+	int nr;
+
+	/*
+	 * The index may already have been refreshed, and just like
+	 * the directory entry they replace, the entries are assumed
+	 * to be unchanged.
+	 */
+	memset(&e, 0, sizeof(e));
+	e.istate = istate;
+	e.uptodate = 1;
+	expand_entry(&e, ce);
+
+	nr = istate->cache_nr + e.nr - 1;
+	ALLOC_GROW(istate->cache, nr, istate->cache_alloc);
+	memmove(istate->cache + pos + e.nr, istate->cache + pos + 1,
+		(istate->cache_nr - pos - 1) * sizeof(*istate->cache));
+	memcpy(istate->cache + pos, e.cache, e.nr * sizeof(*e.cache));
+	istate->cache_nr = nr;
+	free(e.cache);
+	fix_counts(istate);
+	trace_printf("trace: sparse index: expanded %s\n", ce->name);
+}
+
+void sparse_index_loaded(struct index_state *istate)
+{
+	int i;
+
+	for (i = 0; i < istate->cache_nr; i++)
+		if (S_ISSPARSEDIR(istate->cache[i]->ce_mode))
+			ce_mark_uptodate(istate->cache[i]);
+	if (!sparse_index_ok) {
+		ensure_full_index(istate);
+		return;
+	}
+	/*
+	 * The entry counts of the cache-tree were written for the
+	 * entries as they were in core, not as they are on disk.
+	 */
+	fix_counts(istate);
+}
+
+/* Can this entry be left out of the working tree? */
+static int skip_worktree(const struct cache_entry *ce)
+{
+	return !ce_stage(ce) && (ce->ce_flags & CE_VALID) &&
+		!(ce->ce_flags & (CE_REMOVE | CE_INTENT_TO_ADD));
+}
+
+/* Was the entry made by convert_to_sparse(), rather than borrowed? */
+static int new_entry(const struct index_state *istate,
+		     const struct cache_entry *ce)
+{
+	int pos = index_name_pos(istate, ce->name, ce_namelen(ce));
+	return pos < 0 || istate->cache[pos] != ce;
+}
+
+static struct cache_entry *sparse_dir_entry(const char *name, int len,
+					    const unsigned char *sha1)
+{
+	struct cache_entry *ce = xcalloc(1, cache_entry_size(len));
+
+	ce->ce_mode = S_IFDIR;
+	ce->ce_flags = create_ce_flags(len, 0) | CE_VALID;
+	memcpy(ce->name, name, len);
+	hashcpy(ce->sha1, sha1);
+	ce_mark_uptodate(ce);
+	return ce;
+}
+
+/*
+ * Copy the entries inside "base" starting at "pos", collapsing the
+ * subdirectories that can be.  Returns the number of entries looked
+ * at, and sets *skipped if all of them can be left out of the
+ * working tree.
+ */
+static int collapse_dir(const struct index_state *istate,
+			struct sparse_entries *e, struct cache_tree *it,
+			const char *base, int baselen, int pos, int *skipped)
+{
+	int i = pos;
+
+	*skipped = 1;
+	while (i < istate->cache_nr) {
+		struct cache_entry *ce = istate->cache[i];
+		struct cache_tree_sub *sub = NULL;
+		struct cache_tree *subtree;
+		const char *slash;
+		int len = ce_namelen(ce), sublen, mark, k, sub_skipped;
+
+		if (len < baselen || memcmp(ce->name, base, baselen))
+			break;
+		slash = memchr(ce->name + baselen, '/', len - baselen);
+		if (!slash) {
+			if (!skip_worktree(ce))
+				*skipped = 0;
+			append_entry(e, ce);
+			i++;
+			continue;
+		}
+
+		sublen = slash - ce->name + 1;
+		if (it)
+			sub = cache_tree_find_sub(it, ce->name + baselen,
+						  sublen - baselen - 1);
+		subtree = sub ? sub->cache_tree : NULL;
+		mark = e->nr;
+		i += collapse_dir(istate, e, subtree, ce->name, sublen, i,
+				  &sub_skipped);
+		if (!sub_skipped) {
+			*skipped = 0;
+			continue;
+		}
+		if (e->nr - mark == 1 &&
+		    S_ISSPARSEDIR(e->cache[mark]->ce_mode) &&
+		    ce_namelen(e->cache[mark]) == sublen)
+			continue;
+		if (!subtree || subtree->entry_count < 0 ||
+		    !has_sha1_file(subtree->sha1))
+			continue;
+		for (k = mark; k < e->nr; k++)
+			if (S_ISSPARSEDIR(e->cache[k]->ce_mode) &&
+			    new_entry(istate, e->cache[k]))
+				free(e->cache[k]);
+		e->nr = mark;
+		append_entry(e, sparse_dir_entry(ce->name, sublen,
+						 subtree->sha1));
+	}
+	return i - pos;
+}
+
+/* Is there anything that could be left out of the working tree? */
+static int has_skipped_entries(const struct index_state *istate)
+{
+	int i;
+
+	for (i = 0; i < istate->cache_nr; i++)
+		if (istate->cache[i]->ce_flags & CE_VALID)
+			return 1;
+	return 0;
+}
+
+int convert_to_sparse(struct index_state *istate,
+		      struct index_state *sparse)
+{
+	struct sparse_entries e;
+	int i, skipped, nr = 0;
+
+	if (!has_skipped_entries(istate))
+		return 0;
+	/* Only directories with a valid cache-tree can be collapsed */
+	if (!unmerged_index(istate)) {
+		if (!istate->cache_tree)
+			istate->cache_tree = cache_tree();
+		if (istate->cache_tree->entry_count < 0)
+			cache_tree_update(istate->cache_tree, istate->cache,
+					  istate->cache_nr, 1, 0);
+	}
+	memset(&e, 0, sizeof(e));
+	collapse_dir(istate, &e, istate->cache_tree, "", 0, 0, &skipped);
+	for (i = 0; i < e.nr; i++)
+		if (S_ISSPARSEDIR(e.cache[i]->ce_mode))
+			nr++;
+	if (!nr) {
+		free(e.cache);
+		return 0;
+	}
+	*sparse = *istate;
+	sparse->cache = e.cache;
+	sparse->cache_nr = e.nr;
+	sparse->cache_alloc = e.alloc;
+	sparse->sparse_index = 1;
+	return nr;
+}
+
+void discard_sparse_copy(const struct index_state *istate,
+			 struct index_state *sparse)
+{
+	int i;
+
+	for (i = 0; i < sparse->cache_nr; i++) {
+		struct cache_entry *ce = sparse->cache[i];
+		if (S_ISSPARSEDIR(ce->ce_mode) && new_entry(istate, ce))
+			free(ce);
+	}
+	free(sparse->cache);
+}
@@ -0,0 +1,36 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+/*
+ * With core.sparseIndex, a directory whose entries are all marked
+ * "assume unchanged" (CE_VALID) and whose cache-tree is valid is
+ * written as a single entry "dir/" with mode S_IFDIR and the object
+ * name of its tree, so that the index of a sparse checkout grows
+ * with the part of the tree that is actually checked out.
+ *
+ * Commands that know how to deal with such entries set
+ * sparse_index_ok before reading the index; everybody else gets
+ * the directories expanded back into their entries as the index
+ * is read.
+ */
+
+/* Called once the entries of a sparse index have been read */
+extern void sparse_index_loaded(struct index_state *istate);
+
+/* Replace all sparse directory entries by the entries of their trees */
+extern void ensure_full_index(struct index_state *istate);
+
+/* Replace the sparse directory entry at "pos" by its entries */
+extern void expand_sparse_entry(struct index_state *istate, int pos);
+
+/*
+ * Fill "sparse" with a copy of the index where the directories that
+ * can be are collapsed.  Returns the number of sparse directory
+ * entries in the copy; when that is zero, the copy is not made.
+ */
+extern int convert_to_sparse(struct index_state *istate,
+			     struct index_state *sparse);
+extern void discard_sparse_copy(const struct index_state *istate,
+				struct index_state *sparse);
+
+#endif
@@ -0,0 +1,249 @@
+#include "cache.h"
+#include "split-index.h"
+
+/*
+ * Write a new shared index once more than this percentage of the
+ * entries would have to go into the index file itself.
+ */
+#define SPLIT_INDEX_MAX_CHANGE 20
+
+static struct split_index *init_split_index(struct index_state *istate)
+{
+	if (!istate->split_index)
+		istate->split_index = xcalloc(1, sizeof(struct split_index));
+	return istate->split_index;
+}
+
+static void free_base(struct split_index *si)
+{
+	if (!si->base)
+		return;
+	discard_index(si->base);
+	free(si->base->cache);
+	free(si->base);
+	si->base = NULL;
+}
+
+static void merge_base_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base;
+	struct cache_entry **cache;
+	char *keep, *alloc;
+	const char *path;
+	unsigned int i, j, nr, size;
+
+	path = git_path("sharedindex.%s", sha1_to_hex(si->base_sha1));
+	base = xcalloc(1, sizeof(*base));
+	if (read_index_from(base, path) < 0 || !base->initialized)
+		die("broken index, expected %s", path);
+	si->base = base;
+
+	keep = xmalloc(base->cache_nr + 1);
+	memset(keep, 1, base->cache_nr);
+	for (i = 0; i < si->deleted_nr; i++) {
+		if (si->deleted[i] >= base->cache_nr)
+			die("index file corrupt");
+		keep[si->deleted[i]] = 0;
+	}
+	for (i = nr = size = 0; i < base->cache_nr; i++) {
+		if (!keep[i])
+			continue;
+		size += ce_size(base->cache[i]);
+		nr++;
+	}
+
+	alloc = si->alloc = xmalloc(size + 1);
+	nr += istate->cache_nr;
+	cache = xcalloc(alloc_nr(nr), sizeof(*cache));
+	for (i = j = nr = 0; i < istate->cache_nr || j < base->cache_nr; ) {
+		struct cache_entry *ce, *bce;
+		int cmp;
+
+		if (j < base->cache_nr && !keep[j]) {
+			j++;
+			continue;
+		}
+		ce = i < istate->cache_nr ? istate->cache[i] : NULL;
+		bce = j < base->cache_nr ? base->cache[j] : NULL;
+		if (!ce)
+			cmp = 1;
+		else if (!bce)
+			cmp = -1;
+		else
+			cmp = cache_name_compare(ce->name, ce->ce_flags,
+						 bce->name, bce->ce_flags);
+		if (!cmp)
+			die("index file corrupt: %s is in the shared index",
+			    ce->name);
+		if (cmp < 0) {
+			cache[nr++] = ce;
+			i++;
+			continue;
+		}
+		memcpy(alloc, bce, ce_size(bce));
+		cache[nr++] = (struct cache_entry *)alloc;
+		alloc += ce_size(bce);
+		j++;
+	}
+	free(keep);
+
+	free(istate->cache);
+	istate->cache = cache;
+	istate->cache_nr = nr;
+	istate->cache_alloc = alloc_nr(nr);
+}
+
+int read_link_extension(struct index_state *istate,
+			const char *data, unsigned long sz)
+{
+	struct split_index *si;
+	int i;
+
+	if (sz < 20 || (sz - 20) % 4)
+		return error("corrupt link extension (length %lu)", sz);
+	si = init_split_index(istate);
+	hashcpy(si->base_sha1, (const unsigned char *)data);
+	data += 20;
+	sz -= 20;
+	si->deleted_nr = sz / 4;
+	ALLOC_GROW(si->deleted, si->deleted_nr, si->deleted_alloc);
+	for (i = 0; i < si->deleted_nr; i++)
+		si->deleted[i] = ntohl(((uint32_t *)data)[i]);
+	merge_base_index(istate);
+	return 0;
+}
+
+void write_link_extension(struct strbuf *sb,
+			  const struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	int i;
+
+	strbuf_add(sb, si->base_sha1, 20);
+	for (i = 0; i < si->deleted_nr; i++) {
+		uint32_t pos = htonl(si->deleted[i]);
+		strbuf_add(sb, &pos, 4);
+	}
+}
+
+/* Would the entry be written just like it is in the shared index? */
+static int same_entry(const struct cache_entry *a, const struct cache_entry *b)
+{
+	const unsigned int flags = CE_NAMEMASK | CE_STAGEMASK | CE_VALID |
+		CE_EXTENDED_FLAGS;
+
+	return a->ce_ctime == b->ce_ctime &&
+		a->ce_mtime == b->ce_mtime &&
+		a->ce_dev == b->ce_dev &&
+		a->ce_ino == b->ce_ino &&
+		a->ce_mode == b->ce_mode &&
+		a->ce_uid == b->ce_uid &&
+		a->ce_gid == b->ce_gid &&
+		a->ce_size == b->ce_size &&
+		(a->ce_flags & flags) == (b->ce_flags & flags) &&
+		!hashcmp(a->sha1, b->sha1);
+}
+
+static void add_deleted(struct split_index *si, unsigned int pos)
+{
+	ALLOC_GROW(si->deleted, si->deleted_nr + 1, si->deleted_alloc);
+	si->deleted[si->deleted_nr++] = pos;
+}
+
+unsigned char *prepare_split_delta(const struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+	struct index_state *base;
+	unsigned char *skip;
+	unsigned int i, j, nr, changes;
+
+	if (!si || !si->base)
+		return NULL;
+	base = si->base;
+	si->deleted_nr = 0;
+	skip = xcalloc(istate->cache_nr + 1, 1);
+	for (i = j = nr = changes = 0;
+	     i < istate->cache_nr || j < base->cache_nr; ) {
+		struct cache_entry *ce, *bce;
+		int cmp;
+
+		if (i < istate->cache_nr &&
+		    (istate->cache[i]->ce_flags & CE_REMOVE)) {
+			i++;
+			continue;
+		}
+		ce = i < istate->cache_nr ? istate->cache[i] : NULL;
+		bce = j < base->cache_nr ? base->cache[j] : NULL;
+		if (!ce)
+			cmp = 1;
+		else if (!bce)
+			cmp = -1;
+		else
+			cmp = cache_name_compare(ce->name, ce->ce_flags,
+						 bce->name, bce->ce_flags);
+		if (cmp <= 0) {
+			nr++;
+			if (!cmp && same_entry(ce, bce))
+				skip[i] = 1;
+			else
+				changes++;
+			i++;
+		}
+		if (cmp >= 0) {
+			if (cmp || !skip[i - 1])
+				add_deleted(si, j);
+			j++;
+		}
+	}
+	if (changes * 100 > nr * SPLIT_INDEX_MAX_CHANGE) {
+		free(skip);
+		return NULL;
+	}
+	return skip;
+}
+
+void replace_split_base(struct index_state *istate, const unsigned char *sha1)
+{
+	struct split_index *si = init_split_index(istate);
+	struct index_state *base;
+	char *alloc;
+	unsigned int i, nr, size;
+
+	free_base(si);
+	for (i = nr = size = 0; i < istate->cache_nr; i++) {
+		if (istate->cache[i]->ce_flags & CE_REMOVE)
+			continue;
+		size += ce_size(istate->cache[i]);
+		nr++;
+	}
+
+	base = si->base = xcalloc(1, sizeof(*base));
+	base->cache = xcalloc(nr + 1, sizeof(*base->cache));
+	base->cache_alloc = nr + 1;
+	base->alloc = alloc = xmalloc(size + 1);
+	base->initialized = 1;
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		memcpy(alloc, ce, ce_size(ce));
+		base->cache[base->cache_nr++] = (struct cache_entry *)alloc;
+		alloc += ce_size(ce);
+	}
+	hashcpy(si->base_sha1, sha1);
+	si->deleted_nr = 0;
+}
+
+void discard_split_index(struct index_state *istate)
+{
+	struct split_index *si = istate->split_index;
+
+	if (!si)
+		return;
+	free_base(si);
+	free(si->alloc);
+	free(si->deleted);
+	free(si);
+	istate->split_index = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef SPLIT_INDEX_H
+#define SPLIT_INDEX_H
+
+/*
+ * With core.splitIndex, most entries live in a shared index file
+ * "$GIT_DIR/sharedindex.<sha1>" that is rarely rewritten, and the
+ * index file itself only holds the entries added or changed since,
+ * plus a "link" extension naming the shared index and the positions
+ * of its entries that have been removed or replaced.
+ */
+struct split_index {
+	unsigned char base_sha1[20];
+	/* The entries as they are in the shared index */
+	struct index_state *base;
+	/* Copies of the entries of the base that are in use */
+	void *alloc;
+	uint32_t *deleted;
+	int deleted_nr, deleted_alloc;
+};
+
+/* Read the "link" extension and merge in the entries of the base */
+extern int read_link_extension(struct index_state *istate,
+			       const char *data, unsigned long sz);
+extern void write_link_extension(struct strbuf *sb,
+				 const struct index_state *istate);
+
+/*
+ * Compare the entries with those of the base.  Returns an array with
+ * a non-zero byte for every entry that need not be written, or NULL
+ * when it is time to write a new shared index.
+ */
+extern unsigned char *prepare_split_delta(const struct index_state *istate);
+
+/* Make the entries just written to a shared index the new base */
+extern void replace_split_base(struct index_state *istate,
+			       const unsigned char *sha1);
+
+extern void discard_split_index(struct index_state *istate);
+
+#endif
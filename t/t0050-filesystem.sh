@@ -119,4 +119,30 @@ $test_unicode 'merge (silent unicode normalization)' '
 
 '
 
+test_expect_success 'core.ignorecase looks up index entries regardless of case' '
+
+ mkdir icase &&
+ cd icase &&
+ git init &&
+ for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 \
+	  21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40
+ do
+	echo $i >file$i &&
+	git add file$i &&
+	mv file$i FILE$i || exit
+ done &&
+ git config core.ignorecase true &&
+ git ls-files -o >../actual &&
+ test_cmp /dev/null ../actual &&
+ git rm -q --cached file7 file31 &&
+ git ls-files -o >../actual &&
+ printf "FILE31\nFILE7\n" >../expect &&
+ test_cmp ../expect ../actual &&
+ git add FILE7 &&
+ git ls-files -o >../actual &&
+ echo FILE31 >../expect &&
+ test_cmp ../expect ../actual
+
+'
+
 test_done
@@ -0,0 +1,56 @@
+#!/bin/sh
+
+test_description='cache of the loose object directories'
+. ./test-lib.sh
+
+test_expect_success setup '
+	echo outside >outside &&
+	outside=$(git hash-object outside) &&
+	echo another >another &&
+	another=$(git hash-object another) &&
+	ours=$(printf ours | git hash-object --stdin)
+'
+
+test_expect_success 'objects we write are added to the cache' '
+	test-loose-object-cache enable has $ours write ours has $ours >actual &&
+	cat >expect <<-EOF &&
+	$ours no
+	$ours yes
+	$ours yes
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'objects written by others are seen after reprepare' '
+	test-loose-object-cache enable has $outside hash-object outside \
+		has $outside reprepare has $outside >actual &&
+	cat >expect <<-EOF &&
+	$outside no
+	$outside no
+	$outside yes
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'without the cache they are seen at once' '
+	test-loose-object-cache has $another hash-object another \
+		has $another >actual &&
+	cat >expect <<-EOF &&
+	$another no
+	$another yes
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'disabling the cache drops it' '
+	rm -f .git/objects/$(echo $another | sed -e "s|^..|&/|") &&
+	test-loose-object-cache enable has $another hash-object another \
+		disable has $another >actual &&
+	cat >expect <<-EOF &&
+	$another no
+	$another yes
+	EOF
+	test_cmp expect actual
+'
+
+test_done
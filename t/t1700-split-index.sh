@@ -0,0 +1,124 @@
+#!/bin/sh
+
+test_description='split index: shared index plus small index file'
+
+. ./test-lib.sh
+
+shared_indexes () {
+	ls .git | grep "^sharedindex\." | wc -l
+}
+
+test_expect_success 'setup' '
+	cat >.git/info/exclude <<-\EOF &&
+	actual
+	expect
+	sorted
+	ls-files.expect
+	EOF
+	for i in 0 1 2 3 4 5 6 7 8 9
+	do
+		for j in 0 1 2 3 4 5 6 7 8 9
+		do
+			echo $i$j >file$i$j || exit
+		done
+	done &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	git ls-files -s >ls-files.expect &&
+	git config core.splitIndex true
+'
+
+test_expect_success 'writing the index creates a shared index' '
+	echo changed >file00 &&
+	git add file00 &&
+	test $(shared_indexes) = 1 &&
+	size=$(wc -c <.git/index) &&
+	test $size -lt 200
+'
+
+test_expect_success 'small changes only go to the index file' '
+	echo changed >file01 &&
+	echo new >new &&
+	git add file01 new &&
+	git rm -q --cached file02 &&
+	test $(shared_indexes) = 1 &&
+	size=$(wc -c <.git/index) &&
+	test $size -lt 400 &&
+	git ls-files >actual &&
+	grep "^new\$" actual &&
+	! grep "^file02\$" actual &&
+	test $(wc -l <actual) = 100
+'
+
+test_expect_success 'entries are merged in the right order' '
+	git ls-files -s >actual &&
+	sort -k 4 actual >sorted &&
+	test_cmp sorted actual &&
+	git diff --cached --name-status >actual &&
+	cat >expect <<-\EOF &&
+	M	file00
+	M	file01
+	D	file02
+	A	new
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'many changes write a new shared index' '
+	for i in 1 2 3
+	do
+		for j in 0 1 2 3 4 5 6 7 8 9
+		do
+			echo changed >file$i$j || exit
+		done
+	done &&
+	git add . &&
+	test $(shared_indexes) = 2 &&
+	size=$(wc -c <.git/index) &&
+	test $size -lt 200
+'
+
+test_expect_success 'stale temporary shared indexes are removed' '
+	echo stale >.git/sharedindex_stale &&
+	test-chmtime -1300000 .git/sharedindex_stale &&
+	echo fresh >.git/sharedindex_fresh &&
+	for i in 4 5 6
+	do
+		for j in 0 1 2 3 4 5 6 7 8 9
+		do
+			echo changed >file$i$j || exit
+		done
+	done &&
+	git add . &&
+	test $(shared_indexes) = 3 &&
+	! test -f .git/sharedindex_stale &&
+	test -f .git/sharedindex_fresh &&
+	rm .git/sharedindex_fresh
+'
+
+test_expect_success 'reset and commit keep working' '
+	git reset -q --hard &&
+	git ls-files -s >actual &&
+	test_cmp ls-files.expect actual &&
+	git diff --exit-code &&
+	echo again >file55 &&
+	git commit -q -a -m again &&
+	git diff --exit-code HEAD
+'
+
+test_expect_success 'disabling core.splitIndex writes a full index' '
+	git config core.splitIndex false &&
+	echo stale >.git/sharedindex_stale &&
+	test-chmtime -1300000 .git/sharedindex_stale &&
+	echo new >new &&
+	git update-index --add new &&
+	! test -f .git/sharedindex_stale &&
+	mkdir .git/old &&
+	mv .git/sharedindex.* .git/old/ &&
+	git ls-files >actual &&
+	grep "^new\$" actual &&
+	test $(wc -l <actual) = 101
+'
+
+test_done
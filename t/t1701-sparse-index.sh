@@ -0,0 +1,106 @@
+#!/bin/sh
+
+test_description='sparse index: directories nobody looks at as one entry'
+
+. ./test-lib.sh
+
+expanded () {
+	GIT_TRACE=1 git "$@" 2>&1 >/dev/null |
+	sed -n -e "s/^trace: sparse index: expanded //p"
+}
+
+test_expect_success 'setup' '
+	cat >.git/info/exclude <<-\EOF &&
+	actual
+	expect
+	trace
+	ls-files.expect
+	EOF
+	mkdir -p in out/deep out/x &&
+	for i in 1 2 3
+	do
+		echo $i >in/f$i &&
+		echo $i >out/f$i &&
+		echo $i >out/deep/f$i &&
+		echo $i >out/x/f$i || exit
+	done &&
+	echo top >top &&
+	git add . &&
+	test_tick &&
+	git commit -m initial &&
+	git ls-files -s >ls-files.expect &&
+	git config core.sparseIndex true
+'
+
+test_expect_success 'assumed unchanged directories are collapsed' '
+	git ls-files out | xargs git update-index --assume-unchanged &&
+	rm -rf out &&
+	expanded ls-files >actual &&
+	echo "1 directories" >expect &&
+	test_cmp expect actual &&
+	git ls-files -s >actual &&
+	test_cmp ls-files.expect actual
+'
+
+test_expect_success 'status works without expanding the index' '
+	expanded status >actual &&
+	test_cmp /dev/null actual &&
+	test_must_fail git status >actual &&
+	grep "nothing to commit" actual
+'
+
+test_expect_success 'commit works without expanding the index' '
+	echo changed >in/f1 &&
+	test_tick &&
+	expanded commit -q -a -m changed >actual &&
+	test_cmp /dev/null actual &&
+	git diff --cached --exit-code HEAD &&
+	git diff-tree --name-only HEAD^ HEAD >actual &&
+	echo in >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a change inside a sparse directory expands it' '
+	blob=$(echo new | git hash-object -w --stdin) &&
+	git update-index --cacheinfo 100644 $blob out/x/f1 &&
+	git update-index --assume-unchanged out/x/f1 &&
+	test_tick &&
+	git commit -q -m "changed out" &&
+	git reset -q --soft HEAD^ &&
+	expanded status >actual &&
+	echo "out/" >expect &&
+	test_cmp expect actual &&
+	git status >actual &&
+	grep "modified:   out/x/f1" actual &&
+	! grep deleted actual &&
+	git reset -q --soft HEAD@{1}
+'
+
+test_expect_success 'untracked files in a sparse directory are found' '
+	mkdir -p out/x &&
+	echo new >out/x/new &&
+	test_must_fail git status >actual &&
+	grep "out/x/new" actual &&
+	! grep "out/x/f" actual &&
+	rm -rf out
+'
+
+test_expect_success 'write-tree and switching branches' '
+	git write-tree >expect &&
+	git rev-parse HEAD^{tree} >actual &&
+	test_cmp expect actual &&
+	git checkout -q -b side HEAD^ &&
+	git diff --cached --exit-code HEAD &&
+	git checkout -q master &&
+	git diff-index --cached --exit-code HEAD
+'
+
+test_expect_success 'core.sparseIndex=false writes all entries' '
+	git config core.sparseIndex false &&
+	git update-index --no-assume-unchanged in/f1 &&
+	expanded ls-files >actual &&
+	test_cmp /dev/null actual &&
+	test $(git ls-files | wc -l) = 13
+'
+
+test_done
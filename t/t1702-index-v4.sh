@@ -0,0 +1,79 @@
+#!/bin/sh
+
+test_description='index file format version 4: prefix-compressed names'
+
+. ./test-lib.sh
+
+index_version () {
+	od -An -tx1 -j7 -N1 .git/index | tr -d " "
+}
+
+test_expect_success 'setup' '
+	mkdir -p dir/sub/deeper &&
+	for i in 1 2 3 4 5 6 7 8 9 10
+	do
+		echo $i >dir/sub/deeper/file$i &&
+		echo $i >dir/sub/file$i &&
+		echo $i >file$i || exit
+	done &&
+	git add dir file* &&
+	test_tick &&
+	git commit -q -m initial &&
+	git ls-files -s >expect &&
+	test $(index_version) = 02
+'
+
+test_expect_success 'index.version=4 writes a smaller index' '
+	v2_size=$(wc -c <.git/index) &&
+	git config index.version 4 &&
+	rm .git/index &&
+	git read-tree HEAD &&
+	test $(index_version) = 04 &&
+	test $(wc -c <.git/index) -lt $v2_size &&
+	git ls-files -s >actual &&
+	test_cmp expect actual &&
+	git diff-index --cached --exit-code HEAD
+'
+
+test_expect_success 'adding and removing entries' '
+	echo new >dir/sub/new &&
+	git add dir/sub/new &&
+	git rm -q --cached dir/sub/deeper/file1 &&
+	git ls-files >actual &&
+	grep "^dir/sub/new$" actual &&
+	! grep "^dir/sub/deeper/file1$" actual &&
+	test $(git ls-files | wc -l) = 30 &&
+	git reset -q &&
+	git ls-files -s >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a large index is read with threads' '
+	git config index.threads 3 &&
+	blob=$(echo 1 | git hash-object --stdin) &&
+	i=0 &&
+	while test $i -lt 25000
+	do
+		echo "100644 $blob	dir/sub/deeper/many/path$i" &&
+		i=$(($i + 1))
+	done | git update-index --index-info &&
+	git ls-files -s >many.expect &&
+	test $(index_version) = 04 &&
+	GIT_TRACE=1 git ls-files -s 2>trace >actual &&
+	grep "read index entries with 3 threads" trace &&
+	test_cmp many.expect actual
+'
+
+test_expect_success 'index.version=2 goes back to full names' '
+	git config index.version 2 &&
+	git update-index --force-remove file1 &&
+	git update-index --add file1 &&
+	test $(index_version) = 02 &&
+	git ls-files -s >actual &&
+	test_cmp many.expect actual &&
+	git read-tree HEAD &&
+	git ls-files -s >actual &&
+	test_cmp expect actual
+'
+
+test_done
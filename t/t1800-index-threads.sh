@@ -0,0 +1,46 @@
+#!/bin/sh
+
+test_description='reading a large index with several threads'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	empty=$(git hash-object -w /dev/null) &&
+	awk -v e=$empty "BEGIN {
+		for (i = 0; i < 25000; i++)
+			printf \"100644 %s\\tdir%02d/file%05d\\n\", e, i % 50, i
+	}" >index-info &&
+	git update-index --index-info <index-info &&
+	git config index.threads 1 &&
+	git ls-files -s >expect &&
+	test $(wc -l <expect) = 25000
+'
+
+test_expect_success 'index with entry offsets reads the same' '
+	git config index.threads 3 &&
+	git update-index --add index-info &&
+	git update-index --force-remove index-info &&
+	GIT_TRACE=1 git ls-files -s 2>trace >actual &&
+	grep "read index entries with 3 threads" trace &&
+	test_cmp expect actual
+'
+
+test_expect_success 'index.threads=1 reads it sequentially' '
+	git config index.threads 1 &&
+	GIT_TRACE=1 git ls-files -s 2>trace >actual &&
+	! grep "read index entries" trace &&
+	test_cmp expect actual
+'
+
+test_expect_success 'extensions are read along with the entries' '
+	git config index.threads 2 &&
+	git read-tree $(git write-tree) &&
+	git write-tree >tree.expect &&
+	GIT_TRACE=1 git ls-files -s 2>trace >actual &&
+	grep "read index entries with 2 threads" trace &&
+	test_cmp expect actual &&
+	git write-tree >tree.actual &&
+	test_cmp tree.expect tree.actual
+'
+
+test_done
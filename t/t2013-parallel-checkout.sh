@@ -0,0 +1,89 @@
+#!/bin/sh
+
+test_description='checkout with several workers'
+
+. ./test-lib.sh
+
+workers () {
+	GIT_TRACE=1 git "$@" 2>&1 >/dev/null |
+	sed -n -e "s/^trace: parallel checkout: //p"
+}
+
+test_expect_success 'setup' '
+	for d in a b c
+	do
+		mkdir -p $d/sub &&
+		for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 \
+			 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40 \
+			 41 42 43 44 45 46 47 48 49 50
+		do
+			echo $d$i >$d/file$i &&
+			echo $d$i >$d/sub/file$i || exit
+		done
+	done &&
+	echo script >a/script &&
+	chmod +x a/script &&
+	git add . &&
+	test_tick &&
+	git commit -q -m initial &&
+	git checkout -q -b empty &&
+	git rm -q -r a b c &&
+	test_tick &&
+	git commit -q -m empty &&
+	git config checkout.workers 3
+'
+
+test_expect_success 'checkout writes the files with workers' '
+	workers checkout master >actual &&
+	echo "301 files with 3 workers" >expect &&
+	test_cmp expect actual &&
+	test "$(cat b/sub/file42)" = b42 &&
+	test -x a/script &&
+	git diff-files --exit-code &&
+	git diff --exit-code
+'
+
+test_expect_success 'stat data is recorded for the new files' '
+	git ls-files -s >before &&
+	git update-index --refresh &&
+	git ls-files -s >after &&
+	test_cmp before after &&
+	git diff-files --quiet
+'
+
+test_expect_success 'reset --hard puts back removed files' '
+	rm -rf a c &&
+	workers reset -q --hard >actual &&
+	echo "201 files with 2 workers" >expect &&
+	test_cmp expect actual &&
+	git diff-files --exit-code
+'
+
+test_expect_success 'few files are written without workers' '
+	rm b/file1 a/sub/file2 &&
+	workers reset -q --hard >actual &&
+	test_cmp /dev/null actual &&
+	git diff-files --exit-code
+'
+
+test_expect_success 'files in the way are checked before the workers start' '
+	echo changed >a/file1 &&
+	echo changed >c/sub/file50 &&
+	rm .git/index &&
+	workers read-tree -u --reset HEAD >actual &&
+	echo "301 files with 3 workers" >expect &&
+	test_cmp expect actual &&
+	test "$(cat a/file1)" = a1 &&
+	test "$(cat c/sub/file50)" = c50 &&
+	git diff-files --exit-code
+'
+
+test_expect_success 'checkout.workers=1 does not use workers' '
+	git config checkout.workers 1 &&
+	git checkout -q empty &&
+	workers checkout master >actual &&
+	test_cmp /dev/null actual &&
+	git diff-files --exit-code
+'
+
+test_done
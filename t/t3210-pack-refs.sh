@@ -112,4 +112,87 @@ test_expect_success 'pack, prune and repack' '
 	diff all-of-them again
 '
 
+test_expect_success 'packed and loose refs are listed together' '
+	git branch r/a &&
+	git branch r/c &&
+	git pack-refs --all --prune &&
+	git branch r/b &&
+	git branch r/d/e &&
+	second=$(echo second | git commit-tree HEAD^{tree} -p HEAD) &&
+	git update-ref refs/heads/r/c $second &&
+	git for-each-ref --format="%(refname) %(objectname)" refs/heads/r >actual &&
+	cat >expect <<-EOF &&
+	refs/heads/r/a $(git rev-parse HEAD)
+	refs/heads/r/b $(git rev-parse HEAD)
+	refs/heads/r/c $second
+	refs/heads/r/d/e $(git rev-parse HEAD)
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'names that are taken by packed or loose refs' '
+	test_must_fail git branch r/a/x &&
+	test_must_fail git branch r/d &&
+	test_must_fail git branch r &&
+	git pack-refs --all --prune &&
+	test_must_fail git branch r/d &&
+	git branch -m r/d/e r/d &&
+	git rev-parse --verify refs/heads/r/d
+'
+
+test_expect_success 'single packed refs are found in a sorted file' '
+	for i in 0 1 2 3 4 5 6 7 8 9
+	do
+		for j in 0 1 2 3 4 5 6 7 8 9
+		do
+			echo "$(git rev-parse HEAD) refs/heads/s/$i$j" || exit
+		done
+	done >loose-refs &&
+	git pack-refs --all --prune &&
+	{
+		cat .git/packed-refs &&
+		cat loose-refs
+	} >packed &&
+	{
+		echo "# pack-refs with: peeled sorted " &&
+		grep -v "^#" packed | grep -v "^\^" | sort -k 2
+	} >.git/packed-refs &&
+	for r in s/00 s/42 s/99 r/a
+	do
+		git rev-parse --verify refs/heads/$r || exit
+	done &&
+	test_must_fail git rev-parse --verify refs/heads/s/4 &&
+	test_must_fail git rev-parse --verify refs/heads/s/420 &&
+	test_must_fail git rev-parse --verify refs/heads/s &&
+	git for-each-ref refs/heads/s | wc -l >actual &&
+	echo 100 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'an unsorted packed-refs file is still read' '
+	{
+		echo "# pack-refs with: peeled " &&
+		grep -v "^#" packed | grep -v "^\^" | sort -r -k 2
+	} >.git/packed-refs &&
+	git rev-parse --verify refs/heads/s/42 &&
+	git rev-parse --verify refs/heads/r/a &&
+	git for-each-ref --format="%(refname)" refs/heads/s >actual &&
+	sed -e "s/^[0-9a-f]* //" loose-refs >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'deleting a packed ref keeps the file sorted and peeled' '
+	git tag -a -m annotated annotated &&
+	git pack-refs --all --prune &&
+	git branch -d s/42 &&
+	head -n 1 .git/packed-refs >actual &&
+	echo "# pack-refs with: peeled sorted " >expect &&
+	test_cmp expect actual &&
+	grep "^\^$(git rev-parse annotated^{commit})" .git/packed-refs &&
+	test_must_fail git rev-parse --verify refs/heads/s/42 &&
+	git rev-parse --verify refs/heads/s/43 &&
+	git show-ref -d annotated >actual &&
+	test $(wc -l <actual) = 2
+'
+
 test_done
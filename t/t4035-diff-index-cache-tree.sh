@@ -0,0 +1,97 @@
+#!/bin/sh
+
+test_description='diff-index --cached using the cache-tree'
+
+. ./test-lib.sh
+
+used_cache_tree () {
+	GIT_TRACE=1 git "$@" 2>&1 >/dev/null |
+	grep "trace: diff-index: compared the cache-tree"
+}
+
+# the same as diff-tree between HEAD and the tree of the index
+check_cached () {
+	tree=$(git write-tree) &&
+	git diff-tree -r --abbrev=40 HEAD $tree -- "$@" >expect &&
+	git diff-index --cached --abbrev=40 HEAD -- "$@" >actual &&
+	test_cmp expect actual
+}
+
+test_expect_success 'setup' '
+	mkdir -p a/b/c d e &&
+	for i in 1 2 3
+	do
+		echo $i >a/b/c/f$i &&
+		echo $i >a/b/f$i &&
+		echo $i >d/f$i &&
+		echo $i >e/f$i &&
+		echo $i >f$i || exit
+	done &&
+	git add . &&
+	test_tick &&
+	git commit -q -m initial
+'
+
+test_expect_success 'no changes' '
+	used_cache_tree diff-index --cached HEAD &&
+	git diff-index --cached --exit-code HEAD &&
+	check_cached
+'
+
+test_expect_success 'changes in one directory' '
+	echo changed >a/b/c/f2 &&
+	echo new >a/b/new &&
+	git add a &&
+	used_cache_tree diff-index --cached HEAD &&
+	check_cached &&
+	check_cached a/b/c &&
+	check_cached d
+'
+
+test_expect_success 'removed and added directories' '
+	git rm -q -r --cached d &&
+	mkdir g &&
+	echo g >g/f &&
+	git add g &&
+	check_cached
+'
+
+test_expect_success 'a file replaced by a directory and back' '
+	git rm -q --cached f1 &&
+	rm f1 &&
+	mkdir f1 &&
+	echo x >f1/x &&
+	git rm -q -r --cached e &&
+	rm -rf e &&
+	echo e >e &&
+	git add f1 e &&
+	check_cached
+'
+
+test_expect_success 'mode change' '
+	chmod +x f2 &&
+	git update-index f2 &&
+	check_cached
+'
+
+test_expect_success 'commit and status' '
+	used_cache_tree status &&
+	git commit -q -m changes &&
+	used_cache_tree commit -m nothing &&
+	test_must_fail git commit -m nothing &&
+	check_cached
+'
+
+test_expect_success 'unmerged entries are handled the old way' '
+	blob=$(echo unmerged | git hash-object -w --stdin) &&
+	git update-index --index-info <<-EOF &&
+	0 0000000000000000000000000000000000000000	f3
+	100644 $blob 2	f3
+	100644 $blob 3	f3
+	EOF
+	! used_cache_tree diff-index --cached HEAD &&
+	git diff-index --cached HEAD >actual &&
+	grep "	f3$" actual
+'
+
+test_done
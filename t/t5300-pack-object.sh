@@ -382,4 +382,14 @@ test_expect_success 'tolerate absurdly small packsizelimit' '
 	test $(wc -l <obj-list) = $(ls test-9-*.pack | wc -l)
 '
 
+test_expect_success 'objects reused in pack order are copied verbatim' '
+	git config --unset pack.packSizeLimit &&
+	rm -f .git/objects/pack/* &&
+	packname_10=$(git pack-objects --delta-base-offset .git/objects/pack/pack <obj-list) &&
+	GIT_TRACE=2 git pack-objects --delta-base-offset --stdout <obj-list \
+		>test-10.pack 2>trace &&
+	grep "pack-objects: [1-9][0-9]* objects copied verbatim" trace &&
+	cmp test-10.pack .git/objects/pack/pack-$packname_10.pack
+'
+
 test_done
@@ -57,4 +57,33 @@ test_expect_success \
      git config --unset core.packedGitLimit &&
      git verify-pack -v "$pack2"'
 
+test_expect_success \
+    'setup delta chains' \
+    'for i in 1 2 3 4 5 6 7 8
+     do
+         test-genrandom "$i" 512 >>a &&
+         test-genrandom "$i" 512 >>b &&
+         git update-index a b &&
+         tree=`git write-tree` &&
+         commit=`git commit-tree $tree -p HEAD </dev/null` &&
+         git update-ref HEAD $commit || return 1
+     done &&
+     git repack -a -d -f &&
+     git log -p >expect'
+
+test_expect_success \
+    'log -p, deltaBaseCacheLimit == 1 byte' \
+    'git config core.deltaBaseCacheLimit 1 &&
+     GIT_TRACE="$(pwd)/trace" git log -p >actual &&
+     test_cmp expect actual &&
+     grep "delta base cache: .* [1-9][0-9]* evictions" trace &&
+     git config --unset core.deltaBaseCacheLimit'
+
+test_expect_success \
+    'log -p, default deltaBaseCacheLimit' \
+    'rm -f trace &&
+     GIT_TRACE="$(pwd)/trace" git log -p >actual &&
+     test_cmp expect actual &&
+     grep "delta base cache: [1-9][0-9]* hits, .* 0 evictions" trace'
+
 test_done
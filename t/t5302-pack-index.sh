@@ -65,6 +65,13 @@ test_expect_success \
     'cmp "test-1-${pack1}.idx" "1.idx" &&
      cmp "test-2-${pack2}.idx" "2.idx"'
 
+test_expect_success \
+    'index-pack with several threads' \
+    'git index-pack --index-version=1 --threads=4 -o 1-threads.idx "test-1-${pack1}.pack" &&
+     git index-pack --index-version=2 --threads=4 -o 2-threads.idx "test-1-${pack1}.pack" &&
+     cmp "1.idx" "1-threads.idx" &&
+     cmp "2.idx" "2-threads.idx"'
+
 test_expect_success \
     'index v2: force some 64-bit offsets with pack-objects' \
     'pack3=$(git pack-objects --index-version=2,0x40000 test-3 <obj-list)'
@@ -172,6 +179,11 @@ test_expect_success \
      cmp "test-1-${pack1}.pack" ".git/objects/pack/pack-${pack1}.pack" &&
      cmp "test-2-${pack1}.idx"  ".git/objects/pack/pack-${pack1}.idx"'
 
+test_expect_success \
+    '[index v2] fsck verifies the pack with several threads' \
+    'git fsck --full --threads=4 $commit &&
+     git fsck --full --threads=1 $commit'
+
 test_expect_success \
     '[index v2] 2) create a stealth corruption in a delta base reference' \
     '# This test assumes file_101 is a delta smaller than 16 bytes.
@@ -193,7 +205,8 @@ test_expect_success \
 
 test_expect_success \
     '[index v2] 4) confirm that the pack is actually corrupted' \
-    'test_must_fail git fsck --full $commit'
+    'test_must_fail git fsck --full $commit &&
+     test_must_fail git fsck --full --threads=4 $commit'
 
 test_expect_success \
     '[index v2] 5) pack-objects refuses to reuse corrupted data' \
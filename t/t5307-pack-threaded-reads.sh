@@ -0,0 +1,61 @@
+#!/bin/sh
+
+test_description='objects read by several threads at once
+
+The delta search threads of pack-objects read objects without a
+lock of their own.  Make the pack windows and the delta base cache
+tiny, so that the threads keep mapping and dropping windows and
+evicting each other'"'"'s delta bases, and check that every object
+still comes out right.'
+. ./test-lib.sh
+
+objects_in_pack () {
+	git show-index <"$1" | sed -e "s/^[0-9]* \([0-9a-f]*\).*/\1/" | sort
+}
+
+test_expect_success setup '
+	src="$TEST_DIRECTORY/../sha1_file.c" &&
+	for i in 1 2 3 4 5 6 7 8
+	do
+		for f in a b c d e f
+		do
+			(
+				echo "$f $i" &&
+				sed -n -e "$i,$((1000 + 50 * $i))p" "$src"
+			) >$f || exit
+		done &&
+		git add a b c d e f &&
+		test_tick &&
+		git commit -q -m "commit $i" &&
+		git repack -q -d || exit
+	done &&
+	test $(ls .git/objects/pack/*.pack | wc -l) -gt 1 &&
+	git rev-list --objects --all |
+		sed -e "s/^\([0-9a-f]*\).*/\1/" | sort >expect
+'
+
+test_expect_success 'pack with several threads from tiny windows' '
+	git config core.packedGitWindowSize 8k &&
+	git config core.packedGitLimit 32k &&
+	git config core.deltaBaseCacheLimit 4k &&
+	git pack-objects --threads=4 --window=20 --no-reuse-object \
+		--all --revs --stdout </dev/null >threaded.pack &&
+	git index-pack threaded.pack &&
+	git verify-pack threaded.idx &&
+	objects_in_pack threaded.idx >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'the threaded pack has deltas and is complete' '
+	git verify-pack -v threaded.idx | grep " [0-9a-f]\{40\}$" >deltas &&
+	test -s deltas &&
+	mkdir clone.git &&
+	(
+		cd clone.git &&
+		git --bare init -q &&
+		git index-pack --stdin <../threaded.pack &&
+		git fsck --full
+	)
+'
+
+test_done
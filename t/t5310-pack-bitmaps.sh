@@ -0,0 +1,161 @@
+#!/bin/sh
+
+test_description='pack-objects with reachability bitmaps'
+. ./test-lib.sh
+
+objects_in_pack () {
+	git show-index <"$1" | sed -e "s/^[0-9]* \([0-9a-f]*\).*/\1/" | sort
+}
+
+objects_reachable () {
+	git rev-list --objects "$@" | sed -e "s/^\([0-9a-f]*\).*/\1/" | sort
+}
+
+test_expect_success setup '
+	for i in 1 2 3 4 5 6 7 8 9 10 11 12
+	do
+		mkdir -p dir$(($i % 3)) &&
+		echo $i >file$(($i % 5)) &&
+		echo $i >dir$(($i % 3))/file &&
+		git add . &&
+		test_tick &&
+		git commit -m "commit $i" || exit
+	done &&
+	git tag -a -m "annotated" annotated HEAD~4 &&
+	git branch side HEAD~7 &&
+	git checkout side &&
+	echo side >side-file &&
+	git add side-file &&
+	test_tick &&
+	git commit -m "side commit" &&
+	git checkout master
+'
+
+test_expect_success 'repack -b writes a bitmap' '
+	git repack -a -d -b &&
+	ls .git/objects/pack/pack-*.bitmap >bitmaps &&
+	test $(wc -l <bitmaps) = 1
+'
+
+test_expect_success 'bitmap is used for a full pack' '
+	echo master >revs &&
+	GIT_TRACE="$(pwd)/trace" git pack-objects --stdout --revs <revs >full.pack &&
+	grep "using bitmap index" trace &&
+	git index-pack full.pack &&
+	objects_in_pack full.idx >actual &&
+	objects_reachable master >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'bitmap excludes what the other side has' '
+	printf "master\nannotated\n--not\nside\n" >revs &&
+	git pack-objects --stdout --revs <revs >partial.pack &&
+	git index-pack partial.pack &&
+	objects_in_pack partial.idx >actual &&
+	objects_reachable master annotated ^side >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'objects outside the bitmapped pack fall back to a walk' '
+	echo new >new-file &&
+	git add new-file &&
+	test_tick &&
+	git commit -m "not packed yet" &&
+	printf "master\n--not\nside\n" >revs &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git pack-objects --stdout --revs <revs >walk.pack &&
+	! grep "using bitmap index" trace &&
+	git index-pack walk.pack &&
+	objects_in_pack walk.idx >actual &&
+	objects_reachable master ^side >expect &&
+	test_cmp expect actual
+'
+
+deltas_in_pack () {
+	git verify-pack -v "$1" |
+	sed -n -e "s/^\([0-9a-f]*\) \([a-z]*\) .* \([0-9a-f]\{40\}\)$/\1 \2 \3/p" |
+	sort
+}
+
+test_expect_success 'bitmaps keep the name hashes for the delta search' '
+	for i in 1 2 3 4 5 6
+	do
+		for f in alpha.txt beta.c gamma.h
+		do
+			(
+				sed -n -e "1,$((200 + $i))p" "$TEST_DIRECTORY/../builtin-log.c" &&
+				echo $f
+			) >$f || exit
+		done &&
+		git add alpha.txt beta.c gamma.h &&
+		test_tick &&
+		git commit -m "big $i" || exit
+	done &&
+	git repack -a -d -b &&
+	echo master >revs &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" \
+		git pack-objects --no-reuse-delta --stdout --revs <revs >bitmap.pack &&
+	grep "using bitmap index" trace &&
+	git config pack.usebitmaps false &&
+	git pack-objects --no-reuse-delta --stdout --revs <revs >walk.pack &&
+	git config --unset pack.usebitmaps &&
+	git index-pack bitmap.pack &&
+	git index-pack walk.pack &&
+	deltas_in_pack walk.idx >expect &&
+	test -s expect &&
+	deltas_in_pack bitmap.idx >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'thin packs are not made from bitmaps' '
+	printf "master\n--not\nside\n" >revs &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" \
+		git pack-objects --thin --stdout --revs <revs >/dev/null &&
+	! grep "using bitmap index" trace
+'
+
+test_expect_success 'pack.usebitmaps=false disables bitmaps' '
+	git repack -a -d -b &&
+	git config pack.usebitmaps false &&
+	echo master >revs &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git pack-objects --stdout --revs <revs >/dev/null &&
+	! grep "using bitmap index" trace &&
+	git config --unset pack.usebitmaps
+'
+
+test_expect_success 'repack without -b drops the bitmap' '
+	git repack -a -d &&
+	! ls .git/objects/pack/pack-*.bitmap
+'
+
+test_expect_success 'repack.writebitmaps' '
+	git config repack.writebitmaps true &&
+	git repack -a -d &&
+	ls .git/objects/pack/pack-*.bitmap
+'
+
+test_expect_success 'clone and fetch from a bitmapped repository' '
+	git clone --bare "file://$(pwd)/.git" clone.git &&
+	(
+		cd clone.git &&
+		git fsck --full &&
+		objects_reachable --all >../actual
+	) &&
+	objects_reachable --all >expect &&
+	test_cmp expect actual &&
+	echo more >>new-file &&
+	git add new-file &&
+	test_tick &&
+	git commit -m "after clone" &&
+	git repack -a -d &&
+	(
+		cd clone.git &&
+		git fetch "file://$(pwd)/../.git" master:master &&
+		git fsck --full
+	)
+'
+
+test_done
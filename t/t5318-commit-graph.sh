@@ -0,0 +1,125 @@
+#!/bin/sh
+
+test_description='commit-graph file'
+. ./test-lib.sh
+
+test_expect_success setup '
+	for i in 1 2 3 4 5
+	do
+		echo $i >file &&
+		git add file &&
+		test_tick &&
+		git commit -m "commit $i" || exit
+	done &&
+	for b in one two three
+	do
+		git checkout -b $b master~3 &&
+		echo $b >$b &&
+		git add $b &&
+		test_tick &&
+		git commit -m "$b" || exit
+	done &&
+	git checkout master &&
+	test_tick &&
+	git merge one two three &&
+	git tag -a -m "annotated" annotated master~2 &&
+	git log --pretty=raw --parents --topo-order --all >expect.log &&
+	git rev-list --all --date-order --timestamp >expect.dates
+'
+
+test_expect_success 'write the commit-graph' '
+	git commit-graph write &&
+	test -f .git/objects/info/commit-graph &&
+	git commit-graph verify
+'
+
+test_expect_success 'history is the same with the commit-graph' '
+	git log --pretty=raw --parents --topo-order --all >actual.log &&
+	test_cmp expect.log actual.log &&
+	git rev-list --all --date-order --timestamp >actual.dates &&
+	test_cmp expect.dates actual.dates
+'
+
+test_expect_success 'merge-base and reachability' '
+	git merge-base one two >actual &&
+	git rev-parse master~4 >expect &&
+	test_cmp expect actual &&
+	git branch --contains three >actual &&
+	printf "* master\n  three\n" >expect &&
+	test_cmp expect actual &&
+	git branch --merged one >actual &&
+	printf "  one\n" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'commits made after writing the graph' '
+	echo more >file &&
+	git add file &&
+	test_tick &&
+	git commit -m "after graph" &&
+	git log --pretty=raw --parents --topo-order --all >actual.log &&
+	git config core.commitgraph false &&
+	git log --pretty=raw --parents --topo-order --all >expect.log &&
+	git config --unset core.commitgraph &&
+	test_cmp expect.log actual.log &&
+	git branch --contains one >actual &&
+	printf "* master\n  one\n" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'topological walks are the same with the commit-graph' '
+	for opts in "--topo-order" "--date-order" "--graph" \
+		"--topo-order -- one two" "--topo-order --first-parent" \
+		"--graph --date-order -3"
+	do
+		git log --pretty=oneline --parents $opts master >actual.log &&
+		git config core.commitgraph false &&
+		git log --pretty=oneline --parents $opts master >expect.log &&
+		git config --unset core.commitgraph &&
+		test_cmp expect.log actual.log || return 1
+	done
+'
+
+test_expect_success 'grafts disable the commit-graph' '
+	echo "$(git rev-parse master~1) $(git rev-parse one)" >.git/info/grafts &&
+	git rev-list -1 --parents master~1 >actual &&
+	echo "$(git rev-parse master~1) $(git rev-parse one)" >expect &&
+	test_cmp expect actual &&
+	test_must_fail git commit-graph write &&
+	rm .git/info/grafts
+'
+
+test_expect_success 'verify notices a corrupt commit-graph' '
+	cp .git/objects/info/commit-graph graph.backup &&
+	printf "\377" | dd of=.git/objects/info/commit-graph bs=1 seek=1100 \
+		conv=notrunc 2>/dev/null &&
+	test_must_fail git commit-graph verify &&
+	mv graph.backup .git/objects/info/commit-graph &&
+	git commit-graph verify
+'
+
+test_expect_success 'gc.writeCommitGraph' '
+	git config gc.writecommitgraph true &&
+	git gc &&
+	git commit-graph verify &&
+	git log --pretty=raw --parents --topo-order --all >actual.log &&
+	git config core.commitgraph false &&
+	git log --pretty=raw --parents --topo-order --all >expect.log &&
+	git config --unset core.commitgraph &&
+	test_cmp expect.log actual.log
+'
+
+test_expect_success 'commit messages are read for commits from the graph' '
+	git commit-graph write &&
+	git checkout -b messages one &&
+	GIT_MERGE_VERBOSITY=5 git merge two >out &&
+	grep "^[0-9a-f]* one$" out &&
+	git reset --hard one -- >out &&
+	grep "^HEAD is now at [0-9a-f]* one$" out &&
+	git commit --allow-empty -C three &&
+	test "$(git log -1 --pretty=format:%s)" = three &&
+	git cherry-pick two &&
+	test "$(git log -1 --pretty=format:%s)" = two
+'
+
+test_done
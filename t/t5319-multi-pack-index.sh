@@ -0,0 +1,91 @@
+#!/bin/sh
+
+test_description='multi-pack index'
+. ./test-lib.sh
+
+objects () {
+	git rev-list --objects --all | sed -e "s/^\([0-9a-f]*\).*/\1/" | sort
+}
+
+test_expect_success setup '
+	for i in 1 2 3 4 5
+	do
+		echo $i >file$i &&
+		echo $i >>file &&
+		git add file file$i &&
+		test_tick &&
+		git commit -m "commit $i" &&
+		git repack -d -q || exit
+	done &&
+	ls .git/objects/pack/pack-*.pack >packs &&
+	test $(wc -l <packs) = 5 &&
+	objects >expect &&
+	git cat-file --batch-check <expect >expect.info
+'
+
+test_expect_success 'write the multi-pack index' '
+	git multi-pack-index write &&
+	test -f .git/objects/pack/multi-pack-index &&
+	git multi-pack-index verify
+'
+
+test_expect_success 'objects are found through the multi-pack index' '
+	GIT_TRACE="$(pwd)/trace" git cat-file --batch-check <expect >actual &&
+	grep "multi-pack-index: 5 packs" trace &&
+	test_cmp expect.info actual &&
+	git fsck --full
+'
+
+test_expect_success 'packs written later are still searched' '
+	echo 6 >file6 &&
+	git add file6 &&
+	test_tick &&
+	git commit -m "commit 6" &&
+	git rev-list --objects HEAD^..HEAD |
+	git pack-objects -q .git/objects/pack/pack &&
+	git prune-packed &&
+	objects >expect &&
+	git cat-file --batch-check <expect >expect.info &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git cat-file --batch-check <expect >actual &&
+	grep "multi-pack-index: 5 packs" trace &&
+	test_cmp expect.info actual &&
+	git multi-pack-index verify
+'
+
+test_expect_success 'repack keeps the multi-pack index up to date' '
+	echo 7 >file7 &&
+	git add file7 &&
+	test_tick &&
+	git commit -m "commit 7" &&
+	git repack -d -q &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git multi-pack-index verify &&
+	grep "multi-pack-index: 7 packs" trace &&
+	git repack -a -d -q &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git multi-pack-index verify &&
+	grep "multi-pack-index: 1 packs" trace &&
+	objects >expect &&
+	git cat-file --batch-check <expect >expect.info
+'
+
+test_expect_success 'core.multiPackIndex=false ignores the file' '
+	git config core.multipackindex false &&
+	rm -f trace &&
+	GIT_TRACE="$(pwd)/trace" git cat-file --batch-check <expect >actual &&
+	! grep "multi-pack-index:" trace &&
+	test_cmp expect.info actual &&
+	git config --unset core.multipackindex
+'
+
+test_expect_success 'a corrupt multi-pack index is ignored' '
+	echo garbage >.git/objects/pack/multi-pack-index &&
+	git cat-file --batch-check <expect >actual &&
+	test_cmp expect.info actual &&
+	test_must_fail git multi-pack-index verify &&
+	git multi-pack-index write &&
+	git multi-pack-index verify
+'
+
+test_done
@@ -0,0 +1,98 @@
+#!/bin/sh
+
+test_description='pack reverse index (.rev) files'
+. ./test-lib.sh
+
+test_expect_success setup '
+	for i in 1 2 3 4 5 6
+	do
+		for j in a b c d e f g h i j
+		do
+			echo "$j line $i" || exit
+		done >>file &&
+		echo $i >file$i &&
+		git add file file$i &&
+		test_tick &&
+		git commit -m "commit $i" || exit
+	done &&
+	git repack -a -d &&
+	pack=$(ls .git/objects/pack/pack-*.pack) &&
+	git verify-pack -v "$pack" >expect
+'
+
+test_expect_success 'index-pack --rev-index writes a .rev file' '
+	rev=${pack%.pack}.rev &&
+	! test -f "$rev" &&
+	git index-pack --rev-index "$pack" &&
+	test -f "$rev"
+'
+
+test_expect_success 'the .rev file gives the same answers' '
+	git verify-pack -v "$pack" >actual &&
+	test_cmp expect actual &&
+	git pack-objects --all --revs --stdout --delta-base-offset \
+		</dev/null >with-rev.pack &&
+	mv "$rev" rev.save &&
+	git pack-objects --all --revs --stdout --delta-base-offset \
+		</dev/null >without-rev.pack &&
+	mv rev.save "$rev" &&
+	cmp with-rev.pack without-rev.pack
+'
+
+test_expect_success 'a .rev file for another pack is ignored' '
+	cp "$rev" rev.save &&
+	chmod u+w "$rev" &&
+	test-genrandom foo 20 >>"$rev" &&
+	git verify-pack -v "$pack" >actual 2>err &&
+	test_cmp expect actual &&
+	grep "wrong size" err &&
+	mv -f rev.save "$rev" &&
+	chmod u+w "$rev" &&
+	printf "XXXX" | dd of="$rev" bs=1 seek=$(($(wc -c <"$rev") - 40)) \
+		conv=notrunc 2>/dev/null &&
+	git verify-pack -v "$pack" >actual 2>err &&
+	test_cmp expect actual &&
+	grep "does not match its pack" err &&
+	rm -f "$rev"
+'
+
+test_expect_success 'a .rev file with entries out of range is ignored' '
+	git index-pack --rev-index "$pack" &&
+	chmod u+w "$rev" &&
+	printf "\377\377\377\377" | dd of="$rev" bs=1 seek=8 \
+		conv=notrunc 2>/dev/null &&
+	git verify-pack -v "$pack" >actual 2>err &&
+	test_cmp expect actual &&
+	grep "is corrupt" err &&
+	rm -f "$rev"
+'
+
+test_expect_success 'repack writes .rev files when asked to' '
+	git config pack.writeReverseIndex true &&
+	echo 7 >file7 &&
+	git add file7 &&
+	test_tick &&
+	git commit -m "commit 7" &&
+	git repack -a -d &&
+	pack=$(ls .git/objects/pack/pack-*.pack) &&
+	test $(ls .git/objects/pack/*.rev | wc -l) = 1 &&
+	test -f "${pack%.pack}.rev" &&
+	git fsck --full
+'
+
+test_expect_success 'index-pack --stdin honors pack.writeReverseIndex' '
+	git pack-objects --all --revs --stdout </dev/null >all.pack &&
+	mkdir clone.git &&
+	(
+		cd clone.git &&
+		git --bare init &&
+		git index-pack --stdin <../all.pack &&
+		! test -f objects/pack/*.rev &&
+		git config pack.writeReverseIndex true &&
+		git index-pack --stdin <../all.pack &&
+		test -f objects/pack/*.rev &&
+		git verify-pack objects/pack/*.pack
+	)
+'
+
+test_done
@@ -335,4 +335,29 @@ test_expect_success 'fetch into the current branch with --update-head-ok' '
 
 '
 
+test_expect_success 'fetch shows a ref it could not write as not updated' '
+
+	cd "$D" &&
+	mkdir -p .git/logs/refs/remotes/broken/two &&
+	>.git/logs/refs/remotes/broken/two/in-the-way &&
+	test_must_fail git fetch . master:refs/remotes/broken/one \
+		master:refs/remotes/broken/two 2>err &&
+	grep "^ \* \[new branch\] *master *-> broken/one$" err &&
+	grep "^ ! \[new branch\] *master *-> broken/two  (unable to update local ref)$" err &&
+	git rev-parse --verify refs/remotes/broken/one &&
+	test_must_fail git rev-parse --verify refs/remotes/broken/two
+
+'
+
+test_expect_success 'fetch into a ref and into a symref to it' '
+
+	cd "$D" &&
+	git update-ref refs/heads/target master^ &&
+	git symbolic-ref refs/heads/alias refs/heads/target &&
+	git fetch . master:refs/heads/target master:refs/heads/alias &&
+	test $(git rev-parse target) = $(git rev-parse master) &&
+	test refs/heads/target = $(git symbolic-ref refs/heads/alias)
+
+'
+
 test_done
@@ -573,4 +573,120 @@ test_expect_success 'push with branches containing #' '
 	git checkout master
 '
 
+test_expect_success 'push deleting packed refs and updating another' '
+	mk_test heads/del1 heads/del2 heads/del3 heads/keep heads/upd &&
+	(
+		cd testrepo &&
+		git pack-refs --all --prune &&
+		git config core.logAllRefUpdates true
+	) &&
+	rm -f "$D/trace" &&
+	GIT_TRACE="$D/trace" git push testrepo \
+		:refs/heads/del1 :refs/heads/del2 :refs/heads/del3 \
+		$the_commit:refs/heads/upd &&
+	test 1 = $(grep -c "rewriting packed-refs without 3 refs" "$D/trace") &&
+	check_push_result $the_first_commit heads/keep &&
+	check_push_result $the_commit heads/upd &&
+	(
+		cd testrepo &&
+		for ref in del1 del2 del3
+		do
+			test_must_fail git show-ref --verify refs/heads/$ref &&
+			! grep "refs/heads/$ref" .git/packed-refs || exit
+		done &&
+		grep refs/heads/keep .git/packed-refs &&
+		git reflog show refs/heads/upd | grep "push"
+	)
+'
+
+test_expect_success 'push reports a ref it cannot lock and updates the others' '
+	mk_test heads/locked heads/free heads/gone &&
+	>testrepo/.git/refs/heads/locked.lock &&
+	test_must_fail git push testrepo $the_commit:refs/heads/locked \
+		$the_commit:refs/heads/free :refs/heads/gone 2>err &&
+	grep "locked (failed to lock)" err &&
+	rm -f testrepo/.git/refs/heads/locked.lock &&
+	check_push_result $the_first_commit heads/locked &&
+	check_push_result $the_commit heads/free &&
+	(
+		cd testrepo &&
+		test_must_fail git show-ref --verify refs/heads/gone
+	)
+'
+
+test_expect_success 'push updates more refs than it can have files open' '
+	mk_test heads/master &&
+	refspecs= &&
+	(
+		cd testrepo &&
+		for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20
+		do
+			for j in 1 2 3 4 5
+			do
+				git update-ref refs/heads/old$i-$j \
+					$the_first_commit || exit
+			done
+		done &&
+		git pack-refs --all --prune &&
+		git update-ref refs/heads/old1-1 $the_first_commit
+	) &&
+	for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20
+	do
+		for j in 1 2 3 4 5
+		do
+			refspecs="$refspecs :refs/heads/old$i-$j" &&
+			refspecs="$refspecs $the_commit:refs/heads/new$i-$j"
+		done
+	done &&
+	(
+		ulimit -n 32 &&
+		git push testrepo $refspecs
+	) &&
+	(
+		cd testrepo &&
+		git for-each-ref refs/heads >../refs &&
+		test 101 = $(wc -l <../refs) &&
+		test 100 = $(grep -c "^$the_commit commit	refs/heads/new" ../refs)
+	)
+'
+
+test_expect_success 'no ref is locked while the update hooks run' '
+	mk_test heads/one heads/two &&
+	mkdir testrepo/.git/hooks &&
+	cat >testrepo/.git/hooks/update <<-\EOF &&
+	#!/bin/sh
+	find refs -name "*.lock" >>locks
+	echo "$1" >>updates
+	EOF
+	chmod +x testrepo/.git/hooks/update &&
+	git push testrepo $the_commit:refs/heads/one \
+		$the_commit:refs/heads/two &&
+	test 2 = $(wc -l <testrepo/.git/updates) &&
+	! test -s testrepo/.git/locks &&
+	check_push_result $the_commit heads/one heads/two
+'
+
+test_expect_success 'push to a ref and to a symref to it' '
+	mk_test heads/target &&
+	(
+		cd testrepo &&
+		git symbolic-ref refs/heads/alias refs/heads/target
+	) &&
+	git push testrepo $the_commit:refs/heads/target \
+		$the_commit:refs/heads/alias &&
+	check_push_result $the_commit heads/target &&
+	(
+		cd testrepo &&
+		test refs/heads/target = $(git symbolic-ref refs/heads/alias)
+	) &&
+	mk_test heads/target &&
+	(
+		cd testrepo &&
+		git symbolic-ref refs/heads/alias refs/heads/target
+	) &&
+	test_must_fail git push testrepo $the_commit:refs/heads/target \
+		:refs/heads/alias 2>err &&
+	grep "multiple updates for ref" err
+'
+
 test_done
@@ -48,14 +48,23 @@ test_expect_success 'corrupt repo differently' '
 test_expect_success 'fsck fails' '
 	test_must_fail git fsck
 '
+# only shallow clients make upload-pack walk the history itself
 test_expect_success 'upload-pack fails due to error in rev-list' '
 
 	! echo "0032want $(git rev-parse HEAD)
-00000009done
+0034shallow $(git rev-parse HEAD^)00000009done
 0000" | git upload-pack . > /dev/null 2> output.err &&
 	grep "waitpid (async) failed" output.err
 '
 
+test_expect_success 'upload-pack fails due to error in pack-objects walk' '
+
+	! echo "0032want $(git rev-parse HEAD)
+00000009done
+0000" | git upload-pack . > /dev/null 2> output.err &&
+	grep "pack-objects died" output.err
+'
+
 test_expect_success 'create empty repository' '
 
 	mkdir foo &&
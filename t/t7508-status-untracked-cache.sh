@@ -0,0 +1,134 @@
+#!/bin/sh
+
+test_description='git status with the untracked cache'
+
+. ./test-lib.sh
+
+# Make the directories look old enough for their listing to be cached
+backdate_dirs () {
+	(cd repo && find . -name .git -prune -o -type d -print) |
+	(cd repo && xargs test-chmtime -100)
+}
+
+# Compare the output of status with and without the cache
+check_status () {
+	(cd repo && git status) >actual
+	(cd repo && git config core.untrackedCache false && git status) >expect
+	(cd repo && git config core.untrackedCache true) &&
+	test_cmp expect actual
+}
+
+cache_trace () {
+	(cd repo && GIT_TRACE=1 git status 2>&1 >/dev/null) |
+	sed -n -e "s/^trace: untracked cache: //p"
+}
+
+test_expect_success 'setup' '
+	test_create_repo repo &&
+	(
+		cd repo &&
+		mkdir -p one/two three four/five &&
+		echo "*.o" >.gitignore &&
+		echo tracked >one/tracked &&
+		echo untracked >one/untracked &&
+		echo ignored >one/ignored.o &&
+		echo untracked >one/two/untracked &&
+		echo untracked >three/untracked &&
+		echo tracked >four/tracked &&
+		git add .gitignore one/tracked four/tracked &&
+		test_tick &&
+		git commit -m initial &&
+		git config core.untrackedCache true
+	) &&
+	backdate_dirs
+'
+
+test_expect_success 'second status reuses every directory' '
+	check_status &&
+	grep "one/untracked" actual &&
+	cache_trace >trace &&
+	echo "0 directories read, 3 reused" >expect &&
+	test_cmp expect trace
+'
+
+test_expect_success 'new untracked file' '
+	echo new >repo/one/new &&
+	backdate_dirs &&
+	check_status &&
+	grep "one/new" actual &&
+	cache_trace >trace &&
+	echo "0 directories read, 3 reused" >expect &&
+	test_cmp expect trace
+'
+
+test_expect_success 'new file in untracked directory' '
+	echo new >repo/four/five/new &&
+	check_status &&
+	grep "four/five/" actual
+'
+
+test_expect_success 'removed untracked file' '
+	rm repo/one/untracked &&
+	check_status &&
+	! grep "one/untracked" actual
+'
+
+test_expect_success 'edited .gitignore' '
+	echo "three/" >>repo/.gitignore &&
+	check_status &&
+	! grep "three/" actual
+'
+
+test_expect_success 'edited info/exclude' '
+	echo "two/" >>repo/.git/info/exclude &&
+	check_status &&
+	! grep "one/two/" actual
+'
+
+test_expect_success 'add and remove untracked file' '
+	echo added >repo/one/added &&
+	backdate_dirs &&
+	check_status &&
+	grep "one/added" actual &&
+	(cd repo && git add one/added) &&
+	check_status &&
+	! grep "^#	one/added" actual &&
+	(cd repo && git rm -q --cached one/added) &&
+	check_status &&
+	grep "^#	one/added" actual &&
+	(cd repo && git rm -q --cached four/tracked) &&
+	check_status &&
+	grep "^#	four/$" actual
+'
+
+test_expect_success 'preloading checks the cache with several threads' '
+	(
+		cd repo &&
+		for i in 0 1 2 3 4 5 6 7 8 9 10 11
+		do
+			for j in 0 1 2 3 4 5 6 7 8 9
+			do
+				mkdir d$i$j &&
+				for k in 0 1 2 3 4 5 6 7 8
+				do
+					echo $k >d$i$j/f$k || exit
+				done &&
+				echo untracked >d$i$j/untracked || exit
+			done
+		done &&
+		git add d*/f* &&
+		git config core.preloadIndex true &&
+		git config core.preloadIndexThreads 2
+	) &&
+	backdate_dirs &&
+	check_status &&
+	grep "d57/untracked" actual &&
+	(cd repo && GIT_TRACE=1 git status 2>&1 >/dev/null) >trace &&
+	grep "preload: thread 1:" trace &&
+	grep "untracked cache: [0-9]* directories checked with 2 threads" trace &&
+	echo new >repo/d57/new &&
+	check_status &&
+	grep "d57/new" actual
+'
+
+test_done
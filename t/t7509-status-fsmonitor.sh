@@ -0,0 +1,108 @@
+#!/bin/sh
+
+test_description='refreshing the index with core.fsmonitor'
+
+. ./test-lib.sh
+
+# The hook reports the paths listed in .git/changed, or fails when
+# .git/fail exists.
+write_hook () {
+	cat >fsmonitor-hook <<-\EOF &&
+	#!/bin/sh
+	echo "$*" >.git/fsmonitor-args
+	test -f .git/fail && exit 1
+	test -f .git/changed && tr "\n" "\0" <.git/changed
+	exit 0
+	EOF
+	chmod +x fsmonitor-hook
+}
+
+fsmonitor_trace () {
+	GIT_TRACE=1 git status 2>&1 >/dev/null |
+	sed -n -e "s/^trace: fsmonitor: //p"
+}
+
+test_expect_success 'setup' '
+	mkdir dir &&
+	echo one >one &&
+	echo two >two &&
+	echo three >dir/three &&
+	echo "fsmonitor-hook" >.gitignore &&
+	git add .gitignore one two dir/three &&
+	test_tick &&
+	git commit -m initial &&
+	write_hook &&
+	git config core.fsmonitor "$(pwd)/fsmonitor-hook"
+'
+
+test_expect_success 'the hook is not asked without a previous query' '
+	fsmonitor_trace >actual &&
+	echo "0 paths changed, 0 of 4 entries up to date" >expect &&
+	test_cmp expect actual &&
+	! test -f .git/fsmonitor-args
+'
+
+test_expect_success 'entries the hook does not report are trusted' '
+	fsmonitor_trace >actual &&
+	echo "0 paths changed, 4 of 4 entries up to date" >expect &&
+	test_cmp expect actual &&
+	grep "^1 [0-9][0-9]*\$" .git/fsmonitor-args &&
+	echo changed >one &&
+	git diff --name-only >actual &&
+	: >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'reported paths are checked' '
+	echo one >.git/changed &&
+	git diff --name-only >actual &&
+	echo one >expect &&
+	test_cmp expect actual &&
+	fsmonitor_trace >actual &&
+	echo "1 paths changed, 3 of 4 entries up to date" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'reported directories are checked' '
+	git add one &&
+	echo changed >dir/three &&
+	echo dir >.git/changed &&
+	git diff --name-only >actual &&
+	echo dir/three >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'everything is checked when the hook says so' '
+	git add dir/three &&
+	git status >/dev/null &&
+	echo changed >two &&
+	echo / >.git/changed &&
+	git diff --name-only >actual &&
+	echo two >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'everything is checked when the hook fails' '
+	git add two &&
+	rm .git/changed &&
+	git status >/dev/null &&
+	echo changed again >one &&
+	: >.git/fail &&
+	git diff --name-only >actual &&
+	echo one >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'extension is dropped without core.fsmonitor' '
+	rm .git/fail &&
+	git config --unset core.fsmonitor &&
+	git add one &&
+	git config core.fsmonitor "$(pwd)/fsmonitor-hook" &&
+	rm -f .git/fsmonitor-args &&
+	fsmonitor_trace >actual &&
+	echo "0 paths changed, 0 of 4 entries up to date" >expect &&
+	test_cmp expect actual &&
+	! test -f .git/fsmonitor-args
+'
+
+test_done
@@ -0,0 +1,44 @@
+#include "cache.h"
+#include "blob.h"
+#include "run-command.h"
+
+static void show(const unsigned char *sha1)
+{
+	printf("%s %s\n", sha1_to_hex(sha1),
+	       has_sha1_file(sha1) ? "yes" : "no");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char sha1[20];
+
+	setup_git_directory();
+	while (*++argv) {
+		if (!strcmp(*argv, "enable"))
+			enable_loose_object_cache();
+		else if (!strcmp(*argv, "disable"))
+			disable_loose_object_cache();
+		else if (!strcmp(*argv, "reprepare"))
+			reprepare_packed_git();
+		else if (!strcmp(*argv, "has") && argv[1]) {
+			if (get_sha1_hex(*++argv, sha1))
+				die("not an object name: %s", *argv);
+			show(sha1);
+		} else if (!strcmp(*argv, "write") && argv[1]) {
+			argv++;
+			if (write_sha1_file(*argv, strlen(*argv), blob_type, sha1))
+				die("unable to write %s", *argv);
+			show(sha1);
+		} else if (!strcmp(*argv, "hash-object") && argv[1]) {
+			/* another process writes it behind our back */
+			const char *args[] = { "hash-object", "-w", NULL, NULL };
+			args[2] = *++argv;
+			fflush(stdout);
+			if (run_command_v_opt(args, RUN_GIT_CMD |
+					       RUN_COMMAND_STDOUT_TO_STDERR))
+				die("hash-object failed");
+		} else
+			die("unknown command: %s", *argv);
+	}
+	return 0;
+}
@@ -7,6 +7,8 @@
 #include "unpack-trees.h"
 #include "progress.h"
 #include "refs.h"
+#include "sparse-index.h"
+#include "parallel-checkout.h"
 
 /*
  * Error messages expected by scripts out of plumbing commands such as
@@ -47,8 +49,9 @@ static void add_entry(struct unpack_trees_options *o, struct cache_entry *ce,
 	clear |= CE_HASHED | CE_UNHASHED;
 
 	memcpy(new, ce, size);
-	new->next = NULL;
 	new->ce_flags = (new->ce_flags & ~clear) | set;
+	if (S_ISSPARSEDIR(new->ce_mode))
+		o->result.sparse_index = 1;
 	add_index_entry(&o->result, new, ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE|ADD_CACHE_SKIP_DFCHECK);
 }
 
@@ -118,6 +121,12 @@ static int check_updates(struct unpack_trees_options *o)
 		}
 	}
 
+	/* leaves nothing marked CE_UPDATE, unless it did not run */
+	if (o->update)
+		errs = parallel_checkout(index, &state, progress, &cnt);
+	if (errs < 0)
+		errs = 0;
+
 	for (i = 0; i < index->cache_nr; i++) {
 		struct cache_entry *ce = index->cache[i];
 
@@ -240,6 +249,18 @@ static struct cache_entry *create_ce_entry(const struct traverse_info *info, con
 	return ce;
 }
 
+/* The stage the entry from the i-th tree goes to */
+static int tree_stage(const struct unpack_trees_options *o, int i)
+{
+	if (!o->merge)
+		return 0;
+	if (i + 1 < o->head_idx)
+		return 1;
+	if (i + 1 > o->head_idx)
+		return 3;
+	return 2;
+}
+
 static int unpack_nondirectories(int n, unsigned long mask, unsigned long dirmask, struct cache_entry *src[5],
 	const struct name_entry *names, const struct traverse_info *info)
 {
@@ -261,7 +282,6 @@ static int unpack_nondirectories(int n, unsigned long mask, unsigned long dirmas
 	 * now do the rest.
 	 */
 	for (i = 0; i < n; i++) {
-		int stage;
 		unsigned int bit = 1ul << i;
 		if (conflicts & bit) {
 			src[i + o->merge] = o->df_conflict_entry;
@@ -269,15 +289,8 @@ static int unpack_nondirectories(int n, unsigned long mask, unsigned long dirmas
 		}
 		if (!(mask & bit))
 			continue;
-		if (!o->merge)
-			stage = 0;
-		else if (i + 1 < o->head_idx)
-			stage = 1;
-		else if (i + 1 > o->head_idx)
-			stage = 3;
-		else
-			stage = 2;
-		src[i + o->merge] = create_ce_entry(info, names + i, stage);
+		src[i + o->merge] = create_ce_entry(info, names + i,
+						    tree_stage(o, i));
 	}
 
 	if (o->merge)
@@ -289,6 +302,46 @@ static int unpack_nondirectories(int n, unsigned long mask, unsigned long dirmas
 	return 0;
 }
 
+/* Is the index entry a sparse directory entry for this directory? */
+static int is_sparse_dir_of(const struct cache_entry *ce, const struct traverse_info *info, const struct name_entry *n)
+{
+	return S_ISSPARSEDIR(ce->ce_mode) &&
+		ce_namelen(ce) == traverse_path_len(info, n) + 1 &&
+		!do_compare_entry(ce, info, n);
+}
+
+/*
+ * When every tree has the very directory the sparse directory entry
+ * in the index records, let the merge function look at it as a single
+ * entry instead of descending into it.  Returns 1 if it did.
+ */
+static int unpack_sparse_directory(int n, unsigned long mask, unsigned long dirmask,
+				   struct cache_entry *ce, const struct name_entry *names,
+				   const struct traverse_info *info)
+{
+	struct cache_entry *src[5] = { ce, };
+	struct unpack_trees_options *o = info->data;
+	int i;
+
+	if (o->reset || info->conflicts ||
+	    mask != dirmask || mask != (1ul << n) - 1)
+		return 0;
+	for (i = 0; i < n; i++)
+		if (hashcmp(names[i].sha1, ce->sha1))
+			return 0;
+
+	for (i = 0; i < n; i++) {
+		struct cache_entry *dir = xmalloc(ce_size(ce));
+		memcpy(dir, ce, ce_size(ce));
+		dir->ce_flags = create_ce_flags(ce_namelen(ce), tree_stage(o, i));
+		src[i + 1] = dir;
+	}
+	o->pos++;
+	if (call_unpack_fn(src, o) < 0)
+		return -1;
+	return 1;
+}
+
 static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, struct name_entry *names, struct traverse_info *info)
 {
 	struct cache_entry *src[5] = { NULL, };
@@ -304,6 +357,19 @@ static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, str
 		while (o->pos < o->src_index->cache_nr) {
 			struct cache_entry *ce = o->src_index->cache[o->pos];
 			int cmp = compare_entry(ce, info, p);
+			if (S_ISSPARSEDIR(ce->ce_mode) &&
+			    (cmp < 0 || is_sparse_dir_of(ce, info, p))) {
+				int ret = 0;
+				if (cmp > 0)
+					ret = unpack_sparse_directory(n, mask, dirmask,
+								      ce, names, info);
+				if (ret < 0)
+					return -1;
+				if (ret)
+					return mask;
+				expand_sparse_entry(o->src_index, o->pos);
+				continue;
+			}
 			if (cmp < 0) {
 				if (unpack_index_entry(ce, o) < 0)
 					return -1;
@@ -401,6 +467,10 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	if (o->merge) {
 		while (o->pos < o->src_index->cache_nr) {
 			struct cache_entry *ce = o->src_index->cache[o->pos];
+			if (S_ISSPARSEDIR(ce->ce_mode)) {
+				expand_sparse_entry(o->src_index, o->pos);
+				continue;
+			}
 			if (unpack_index_entry(ce, o) < 0)
 				return unpack_failed(o, NULL);
 		}
@@ -411,8 +481,11 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 
 	o->src_index = NULL;
 	ret = check_updates(o) ? (-2) : 0;
-	if (o->dst_index)
+	if (o->dst_index) {
+		/* keep sharing the same shared index, if any */
+		o->result.split_index = o->dst_index->split_index;
 		*o->dst_index = o->result;
+	}
 	return ret;
 }
 
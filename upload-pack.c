@@ -26,7 +26,7 @@ static const char upload_pack_usage[] = "git-upload-pack [--strict] [--timeout=n
 
 static unsigned long oldest_have;
 
-static int multi_ack, nr_our_refs;
+static int multi_ack, nr_our_refs, shallow_nr;
 static int use_thin_pack, use_ofs_delta, use_include_tag;
 static int no_progress;
 static struct object_array have_obj;
@@ -140,6 +140,27 @@ static int do_rev_list(int fd, void *create_full_pack)
 	return 0;
 }
 
+/*
+ * Unless the client is shallow, let pack-objects do the counting
+ * itself with --revs; it can answer from a bitmap index without
+ * walking the history at all.
+ */
+static int feed_pack_objects_revs(int fd, void *data)
+{
+	FILE *out = fdopen(fd, "w");
+	int i;
+
+	for (i = 0; i < want_obj.nr; i++)
+		fprintf(out, "%s\n", sha1_to_hex(want_obj.objects[i].item->sha1));
+	fprintf(out, "--not\n");
+	for (i = 0; i < have_obj.nr; i++)
+		fprintf(out, "%s\n", sha1_to_hex(have_obj.objects[i].item->sha1));
+	fprintf(out, "\n");
+	if (fclose(out))
+		die("broken output pipe");
+	return 0;
+}
+
 static void create_pack_file(void)
 {
 	struct async rev_list;
@@ -153,13 +174,23 @@ static void create_pack_file(void)
 	const char *argv[10];
 	int arg = 0;
 
-	rev_list.proc = do_rev_list;
-	/* .data is just a boolean: any non-NULL value will do */
-	rev_list.data = create_full_pack ? &rev_list : NULL;
+	if (shallow_nr) {
+		rev_list.proc = do_rev_list;
+		/* .data is just a boolean: any non-NULL value will do */
+		rev_list.data = create_full_pack ? &rev_list : NULL;
+	} else {
+		rev_list.proc = feed_pack_objects_revs;
+		rev_list.data = NULL;
+	}
 	if (start_async(&rev_list))
 		die("git upload-pack: unable to fork git-rev-list");
 
 	argv[arg++] = "pack-objects";
+	if (!shallow_nr) {
+		argv[arg++] = "--revs";
+		if (use_thin_pack && !create_full_pack)
+			argv[arg++] = "--thin";
+	}
 	argv[arg++] = "--stdout";
 	if (!no_progress)
 		argv[arg++] = "--progress";
@@ -522,6 +553,7 @@ static void receive_needs(void)
 		write_in_full(debug_fd, "#E\n", 3);
 	if (depth == 0 && shallows.nr == 0)
 		return;
+	shallow_nr = 1;
 	if (depth > 0) {
 		struct commit_list *result, *backup;
 		int i;
@@ -256,6 +256,12 @@ static void wt_status_print_untracked(struct wt_status *s)
 	}
 	setup_standard_excludes(&dir);
 
+	if (core_untracked_cache) {
+		if (!the_index.untracked)
+			the_index.untracked = xcalloc(1, sizeof(*the_index.untracked));
+		dir.untracked = the_index.untracked;
+	}
+
 	read_directory(&dir, ".", "", 0, NULL);
 	for(i = 0; i < dir.nr; i++) {
 		struct dir_entry *ent = dir.entries[i];